@@ -0,0 +1,169 @@
+#include "crappola.h"
+#include <time.h>
+
+/* The flat AST: the memory a unit's nodes take and the time to parse
+ * it, walk every node, compile it to bytecode and generate its code,
+ * each phase over every function of the unit, best of three passes.
+ * Used by ast.sh. */
+
+#define PASSES 3
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/* Visit every node of a function without recursing; the node count */
+static uint32_t walk(const Ast *ast, NodeIndex function, NodeIndex **stack, uint32_t *capacity) {
+    uint32_t visited = 0;
+    uint32_t depth = 0;
+    (*stack)[depth++] = function;
+    while (depth > 0) {
+        NodeIndex node = (*stack)[--depth];
+        visited++;
+        // At most a block's worth of children is pushed per node
+        uint32_t children = ast->kinds[node] == NODE_BLOCK ? ast->rhs[node] : 2;
+        if (depth + children > *capacity) {
+            while (depth + children > *capacity) {
+                *capacity *= 2;
+            }
+            *stack = realloc(*stack, sizeof(NodeIndex) * *capacity);
+        }
+        NodeIndex *top = *stack + depth;
+        switch (ast->kinds[node]) {
+        case NODE_FUNCTION:
+        case NODE_RETURN:
+        case NODE_ASSIGNMENT:
+        case NODE_DECLARATION:
+            top[0] = ast->lhs[node];
+            depth += top[0] != 0;
+            break;
+        case NODE_BINARY_OP:
+        case NODE_WHILE:
+            top[0] = ast->lhs[node];
+            top[1] = ast->rhs[node];
+            depth += 2;
+            break;
+        case NODE_IF:
+            top[0] = ast->lhs[node];
+            top[1] = ast->extra[ast->rhs[node]];
+            top[2] = ast->extra[ast->rhs[node] + 1];
+            depth += 2 + (top[2] != 0);
+            break;
+        case NODE_BLOCK:
+            memcpy(top, ast->extra + ast->lhs[node], sizeof(NodeIndex) * ast->rhs[node]);
+            depth += ast->rhs[node];
+            break;
+        default:
+            break;
+        }
+    }
+    return visited;
+}
+
+static void report(const char *phase, double best) {
+    printf("  %-22s %8.1f ms\n", phase, best * 1e3);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <source.c>\n", argv[0]);
+        return 1;
+    }
+
+    // Parsing is timed once: it fills the AST the other phases read
+    CompilerContext *context = crappola_create();
+    Preprocessor pp;
+    if (!context || !pp_init(&pp, context, argv[1])) {
+        return 1;
+    }
+    Lexer lexer;
+    lexer_init(&lexer, &pp);
+    Ast ast;
+    ast_init(&ast);
+    Parser parser;
+    if (!parser_init(&parser, &lexer, &ast)) {
+        return 1;
+    }
+    NodeIndex *functions = NULL;
+    int count = 0;
+    int capacity = 0;
+    double start = now();
+    do {
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            functions = realloc(functions, sizeof(NodeIndex) * (size_t)capacity);
+            if (!functions) {
+                return 1;
+            }
+        }
+        functions[count] = parse_function(&parser);
+        if (!functions[count]) {
+            return 1;
+        }
+        count++;
+    } while (!parse_at_end(&parser));
+    double parse_time = now() - start;
+
+    printf("%d functions, %u nodes, %u extra entries, %.1f MB of nodes\n", count, ast.count - 1,
+           ast.extra_count, ast_peak_bytes(&ast) / (1024.0 * 1024.0));
+    report("parse", parse_time);
+
+    uint32_t stack_capacity = 256;
+    NodeIndex *stack = malloc(sizeof(NodeIndex) * stack_capacity);
+    double best[3] = { 0, 0, 0 };
+    uint32_t visited = 0;
+    for (int pass = 0; pass < PASSES; pass++) {
+        double times[3];
+
+        start = now();
+        visited = 0;
+        for (int i = 0; i < count; i++) {
+            visited += walk(&ast, functions[i], &stack, &stack_capacity);
+        }
+        times[0] = now() - start;
+
+        start = now();
+        for (int i = 0; i < count; i++) {
+            BytecodeFunction *bytecode = compile_bytecode(&context->symbols, &ast, functions[i]);
+            if (!bytecode) {
+                return 1;
+            }
+            free_bytecode(bytecode);
+        }
+        times[1] = now() - start;
+
+        start = now();
+        AsmWriter out;
+        writer_init_memory(&out);
+        for (int i = 0; i < count; i++) {
+            if (!generate_code(&context->symbols, &ast, functions[i], i, false, &out)) {
+                return 1;
+            }
+        }
+        writer_release(&out);
+        times[2] = now() - start;
+
+        for (int phase = 0; phase < 3; phase++) {
+            if (pass == 0 || times[phase] < best[phase]) {
+                best[phase] = times[phase];
+            }
+        }
+    }
+    if (visited != ast.count - 1) {
+        fprintf(stderr, "Error: The walk visited %u of %u nodes\n", visited, ast.count - 1);
+        return 1;
+    }
+    report("full tree walk", best[0]);
+    report("bytecode compilation", best[1]);
+    report("code generation", best[2]);
+
+    free(stack);
+    free(functions);
+    parser_finish(&parser);
+    ast_release(&ast);
+    pp_finish(&pp);
+    crappola_destroy(context);
+    return 0;
+}
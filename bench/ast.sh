@@ -0,0 +1,27 @@
+#!/bin/sh
+# Node memory and traversal time of the flat AST, on a unit of 5000
+# functions of branches and loops.
+#
+#   bench/ast.sh <build-dir>
+set -e
+
+build=${1:?usage: bench/ast.sh <build-dir>}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+cmake --build "$build" --target bench_ast >/dev/null
+
+awk 'BEGIN {
+    for (f = 0; f < 5000; f++) {
+        printf "int f%d() {\n  int a = 0;\n  int b = 3;\n", f
+        for (i = 0; i < 40; i++) {
+            printf "  if (a < %d) { a = a + b * %d; } else { b = b - 1; }\n", i * 3, i % 5
+            print "  while (b > 10) { b = b - 2; }"
+        }
+        print "  return a;\n}"
+    }
+    print "int main() {\n  return 0;\n}"
+}' > "$work/funcs.c"
+
+echo "funcs.c, $(wc -c < "$work/funcs.c") bytes:"
+"$build/bench/bench_ast" "$work/funcs.c"
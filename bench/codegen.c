@@ -0,0 +1,104 @@
+#include "crappola.h"
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Code generation throughput: parse a unit once, then generate every
+ * function from the parsed AST into a memory writer and into a writer on
+ * /dev/null, reporting the best of three passes each. Used by
+ * codegen.sh. */
+
+#define PASSES 3
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/* One pass over every function; the bytes written, or 0 on an error */
+static uint64_t generate_all(const SymbolTable *symbols, const Ast *ast, const NodeIndex *functions,
+                             int count, int fd) {
+    AsmWriter out;
+    if (fd >= 0) {
+        writer_init_fd(&out, fd);
+    } else {
+        writer_init_memory(&out);
+    }
+    bool ok = true;
+    for (int i = 0; i < count && ok; i++) {
+        ok = generate_code(symbols, ast, functions[i], i, false, &out);
+    }
+    ok = writer_flush(&out) && ok;
+    uint64_t total = out.total;
+    writer_release(&out);
+    return ok ? total : 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <source.c>\n", argv[0]);
+        return 1;
+    }
+
+    CompilerContext *context = crappola_create();
+    Preprocessor pp;
+    if (!context || !pp_init(&pp, context, argv[1])) {
+        return 1;
+    }
+    Lexer lexer;
+    lexer_init(&lexer, &pp);
+    Ast ast;
+    ast_init(&ast);
+    Parser parser;
+    if (!parser_init(&parser, &lexer, &ast)) {
+        return 1;
+    }
+    NodeIndex *functions = NULL;
+    int count = 0;
+    int capacity = 0;
+    do {
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            functions = realloc(functions, sizeof(NodeIndex) * (size_t)capacity);
+            if (!functions) {
+                return 1;
+            }
+        }
+        functions[count] = parse_function(&parser);
+        if (!functions[count]) {
+            return 1;
+        }
+        count++;
+    } while (!parse_at_end(&parser));
+
+    int null_fd = open("/dev/null", O_WRONLY);
+    const char *sinks[] = { "memory", "/dev/null" };
+    for (int sink = 0; sink < 2; sink++) {
+        uint64_t bytes = 0;
+        double best = 0;
+        for (int pass = 0; pass < PASSES; pass++) {
+            double start = now();
+            bytes = generate_all(&context->symbols, &ast, functions, count, sink ? null_fd : -1);
+            double elapsed = now() - start;
+            if (!bytes) {
+                fprintf(stderr, "Error: Code generation failed\n");
+                return 1;
+            }
+            if (pass == 0 || elapsed < best) {
+                best = elapsed;
+            }
+        }
+        double megabytes = bytes / (1024.0 * 1024.0);
+        printf("%d functions, %.1f MB of assembly to %s: %.0f MB/s\n", count, megabytes,
+               sinks[sink], megabytes / best);
+    }
+
+    close(null_fd);
+    free(functions);
+    parser_finish(&parser);
+    ast_release(&ast);
+    pp_finish(&pp);
+    crappola_destroy(context);
+    return 0;
+}
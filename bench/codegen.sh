@@ -0,0 +1,46 @@
+#!/bin/sh
+# Code generation throughput over pre-parsed units: many functions with
+# branches and loops, one long straight-line function using macros, and
+# one expression of a million terms.
+#
+#   bench/codegen.sh <build-dir>
+set -e
+
+build=${1:?usage: bench/codegen.sh <build-dir>}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+cmake --build "$build" --target bench_codegen >/dev/null
+
+awk 'BEGIN {
+    for (f = 0; f < 5000; f++) {
+        printf "int f%d() {\n  int a = 0;\n  int b = 3;\n", f
+        for (i = 0; i < 40; i++) {
+            printf "  if (a < %d) { a = a + b * %d; } else { b = b - 1; }\n", i * 3, i % 5
+            print "  while (b > 10) { b = b - 2; }"
+        }
+        print "  return a;\n}"
+    }
+    print "int main() {\n  return 0;\n}"
+}' > "$work/funcs.c"
+
+awk 'BEGIN {
+    print "#define SQ(x) ((x)*(x))\n#define ADD(a,b) ((a)+(b))\nint main() {\n  int acc = 0;"
+    for (i = 1; i < 100000; i += 2) {
+        print "  if (acc > 1000) { acc = acc - 999; }"
+        printf "  int v%d = ADD(SQ(%d), %d) * %d + acc;\n", i, i % 7, i % 13, i % 3
+        printf "  acc = v%d - acc;\n", i
+    }
+    print "  return acc;\n}"
+}' > "$work/big.c"
+
+awk 'BEGIN {
+    printf "int main() {\n  return "
+    for (i = 0; i < 999999; i++) printf "1 + "
+    print "1;\n}"
+}' > "$work/sum.c"
+
+for unit in funcs big sum; do
+    echo "$unit.c:"
+    "$build/bench/bench_codegen" "$work/$unit.c"
+done
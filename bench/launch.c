@@ -0,0 +1,49 @@
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <time.h>
+
+/* Start a command over and over with posix_spawnp and waitpid, and
+ * report the mean time per launch. The command's output is discarded. Used by startup.sh to compare
+ * executables linked dynamically with ones built with -static -nostdlib,
+ * and by tools.sh to time whole compilations. */
+
+extern char **environ;
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3 || atoi(argv[1]) < 1) {
+        fprintf(stderr, "Usage: %s <launches> <program> [argument]...\n", argv[0]);
+        return 1;
+    }
+    int launches = atoi(argv[1]);
+    char **args = argv + 2;
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, 1, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, 1, 2);
+
+    double start = now();
+    for (int i = 0; i < launches; i++) {
+        pid_t pid;
+        int status;
+        if (posix_spawnp(&pid, args[0], &actions, NULL, args, environ) != 0 ||
+            waitpid(pid, &status, 0) < 0) {
+            fprintf(stderr, "Error: Could not launch %s\n", args[0]);
+            return 1;
+        }
+    }
+    double elapsed = now() - start;
+    posix_spawn_file_actions_destroy(&actions);
+
+    printf("%.1f us/launch\n", elapsed / launches * 1e6);
+    return 0;
+}
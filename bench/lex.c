@@ -0,0 +1,83 @@
+#include "crappola.h"
+#include <time.h>
+
+/* Lexer throughput over a file that is already in memory, so the figure
+ * is scanning and interning alone. The scanner backend is the one the
+ * lexer picks, or the one CRAPPOLA_SCAN names. Used by scan.sh. */
+
+#define PASSES 3
+
+typedef struct {
+    const char *text;
+    size_t length;
+    bool read;
+} WholeFile;
+
+/* The file as a single line; the lexer counts the newlines in it */
+static bool whole_file(void *source, const char **text, size_t *length, int *line) {
+    WholeFile *file = source;
+    *text = file->read ? NULL : file->text;
+    *length = file->length;
+    *line = 1;
+    file->read = true;
+    return true;
+}
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <file>\n", argv[0]);
+        return 1;
+    }
+    FILE *f = fopen(argv[1], "rb");
+    if (!f) {
+        fprintf(stderr, "Error: Could not open file %s\n", argv[1]);
+        return 1;
+    }
+    fseek(f, 0, SEEK_END);
+    size_t size = (size_t)ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *text = malloc(size + 1);
+    if (!text || fread(text, 1, size, f) != size) {
+        fprintf(stderr, "Error: Could not read file %s\n", argv[1]);
+        return 1;
+    }
+    fclose(f);
+    text[size] = '\n';
+
+    SymbolTable symbols;
+    memset(&symbols, 0, sizeof(symbols));
+    long tokens = 0;
+    double best = 0;
+    for (int pass = 0; pass < PASSES; pass++) {
+        WholeFile file = { text, size + 1, false };
+        Lexer lexer;
+        lexer_init_source(&lexer, &symbols, whole_file, &file);
+        Token token;
+        tokens = 0;
+        double start = now();
+        do {
+            if (!lexer_next(&lexer, &token)) {
+                fprintf(stderr, "Error: Lexing failed\n");
+                return 1;
+            }
+            tokens++;
+        } while (token.type != TOKEN_EOF);
+        double elapsed = now() - start;
+        if (pass == 0 || elapsed < best) {
+            best = elapsed;
+        }
+    }
+
+    double megabytes = size / (1024.0 * 1024.0);
+    printf("%.1f MB, %ld tokens, %.0f MB/s (%s scanner)\n", megabytes, tokens,
+           megabytes / best, scan_backend_name());
+    intern_release(&symbols);
+    free(text);
+    return 0;
+}
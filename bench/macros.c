@@ -0,0 +1,56 @@
+#include "crappola.h"
+#include <time.h>
+
+/* Preprocess each file given and report the time it takes, best of
+ * three passes, with nothing after the preprocessor. Used by macros.sh
+ * to measure macro lookup against the number of macros defined. */
+
+#define PASSES 3
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <source.c>...\n", argv[0]);
+        return 1;
+    }
+
+    CompilerContext *context = crappola_create();
+    if (!context) {
+        return 1;
+    }
+    for (int i = 1; i < argc; i++) {
+        double best = 0;
+        size_t bytes = 0;
+        for (int pass = 0; pass < PASSES; pass++) {
+            // pp_init starts from an empty macro table each time
+            Preprocessor pp;
+            double start = now();
+            if (!pp_init(&pp, context, argv[i])) {
+                return 1;
+            }
+            const char *line;
+            size_t length;
+            bytes = 0;
+            while ((line = pp_next_line(&pp, &length))) {
+                bytes += length;
+            }
+            bool failed = pp.failed;
+            pp_finish(&pp);
+            double elapsed = now() - start;
+            if (failed) {
+                return 1;
+            }
+            if (pass == 0 || elapsed < best) {
+                best = elapsed;
+            }
+        }
+        printf("  %-16s %8.1f ms, %zu bytes out\n", argv[i], best * 1e3, bytes);
+    }
+    crappola_destroy(context);
+    return 0;
+}
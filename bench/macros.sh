@@ -0,0 +1,37 @@
+#!/bin/sh
+# Macro lookup cost against the number of macros defined. Each body has
+# 50k lines with 800k macro references scattered uniformly over N macros;
+# the defines-only file shows how much of the time is the #define lines.
+#
+#   bench/macros.sh <build-dir>
+set -e
+
+build=${1:?usage: bench/macros.sh <build-dir>}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+cmake --build "$build" --target bench_macros >/dev/null
+driver=$(cd "$build" && pwd)/bench/bench_macros
+
+for n in 100 1000 10000 100000; do
+    awk -v n=$n 'BEGIN {
+        for (i = 0; i < n; i++) {
+            printf "#define M%d %d\n", i, i
+        }
+    }' > "$work/defines.c"
+    awk -v n=$n 'BEGIN {
+        for (i = 0; i < n; i++) {
+            printf "#define M%d %d\n", i, i
+        }
+        k = 0
+        for (l = 0; l < 50000; l++) {
+            printf "x = M%d", k++ % n
+            for (j = 1; j < 16; j++) {
+                printf " + M%d", (k++ * 7919) % n
+            }
+            print ";"
+        }
+    }' > "$work/body.c"
+    echo "N = $n:"
+    (cd "$work" && "$driver" defines.c body.c)
+done
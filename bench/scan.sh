@@ -0,0 +1,43 @@
+#!/bin/sh
+# Lexer throughput with each scanner backend, on a token-dense corpus and
+# on a whitespace-heavy one of about the same number of tokens.
+#
+#   bench/scan.sh <build-dir> [statements]
+set -e
+
+build=${1:?usage: bench/scan.sh <build-dir> [statements]}
+statements=${2:-200000}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+cmake --build "$build" --target bench_lex >/dev/null
+
+# Arithmetic over a dozen variables, packed as tightly as C allows
+awk -v n="$statements" 'BEGIN {
+    srand(1)
+    print "int main() {"
+    for (v = 0; v < 12; v++) printf "int a%d=1;", v
+    for (i = 0; i < n; i++) {
+        printf "a%d=(", int(rand() * 12)
+        for (t = 0; t < 4; t++) {
+            printf "%s(a%d*3-%d)", t ? "+" : "", int(rand() * 12), int(rand() * 100)
+        }
+        print ")/7;"
+    }
+    print "return 0;}"
+}' > "$work/dense.c"
+
+# The same statements, deeply indented and separated by blank lines with
+# trailing spaces, so whitespace comes in runs longer than a vector
+awk '{
+    print "                                " $0
+    print "                                        "
+    print ""
+}' "$work/dense.c" > "$work/sparse.c"
+
+for corpus in dense sparse; do
+    for backend in scalar ssse3 avx2; do
+        printf "%-7s %-7s " "$corpus" "$backend"
+        CRAPPOLA_SCAN=$backend "$build/bench/bench_lex" "$work/$corpus.c"
+    done
+done
@@ -0,0 +1,22 @@
+#!/bin/sh
+# Startup cost of a dynamically linked executable against one built with
+# -static -nostdlib, both from examples/loop.c.
+#
+#   bench/startup.sh <build-dir> [launches]
+set -e
+
+build=${1:?usage: bench/startup.sh <build-dir> [launches]}
+launches=${2:-3000}
+root=$(cd "$(dirname "$0")/.." && pwd)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+cmake --build "$build" --target crappola bench_launch >/dev/null
+"$build/crappola" "$root/examples/loop.c" -o "$work/dynamic" >/dev/null 2>&1
+"$build/crappola" "$root/examples/loop.c" -o "$work/static" -static -nostdlib >/dev/null 2>&1
+
+for program in dynamic static; do
+    size=$(wc -c < "$work/$program")
+    time=$("$build/bench/bench_launch" "$launches" "$work/$program")
+    echo "$program: $size bytes, $time"
+done
@@ -0,0 +1,20 @@
+#!/bin/sh
+# Wall-clock time of a whole compilation, assembler and linker included,
+# for each of the examples.
+#
+#   bench/tools.sh <build-dir> [rounds]
+set -e
+
+build=${1:?usage: bench/tools.sh <build-dir> [rounds]}
+rounds=${2:-20}
+root=$(cd "$(dirname "$0")/.." && pwd)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+cmake --build "$build" --target crappola bench_launch >/dev/null
+
+for example in "$root"/examples/*.c; do
+    name=$(basename "$example" .c)
+    printf "%-12s " "$name"
+    "$build/bench/bench_launch" "$rounds" "$build/crappola" "$example" -o "$work/$name"
+done
@@ -6,6 +6,21 @@
 #include <string.h>
 #include <ctype.h>
 #include <stdbool.h>
+#include <stdint.h>
+
+#define CRAPPOLA_VERSION "0.1"
+
+/* Arena allocator: bump allocation, released all at once */
+typedef struct ArenaChunk ArenaChunk;
+
+typedef struct {
+    ArenaChunk *head;
+    size_t allocated;
+    size_t reserved;
+    size_t peak;
+    size_t peak_reserved;
+    int chunk_count;
+} Arena;
 
 /* Token types */
 typedef enum {
@@ -36,13 +51,27 @@ typedef enum {
     TOKEN_COMMA,
 } TokenType;
 
-/* Token structure */
+/* Token structure: a span (stream offset and length) of the preprocessed
+ * source. value holds the converted number for TOKEN_NUMBER and the
+ * symbol ID for TOKEN_IDENTIFIER, so no token text is kept. */
 typedef struct {
     TokenType type;
-    char *value;
     int line;
+    uint32_t offset;
+    uint32_t length;
+    int value;
 } Token;
 
+/* Keywords are interned first, so their symbol IDs are fixed */
+enum {
+    SYM_INT,
+    SYM_RETURN,
+    SYM_IF,
+    SYM_ELSE,
+    SYM_WHILE,
+    SYM_KEYWORD_COUNT,
+};
+
 /* AST Node types */
 typedef enum {
     NODE_PROGRAM,
@@ -55,66 +84,589 @@ typedef enum {
     NODE_IF,
     NODE_WHILE,
     NODE_BLOCK,
+    NODE_DECLARATION,
 } NodeType;
 
-/* AST Node */
-typedef struct ASTNode {
-    NodeType type;
-    union {
-        struct {
-            char *name;
-            struct ASTNode *body;
-        } function;
-        struct {
-            struct ASTNode *expr;
-        } return_stmt;
-        struct {
-            int value;
-        } number;
-        struct {
-            char op;
-            struct ASTNode *left;
-            struct ASTNode *right;
-        } binary_op;
-        struct {
-            char *name;
-        } variable;
-        struct {
-            char *name;
-            struct ASTNode *value;
-        } assignment;
-        struct {
-            struct ASTNode *condition;
-            struct ASTNode *then_branch;
-            struct ASTNode *else_branch;
-        } if_stmt;
-        struct {
-            struct ASTNode *condition;
-            struct ASTNode *body;
-        } while_stmt;
-        struct {
-            struct ASTNode **statements;
-            int count;
-        } block;
-    } data;
-    struct ASTNode *next;
-} ASTNode;
+/* AST, stored flat: node i is kinds[i], values[i], lhs[i] and rhs[i],
+ * and nodes refer to each other by 32-bit index. Node 0 is never used,
+ * so 0 means "none". By kind:
+ *
+ *   NODE_FUNCTION    value: name symbol   lhs: body  rhs: first node
+ *   NODE_RETURN                           lhs: expression
+ *   NODE_NUMBER      value: the number
+ *   NODE_BINARY_OP   value: operator      lhs, rhs: operands
+ *   NODE_VARIABLE    value: symbol
+ *   NODE_ASSIGNMENT  value: symbol        lhs: value
+ *   NODE_IF                               lhs: condition
+ *                                         rhs: extra index of then, else
+ *   NODE_WHILE                            lhs: condition  rhs: body
+ *   NODE_BLOCK                            lhs: extra index of the first
+ *                                         statement  rhs: count
+ *   NODE_DECLARATION value: symbol        lhs: initial value, or 0
+ *
+ * A block's statements are contiguous in extra. */
+typedef uint32_t NodeIndex;
+
+typedef struct {
+    uint8_t *kinds;
+    int32_t *values;
+    NodeIndex *lhs;
+    NodeIndex *rhs;
+    uint32_t count;
+    uint32_t capacity;
+    NodeIndex *extra;
+    uint32_t extra_count;
+    uint32_t extra_capacity;
+    uint32_t peak;              /* of count */
+    uint32_t extra_peak;
+} Ast;
+
+typedef struct {
+    uint32_t count;
+    uint32_t extra_count;
+} AstMark;
+
+/* Bytecode opcodes (register machine: a, b, c are register numbers,
+ * immediates or instruction indices depending on the opcode) */
+typedef enum {
+    OP_LOADI,       /* r[a] = b */
+    OP_MOV,         /* r[a] = r[b] */
+    OP_ADD,         /* r[a] = r[b] + r[c] */
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_LT,          /* r[a] = r[b] < r[c] */
+    OP_GT,
+    OP_LE,
+    OP_GE,
+    OP_EQ,
+    OP_NE,
+    OP_ADDI,        /* r[a] = r[b] + c */
+    OP_SUBI,
+    OP_MULI,
+    OP_JMP,         /* goto a */
+    OP_LOOP,        /* goto a, counting a loop backedge */
+    OP_JZ,          /* if (r[a] == 0) goto b */
+    OP_JLT,         /* if (r[a] < r[b]) goto c */
+    OP_JGT,
+    OP_JLE,
+    OP_JGE,
+    OP_JEQ,
+    OP_JNE,
+    OP_JLTI,        /* if (r[a] < b) goto c */
+    OP_JGTI,
+    OP_JLEI,
+    OP_JGEI,
+    OP_JEQI,
+    OP_JNEI,
+    OP_RET,         /* return r[a] */
+    OP_COUNT,
+} Opcode;
+
+typedef struct {
+    int op;
+    int a;
+    int b;
+    int c;
+} Instruction;
+
+typedef struct {
+    char *name;
+    Instruction *code;
+    int count;
+    int capacity;
+    int register_count;
+    long backedges;
+} BytecodeFunction;
+
+typedef enum {
+    INTERP_DONE,
+    INTERP_HOT,
+    INTERP_ERROR,
+} InterpStatus;
+
+/* Assembly output (writer.c): text kept in memory, or streamed to a
+ * file descriptor in fixed-size chunks. failed is sticky. */
+typedef struct {
+    char *data;
+    size_t size;
+    size_t capacity;
+    int fd;                     /* -1 to keep the text in memory */
+    uint64_t total;             /* bytes written, flushed or not */
+    bool failed;
+} AsmWriter;
+
+/* AST functions */
+void ast_init(Ast *ast);
+NodeIndex ast_add(Ast *ast, NodeType kind, int32_t value, NodeIndex lhs, NodeIndex rhs);
+uint32_t ast_add_extra(Ast *ast, const NodeIndex *items, uint32_t count);
+AstMark ast_mark(const Ast *ast);
+void ast_reset(Ast *ast, AstMark mark);
+size_t ast_peak_bytes(const Ast *ast);
+void ast_release(Ast *ast);
+
+/* Arena functions */
+void arena_init(Arena *arena);
+void *arena_alloc(Arena *arena, size_t size);
+void *arena_calloc(Arena *arena, size_t size);
+char *arena_strndup(Arena *arena, const char *str, size_t len);
+void arena_clear(Arena *arena);
+void arena_release(Arena *arena);
+
+/* Character classes used by the lexer's scanners */
+enum {
+    CHAR_DIGIT = 0x01,
+    CHAR_ALPHA_LO = 0x02,       /* A-O, a-o */
+    CHAR_ALPHA_HI = 0x04,       /* P-Z, p-z */
+    CHAR_UNDERSCORE = 0x08,
+    CHAR_CONTROL_SPACE = 0x10,  /* \t \n \v \f \r */
+    CHAR_SPACE = 0x20,
+    CHAR_IDENT_START = CHAR_ALPHA_LO | CHAR_ALPHA_HI | CHAR_UNDERSCORE,
+    CHAR_IDENT = CHAR_IDENT_START | CHAR_DIGIT,
+    CHAR_WHITESPACE = CHAR_CONTROL_SPACE | CHAR_SPACE,
+};
+
+extern const uint8_t char_class[256];
+
+/* Scanner functions: return the first byte at or after p (before end)
+ * that is outside the class */
+const char *scan_class(const char *p, const char *end, uint8_t mask);
+const char *scan_whitespace(const char *p, const char *end, int *newlines);
+size_t scan_count_newlines(const char *p, const char *end);
+const char *scan_backend_name(void);
+
+/* Interned identifiers (intern.c) */
+typedef struct InternSlot InternSlot;
+
+/* Names live in fixed-size pages that never move, so a thread may look
+ * up a symbol it was handed while another one keeps interning. The page
+ * directory doubles as it fills; a replaced directory stays valid, in
+ * the strings arena, until the table is released. */
+#define SYMBOL_PAGE_SIZE 4096
+
+typedef struct {
+    InternSlot *table;
+    size_t table_size;
+    const char ***_Atomic pages;
+    int page_capacity;
+    uint32_t *lengths;
+    int count;
+    int capacity;
+    Arena strings;
+} SymbolTable;
+
+/* Interner functions */
+int intern(SymbolTable *symbols, const char *str, size_t len);
+const char *symbol_name(const SymbolTable *symbols, int symbol);
+int symbol_count(const SymbolTable *symbols);
+void intern_release(SymbolTable *symbols);
+
+/* A source file mapped into memory, shared by every #include of it */
+typedef struct {
+    char *path;
+    size_t dir_length;      /* length of the directory prefix of path */
+    const char *data;
+    size_t size;
+    bool once;              /* #pragma once seen */
+    bool entered;
+    const char *guard;      /* include-guard macro name, or NULL */
+    size_t guard_length;
+} SourceFile;
+
+/* Source files read so far and the include search path (include.c) */
+#define FILE_TABLE_SIZE 256
+
+typedef struct FileNode FileNode;
+typedef struct Resolution Resolution;
+
+/* Mapped files shared by the caches of many contexts, across
+ * compilations, for a long-running process (include.c) */
+typedef struct FileStore FileStore;
+
+typedef struct {
+    FileNode *files[FILE_TABLE_SIZE];
+    FileNode *first_loaded;
+    FileNode *last_loaded;
+    Resolution *resolutions[FILE_TABLE_SIZE];
+    char **search_paths;
+    int search_path_count;
+    FileStore *store;           /* where files are mapped from, or NULL */
+} FileCache;
+
+/* Macro definitions and expansions of them (macro.c) */
+#define EXPANSION_CACHE_BUCKETS 4096
+
+typedef struct Macro Macro;
+typedef struct CacheEntry CacheEntry;
+
+typedef struct {
+    Macro *macros;
+    size_t table_size;
+    size_t count;
+    uint64_t epoch;             /* bumped by every definition change */
+    CacheEntry *cache[EXPANSION_CACHE_BUCKETS];
+    int cache_count;
+    Arena scratch;              /* tokens and hide sets of the line being expanded */
+} MacroTable;
+
+/* A -D or -U option */
+typedef struct {
+    bool undefine;
+    char *text;             /* NAME or NAME=VALUE */
+} MacroOption;
+
+/* Everything a compilation keeps between phases. Nothing is shared
+ * between contexts, so each thread can compile with its own. */
+typedef struct CompilerContext {
+    SymbolTable symbols;
+    FileCache files;
+    MacroTable macros;
+    MacroOption *macro_options;     /* applied to every unit, in order */
+    int macro_option_count;
+    int codegen_threads;            /* generating functions; 0 or 1 is the calling thread */
+    int max_nesting;                /* of statements and parentheses; 0 for the default */
+} CompilerContext;
+
+/* Include-guard detection state of one open file */
+typedef enum {
+    GUARD_START,        /* only blank lines so far */
+    GUARD_INSIDE,       /* inside the leading #ifndef */
+    GUARD_CLOSED,       /* its #endif seen, only blank lines since */
+    GUARD_NONE,
+} GuardState;
+
+typedef struct {
+    SourceFile *file;
+    const char *ptr;
+    const char *end;
+    int line;
+    int cond_base;          /* conditional depth when the file was entered */
+    GuardState guard_state;
+    int guard_depth;
+    const char *guard;
+    size_t guard_length;
+} IncludeFrame;
+
+/* One open #if/#ifdef/#ifndef group */
+typedef struct {
+    bool enclosing_active;  /* the group sits in an active region */
+    bool active;            /* the current branch is being compiled */
+    bool taken;             /* some branch has been compiled already */
+    bool seen_else;
+    int line;
+} Conditional;
+
+/* Preprocessor state: expands the source one line at a time into a
+ * growable output buffer, with a stack of files being included */
+typedef struct {
+    CompilerContext *context;
+    IncludeFrame *frames;
+    int depth;
+    int frame_capacity;
+    Conditional *conds;
+    int cond_depth;
+    int cond_capacity;
+    char *output;
+    size_t output_size;
+    size_t output_capacity;
+    char *splice;               /* current line with backslash-newlines removed */
+    size_t splice_size;
+    size_t splice_capacity;
+    int line;               /* source line of the last line returned */
+    size_t bytes_read;
+    int includes;
+    int includes_skipped;
+    const char *pch_ptr;        /* buffered lines, as of a PCH, still to return */
+    const char *pch_end;
+    long expansion_lookups;     /* macro invocations looked up in the cache */
+    long expansion_hits;
+    bool failed;
+} Preprocessor;
+
+/* Where a lexer pulls its lines from. *text is NULL at the end of input;
+ * false means the source failed and has reported why. */
+typedef bool (*LineSource)(void *source, const char **text, size_t *length, int *line);
+
+/* Lexer state: tokenizes preprocessed lines as they are pulled */
+typedef struct {
+    LineSource read_line;
+    void *source;
+    SymbolTable *symbols;
+    const char *start;
+    const char *ptr;
+    const char *end;
+    size_t base;    /* stream offset of the current line */
+    int line;
+    bool failed;
+} Lexer;
+
+/* Where a parser pulls its tokens from; false on an error */
+typedef bool (*TokenSource)(void *source, Token *token);
+
+/* Nesting of statements and of parentheses accepted by default. Neither
+ * the parser nor the code generator recurses on it, so the limit only
+ * guards against runaway input. */
+#define DEFAULT_MAX_NESTING 4096
+
+/* An operator waiting for its right operand, or an open parenthesis */
+typedef struct {
+    char op;                    /* '(' for a parenthesis */
+    int precedence;
+    bool compared;              /* a parenthesis: its enclosing level had a comparison */
+} PendingOp;
+
+/* A compound statement still waiting for what it contains */
+typedef enum {
+    AWAIT_THEN,
+    AWAIT_ELSE,
+    AWAIT_BODY,
+    AWAIT_STATEMENTS
+} PendingKind;
+
+typedef struct {
+    PendingKind kind;
+    NodeIndex node;
+    uint32_t first;             /* a block's first statement in the parser's list */
+} PendingStatement;
+
+/* Parser state: one token of lookahead over the lexer. The stacks are
+ * kept between statements so that parsing does not allocate once they
+ * have grown. statements collects the statements of the open blocks
+ * until each is closed and copied to the AST as a contiguous range. */
+typedef struct {
+    TokenSource next_token;
+    void *source;
+    const SymbolTable *symbols;
+    Token lookahead;
+    Token previous;
+    bool lex_failed;
+    int max_nesting;            /* 0 for DEFAULT_MAX_NESTING */
+    Ast *ast;
+    NodeIndex *operands;
+    uint32_t operand_capacity;
+    PendingOp *ops;
+    uint32_t op_capacity;
+    PendingStatement *pending;
+    uint32_t pending_capacity;
+    NodeIndex *statements;
+    uint32_t statement_count;
+    uint32_t statement_capacity;
+} Parser;
+
+/* A node the code generator has started on, and how far it has got */
+typedef struct {
+    NodeIndex node;
+    int stage;
+    int values[2];              /* its labels, an assignment's offset, or
+                                   the scope it closes */
+} CodegenTask;
+
+/* A declaration's binding of symbol, and the one it hides */
+typedef struct {
+    int symbol;
+    int previous;
+} ScopeBinding;
+
+/* A symbol declared in the function being generated, and the stack
+ * offset of its innermost declaration in scope (0 = none) */
+typedef struct {
+    int symbol;                 /* -1 for an empty entry */
+    int offset;
+} LocalSlot;
+
+/* Code generator state for the function being generated. locals is an
+ * open-addressed hash table from symbol to LocalSlot, sized to the
+ * symbols the function declares; bindings logs the declarations of the
+ * open scopes, so leaving one restores what it hid. Locals live below
+ * the frame pointer down to stack_offset, and those above scope_base
+ * belong to the innermost scope. Labels are numbered per function and
+ * carry its index in the unit, so functions can be generated separately
+ * and in any order. */
+typedef struct {
+    const SymbolTable *symbols;
+    const Ast *ast;
+    int function;
+    LocalSlot *locals;
+    int local_count;
+    int local_capacity;         /* a power of two */
+    ScopeBinding *bindings;
+    int binding_count;
+    int binding_capacity;
+    int stack_offset;
+    int scope_base;
+    int label_counter;
+    CodegenTask *tasks;         /* work stack: nodes not yet finished */
+    int task_count;
+    int task_capacity;
+    AsmWriter *out;
+    bool failed;                /* an error was reported */
+} CodeGenerator;
+
+/* Include functions */
+bool include_add_path(FileCache *cache, const char *dir);
+SourceFile *include_open(FileCache *cache, const char *path);
+SourceFile *include_add_memory(FileCache *cache, const char *path, const char *data, size_t size);
+SourceFile *include_resolve(FileCache *cache, const SourceFile *includer, const char *name,
+                            size_t len, bool angled);
+SourceFile *include_next_loaded(const FileCache *cache, const SourceFile *file);
+bool include_write_deps(const FileCache *cache, const char *dep_file, const char *target);
+void include_reset(FileCache *cache);
+void include_release(FileCache *cache);
+FileStore *file_store_create(void);
+void file_store_destroy(FileStore *store);
+void file_store_stats(FileStore *store, long *hits, long *misses, int *files, size_t *bytes);
 
 /* Preprocessor functions */
-char *preprocess(const char *source);
+bool pp_init(Preprocessor *pp, CompilerContext *context, const char *path);
+bool pp_init_memory(Preprocessor *pp, CompilerContext *context, const char *name,
+                    const char *source, size_t length);
+const char *pp_next_line(Preprocessor *pp, size_t *length);
+void pp_finish(Preprocessor *pp);
+bool pp_define(Preprocessor *pp, const char *definition);
+void pp_undefine(Preprocessor *pp, const char *name);
+bool pp_evaluate(const char *p, const char *end, long long *value, const char **error);
+bool pp_reserve(Preprocessor *pp, size_t extra);
+bool pp_append(Preprocessor *pp, const char *text, size_t len);
+char *pp_buffer_lines(Preprocessor *pp, size_t *size);
+
+/* Macro functions */
+typedef bool (*MacroVisitor)(void *context, const char *name, size_t name_length,
+                             const char *params, size_t params_length,
+                             const char *value, size_t value_length);
+bool macro_define(MacroTable *table, const char *p, const char *end, const char *file, int line);
+void macro_undefine(MacroTable *table, const char *name, size_t len);
+bool macro_defined(MacroTable *table, const char *name, size_t len);
+bool macro_expand_line(Preprocessor *pp, const char *p, const char *end);
+bool macro_expand_condition(Preprocessor *pp, const char *p, const char *end);
+bool macro_visit(const MacroTable *table, MacroVisitor visit, void *context);
+void macro_clear(MacroTable *table);
+void macro_release(MacroTable *table);
+
+/* Precompiled header functions */
+bool pch_write(Preprocessor *pp, const char *output);
+bool pch_load(Preprocessor *pp, const char *path);
+
+/* Compilation result cache (cache.c) */
+typedef struct {
+    const char *directory;
+    uint64_t max_size;          /* in bytes; least recently used entries go first */
+} ResultCache;
+
+typedef struct {
+    char hex[33];
+} ResultKey;
+
+void result_cache_key(ResultKey *key, const char *lines, size_t size, bool freestanding);
+bool result_cache_fetch(const ResultCache *cache, const ResultKey *key, const char *object);
+void result_cache_store(const ResultCache *cache, const ResultKey *key, const char *object);
+bool result_cache_print_stats(const ResultCache *cache, FILE *out);
 
 /* Lexer functions */
-Token *tokenize(const char *source, int *token_count);
-void free_tokens(Token *tokens, int count);
+void lexer_init(Lexer *lexer, Preprocessor *pp);
+void lexer_init_source(Lexer *lexer, SymbolTable *symbols, LineSource read_line, void *source);
+bool lexer_next(Lexer *lexer, Token *token);
+
+/* Writer functions */
+void writer_init_memory(AsmWriter *writer);
+void writer_init_fd(AsmWriter *writer, int fd);
+bool writer_reserve(AsmWriter *writer, size_t length);
+void writer_write(AsmWriter *writer, const char *text, size_t length);
+bool writer_flush(AsmWriter *writer);
+char *writer_take(AsmWriter *writer);
+void writer_release(AsmWriter *writer);
 
 /* Parser functions */
-ASTNode *parse(Token *tokens, int token_count);
-void free_ast(ASTNode *node);
+bool parser_init(Parser *parser, Lexer *lexer, Ast *ast);
+bool parser_init_source(Parser *parser, const SymbolTable *symbols, TokenSource next_token,
+                        void *source, Ast *ast);
+void parser_finish(Parser *parser);
+int parse_function_header(Parser *parser);
+NodeIndex parse_function_statement(Parser *parser, bool *done);
+NodeIndex parse_function(Parser *parser);
+bool parse_at_end(Parser *parser);
+NodeIndex parse(Lexer *lexer, Ast *ast, int max_nesting);
 
 /* Code generator functions */
-char *generate_code(ASTNode *ast);
+bool generate_code(const SymbolTable *symbols, const Ast *ast, NodeIndex node, int function,
+                   bool freestanding, AsmWriter *out);
+void codegen_begin(CodeGenerator *gen, const SymbolTable *symbols, const Ast *ast,
+                   const char *name, int function, AsmWriter *out);
+void codegen_statement(CodeGenerator *gen, NodeIndex stmt);
+bool codegen_end(CodeGenerator *gen, bool freestanding);
+
+/* Bytecode functions */
+BytecodeFunction *compile_bytecode(const SymbolTable *symbols, const Ast *ast, NodeIndex node);
+void free_bytecode(BytecodeFunction *function);
+InterpStatus interpret(BytecodeFunction *function, long hot_threshold, int *result);
 
 /* Linker functions */
-int link_program(const char *asm_file, const char *output_file);
+/* Writes assembly for assemble_generated; false after reporting an error */
+typedef bool (*AsmGenerator)(void *source, AsmWriter *out);
+
+int link_program(const char *assembly, const char *output_file, bool freestanding);
+int assemble_object(const char *assembly, const char *obj_file);
+int assemble_generated(AsmGenerator generate, void *source, const char *obj_file);
+int link_objects(const char *const *objects, int count, const char *output_file,
+                 bool freestanding);
+
+/* JIT functions */
+int jit_run(const char *assembly, int *result);
+
+/* Library API (api.c). A context may be reused for any number of
+ * compilations, by one thread at a time; separate contexts can be used
+ * from separate threads concurrently. */
+CompilerContext *crappola_create(void);
+void crappola_destroy(CompilerContext *context);
+void crappola_reset(CompilerContext *context);
+bool crappola_add_include_path(CompilerContext *context, const char *dir);
+bool crappola_define(CompilerContext *context, const char *definition);
+bool crappola_undefine(CompilerContext *context, const char *name);
+char *crappola_compile(CompilerContext *context, const char *name, const char *source,
+                       size_t length, bool freestanding);
+unsigned char *crappola_compile_object(CompilerContext *context, const char *name,
+                                       const char *source, size_t length, bool freestanding,
+                                       size_t *size);
+void crappola_set_streams(FILE *out, FILE *err);
+FILE *out_stream(void);
+FILE *err_stream(void);
+bool compile_stream(Preprocessor *pp, Ast *ast, bool freestanding, AsmWriter *out);
+bool compile_function(Parser *parser, int function, bool freestanding, AsmWriter *out);
+bool compile_functions(Parser *parser, bool freestanding, int threads, AsmWriter *out);
+
+/* Parallel code generation (parallel.c) */
+bool generate_parallel(Parser *parser, bool freestanding, int threads, AsmWriter *out);
+
+/* Pipelined front end (pipeline.c): preprocessing, lexing and parsing
+ * with code generation run as concurrent stages */
+typedef enum {
+    STAGE_PREPROCESS,
+    STAGE_LEX,
+    STAGE_GENERATE,
+    STAGE_COUNT
+} PipelineStageId;
+
+typedef struct {
+    double busy;                /* seconds spent working */
+    double waiting;             /* seconds blocked on an empty or full ring */
+    long batches;               /* handed on to the next stage */
+} PipelineStage;
+
+typedef struct {
+    PipelineStage stages[STAGE_COUNT];
+    double elapsed;
+} PipelineStats;
+
+bool compile_pipelined(Preprocessor *pp, Ast *ast, bool freestanding, PipelineStats *stats,
+                       AsmWriter *out);
+void pipeline_print_stats(const PipelineStats *stats, FILE *out);
+
+/* Command-line driver (main.c). With a directory, relative paths are
+ * taken from there and units are compiled in the calling thread; the
+ * compile server runs requests this way. */
+int driver_run(CompilerContext *context, int argc, char *argv[], const char *directory);
+
+/* Compile server and its client (server.c) */
+int server_run(const char *socket_path, int threads);
+int client_run(const char *socket_path, int argc, char *argv[]);
 
 #endif /* CRAPPOLA_H */
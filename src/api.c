@@ -0,0 +1,233 @@
+#include "crappola.h"
+#include <unistd.h>
+#include <sys/stat.h>
+
+/* Library interface. All state of a compilation lives in its
+ * CompilerContext, so any number of threads can compile at once as long
+ * as each uses its own context. Sources are taken from memory and the
+ * result comes back as assembly text or object file bytes. */
+
+/* Progress output and diagnostics of the calling thread */
+static _Thread_local FILE *thread_out;
+static _Thread_local FILE *thread_err;
+
+FILE *out_stream(void) {
+    return thread_out ? thread_out : stdout;
+}
+
+FILE *err_stream(void) {
+    return thread_err ? thread_err : stderr;
+}
+
+/* Send what compilations on this thread print to out and err; NULL
+ * restores stdout or stderr */
+void crappola_set_streams(FILE *out, FILE *err) {
+    thread_out = out;
+    thread_err = err;
+}
+
+CompilerContext *crappola_create(void) {
+    CompilerContext *context = calloc(1, sizeof(CompilerContext));
+    if (!context) {
+        fprintf(err_stream(), "Error: Memory allocation failed creating compiler context\n");
+    }
+    return context;
+}
+
+void crappola_destroy(CompilerContext *context) {
+    if (!context) {
+        return;
+    }
+    crappola_reset(context);
+    macro_release(&context->macros);
+    free(context->macro_options);
+    free(context);
+}
+
+/* Forget the include paths, macros and identifiers of earlier
+ * compilations, so the context can be reused for an unrelated one. Its
+ * tables keep their memory, and a file store stays attached. */
+void crappola_reset(CompilerContext *context) {
+    macro_clear(&context->macros);
+    include_release(&context->files);
+    intern_release(&context->symbols);
+    for (int i = 0; i < context->macro_option_count; i++) {
+        free(context->macro_options[i].text);
+    }
+    context->macro_option_count = 0;
+}
+
+bool crappola_add_include_path(CompilerContext *context, const char *dir) {
+    return include_add_path(&context->files, dir);
+}
+
+static bool add_macro_option(CompilerContext *context, bool undefine, const char *text) {
+    MacroOption *options = realloc(context->macro_options,
+                                   sizeof(MacroOption) * (context->macro_option_count + 1));
+    if (!options) {
+        return false;
+    }
+    context->macro_options = options;
+    char *copy = strdup(text);
+    if (!copy) {
+        return false;
+    }
+    options[context->macro_option_count].undefine = undefine;
+    options[context->macro_option_count].text = copy;
+    context->macro_option_count++;
+    return true;
+}
+
+/* Like -D and -U: applied in order at the start of every compilation */
+bool crappola_define(CompilerContext *context, const char *definition) {
+    return add_macro_option(context, false, definition);
+}
+
+bool crappola_undefine(CompilerContext *context, const char *name) {
+    return add_macro_option(context, true, name);
+}
+
+/* Parse and generate code for the next function parser reads, the
+ * function'th of its unit. Each top-level statement is generated as soon
+ * as it is parsed and its nodes are released, so memory is bounded by
+ * the deepest statement rather than by the size of the function. With
+ * freestanding, main also gets a _start. The code goes to out; returns
+ * false after reporting an error. */
+bool compile_function(Parser *parser, int function, bool freestanding, AsmWriter *out) {
+    int symbol = parse_function_header(parser);
+    if (symbol < 0) {
+        return false;
+    }
+    const char *name = symbol_name(parser->symbols, symbol);
+
+    CodeGenerator gen;
+    codegen_begin(&gen, parser->symbols, parser->ast, name, function, out);
+    bool done = false;
+    while (!done) {
+        AstMark mark = ast_mark(parser->ast);
+        NodeIndex stmt = parse_function_statement(parser, &done);
+        if (!stmt) {
+            break;
+        }
+        codegen_statement(&gen, stmt);
+        ast_reset(parser->ast, mark);
+    }
+    bool written = codegen_end(&gen, freestanding && strcmp(name, "main") == 0);
+    return done && written;
+}
+
+/* Generate every function of the unit parser reads, in source order. With
+ * more than one thread, functions are parsed whole and generated on a
+ * pool; the output is the same either way. */
+bool compile_functions(Parser *parser, bool freestanding, int threads, AsmWriter *out) {
+    if (threads > 1) {
+        return generate_parallel(parser, freestanding, threads, out);
+    }
+
+    int function = 0;
+    do {
+        if (!compile_function(parser, function++, freestanding, out)) {
+            return false;
+        }
+    } while (!parse_at_end(parser));
+    return true;
+}
+
+/* Compile the unit pp reads, every phase on the calling thread except
+ * code generation on the context's codegen_threads */
+bool compile_stream(Preprocessor *pp, Ast *ast, bool freestanding, AsmWriter *out) {
+    Lexer lexer;
+    lexer_init(&lexer, pp);
+    Parser parser;
+    if (!parser_init(&parser, &lexer, ast)) {
+        return false;
+    }
+    parser.max_nesting = pp->context->max_nesting;
+    bool ok = compile_functions(&parser, freestanding, pp->context->codegen_threads, out);
+    parser_finish(&parser);
+    return ok;
+}
+
+typedef struct {
+    CompilerContext *context;
+    const char *name;
+    const char *source;
+    size_t length;
+    bool freestanding;
+} SourceUnit;
+
+/* Compile a unit held in memory to out */
+static bool compile_source(void *arg, AsmWriter *out) {
+    SourceUnit *unit = arg;
+    Preprocessor pp;
+    if (!pp_init_memory(&pp, unit->context, unit->name, unit->source, unit->length)) {
+        pp_finish(&pp);
+        return false;
+    }
+    Ast ast;
+    ast_init(&ast);
+    bool ok = compile_stream(&pp, &ast, unit->freestanding, out);
+    pp_finish(&pp);
+    ast_release(&ast);
+    // Symbols are only meaningful within a unit; a long-lived context
+    // should not keep every identifier it has ever seen
+    intern_release(&unit->context->symbols);
+    return ok;
+}
+
+/* Compile source to assembly. name is used in diagnostics and as the
+ * base for quoted #includes. The result is malloc'd and NUL-terminated. */
+char *crappola_compile(CompilerContext *context, const char *name, const char *source,
+                       size_t length, bool freestanding) {
+    SourceUnit unit = { context, name, source, length, freestanding };
+    AsmWriter out;
+    writer_init_memory(&out);
+    bool ok = compile_source(&unit, &out);
+    char *assembly = writer_take(&out);
+    if (!ok) {
+        free(assembly);
+        return NULL;
+    }
+    return assembly;
+}
+
+/* Compile source to the bytes of an object file, through the system
+ * assembler. The result is malloc'd and its length stored in *size. */
+unsigned char *crappola_compile_object(CompilerContext *context, const char *name,
+                                       const char *source, size_t length, bool freestanding,
+                                       size_t *size) {
+    // The assembler needs a file to write; a unique name keeps
+    // concurrent compilations apart
+    char obj_file[] = "/tmp/crappola_XXXXXX";
+    int fd = mkstemp(obj_file);
+    if (fd < 0) {
+        fprintf(err_stream(), "Error: Could not create a temporary object file\n");
+        return NULL;
+    }
+    close(fd);
+    // The assembly goes to the assembler as it is generated
+    SourceUnit unit = { context, name, source, length, freestanding };
+    if (assemble_generated(compile_source, &unit, obj_file) != 0) {
+        return NULL;
+    }
+
+    unsigned char *bytes = NULL;
+    FILE *in = fopen(obj_file, "rb");
+    struct stat st;
+    if (in && fstat(fileno(in), &st) == 0 && (bytes = malloc(st.st_size ? st.st_size : 1))) {
+        if (fread(bytes, 1, st.st_size, in) == (size_t)st.st_size) {
+            *size = (size_t)st.st_size;
+        } else {
+            free(bytes);
+            bytes = NULL;
+        }
+    }
+    if (in) {
+        fclose(in);
+    }
+    if (!bytes) {
+        fprintf(err_stream(), "Error: Could not read object file %s\n", obj_file);
+    }
+    remove(obj_file);
+    return bytes;
+}
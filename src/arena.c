@@ -0,0 +1,116 @@
+#include "crappola.h"
+#include <stddef.h>
+
+/* Bump allocator used for strings and macro expansion. Chunks grow
+ * geometrically and everything is released at once by arena_release. */
+
+#define ARENA_MIN_CHUNK (64 * 1024)
+#define ARENA_MAX_CHUNK (16 * 1024 * 1024)
+#define ARENA_ALIGN _Alignof(max_align_t)
+
+struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t size;
+    size_t used;
+    _Alignas(max_align_t) char data[];
+};
+
+void arena_init(Arena *arena) {
+    memset(arena, 0, sizeof(*arena));
+}
+
+/* Start a new chunk, twice the size of the last up to ARENA_MAX_CHUNK.
+ * A request bigger than that size gets a chunk of exactly its own size;
+ * nothing else distinguishes it. Whatever was left in the previous chunk
+ * is abandoned. */
+static ArenaChunk *arena_grow(Arena *arena, size_t min_size) {
+    size_t size = arena->head ? arena->head->size * 2 : ARENA_MIN_CHUNK;
+    if (size > ARENA_MAX_CHUNK) {
+        size = ARENA_MAX_CHUNK;
+    }
+    if (size < min_size) {
+        size = min_size;
+    }
+
+    ArenaChunk *chunk = malloc(sizeof(ArenaChunk) + size);
+    if (!chunk) {
+        fprintf(err_stream(), "Error: Memory allocation failed in arena\n");
+        return NULL;
+    }
+    chunk->next = arena->head;
+    chunk->size = size;
+    chunk->used = 0;
+    arena->head = chunk;
+    arena->reserved += size;
+    if (arena->reserved > arena->peak_reserved) {
+        arena->peak_reserved = arena->reserved;
+    }
+    arena->chunk_count++;
+    return chunk;
+}
+
+void *arena_alloc(Arena *arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    ArenaChunk *chunk = arena->head;
+    if (!chunk || chunk->size - chunk->used < size) {
+        chunk = arena_grow(arena, size);
+        if (!chunk) {
+            return NULL;
+        }
+    }
+
+    void *ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    arena->allocated += size;
+    if (arena->allocated > arena->peak) {
+        arena->peak = arena->allocated;
+    }
+    return ptr;
+}
+
+void *arena_calloc(Arena *arena, size_t size) {
+    void *ptr = arena_alloc(arena, size);
+    if (ptr) {
+        memset(ptr, 0, size);
+    }
+    return ptr;
+}
+
+char *arena_strndup(Arena *arena, const char *str, size_t len) {
+    char *copy = arena_alloc(arena, len + 1);
+    if (copy) {
+        memcpy(copy, str, len);
+        copy[len] = '\0';
+    }
+    return copy;
+}
+
+/* Free everything allocated, keeping the first chunk, so clearing in a
+ * loop does not return it to malloc every time. The peaks are kept. */
+void arena_clear(Arena *arena) {
+    while (arena->head && arena->head->next) {
+        ArenaChunk *chunk = arena->head;
+        arena->head = chunk->next;
+        arena->reserved -= chunk->size;
+        arena->chunk_count--;
+        free(chunk);
+    }
+    if (arena->head) {
+        arena->head->used = 0;
+    }
+    arena->allocated = 0;
+}
+
+void arena_release(Arena *arena) {
+    ArenaChunk *chunk = arena->head;
+    while (chunk) {
+        ArenaChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena->head = NULL;
+    arena->allocated = 0;
+    arena->reserved = 0;
+    arena->chunk_count = 0;
+}
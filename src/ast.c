@@ -0,0 +1,116 @@
+#include "crappola.h"
+
+/* Flat AST storage. Nodes are appended to parallel arrays that double
+ * when full; a traversal touches only the arrays it reads, and children
+ * are found by index rather than through pointers into the heap. In
+ * streaming compilation the same storage is reset to a mark after every
+ * statement, so it stays at the size of the largest statement. */
+
+#define AST_MIN_CAPACITY 1024
+
+void ast_init(Ast *ast) {
+    memset(ast, 0, sizeof(*ast));
+}
+
+static bool ast_grow(Ast *ast) {
+    uint32_t capacity = ast->capacity ? ast->capacity * 2 : AST_MIN_CAPACITY;
+    if (capacity <= ast->capacity) {
+        fprintf(err_stream(), "Error: Too many AST nodes\n");
+        return false;
+    }
+    uint8_t *kinds = realloc(ast->kinds, capacity);
+    if (kinds) {
+        ast->kinds = kinds;
+    }
+    int32_t *values = realloc(ast->values, sizeof(int32_t) * capacity);
+    if (values) {
+        ast->values = values;
+    }
+    NodeIndex *lhs = realloc(ast->lhs, sizeof(NodeIndex) * capacity);
+    if (lhs) {
+        ast->lhs = lhs;
+    }
+    NodeIndex *rhs = realloc(ast->rhs, sizeof(NodeIndex) * capacity);
+    if (rhs) {
+        ast->rhs = rhs;
+    }
+    if (!kinds || !values || !lhs || !rhs) {
+        fprintf(err_stream(), "Error: Memory allocation failed in parser\n");
+        return false;
+    }
+    ast->capacity = capacity;
+    return true;
+}
+
+/* Append a node and return its index, or 0 after reporting an error */
+NodeIndex ast_add(Ast *ast, NodeType kind, int32_t value, NodeIndex lhs, NodeIndex rhs) {
+    if (ast->count == ast->capacity && !ast_grow(ast)) {
+        return 0;
+    }
+    if (ast->count == 0) {
+        // Node 0 stands for "none" and is never handed out
+        ast->count = 1;
+    }
+    NodeIndex node = ast->count++;
+    ast->kinds[node] = (uint8_t)kind;
+    ast->values[node] = value;
+    ast->lhs[node] = lhs;
+    ast->rhs[node] = rhs;
+    if (ast->count > ast->peak) {
+        ast->peak = ast->count;
+    }
+    return node;
+}
+
+/* Copy count indices to extra as one range and return where it starts,
+ * or UINT32_MAX after reporting an error */
+uint32_t ast_add_extra(Ast *ast, const NodeIndex *items, uint32_t count) {
+    if (ast->extra_count + count > ast->extra_capacity) {
+        uint32_t capacity = ast->extra_capacity ? ast->extra_capacity : AST_MIN_CAPACITY;
+        while (capacity < ast->extra_count + count) {
+            capacity *= 2;
+        }
+        NodeIndex *extra = realloc(ast->extra, sizeof(NodeIndex) * capacity);
+        if (!extra) {
+            fprintf(err_stream(), "Error: Memory allocation failed in parser\n");
+            return UINT32_MAX;
+        }
+        ast->extra = extra;
+        ast->extra_capacity = capacity;
+    }
+    uint32_t start = ast->extra_count;
+    if (count > 0) {
+        memcpy(ast->extra + start, items, sizeof(NodeIndex) * count);
+    }
+    ast->extra_count += count;
+    if (ast->extra_count > ast->extra_peak) {
+        ast->extra_peak = ast->extra_count;
+    }
+    return start;
+}
+
+AstMark ast_mark(const Ast *ast) {
+    AstMark mark = { ast->count, ast->extra_count };
+    return mark;
+}
+
+/* Drop every node and range added since the mark */
+void ast_reset(Ast *ast, AstMark mark) {
+    ast->count = mark.count;
+    ast->extra_count = mark.extra_count;
+}
+
+/* Bytes the most nodes and ranges held at once took */
+size_t ast_peak_bytes(const Ast *ast) {
+    size_t node_size = sizeof(uint8_t) + sizeof(int32_t) + 2 * sizeof(NodeIndex);
+    return node_size * ast->peak + sizeof(NodeIndex) * ast->extra_peak;
+}
+
+void ast_release(Ast *ast) {
+    free(ast->kinds);
+    free(ast->values);
+    free(ast->lhs);
+    free(ast->rhs);
+    free(ast->extra);
+    memset(ast, 0, sizeof(*ast));
+}
@@ -0,0 +1,472 @@
+#include "crappola.h"
+
+/* Bytecode compiler: lowers the AST onto a register machine. Every
+ * variable in scope owns a register; temporaries are allocated above
+ * them. Scopes work as in the code generator: registers maps each symbol
+ * to its innermost declaration, and leaving a scope undoes the bindings
+ * logged since it began and frees its registers for the next one. */
+
+typedef struct {
+    const SymbolTable *symbols;
+    const Ast *ast;
+    int *registers;     /* register of each variable plus one, by symbol ID (0 = none) */
+    int var_count;      /* registers set aside for variables */
+    ScopeBinding *bindings;
+    int binding_count;
+    int next_variable;  /* register for the next declaration */
+    int scope_base;     /* first register of the innermost scope */
+    int next_temp;
+    BytecodeFunction *function;
+    bool failed;
+} BytecodeCompiler;
+
+static int emit_op(BytecodeCompiler *bc, int op, int a, int b, int c) {
+    if (bc->function->count >= bc->function->capacity) {
+        int capacity = bc->function->capacity ? bc->function->capacity * 2 : 64;
+        Instruction *code = realloc(bc->function->code, sizeof(Instruction) * capacity);
+        if (!code) {
+            fprintf(err_stream(), "Error: Memory allocation failed in bytecode compiler\n");
+            bc->failed = true;
+            return bc->function->count;
+        }
+        bc->function->code = code;
+        bc->function->capacity = capacity;
+    }
+    Instruction *insn = &bc->function->code[bc->function->count];
+    insn->op = op;
+    insn->a = a;
+    insn->b = b;
+    insn->c = c;
+    return bc->function->count++;
+}
+
+static int find_variable(BytecodeCompiler *bc, int symbol) {
+    return bc->registers[symbol] - 1;
+}
+
+/* A node being compiled, and how far it has got */
+typedef struct {
+    NodeIndex node;
+    int stage;
+    int values[2];      /* saved temporary and left operand, or jump indices */
+} Task;
+
+/* Explicit work stack, so deep nesting does not use the C stack */
+typedef struct {
+    Task *tasks;
+    int count;
+    int capacity;
+} TaskStack;
+
+static void push_task(BytecodeCompiler *bc, TaskStack *stack, NodeIndex node, int stage) {
+    if (stack->count == stack->capacity) {
+        int capacity = stack->capacity ? stack->capacity * 2 : 64;
+        Task *tasks = realloc(stack->tasks, sizeof(Task) * capacity);
+        if (!tasks) {
+            fprintf(err_stream(), "Error: Memory allocation failed in bytecode compiler\n");
+            bc->failed = true;
+            return;
+        }
+        stack->tasks = tasks;
+        stack->capacity = capacity;
+    }
+    Task *task = &stack->tasks[stack->count++];
+    task->node = node;
+    task->stage = stage;
+}
+
+/* Push the task just popped back, to continue at stage */
+static void resume_task(TaskStack *stack, int stage) {
+    stack->tasks[stack->count++].stage = stage;
+}
+
+/* Stages any statement can be pushed at ahead of its own: a scope opens
+ * around it, and closes once it is done */
+enum {
+    STAGE_OPEN_SCOPE = -1,
+    STAGE_CLOSE_SCOPE = -2,
+};
+
+/* Set a register aside for every declaration before emitting any code,
+ * so temporaries never collide with variables declared later on. That
+ * is more than the most in scope at once, but never fewer. A function's
+ * nodes are contiguous, so this is a scan rather than a walk of the
+ * tree. */
+static int count_declarations(const Ast *ast, NodeIndex function) {
+    int count = 0;
+    for (NodeIndex node = ast->rhs[function]; node < function; node++) {
+        count += ast->kinds[node] == NODE_DECLARATION;
+    }
+    return count;
+}
+
+static int new_temp(BytecodeCompiler *bc) {
+    int reg = bc->next_temp++;
+    if (bc->next_temp > bc->function->register_count) {
+        bc->function->register_count = bc->next_temp;
+    }
+    return reg;
+}
+
+static int arithmetic_op(char op) {
+    switch (op) {
+        case '+': return OP_ADD;
+        case '-': return OP_SUB;
+        case '*': return OP_MUL;
+        case '/': return OP_DIV;
+        case '<': return OP_LT;
+        case '>': return OP_GT;
+        case 'l': return OP_LE;
+        case 'g': return OP_GE;
+        case 'e': return OP_EQ;
+        case 'n': return OP_NE;
+    }
+    return -1;
+}
+
+static bool is_comparison(char op) {
+    return op == '<' || op == '>' || op == 'l' || op == 'g' || op == 'e' || op == 'n';
+}
+
+/* Jump taken when the comparison is false, as a register-register op. */
+static int inverse_branch(char op) {
+    switch (op) {
+        case '<': return OP_JGE;
+        case '>': return OP_JLE;
+        case 'l': return OP_JGT;
+        case 'g': return OP_JLT;
+        case 'e': return OP_JNE;
+        case 'n': return OP_JEQ;
+    }
+    return -1;
+}
+
+/* A number or variable, or 0 after reporting an error */
+static int compile_operand(BytecodeCompiler *bc, NodeIndex node) {
+    int value = bc->ast->values[node];
+    switch (bc->ast->kinds[node]) {
+        case NODE_NUMBER: {
+            int reg = new_temp(bc);
+            emit_op(bc, OP_LOADI, reg, value, 0);
+            return reg;
+        }
+
+        case NODE_VARIABLE: {
+            int reg = find_variable(bc, value);
+            if (reg == -1) {
+                fprintf(err_stream(), "Undefined variable: %s\n", symbol_name(bc->symbols, value));
+                bc->failed = true;
+                return 0;
+            }
+            return reg;
+        }
+
+        default:
+            fprintf(err_stream(), "Unsupported expression in bytecode compiler\n");
+            bc->failed = true;
+            return 0;
+    }
+}
+
+/* Evaluate an expression, returning the register that holds the result.
+ * Variables are used in place; everything else lands in a temporary.
+ * Operators wait on a work stack while their operands are compiled,
+ * left first, so long chains do not recurse. */
+static int compile_expression(BytecodeCompiler *bc, NodeIndex root) {
+    if (!root || bc->failed) {
+        bc->failed = true;
+        return 0;
+    }
+
+    const Ast *ast = bc->ast;
+    TaskStack stack = {0};
+    NodeIndex node = root;
+    int result = 0;
+    for (;;) {
+        // Down the left operands to the first number or variable
+        while (ast->kinds[node] == NODE_BINARY_OP && !bc->failed) {
+            push_task(bc, &stack, node, 0);
+            if (!bc->failed) {
+                stack.tasks[stack.count - 1].values[0] = bc->next_temp;
+            }
+            node = ast->lhs[node];
+        }
+        result = compile_operand(bc, node);
+
+        // Then up through the operators whose operands are done
+        node = 0;
+        while (stack.count > 0 && !bc->failed && !node) {
+            Task *task = &stack.tasks[--stack.count];
+            char op = (char)ast->values[task->node];
+            NodeIndex right = ast->rhs[task->node];
+            int saved_temp = task->values[0];
+            if (task->stage == 0) {
+                // Superinstruction: arithmetic with a constant right operand
+                if (ast->kinds[right] == NODE_NUMBER && (op == '+' || op == '-' || op == '*')) {
+                    bc->next_temp = saved_temp;
+                    int dst = new_temp(bc);
+                    int opcode = op == '+' ? OP_ADDI : (op == '-' ? OP_SUBI : OP_MULI);
+                    emit_op(bc, opcode, dst, result, ast->values[right]);
+                    result = dst;
+                    continue;
+                }
+                task->values[1] = result;
+                resume_task(&stack, 1);
+                node = right;
+            } else {
+                int left = task->values[1];
+                bc->next_temp = saved_temp;
+                int dst = new_temp(bc);
+                emit_op(bc, arithmetic_op(op), dst, left, result);
+                result = dst;
+            }
+        }
+        if (!node || bc->failed) {
+            free(stack.tasks);
+            return bc->failed ? 0 : result;
+        }
+    }
+}
+
+/* Emit a jump taken when the condition is false and return its index so
+ * the target can be patched. Comparisons fuse into a single branch. */
+static int compile_branch_if_false(BytecodeCompiler *bc, NodeIndex cond) {
+    const Ast *ast = bc->ast;
+    int saved_temp = bc->next_temp;
+    int index;
+
+    if (cond && ast->kinds[cond] == NODE_BINARY_OP && is_comparison((char)ast->values[cond])) {
+        char op = (char)ast->values[cond];
+        NodeIndex right = ast->rhs[cond];
+        int left = compile_expression(bc, ast->lhs[cond]);
+        int branch = inverse_branch(op);
+        if (ast->kinds[right] == NODE_NUMBER) {
+            index = emit_op(bc, branch + (OP_JLTI - OP_JLT), left, ast->values[right], -1);
+        } else {
+            int rhs = compile_expression(bc, right);
+            index = emit_op(bc, branch, left, rhs, -1);
+        }
+    } else {
+        int reg = compile_expression(bc, cond);
+        index = emit_op(bc, OP_JZ, reg, -1, 0);
+    }
+
+    bc->next_temp = saved_temp;
+    return index;
+}
+
+static void patch_branch(BytecodeCompiler *bc, int index, int target) {
+    if (bc->failed) return;
+    Instruction *insn = &bc->function->code[index];
+    if (insn->op == OP_JZ) {
+        insn->b = target;
+    } else if (insn->op == OP_JMP) {
+        insn->a = target;
+    } else {
+        insn->c = target;
+    }
+}
+
+/* Evaluate expr into the variable in dst */
+static void compile_value(BytecodeCompiler *bc, NodeIndex expr, int dst) {
+    int saved_temp = bc->next_temp;
+    int start = bc->function->count;
+    int reg = compile_expression(bc, expr);
+    // Retarget the last instruction when it produced a fresh temporary
+    if (!bc->failed && reg >= bc->var_count && bc->function->count > start &&
+        bc->function->code[bc->function->count - 1].a == reg) {
+        bc->function->code[bc->function->count - 1].a = dst;
+    } else if (reg != dst) {
+        emit_op(bc, OP_MOV, dst, reg, 0);
+    }
+    bc->next_temp = saved_temp;
+}
+
+static void compile_assignment(BytecodeCompiler *bc, NodeIndex node) {
+    int symbol = bc->ast->values[node];
+    int dst = find_variable(bc, symbol);
+    if (dst == -1) {
+        fprintf(err_stream(), "Undefined variable: %s\n", symbol_name(bc->symbols, symbol));
+        bc->failed = true;
+        return;
+    }
+    compile_value(bc, bc->ast->lhs[node], dst);
+}
+
+/* A new variable takes the next register, and is in scope only after its
+ * initial value; declaring a name again in the same scope assigns to it */
+static void compile_declaration(BytecodeCompiler *bc, NodeIndex node) {
+    int symbol = bc->ast->values[node];
+    int dst = find_variable(bc, symbol);
+    bool fresh = dst < bc->scope_base;
+    if (fresh) {
+        dst = bc->next_variable;
+    }
+    if (bc->ast->lhs[node]) {
+        compile_value(bc, bc->ast->lhs[node], dst);
+    } else {
+        emit_op(bc, OP_LOADI, dst, 0, 0);
+    }
+    if (fresh) {
+        ScopeBinding *binding = &bc->bindings[bc->binding_count++];
+        binding->symbol = symbol;
+        binding->previous = bc->registers[symbol];
+        bc->registers[symbol] = ++bc->next_variable;
+    }
+}
+
+/* Start on node in a scope of its own. Blocks and the statements under
+ * if and while get one, as in C99. */
+static void push_scope(BytecodeCompiler *bc, TaskStack *stack, NodeIndex node) {
+    push_task(bc, stack, node, STAGE_OPEN_SCOPE);
+}
+
+/* Statements wait on a work stack while the statements inside them are
+ * compiled, each task recording the stage to resume at */
+static void compile_statement(BytecodeCompiler *bc, NodeIndex body) {
+    const Ast *ast = bc->ast;
+    TaskStack stack = {0};
+    push_task(bc, &stack, body, 0);
+    while (stack.count > 0 && !bc->failed) {
+        Task *task = &stack.tasks[--stack.count];
+        NodeIndex node = task->node;
+        if (!node) continue;
+
+        NodeIndex lhs = ast->lhs[node];
+        NodeIndex rhs = ast->rhs[node];
+        if (task->stage == STAGE_OPEN_SCOPE) {
+            task->values[0] = bc->binding_count;
+            task->values[1] = bc->scope_base;
+            bc->scope_base = bc->next_variable;
+            resume_task(&stack, STAGE_CLOSE_SCOPE);
+            push_task(bc, &stack, node, 0);
+            continue;
+        }
+        if (task->stage == STAGE_CLOSE_SCOPE) {
+            while (bc->binding_count > task->values[0]) {
+                ScopeBinding *binding = &bc->bindings[--bc->binding_count];
+                bc->registers[binding->symbol] = binding->previous;
+            }
+            bc->next_variable = bc->scope_base;
+            bc->scope_base = task->values[1];
+            continue;
+        }
+
+        switch (ast->kinds[node]) {
+            case NODE_RETURN: {
+                int saved_temp = bc->next_temp;
+                int reg = compile_expression(bc, lhs);
+                emit_op(bc, OP_RET, reg, 0, 0);
+                bc->next_temp = saved_temp;
+                break;
+            }
+
+            case NODE_ASSIGNMENT:
+                compile_assignment(bc, node);
+                break;
+
+            case NODE_DECLARATION:
+                compile_declaration(bc, node);
+                break;
+
+            case NODE_IF: {
+                // values: the branch to the else part or the end, then the
+                // jump over the else part
+                NodeIndex else_branch = ast->extra[rhs + 1];
+                if (task->stage == 0) {
+                    task->values[0] = compile_branch_if_false(bc, lhs);
+                    resume_task(&stack, 1);
+                    push_scope(bc, &stack, ast->extra[rhs]);
+                } else if (task->stage == 1 && else_branch) {
+                    task->values[1] = emit_op(bc, OP_JMP, -1, 0, 0);
+                    patch_branch(bc, task->values[0], bc->function->count);
+                    resume_task(&stack, 2);
+                    push_scope(bc, &stack, else_branch);
+                } else if (task->stage == 1) {
+                    patch_branch(bc, task->values[0], bc->function->count);
+                } else {
+                    patch_branch(bc, task->values[1], bc->function->count);
+                }
+                break;
+            }
+
+            case NODE_WHILE:
+                // values: the loop's start, then its exit branch
+                if (task->stage == 0) {
+                    task->values[0] = bc->function->count;
+                    task->values[1] = compile_branch_if_false(bc, lhs);
+                    resume_task(&stack, 1);
+                    push_scope(bc, &stack, rhs);
+                } else {
+                    emit_op(bc, OP_LOOP, task->values[0], 0, 0);
+                    patch_branch(bc, task->values[1], bc->function->count);
+                }
+                break;
+
+            case NODE_BLOCK:
+                for (uint32_t i = rhs; i > 0; i--) {
+                    NodeIndex stmt = ast->extra[lhs + i - 1];
+                    if (ast->kinds[stmt] == NODE_BLOCK) {
+                        push_scope(bc, &stack, stmt);
+                    } else {
+                        push_task(bc, &stack, stmt, 0);
+                    }
+                }
+                break;
+
+            default:
+                break;
+        }
+    }
+    free(stack.tasks);
+}
+
+BytecodeFunction *compile_bytecode(const SymbolTable *symbols, const Ast *ast, NodeIndex node) {
+    if (!node || ast->kinds[node] != NODE_FUNCTION) {
+        fprintf(err_stream(), "Invalid AST for bytecode compilation\n");
+        return NULL;
+    }
+
+    BytecodeCompiler compiler = { symbols, ast, NULL, 0, NULL, 0, 0, 0, 0, NULL, false };
+    BytecodeCompiler *bc = &compiler;
+    bc->function = calloc(1, sizeof(BytecodeFunction));
+    if (!bc->function) {
+        return NULL;
+    }
+    bc->function->name = strdup(symbol_name(symbols, ast->values[node]));
+
+    // Every symbol is known once parsing is done
+    bc->registers = calloc(symbol_count(symbols), sizeof(int));
+    bc->var_count = count_declarations(ast, node);
+    bc->bindings = malloc(sizeof(ScopeBinding) * (bc->var_count ? bc->var_count : 1));
+    if (!bc->registers || !bc->bindings) {
+        free(bc->registers);
+        free(bc->bindings);
+        free_bytecode(bc->function);
+        return NULL;
+    }
+    bc->next_temp = bc->var_count;
+    bc->function->register_count = bc->var_count;
+
+    compile_statement(bc, ast->lhs[node]);
+
+    // Default return if no explicit return
+    int reg = new_temp(bc);
+    emit_op(bc, OP_LOADI, reg, 0, 0);
+    emit_op(bc, OP_RET, reg, 0, 0);
+
+    free(bc->registers);
+    free(bc->bindings);
+    if (bc->failed) {
+        free_bytecode(bc->function);
+        return NULL;
+    }
+    return bc->function;
+}
+
+void free_bytecode(BytecodeFunction *bytecode) {
+    if (!bytecode) return;
+    free(bytecode->name);
+    free(bytecode->code);
+    free(bytecode);
+}
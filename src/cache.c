@@ -0,0 +1,349 @@
+#include "crappola.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+/* Compilation result cache. An object file is stored under a 128-bit
+ * hash of the unit's preprocessed output, the compiler version and the
+ * code generation flags, so identical units compiled anywhere on the
+ * machine share one entry:
+ *
+ *   <dir>/stats          counters, updated under flock
+ *   <dir>/ab/abcdef...   entries, sharded by the first byte of the key
+ *
+ * Entries are written to a temporary name and renamed into place, so a
+ * concurrent reader sees either the whole file or none. A hit touches
+ * the entry's mtime; when the total size passes the limit the least
+ * recently used entries are removed until it is under 90% of it. */
+
+#define CACHE_FORMAT 1
+
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t stores;
+    uint64_t evictions;
+    uint64_t bytes;             /* size of all entries, as last counted */
+} CacheStats;
+
+typedef struct {
+    char *path;
+    time_t mtime;
+    long mtime_ns;
+    uint64_t size;
+} ResultEntry;
+
+/* FNV-1a, 128-bit */
+static unsigned __int128 hash_bytes(unsigned __int128 hash, const void *data, size_t len) {
+    const unsigned __int128 prime = ((unsigned __int128)1 << 88) + 0x13b;
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= prime;
+    }
+    return hash;
+}
+
+/* The key of a unit: what it preprocessed to and what it is compiled with */
+void result_cache_key(ResultKey *key, const char *lines, size_t size, bool freestanding) {
+    unsigned __int128 hash = ((unsigned __int128)0x6c62272e07bb0142u << 64) | 0x62b821756295c58du;
+    uint32_t format = CACHE_FORMAT;
+    hash = hash_bytes(hash, &format, sizeof(format));
+    hash = hash_bytes(hash, CRAPPOLA_VERSION, sizeof(CRAPPOLA_VERSION));
+    hash = hash_bytes(hash, &freestanding, sizeof(freestanding));
+    hash = hash_bytes(hash, lines, size);
+    for (int i = 0; i < 16; i++) {
+        snprintf(key->hex + 2 * i, 3, "%02x", (unsigned)(uint8_t)(hash >> (120 - 8 * i)));
+    }
+}
+
+static char *join(const char *dir, const char *name) {
+    size_t dir_len = strlen(dir);
+    size_t len = strlen(name);
+    char *path = malloc(dir_len + len + 2);
+    if (path) {
+        memcpy(path, dir, dir_len);
+        path[dir_len] = '/';
+        memcpy(path + dir_len + 1, name, len + 1);
+    }
+    return path;
+}
+
+/* mkdir -p */
+static bool make_directory(const char *path) {
+    char *copy = strdup(path);
+    if (!copy) {
+        return false;
+    }
+    bool ok = true;
+    for (char *p = copy + 1; ok; p++) {
+        if (*p == '/' || *p == '\0') {
+            char c = *p;
+            *p = '\0';
+            ok = mkdir(copy, 0777) == 0 || errno == EEXIST;
+            *p = c;
+            if (c == '\0') {
+                break;
+            }
+        }
+    }
+    free(copy);
+    return ok;
+}
+
+/* The entry's path: <dir>/<first two hex digits>/<key> */
+static char *entry_path(const ResultCache *cache, const ResultKey *key) {
+    char shard[3] = { key->hex[0], key->hex[1], '\0' };
+    char *dir = join(cache->directory, shard);
+    char *path = dir ? join(dir, key->hex) : NULL;
+    free(dir);
+    return path;
+}
+
+/* Copy a file through a temporary next to the target and rename it into
+ * place. Returns the number of bytes copied, or -1. */
+static long long copy_file(const char *from, const char *to) {
+    int in = open(from, O_RDONLY);
+    if (in < 0) {
+        return -1;
+    }
+    size_t len = strlen(to);
+    char *temp = malloc(len + 8);
+    if (!temp) {
+        close(in);
+        return -1;
+    }
+    memcpy(temp, to, len);
+    memcpy(temp + len, ".XXXXXX", 8);
+    int out = mkstemp(temp);
+    if (out < 0) {
+        close(in);
+        free(temp);
+        return -1;
+    }
+
+    char buffer[65536];
+    long long total = 0;
+    ssize_t n;
+    while ((n = read(in, buffer, sizeof(buffer))) > 0) {
+        for (ssize_t done = 0; done < n;) {
+            ssize_t written = write(out, buffer + done, (size_t)(n - done));
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                n = -1;
+                break;
+            }
+            done += written;
+        }
+        if (n < 0) {
+            break;
+        }
+        total += n;
+    }
+    close(in);
+    bool ok = n == 0 && fchmod(out, 0644) == 0;
+    if (close(out) != 0) {
+        ok = false;
+    }
+    if (!ok || rename(temp, to) != 0) {
+        remove(temp);
+        total = -1;
+    }
+    free(temp);
+    return total;
+}
+
+/* Open the counters locked, creating the cache directory if needed */
+static int lock_stats(const ResultCache *cache, CacheStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    char *path = join(cache->directory, "stats");
+    if (!path || !make_directory(cache->directory)) {
+        free(path);
+        return -1;
+    }
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    free(path);
+    if (fd < 0) {
+        return -1;
+    }
+    if (flock(fd, LOCK_EX) != 0) {
+        close(fd);
+        return -1;
+    }
+    if (pread(fd, stats, sizeof(*stats), 0) != (ssize_t)sizeof(*stats)) {
+        memset(stats, 0, sizeof(*stats));
+    }
+    return fd;
+}
+
+static void unlock_stats(int fd, const CacheStats *stats) {
+    if (pwrite(fd, stats, sizeof(*stats), 0) != (ssize_t)sizeof(*stats)) {
+        fprintf(err_stream(), "Warning: Could not update the result cache counters\n");
+    }
+    close(fd);
+}
+
+static int compare_entries(const void *a, const void *b) {
+    const ResultEntry *x = a;
+    const ResultEntry *y = b;
+    if (x->mtime != y->mtime) {
+        return x->mtime < y->mtime ? -1 : 1;
+    }
+    return (x->mtime_ns > y->mtime_ns) - (x->mtime_ns < y->mtime_ns);
+}
+
+/* Every entry in the cache, skipping temporaries still being written */
+static ResultEntry *list_entries(const ResultCache *cache, int *count, uint64_t *bytes) {
+    ResultEntry *entries = NULL;
+    int capacity = 0;
+    *count = 0;
+    *bytes = 0;
+    for (int shard = 0; shard < 256; shard++) {
+        char name[3];
+        snprintf(name, sizeof(name), "%02x", shard);
+        char *dir_path = join(cache->directory, name);
+        DIR *dir = dir_path ? opendir(dir_path) : NULL;
+        struct dirent *ent;
+        while (dir && (ent = readdir(dir))) {
+            struct stat st;
+            char *path;
+            if (strlen(ent->d_name) != 32 || !(path = join(dir_path, ent->d_name))) {
+                continue;
+            }
+            if (stat(path, &st) != 0) {
+                free(path);
+                continue;
+            }
+            if (*count == capacity) {
+                capacity = capacity ? capacity * 2 : 256;
+                ResultEntry *grown = realloc(entries, sizeof(ResultEntry) * (size_t)capacity);
+                if (!grown) {
+                    free(path);
+                    break;
+                }
+                entries = grown;
+            }
+            entries[*count].path = path;
+            entries[*count].mtime = st.st_mtime;
+#ifdef __APPLE__
+            entries[*count].mtime_ns = st.st_mtimespec.tv_nsec;
+#else
+            entries[*count].mtime_ns = st.st_mtim.tv_nsec;
+#endif
+            entries[*count].size = (uint64_t)st.st_size;
+            *bytes += (uint64_t)st.st_size;
+            (*count)++;
+        }
+        if (dir) {
+            closedir(dir);
+        }
+        free(dir_path);
+    }
+    return entries;
+}
+
+static void free_entries(ResultEntry *entries, int count) {
+    for (int i = 0; i < count; i++) {
+        free(entries[i].path);
+    }
+    free(entries);
+}
+
+/* Remove the least recently used entries until the cache is under 90% of
+ * its limit. Called with the counters locked. */
+static void evict(const ResultCache *cache, CacheStats *stats) {
+    int count;
+    uint64_t bytes;
+    ResultEntry *entries = list_entries(cache, &count, &bytes);
+    qsort(entries, (size_t)count, sizeof(ResultEntry), compare_entries);
+    uint64_t target = cache->max_size / 10 * 9;
+    for (int i = 0; i < count && bytes > target; i++) {
+        if (remove(entries[i].path) == 0) {
+            bytes -= entries[i].size;
+            stats->evictions++;
+        }
+    }
+    stats->bytes = bytes;
+    free_entries(entries, count);
+}
+
+/* Copy the entry for key to object. Returns false on a miss. */
+bool result_cache_fetch(const ResultCache *cache, const ResultKey *key, const char *object) {
+    char *path = entry_path(cache, key);
+    bool hit = path && copy_file(path, object) >= 0;
+    if (hit) {
+        // Mark it as recently used
+        utimes(path, NULL);
+    }
+    free(path);
+
+    CacheStats stats;
+    int fd = lock_stats(cache, &stats);
+    if (fd >= 0) {
+        if (hit) {
+            stats.hits++;
+        } else {
+            stats.misses++;
+        }
+        unlock_stats(fd, &stats);
+    }
+    return hit;
+}
+
+/* Save object as the entry for key. Failing to store is not an error for
+ * the compilation, so nothing is reported. */
+void result_cache_store(const ResultCache *cache, const ResultKey *key, const char *object) {
+    char shard[3] = { key->hex[0], key->hex[1], '\0' };
+    char *dir = join(cache->directory, shard);
+    char *path = entry_path(cache, key);
+    long long size = dir && path && make_directory(dir) ? copy_file(object, path) : -1;
+    free(dir);
+    free(path);
+    if (size < 0) {
+        return;
+    }
+
+    CacheStats stats;
+    int fd = lock_stats(cache, &stats);
+    if (fd >= 0) {
+        stats.stores++;
+        stats.bytes += (uint64_t)size;
+        if (stats.bytes > cache->max_size) {
+            evict(cache, &stats);
+        }
+        unlock_stats(fd, &stats);
+    }
+}
+
+/* --cache-stats: the counters, and the entries as they are on disk */
+bool result_cache_print_stats(const ResultCache *cache, FILE *out) {
+    CacheStats stats;
+    int fd = lock_stats(cache, &stats);
+    if (fd < 0) {
+        fprintf(err_stream(), "Error: Could not open the result cache in %s\n", cache->directory);
+        return false;
+    }
+    int count;
+    uint64_t bytes;
+    ResultEntry *entries = list_entries(cache, &count, &bytes);
+    free_entries(entries, count);
+    stats.bytes = bytes;
+    unlock_stats(fd, &stats);
+
+    uint64_t lookups = stats.hits + stats.misses;
+    fprintf(out, "Result cache: %s\n", cache->directory);
+    fprintf(out, "  Entries: %d, %.1f of %.1f MB\n", count, bytes / (1024.0 * 1024.0),
+            cache->max_size / (1024.0 * 1024.0));
+    fprintf(out, "  Lookups: %llu, %llu hits (%.1f%%), %llu misses\n",
+            (unsigned long long)lookups, (unsigned long long)stats.hits,
+            lookups ? 100.0 * stats.hits / lookups : 0.0, (unsigned long long)stats.misses);
+    fprintf(out, "  Stored: %llu, evicted: %llu\n", (unsigned long long)stats.stores,
+            (unsigned long long)stats.evictions);
+    return true;
+}
@@ -1,265 +1,582 @@
 #include "crappola.h"
-#include <stdarg.h>
-
-#define MAX_VARS 100
-
-typedef struct {
-    char *name;
-    int offset;
-} Variable;
-
-static Variable variables[MAX_VARS];
-static int var_count = 0;
-static int stack_offset = 0;
-static int label_counter = 0;
-
-static char *output = NULL;
-static size_t output_size = 0;
-static size_t output_capacity = 0;
-
-static void emit(const char *fmt, ...) {
-    char buffer[1024];
-    va_list args;
-    va_start(args, fmt);
-    int len = vsnprintf(buffer, sizeof(buffer), fmt, args);
-    va_end(args);
-
-    if (output_size + len + 1 >= output_capacity) {
-        output_capacity = (output_capacity == 0) ? 4096 : output_capacity * 2;
-        char *new_output = realloc(output, output_capacity);
-        if (!new_output) {
-            fprintf(stderr, "Error: Memory allocation failed in code generator\n");
-            return;
-        }
-        output = new_output;
+
+/* Output goes straight into the writer's buffer: lines are copied, and
+ * numbers and labels are formatted by hand rather than through printf.
+ * Only a full buffer leaves the inline path. */
+static inline void emit_text(CodeGenerator *gen, const char *text, size_t length) {
+    AsmWriter *out = gen->out;
+    if (out->capacity - out->size < length && !writer_reserve(out, length)) {
+        return;
+    }
+    memcpy(out->data + out->size, text, length);
+    out->size += length;
+    out->total += length;
+}
+
+static inline void emit(CodeGenerator *gen, const char *text) {
+    emit_text(gen, text, strlen(text));
+}
+
+static void emit_int(CodeGenerator *gen, long value) {
+    char digits[24];
+    char *start = digits + sizeof(digits);
+    unsigned long magnitude = value < 0 ? 0UL - (unsigned long)value : (unsigned long)value;
+    do {
+        *--start = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude);
+    if (value < 0) {
+        *--start = '-';
     }
+    emit_text(gen, start, (size_t)(digits + sizeof(digits) - start));
+}
+
+/* .L<function>_<label> */
+static void emit_label(CodeGenerator *gen, int label) {
+    emit(gen, ".L");
+    emit_int(gen, gen->function);
+    emit(gen, "_");
+    emit_int(gen, label);
+}
 
-    strcpy(output + output_size, buffer);
-    output_size += len;
+/* -<offset>(%rbp) */
+static void emit_local(CodeGenerator *gen, int offset) {
+    emit(gen, "-");
+    emit_int(gen, offset);
+    emit(gen, "(%rbp)");
 }
 
-static int find_variable(const char *name) {
-    for (int i = 0; i < var_count; i++) {
-        if (strcmp(variables[i].name, name) == 0) {
-            return variables[i].offset;
+/* Locals are found through a hash table keyed by symbol ID and sized to
+ * the symbols the function itself declares, never to the unit's symbol
+ * count, so a function costs time in proportion to its own locals. An
+ * entry holds the innermost declaration in scope. A declaration logs the
+ * binding it hides, and leaving a scope undoes the log back to where the
+ * scope began; lookups and declarations are O(1) on average. */
+static LocalSlot *find_slot(const CodeGenerator *gen, int symbol) {
+    if (!gen->locals) {
+        return NULL;
+    }
+    uint32_t mask = (uint32_t)gen->local_capacity - 1;
+    for (uint32_t i = ((uint32_t)symbol * 2654435761u) & mask;; i = (i + 1) & mask) {
+        LocalSlot *slot = &gen->locals[i];
+        if (slot->symbol == symbol) {
+            return slot;
+        }
+        if (slot->symbol == -1) {
+            return NULL;
         }
     }
-    return -1;
 }
 
-static int add_variable(const char *name) {
-    int offset = find_variable(name);
-    if (offset != -1) {
-        return offset;
+/* The empty entry where symbol belongs, in a table with room */
+static LocalSlot *add_empty_slot(CodeGenerator *gen, int symbol) {
+    uint32_t mask = (uint32_t)gen->local_capacity - 1;
+    uint32_t i = ((uint32_t)symbol * 2654435761u) & mask;
+    while (gen->locals[i].symbol != -1) {
+        i = (i + 1) & mask;
     }
+    return &gen->locals[i];
+}
 
-    stack_offset += 8;
-    variables[var_count].name = strdup(name);
-    variables[var_count].offset = stack_offset;
-    var_count++;
-    return stack_offset;
+static int find_variable(CodeGenerator *gen, int symbol) {
+    LocalSlot *slot = find_slot(gen, symbol);
+    return slot && slot->offset ? slot->offset : -1;
 }
 
-static void clear_variables(void) {
-    for (int i = 0; i < var_count; i++) {
-        free(variables[i].name);
+/* The entry for symbol, added if the function has not declared it
+ * before, or NULL after reporting an error */
+static LocalSlot *add_slot(CodeGenerator *gen, int symbol) {
+    LocalSlot *slot = find_slot(gen, symbol);
+    if (slot) {
+        return slot;
     }
-    var_count = 0;
-    stack_offset = 0;
+    // Kept at most half full, doubling and rehashing as it fills
+    if ((gen->local_count + 1) * 2 > gen->local_capacity) {
+        int capacity = gen->local_capacity ? gen->local_capacity * 2 : 16;
+        LocalSlot *locals = malloc(sizeof(LocalSlot) * capacity);
+        if (!locals) {
+            fprintf(err_stream(), "Error: Memory allocation failed in code generator\n");
+            gen->failed = true;
+            return NULL;
+        }
+        for (int i = 0; i < capacity; i++) {
+            locals[i].symbol = -1;
+        }
+        LocalSlot *old = gen->locals;
+        int old_capacity = gen->local_capacity;
+        gen->locals = locals;
+        gen->local_capacity = capacity;
+        for (int i = 0; i < old_capacity; i++) {
+            if (old[i].symbol != -1) {
+                *add_empty_slot(gen, old[i].symbol) = old[i];
+            }
+        }
+        free(old);
+    }
+    slot = add_empty_slot(gen, symbol);
+    slot->symbol = symbol;
+    slot->offset = 0;
+    gen->local_count++;
+    return slot;
 }
 
-static int next_label(void) {
-    return label_counter++;
+/* Bind symbol to the next slot of the current scope and return its
+ * offset, or -1 after reporting an error */
+static int bind_variable(CodeGenerator *gen, int symbol) {
+    LocalSlot *slot = add_slot(gen, symbol);
+    if (!slot) {
+        return -1;
+    }
+    if (gen->binding_count == gen->binding_capacity) {
+        int capacity = gen->binding_capacity ? gen->binding_capacity * 2 : 64;
+        ScopeBinding *bindings = realloc(gen->bindings, sizeof(ScopeBinding) * capacity);
+        if (!bindings) {
+            fprintf(err_stream(), "Error: Memory allocation failed in code generator\n");
+            gen->failed = true;
+            return -1;
+        }
+        gen->bindings = bindings;
+        gen->binding_capacity = capacity;
+    }
+
+    ScopeBinding *binding = &gen->bindings[gen->binding_count++];
+    binding->symbol = symbol;
+    binding->previous = slot->offset;
+    gen->stack_offset += 8;
+    slot->offset = gen->stack_offset;
+    return gen->stack_offset;
 }
 
-static void generate_expression(ASTNode *node);
+/* Declare symbol with the value in %rax. A new local is pushed, so the
+ * stack pointer always sits just below the locals in scope and the
+ * frame grows only as far as the deepest scope needs. Declaring a name
+ * again in the same scope assigns to it. */
+static void declare_variable(CodeGenerator *gen, int symbol) {
+    int offset = find_variable(gen, symbol);
+    if (offset > gen->scope_base) {
+        emit(gen, "    movq %rax, ");
+        emit_local(gen, offset);
+        emit(gen, "\n");
+    } else if (bind_variable(gen, symbol) != -1) {
+        emit(gen, "    pushq %rax\n");
+    }
+}
 
-static void generate_statement(ASTNode *node) {
-    if (!node) return;
+/* Leave the innermost scope: give back its slots and restore the
+ * bindings its declarations hid */
+static void close_scope(CodeGenerator *gen, int mark, int outer_base) {
+    if (gen->stack_offset > gen->scope_base) {
+        emit(gen, "    addq $");
+        emit_int(gen, gen->stack_offset - gen->scope_base);
+        emit(gen, ", %rsp\n");
+    }
+    while (gen->binding_count > mark) {
+        ScopeBinding *binding = &gen->bindings[--gen->binding_count];
+        find_slot(gen, binding->symbol)->offset = binding->previous;
+    }
+    gen->stack_offset = gen->scope_base;
+    gen->scope_base = outer_base;
+}
 
-    switch (node->type) {
-        case NODE_RETURN:
-            generate_expression(node->data.return_stmt.expr);
-            emit("    movq %%rbp, %%rsp\n");
-            emit("    popq %%rbp\n");
-            emit("    ret\n");
-            break;
+static int next_label(CodeGenerator *gen) {
+    return gen->label_counter++;
+}
 
-        case NODE_ASSIGNMENT: {
-            int offset = add_variable(node->data.assignment.name);
-            generate_expression(node->data.assignment.value);
-            emit("    movq %%rax, -%d(%%rbp)\n", offset);
-            break;
-        }
+/* Stages any node can be pushed at ahead of its own: a scope opens
+ * around it, and closes once it is done */
+enum {
+    STAGE_OPEN_SCOPE = -1,
+    STAGE_CLOSE_SCOPE = -2,
+};
 
-        case NODE_IF: {
-            int end_label = next_label();
-            int else_label = next_label();
-            
-            generate_expression(node->data.if_stmt.condition);
-            emit("    cmpq $0, %%rax\n");
-            if (node->data.if_stmt.else_branch) {
-                emit("    je .L%d\n", else_label);
-            } else {
-                emit("    je .L%d\n", end_label);
-            }
-            
-            generate_statement(node->data.if_stmt.then_branch);
-            
-            if (node->data.if_stmt.else_branch) {
-                emit("    jmp .L%d\n", end_label);
-                emit(".L%d:\n", else_label);
-                generate_statement(node->data.if_stmt.else_branch);
-            }
-            
-            emit(".L%d:\n", end_label);
-            break;
-        }
+/* Start on node once the tasks above it are done */
+static void push_task(CodeGenerator *gen, NodeIndex node, int stage) {
+    if (!node) return;
 
-        case NODE_WHILE: {
-            int start_label = next_label();
-            int end_label = next_label();
-            
-            emit(".L%d:\n", start_label);
-            generate_expression(node->data.while_stmt.condition);
-            emit("    cmpq $0, %%rax\n");
-            emit("    je .L%d\n", end_label);
-            
-            generate_statement(node->data.while_stmt.body);
-            emit("    jmp .L%d\n", start_label);
-            emit(".L%d:\n", end_label);
-            break;
+    if (gen->task_count == gen->task_capacity) {
+        int capacity = gen->task_capacity ? gen->task_capacity * 2 : 64;
+        CodegenTask *tasks = realloc(gen->tasks, sizeof(CodegenTask) * capacity);
+        if (!tasks) {
+            fprintf(err_stream(), "Error: Memory allocation failed in code generator\n");
+            gen->failed = true;
+            return;
         }
+        gen->tasks = tasks;
+        gen->task_capacity = capacity;
+    }
+    CodegenTask *task = &gen->tasks[gen->task_count++];
+    task->node = node;
+    task->stage = stage;
+}
 
-        case NODE_BLOCK:
-            for (int i = 0; i < node->data.block.count; i++) {
-                generate_statement(node->data.block.statements[i]);
-            }
-            break;
+/* Push node back to continue at stage; its values are kept */
+static void resume_task(CodeGenerator *gen, int stage) {
+    gen->tasks[gen->task_count].stage = stage;
+    gen->task_count++;
+}
 
-        default:
-            break;
+/* Start on node in a scope of its own. Blocks and the statements under
+ * if and while get one, as in C99. */
+static void push_scope(CodeGenerator *gen, NodeIndex node) {
+    push_task(gen, node, STAGE_OPEN_SCOPE);
+}
+
+/* Load a number or variable into reg */
+static void generate_operand(CodeGenerator *gen, NodeIndex node, const char *reg) {
+    int value = gen->ast->values[node];
+    if (gen->ast->kinds[node] == NODE_NUMBER) {
+        emit(gen, "    movq $");
+        emit_int(gen, value);
+        emit(gen, ", %");
+        emit(gen, reg);
+        emit(gen, "\n");
+        return;
+    }
+    int offset = find_variable(gen, value);
+    if (offset == -1) {
+        fprintf(err_stream(), "Undefined variable: %s\n", symbol_name(gen->symbols, value));
+        gen->failed = true;
+        return;
     }
+    emit(gen, "    movq ");
+    emit_local(gen, offset);
+    emit(gen, ", %");
+    emit(gen, reg);
+    emit(gen, "\n");
 }
 
-static void generate_expression(ASTNode *node) {
-    if (!node) return;
+static bool is_operand(const Ast *ast, NodeIndex node) {
+    return ast->kinds[node] == NODE_NUMBER || ast->kinds[node] == NODE_VARIABLE;
+}
 
-    switch (node->type) {
-        case NODE_NUMBER:
-            emit("    movq $%d, %%rax\n", node->data.number.value);
+/* %rax = %rax op %rcx */
+static void generate_binary_op(CodeGenerator *gen, char op) {
+    switch (op) {
+        case '+':
+            emit(gen, "    addq %rcx, %rax\n");
             break;
-
-        case NODE_VARIABLE: {
-            int offset = find_variable(node->data.variable.name);
-            if (offset == -1) {
-                fprintf(stderr, "Undefined variable: %s\n", node->data.variable.name);
-                return;
-            }
-            emit("    movq -%d(%%rbp), %%rax\n", offset);
+        case '-':
+            emit(gen, "    subq %rcx, %rax\n");
+            break;
+        case '*':
+            emit(gen, "    imulq %rcx, %rax\n");
+            break;
+        case '/':
+            emit(gen, "    cqto\n");
+            emit(gen, "    idivq %rcx\n");
+            break;
+        case '<':
+            emit(gen, "    cmpq %rcx, %rax\n");
+            emit(gen, "    setl %al\n");
+            emit(gen, "    movzbq %al, %rax\n");
+            break;
+        case '>':
+            emit(gen, "    cmpq %rcx, %rax\n");
+            emit(gen, "    setg %al\n");
+            emit(gen, "    movzbq %al, %rax\n");
+            break;
+        case 'l': // <=
+            emit(gen, "    cmpq %rcx, %rax\n");
+            emit(gen, "    setle %al\n");
+            emit(gen, "    movzbq %al, %rax\n");
+            break;
+        case 'g': // >=
+            emit(gen, "    cmpq %rcx, %rax\n");
+            emit(gen, "    setge %al\n");
+            emit(gen, "    movzbq %al, %rax\n");
             break;
+        case 'e': // ==
+            emit(gen, "    cmpq %rcx, %rax\n");
+            emit(gen, "    sete %al\n");
+            emit(gen, "    movzbq %al, %rax\n");
+            break;
+        case 'n': // !=
+            emit(gen, "    cmpq %rcx, %rax\n");
+            emit(gen, "    setne %al\n");
+            emit(gen, "    movzbq %al, %rax\n");
+            break;
+    }
+}
+
+/* Generate node and everything below it. Nodes wait on an explicit work
+ * stack instead of the C stack, each task recording the stage to resume
+ * at once the children it pushed are done, so nesting depth is limited
+ * only by memory.
+ *
+ * Binary operators evaluate their left operand first and keep it in %rax
+ * when the right one is a number or variable, so a long left-associative
+ * chain needs no stack in the generated code either; only a compound
+ * right operand saves %rax around itself. */
+static void generate(CodeGenerator *gen, NodeIndex root) {
+    const Ast *ast = gen->ast;
+    int base = gen->task_count;
+    if (ast->kinds[root] == NODE_BLOCK) {
+        push_scope(gen, root);
+    } else {
+        push_task(gen, root, 0);
+    }
+    while (gen->task_count > base) {
+        CodegenTask *task = &gen->tasks[--gen->task_count];
+        NodeIndex node = task->node;
+        NodeIndex lhs = ast->lhs[node];
+        NodeIndex rhs = ast->rhs[node];
+        int stage = task->stage;
+
+        if (stage == STAGE_OPEN_SCOPE) {
+            task->values[0] = gen->binding_count;
+            task->values[1] = gen->scope_base;
+            gen->scope_base = gen->stack_offset;
+            resume_task(gen, STAGE_CLOSE_SCOPE);
+            push_task(gen, node, 0);
+            continue;
+        }
+        if (stage == STAGE_CLOSE_SCOPE) {
+            close_scope(gen, task->values[0], task->values[1]);
+            continue;
         }
 
-        case NODE_BINARY_OP:
-            generate_expression(node->data.binary_op.right);
-            emit("    pushq %%rax\n");
-            generate_expression(node->data.binary_op.left);
-            emit("    popq %%rcx\n");
+        switch (ast->kinds[node]) {
+            case NODE_NUMBER:
+            case NODE_VARIABLE:
+                generate_operand(gen, node, "rax");
+                break;
 
-            switch (node->data.binary_op.op) {
-                case '+':
-                    emit("    addq %%rcx, %%rax\n");
-                    break;
-                case '-':
-                    emit("    subq %%rcx, %%rax\n");
-                    break;
-                case '*':
-                    emit("    imulq %%rcx, %%rax\n");
-                    break;
-                case '/':
-                    emit("    cqto\n");
-                    emit("    idivq %%rcx\n");
-                    break;
-                case '<':
-                    emit("    cmpq %%rcx, %%rax\n");
-                    emit("    setl %%al\n");
-                    emit("    movzbq %%al, %%rax\n");
-                    break;
-                case '>':
-                    emit("    cmpq %%rcx, %%rax\n");
-                    emit("    setg %%al\n");
-                    emit("    movzbq %%al, %%rax\n");
-                    break;
-                case 'l': // <=
-                    emit("    cmpq %%rcx, %%rax\n");
-                    emit("    setle %%al\n");
-                    emit("    movzbq %%al, %%rax\n");
-                    break;
-                case 'g': // >=
-                    emit("    cmpq %%rcx, %%rax\n");
-                    emit("    setge %%al\n");
-                    emit("    movzbq %%al, %%rax\n");
-                    break;
-                case 'e': // ==
-                    emit("    cmpq %%rcx, %%rax\n");
-                    emit("    sete %%al\n");
-                    emit("    movzbq %%al, %%rax\n");
-                    break;
-                case 'n': // !=
-                    emit("    cmpq %%rcx, %%rax\n");
-                    emit("    setne %%al\n");
-                    emit("    movzbq %%al, %%rax\n");
+            case NODE_BINARY_OP:
+                if (stage == 0) {
+                    resume_task(gen, 1);
+                    push_task(gen, lhs, 0);
+                } else if (stage == 1 && is_operand(ast, rhs)) {
+                    generate_operand(gen, rhs, "rcx");
+                    generate_binary_op(gen, (char)ast->values[node]);
+                } else if (stage == 1) {
+                    emit(gen, "    pushq %rax\n");
+                    resume_task(gen, 2);
+                    push_task(gen, rhs, 0);
+                } else {
+                    emit(gen, "    movq %rax, %rcx\n");
+                    emit(gen, "    popq %rax\n");
+                    generate_binary_op(gen, (char)ast->values[node]);
+                }
+                break;
+
+            case NODE_RETURN:
+                if (stage == 0) {
+                    resume_task(gen, 1);
+                    push_task(gen, lhs, 0);
+                } else {
+                    emit(gen, "    movq %rbp, %rsp\n");
+                    emit(gen, "    popq %rbp\n");
+                    emit(gen, "    ret\n");
+                }
+                break;
+
+            case NODE_DECLARATION:
+                // The new name is in scope only after its initial value
+                if (stage == 0 && lhs) {
+                    resume_task(gen, 1);
+                    push_task(gen, lhs, 0);
                     break;
+                }
+                if (!lhs) {
+                    emit(gen, "    movq $0, %rax\n");
+                }
+                declare_variable(gen, ast->values[node]);
+                break;
+
+            case NODE_ASSIGNMENT:
+                if (stage == 0) {
+                    task->values[0] = find_variable(gen, ast->values[node]);
+                    if (task->values[0] == -1) {
+                        fprintf(err_stream(), "Undefined variable: %s\n",
+                                symbol_name(gen->symbols, ast->values[node]));
+                        gen->failed = true;
+                        break;
+                    }
+                    resume_task(gen, 1);
+                    push_task(gen, lhs, 0);
+                } else {
+                    emit(gen, "    movq %rax, ");
+                    emit_local(gen, task->values[0]);
+                    emit(gen, "\n");
+                }
+                break;
+
+            case NODE_IF: {
+                // rhs: the extra index of the then and else branches
+                NodeIndex else_branch = ast->extra[rhs + 1];
+                if (stage == 0) {
+                    task->values[0] = next_label(gen);     // end
+                    task->values[1] = next_label(gen);     // else
+                    resume_task(gen, 1);
+                    push_task(gen, lhs, 0);
+                } else if (stage == 1) {
+                    emit(gen, "    cmpq $0, %rax\n");
+                    emit(gen, "    je ");
+                    emit_label(gen, else_branch ? task->values[1] : task->values[0]);
+                    emit(gen, "\n");
+                    resume_task(gen, 2);
+                    push_scope(gen, ast->extra[rhs]);
+                } else if (stage == 2 && else_branch) {
+                    emit(gen, "    jmp ");
+                    emit_label(gen, task->values[0]);
+                    emit(gen, "\n");
+                    emit_label(gen, task->values[1]);
+                    emit(gen, ":\n");
+                    resume_task(gen, 3);
+                    push_scope(gen, else_branch);
+                } else {
+                    emit_label(gen, task->values[0]);
+                    emit(gen, ":\n");
+                }
+                break;
             }
-            break;
 
-        default:
-            break;
+            case NODE_WHILE:
+                if (stage == 0) {
+                    task->values[0] = next_label(gen);     // start
+                    task->values[1] = next_label(gen);     // end
+                    emit_label(gen, task->values[0]);
+                    emit(gen, ":\n");
+                    resume_task(gen, 1);
+                    push_task(gen, lhs, 0);
+                } else if (stage == 1) {
+                    emit(gen, "    cmpq $0, %rax\n");
+                    emit(gen, "    je ");
+                    emit_label(gen, task->values[1]);
+                    emit(gen, "\n");
+                    resume_task(gen, 2);
+                    push_scope(gen, rhs);
+                } else {
+                    emit(gen, "    jmp ");
+                    emit_label(gen, task->values[0]);
+                    emit(gen, "\n");
+                    emit_label(gen, task->values[1]);
+                    emit(gen, ":\n");
+                }
+                break;
+
+            case NODE_BLOCK:
+                // Last statement first, so the first is on top. A block
+                // inside gets a scope of its own.
+                for (uint32_t i = rhs; i > 0; i--) {
+                    NodeIndex stmt = ast->extra[lhs + i - 1];
+                    if (ast->kinds[stmt] == NODE_BLOCK) {
+                        push_scope(gen, stmt);
+                    } else {
+                        push_task(gen, stmt, 0);
+                    }
+                }
+                break;
+
+            default:
+                break;
+        }
     }
 }
 
-char *generate_code(ASTNode *ast) {
-    if (!ast || ast->type != NODE_FUNCTION) {
-        fprintf(stderr, "Invalid AST for code generation\n");
-        return NULL;
-    }
+/* Entry point for -nostdlib executables: call main and hand its result
+ * straight to the exit syscall, skipping crt1.o and libc start-up. */
+static void generate_start_stub(CodeGenerator *gen) {
+#ifdef __APPLE__
+    emit(gen, "    .globl start\n");
+    emit(gen, "start:\n");
+    emit(gen, "    xorl %ebp, %ebp\n");
+    emit(gen, "    andq $-16, %rsp\n");
+    emit(gen, "    callq _main\n");
+    emit(gen, "    movl %eax, %edi\n");
+    emit(gen, "    movl $0x2000001, %eax\n");
+    emit(gen, "    syscall\n");
+#else
+    emit(gen, "    .globl _start\n");
+    emit(gen, "    .type _start, @function\n");
+    emit(gen, "_start:\n");
+    emit(gen, "    xorl %ebp, %ebp\n");
+    emit(gen, "    andq $-16, %rsp\n");
+    emit(gen, "    call main\n");
+    emit(gen, "    movl %eax, %edi\n");
+    emit(gen, "    movl $60, %eax\n");
+    emit(gen, "    syscall\n");
+#endif
+}
 
-    output = NULL;
-    output_size = 0;
-    output_capacity = 0;
-    label_counter = 0;
-    clear_variables();
+/* Streaming interface: code for a function can be generated one
+ * statement at a time, so the caller only keeps one statement's AST. */
+void codegen_begin(CodeGenerator *gen, const SymbolTable *symbols, const Ast *ast,
+                   const char *name, int function, AsmWriter *out) {
+    memset(gen, 0, sizeof(*gen));
+    gen->out = out;
+    gen->symbols = symbols;
+    gen->ast = ast;
+    gen->function = function;
 
 #ifdef __APPLE__
     // Emit assembly header for macOS
-    emit("    .section __TEXT,__text,regular,pure_instructions\n");
-    emit("    .globl _%s\n", ast->data.function.name);
-    emit("    .p2align 4, 0x90\n");
-    emit("_%s:\n", ast->data.function.name);
+    emit(gen, "    .section __TEXT,__text,regular,pure_instructions\n");
+    emit(gen, "    .globl _");
+    emit(gen, name);
+    emit(gen, "\n");
+    emit(gen, "    .p2align 4, 0x90\n");
+    emit(gen, "_");
+    emit(gen, name);
+    emit(gen, ":\n");
 #else
     // Emit assembly header for Linux
-    emit("    .text\n");
-    emit("    .globl %s\n", ast->data.function.name);
-    emit("    .type %s, @function\n", ast->data.function.name);
-    emit("%s:\n", ast->data.function.name);
+    emit(gen, "    .text\n");
+    emit(gen, "    .globl ");
+    emit(gen, name);
+    emit(gen, "\n");
+    emit(gen, "    .type ");
+    emit(gen, name);
+    emit(gen, ", @function\n");
+    emit(gen, name);
+    emit(gen, ":\n");
 #endif
     
     // Function prologue
-    emit("    pushq %%rbp\n");
-    emit("    movq %%rsp, %%rbp\n");
-    
-    // Reserve space for local variables (we'll allocate a fixed amount)
-    emit("    subq $128, %%rsp\n");
-    
-    // Generate function body
-    generate_statement(ast->data.function.body);
-    
+    emit(gen, "    pushq %rbp\n");
+    emit(gen, "    movq %rsp, %rbp\n");
+    // Locals are pushed as they are declared, so nothing is reserved
+}
+
+void codegen_statement(CodeGenerator *gen, NodeIndex stmt) {
+    generate(gen, stmt);
+}
+
+/* False if an error was reported or the output could not be written */
+bool codegen_end(CodeGenerator *gen, bool freestanding) {
     // Default return if no explicit return
-    emit("    movq $0, %%rax\n");
-    emit("    movq %%rbp, %%rsp\n");
-    emit("    popq %%rbp\n");
-    emit("    ret\n");
+    emit(gen, "    movq $0, %rax\n");
+    emit(gen, "    movq %rbp, %rsp\n");
+    emit(gen, "    popq %rbp\n");
+    emit(gen, "    ret\n");
 
-    clear_variables();
-    return output;
+    if (freestanding) {
+        generate_start_stub(gen);
+    }
+
+    free(gen->locals);
+    free(gen->bindings);
+    free(gen->tasks);
+    bool ok = !gen->failed && !gen->out->failed;
+    memset(gen, 0, sizeof(*gen));
+    return ok;
+}
+
+/* Generate the function'th function of a unit from its whole AST to out */
+bool generate_code(const SymbolTable *symbols, const Ast *ast, NodeIndex node, int function,
+                   bool freestanding, AsmWriter *out) {
+    if (!node || ast->kinds[node] != NODE_FUNCTION) {
+        fprintf(err_stream(), "Invalid AST for code generation\n");
+        return false;
+    }
+
+    CodeGenerator gen;
+    codegen_begin(&gen, symbols, ast, symbol_name(symbols, ast->values[node]), function, out);
+    // The body's statements, one at a time, as when streaming; they are
+    // in the function's own scope
+    NodeIndex body = ast->lhs[node];
+    for (uint32_t i = 0; i < ast->rhs[body]; i++) {
+        codegen_statement(&gen, ast->extra[ast->lhs[body] + i]);
+    }
+    return codegen_end(&gen, freestanding);
 }
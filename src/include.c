@@ -0,0 +1,445 @@
+#include "crappola.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Source files for #include: search paths, a cache of mapped file
+ * contents keyed by path, and a cache of resolved #include names, so a
+ * header is opened and read at most once per compilation. A FileStore
+ * keeps the mappings between compilations as well. */
+
+#define FILE_STORE_SIZE 1024
+
+#ifdef __APPLE__
+#define st_mtim st_mtimespec
+#endif
+
+/* One mapping of a file in a store. It is replaced, not changed, when
+ * the file changes; caches still using the old one keep it alive. */
+typedef struct StoredFile {
+    char *path;
+    const char *data;
+    size_t size;
+    dev_t device;
+    ino_t inode;
+    struct timespec mtime;
+    int refs;                       /* caches using it, plus one while current */
+    struct StoredFile *next;
+} StoredFile;
+
+struct FileStore {
+    pthread_mutex_t lock;
+    StoredFile *files[FILE_STORE_SIZE];
+    long hits;
+    long misses;
+};
+
+struct FileNode {
+    SourceFile file;
+    struct FileNode *next_in_bucket;
+    struct FileNode *next_loaded;   /* load order, for dependency files */
+    dev_t device;
+    ino_t inode;
+    bool mapped;                    /* false for sources given in memory */
+    StoredFile *stored;             /* the store's mapping, if from a store */
+};
+
+/* An #include name resolved from one directory; file is NULL when the
+ * name was not found, so failed searches are not repeated either */
+struct Resolution {
+    char *key;
+    SourceFile *file;
+    struct Resolution *next;
+};
+
+static uint32_t hash_string(const char *str, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)str[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* Map a regular file read-only; st receives its identity */
+static const char *map_file(const char *filename, size_t *size, struct stat *st) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    if (fstat(fd, st) != 0 || !S_ISREG(st->st_mode)) {
+        close(fd);
+        return NULL;
+    }
+
+    *size = (size_t)st->st_size;
+    if (*size == 0) {
+        close(fd);
+        return "";
+    }
+
+    void *data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    return data == MAP_FAILED ? NULL : data;
+}
+
+static void unmap_file(const char *data, size_t size) {
+    if (size > 0) {
+        munmap((void *)data, size);
+    }
+}
+
+FileStore *file_store_create(void) {
+    FileStore *store = calloc(1, sizeof(FileStore));
+    if (!store) {
+        fprintf(err_stream(), "Error: Memory allocation failed creating file store\n");
+        return NULL;
+    }
+    pthread_mutex_init(&store->lock, NULL);
+    return store;
+}
+
+static void release_stored(StoredFile *stored) {
+    if (--stored->refs == 0) {
+        unmap_file(stored->data, stored->size);
+        free(stored->path);
+        free(stored);
+    }
+}
+
+/* Every cache using the store must have been reset first */
+void file_store_destroy(FileStore *store) {
+    if (!store) {
+        return;
+    }
+    for (int i = 0; i < FILE_STORE_SIZE; i++) {
+        while (store->files[i]) {
+            StoredFile *stored = store->files[i];
+            store->files[i] = stored->next;
+            release_stored(stored);
+        }
+    }
+    pthread_mutex_destroy(&store->lock);
+    free(store);
+}
+
+void file_store_stats(FileStore *store, long *hits, long *misses, int *files, size_t *bytes) {
+    pthread_mutex_lock(&store->lock);
+    *hits = store->hits;
+    *misses = store->misses;
+    *files = 0;
+    *bytes = 0;
+    for (int i = 0; i < FILE_STORE_SIZE; i++) {
+        for (StoredFile *stored = store->files[i]; stored; stored = stored->next) {
+            (*files)++;
+            *bytes += stored->size;
+        }
+    }
+    pthread_mutex_unlock(&store->lock);
+}
+
+static bool same_file(const StoredFile *stored, const struct stat *st) {
+    return stored->device == st->st_dev && stored->inode == st->st_ino &&
+           stored->size == (size_t)st->st_size && stored->mtime.tv_sec == st->st_mtim.tv_sec &&
+           stored->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/* Take a reference to the store's mapping of path, mapping it again if
+ * the file's mtime, size or inode no longer match. st receives the
+ * identity of the file. */
+static StoredFile *store_open(FileStore *store, const char *path, uint32_t hash, struct stat *st) {
+    if (stat(path, st) != 0 || !S_ISREG(st->st_mode)) {
+        return NULL;
+    }
+    StoredFile **bucket = &store->files[hash & (FILE_STORE_SIZE - 1)];
+    pthread_mutex_lock(&store->lock);
+    for (StoredFile *stored = *bucket; stored; stored = stored->next) {
+        if (strcmp(stored->path, path) == 0 && same_file(stored, st)) {
+            stored->refs++;
+            store->hits++;
+            pthread_mutex_unlock(&store->lock);
+            return stored;
+        }
+    }
+    store->misses++;
+    pthread_mutex_unlock(&store->lock);
+
+    // Mapped outside the lock; the identity is that of the file mapped
+    StoredFile *stored = calloc(1, sizeof(StoredFile));
+    if (!stored || !(stored->path = strdup(path))) {
+        free(stored);
+        return NULL;
+    }
+    stored->data = map_file(path, &stored->size, st);
+    if (!stored->data) {
+        free(stored->path);
+        free(stored);
+        return NULL;
+    }
+    stored->device = st->st_dev;
+    stored->inode = st->st_ino;
+    stored->mtime = st->st_mtim;
+    stored->refs = 2;
+
+    // Replace any older mapping of the same path
+    pthread_mutex_lock(&store->lock);
+    for (StoredFile **link = bucket; *link; link = &(*link)->next) {
+        if (strcmp((*link)->path, path) == 0) {
+            StoredFile *old = *link;
+            *link = old->next;
+            release_stored(old);
+            break;
+        }
+    }
+    stored->next = *bucket;
+    *bucket = stored;
+    pthread_mutex_unlock(&store->lock);
+    return stored;
+}
+
+static void store_release(FileStore *store, StoredFile *stored) {
+    pthread_mutex_lock(&store->lock);
+    release_stored(stored);
+    pthread_mutex_unlock(&store->lock);
+}
+
+/* Directories are stored with a trailing slash */
+bool include_add_path(FileCache *cache, const char *dir) {
+    char **paths = realloc(cache->search_paths, sizeof(char *) * (cache->search_path_count + 1));
+    if (!paths) {
+        return false;
+    }
+    cache->search_paths = paths;
+
+    size_t len = strlen(dir);
+    bool slash = len == 0 || dir[len - 1] == '/';
+    char *copy = malloc(len + 2);
+    if (!copy) {
+        return false;
+    }
+    memcpy(copy, dir, len);
+    copy[len] = '/';
+    copy[len + (slash ? 0 : 1)] = '\0';
+    cache->search_paths[cache->search_path_count++] = copy;
+    return true;
+}
+
+static FileNode *add_file(FileCache *cache, const char *path, uint32_t bucket) {
+    FileNode *node = calloc(1, sizeof(FileNode));
+    if (!node || !(node->file.path = strdup(path))) {
+        free(node);
+        return NULL;
+    }
+    const char *slash = strrchr(path, '/');
+    node->file.dir_length = slash ? (size_t)(slash - path) + 1 : 0;
+
+    node->next_in_bucket = cache->files[bucket];
+    cache->files[bucket] = node;
+    if (cache->last_loaded) {
+        cache->last_loaded->next_loaded = node;
+    } else {
+        cache->first_loaded = node;
+    }
+    cache->last_loaded = node;
+    return node;
+}
+
+/* Return the cached file for path, mapping it on first use */
+SourceFile *include_open(FileCache *cache, const char *path) {
+    uint32_t hash = hash_string(path, strlen(path));
+    uint32_t bucket = hash & (FILE_TABLE_SIZE - 1);
+    for (FileNode *node = cache->files[bucket]; node; node = node->next_in_bucket) {
+        if (strcmp(node->file.path, path) == 0) {
+            return &node->file;
+        }
+    }
+
+    size_t size = 0;
+    struct stat st;
+    StoredFile *stored = NULL;
+    const char *data;
+    if (cache->store) {
+        stored = store_open(cache->store, path, hash, &st);
+        data = stored ? stored->data : NULL;
+        size = stored ? stored->size : 0;
+    } else {
+        data = map_file(path, &size, &st);
+    }
+    if (!data) {
+        return NULL;
+    }
+
+    // The same file reached through another spelling of its path shares
+    // one entry, so #pragma once and include guards still apply
+    FileNode *node;
+    for (node = cache->first_loaded; node; node = node->next_loaded) {
+        if (node->mapped && node->device == st.st_dev && node->inode == st.st_ino) {
+            break;
+        }
+    }
+    if (!node && (node = add_file(cache, path, bucket))) {
+        node->device = st.st_dev;
+        node->inode = st.st_ino;
+        node->mapped = true;
+        node->stored = stored;
+        node->file.data = data;
+        node->file.size = size;
+        return &node->file;
+    }
+
+    if (stored) {
+        store_release(cache->store, stored);
+    } else {
+        unmap_file(data, size);
+    }
+    return node ? &node->file : NULL;
+}
+
+/* Enter source held in memory under path. The caller keeps data alive
+ * until the cache is reset; #include of path then finds it as well. */
+SourceFile *include_add_memory(FileCache *cache, const char *path, const char *data, size_t size) {
+    uint32_t bucket = hash_string(path, strlen(path)) & (FILE_TABLE_SIZE - 1);
+    FileNode *node = add_file(cache, path, bucket);
+    if (!node) {
+        return NULL;
+    }
+    node->file.data = data;
+    node->file.size = size;
+    return &node->file;
+}
+
+/* Try dir + name; dir is empty or ends in a slash */
+static SourceFile *try_path(FileCache *cache, const char *dir, size_t dir_len, const char *name,
+                            size_t len) {
+    char *path = malloc(dir_len + len + 1);
+    if (!path) {
+        return NULL;
+    }
+    memcpy(path, dir, dir_len);
+    memcpy(path + dir_len, name, len);
+    path[dir_len + len] = '\0';
+    SourceFile *file = include_open(cache, path);
+    free(path);
+    return file;
+}
+
+static SourceFile *search(FileCache *cache, const SourceFile *includer, const char *name, size_t len,
+                          bool angled) {
+    if (name[0] == '/') {
+        return try_path(cache, "", 0, name, len);
+    }
+
+    // Quoted names are looked up next to the including file first
+    if (!angled) {
+        SourceFile *file = try_path(cache, includer->path, includer->dir_length, name, len);
+        if (file) {
+            return file;
+        }
+    }
+
+    for (int i = 0; i < cache->search_path_count; i++) {
+        const char *dir = cache->search_paths[i];
+        SourceFile *file = try_path(cache, dir, strlen(dir), name, len);
+        if (file) {
+            return file;
+        }
+    }
+    return NULL;
+}
+
+/* Resolve an #include name as seen from includer. Results are cached by
+ * the includer's directory, the name and the bracket style. */
+SourceFile *include_resolve(FileCache *cache, const SourceFile *includer, const char *name,
+                            size_t len, bool angled) {
+    size_t dir_len = angled ? 0 : includer->dir_length;
+    size_t key_len = dir_len + len + 2;
+    char *key = malloc(key_len + 1);
+    if (!key) {
+        return NULL;
+    }
+    memcpy(key, includer->path, dir_len);
+    key[dir_len] = angled ? '<' : '"';
+    memcpy(key + dir_len + 1, name, len);
+    key[key_len - 1] = '\0';
+
+    uint32_t bucket = hash_string(key, key_len - 1) & (FILE_TABLE_SIZE - 1);
+    for (Resolution *r = cache->resolutions[bucket]; r; r = r->next) {
+        if (strcmp(r->key, key) == 0) {
+            free(key);
+            return r->file;
+        }
+    }
+
+    Resolution *r = malloc(sizeof(Resolution));
+    if (!r) {
+        free(key);
+        return NULL;
+    }
+    r->key = key;
+    r->file = search(cache, includer, name, len, angled);
+    r->next = cache->resolutions[bucket];
+    cache->resolutions[bucket] = r;
+    return r->file;
+}
+
+/* Files in the order they were first read; NULL starts the walk */
+SourceFile *include_next_loaded(const FileCache *cache, const SourceFile *file) {
+    if (!file) {
+        return cache->first_loaded ? &cache->first_loaded->file : NULL;
+    }
+    const FileNode *node = (const FileNode *)file;
+    return node->next_loaded ? &node->next_loaded->file : NULL;
+}
+
+/* Write a make rule listing every file read, as cc -MD does */
+bool include_write_deps(const FileCache *cache, const char *dep_file, const char *target) {
+    FILE *out = fopen(dep_file, "w");
+    if (!out) {
+        fprintf(err_stream(), "Error: Could not write dependency file %s\n", dep_file);
+        return false;
+    }
+    fprintf(out, "%s:", target);
+    for (FileNode *node = cache->first_loaded; node; node = node->next_loaded) {
+        fprintf(out, " \\\n  %s", node->file.path);
+    }
+    fprintf(out, "\n");
+    return fclose(out) == 0;
+}
+
+/* Drop every file and resolution; the search paths and store are kept */
+void include_reset(FileCache *cache) {
+    for (int i = 0; i < FILE_TABLE_SIZE; i++) {
+        while (cache->files[i]) {
+            FileNode *node = cache->files[i];
+            cache->files[i] = node->next_in_bucket;
+            if (node->stored) {
+                store_release(cache->store, node->stored);
+            } else if (node->mapped) {
+                unmap_file(node->file.data, node->file.size);
+            }
+            free(node->file.path);
+            free(node);
+        }
+        while (cache->resolutions[i]) {
+            Resolution *r = cache->resolutions[i];
+            cache->resolutions[i] = r->next;
+            free(r->key);
+            free(r);
+        }
+    }
+    cache->first_loaded = NULL;
+    cache->last_loaded = NULL;
+}
+
+void include_release(FileCache *cache) {
+    include_reset(cache);
+    for (int i = 0; i < cache->search_path_count; i++) {
+        free(cache->search_paths[i]);
+    }
+    free(cache->search_paths);
+    cache->search_paths = NULL;
+    cache->search_path_count = 0;
+}
@@ -0,0 +1,165 @@
+#include "crappola.h"
+#include <limits.h>
+#include <stdatomic.h>
+
+/* String interner: every distinct identifier gets a dense integer
+ * symbol ID, so later phases compare and index by ID instead of strcmp. */
+
+#define INITIAL_TABLE_SIZE 1024
+#define INITIAL_PAGES 16
+
+struct InternSlot {
+    uint32_t hash;
+    int symbol;     /* -1 when the slot is empty */
+};
+
+/* Pre-interned so their IDs match the SYM_* constants */
+static const char *const keywords[SYM_KEYWORD_COUNT] = {
+    "int", "return", "if", "else", "while",
+};
+
+static uint32_t hash_span(const char *str, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)str[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static bool resize_table(SymbolTable *t, size_t new_size) {
+    InternSlot *new_table = malloc(sizeof(InternSlot) * new_size);
+    if (!new_table) {
+        return false;
+    }
+    for (size_t i = 0; i < new_size; i++) {
+        new_table[i].symbol = -1;
+    }
+
+    for (size_t i = 0; i < t->table_size; i++) {
+        if (t->table[i].symbol < 0) continue;
+        size_t index = t->table[i].hash & (new_size - 1);
+        while (new_table[index].symbol >= 0) {
+            index = (index + 1) & (new_size - 1);
+        }
+        new_table[index] = t->table[i];
+    }
+
+    free(t->table);
+    t->table = new_table;
+    t->table_size = new_size;
+    return true;
+}
+
+static const char **name_slot(const SymbolTable *t, int symbol) {
+    const char ***pages = atomic_load_explicit(&((SymbolTable *)t)->pages, memory_order_acquire);
+    return &pages[symbol / SYMBOL_PAGE_SIZE][symbol % SYMBOL_PAGE_SIZE];
+}
+
+/* Double the page directory. Another thread may still be reading the
+ * old one, so it is left in the arena rather than freed; all of them
+ * together take less room than the newest. */
+static bool grow_pages(SymbolTable *t) {
+    int capacity = t->page_capacity ? t->page_capacity * 2 : INITIAL_PAGES;
+    const char ***pages = arena_calloc(&t->strings, sizeof(char **) * (size_t)capacity);
+    if (!pages) {
+        return false;
+    }
+    const char ***old = atomic_load_explicit(&t->pages, memory_order_relaxed);
+    if (old) {
+        memcpy(pages, old, sizeof(char **) * (size_t)t->page_capacity);
+    }
+    atomic_store_explicit(&t->pages, pages, memory_order_release);
+    t->page_capacity = capacity;
+    return true;
+}
+
+static int insert(SymbolTable *t, const char *str, size_t len, uint32_t hash, size_t index) {
+    if (t->count == INT_MAX) {
+        fprintf(err_stream(), "Error: Too many identifiers\n");
+        return -1;
+    }
+    int page = t->count / SYMBOL_PAGE_SIZE;
+    if (page == t->page_capacity && !grow_pages(t)) {
+        return -1;
+    }
+    const char ***pages = atomic_load_explicit(&t->pages, memory_order_relaxed);
+    if (!pages[page] && !(pages[page] = malloc(sizeof(char *) * SYMBOL_PAGE_SIZE))) {
+        return -1;
+    }
+    if (t->count >= t->capacity) {
+        int new_capacity = t->capacity ? t->capacity * 2 : 256;
+        uint32_t *new_lengths = realloc(t->lengths, sizeof(uint32_t) * new_capacity);
+        if (!new_lengths) return -1;
+        t->lengths = new_lengths;
+        t->capacity = new_capacity;
+    }
+
+    char *copy = arena_strndup(&t->strings, str, len);
+    if (!copy) return -1;
+
+    int symbol = t->count++;
+    *name_slot(t, symbol) = copy;
+    t->lengths[symbol] = (uint32_t)len;
+    t->table[index].hash = hash;
+    t->table[index].symbol = symbol;
+
+    // Keep the load factor at or below one half
+    if ((size_t)t->count * 2 > t->table_size && !resize_table(t, t->table_size * 2)) {
+        return -1;
+    }
+    return symbol;
+}
+
+static bool intern_init(SymbolTable *t) {
+    arena_init(&t->strings);
+    if (!resize_table(t, INITIAL_TABLE_SIZE)) {
+        return false;
+    }
+    for (int i = 0; i < SYM_KEYWORD_COUNT; i++) {
+        if (intern(t, keywords[i], strlen(keywords[i])) != i) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int intern(SymbolTable *t, const char *str, size_t len) {
+    if (!t->table && !intern_init(t)) {
+        fprintf(err_stream(), "Error: Memory allocation failed in interner\n");
+        return -1;
+    }
+
+    uint32_t hash = hash_span(str, len);
+    size_t index = hash & (t->table_size - 1);
+    while (t->table[index].symbol >= 0) {
+        int symbol = t->table[index].symbol;
+        if (t->table[index].hash == hash && t->lengths[symbol] == len &&
+            memcmp(*name_slot(t, symbol), str, len) == 0) {
+            return symbol;
+        }
+        index = (index + 1) & (t->table_size - 1);
+    }
+    return insert(t, str, len, hash, index);
+}
+
+const char *symbol_name(const SymbolTable *t, int symbol) {
+    return *name_slot(t, symbol);
+}
+
+/* Only meaningful while no other thread is interning */
+int symbol_count(const SymbolTable *t) {
+    return t->count;
+}
+
+/* Forget every symbol; the table starts over with the keywords */
+void intern_release(SymbolTable *t) {
+    free(t->table);
+    const char ***pages = atomic_load_explicit(&t->pages, memory_order_relaxed);
+    for (int page = 0; page < t->page_capacity && pages[page]; page++) {
+        free(pages[page]);
+    }
+    free(t->lengths);
+    arena_release(&t->strings);
+    memset(t, 0, sizeof(*t));
+}
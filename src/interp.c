@@ -0,0 +1,136 @@
+#include "crappola.h"
+#include <stdint.h>
+
+/* Bytecode interpreter. With GCC/Clang each handler jumps straight to the
+ * next one through a computed goto; other compilers get a switch loop. */
+
+#if defined(__GNUC__) && !defined(CRAPPOLA_SWITCH_DISPATCH)
+#define THREADED_DISPATCH 1
+#endif
+
+#ifdef THREADED_DISPATCH
+#define DISPATCH() goto *handlers[ip->op]
+#define HANDLER(name) handler_##name:
+#define NEXT() do { ip++; DISPATCH(); } while (0)
+#define JUMP(target) do { ip = code + (target); DISPATCH(); } while (0)
+#else
+#define DISPATCH() continue
+#define HANDLER(name) case name:
+#define NEXT() { ip++; continue; }
+#define JUMP(target) { ip = code + (target); continue; }
+#endif
+
+/* Arithmetic wraps like the native 64-bit code instead of being UB */
+#define WRAP(expr) ((int64_t)(uint64_t)(expr))
+
+InterpStatus interpret(BytecodeFunction *function, long hot_threshold, int *result) {
+    int64_t *r = calloc(function->register_count > 0 ? function->register_count : 1, sizeof(int64_t));
+    if (!r) {
+        fprintf(err_stream(), "Error: Memory allocation failed in interpreter\n");
+        return INTERP_ERROR;
+    }
+
+    const Instruction *code = function->code;
+    const Instruction *ip = code;
+    InterpStatus status = INTERP_DONE;
+
+#ifdef THREADED_DISPATCH
+    static const void *handlers[OP_COUNT] = {
+        [OP_LOADI] = &&handler_OP_LOADI,
+        [OP_MOV] = &&handler_OP_MOV,
+        [OP_ADD] = &&handler_OP_ADD,
+        [OP_SUB] = &&handler_OP_SUB,
+        [OP_MUL] = &&handler_OP_MUL,
+        [OP_DIV] = &&handler_OP_DIV,
+        [OP_LT] = &&handler_OP_LT,
+        [OP_GT] = &&handler_OP_GT,
+        [OP_LE] = &&handler_OP_LE,
+        [OP_GE] = &&handler_OP_GE,
+        [OP_EQ] = &&handler_OP_EQ,
+        [OP_NE] = &&handler_OP_NE,
+        [OP_ADDI] = &&handler_OP_ADDI,
+        [OP_SUBI] = &&handler_OP_SUBI,
+        [OP_MULI] = &&handler_OP_MULI,
+        [OP_JMP] = &&handler_OP_JMP,
+        [OP_LOOP] = &&handler_OP_LOOP,
+        [OP_JZ] = &&handler_OP_JZ,
+        [OP_JLT] = &&handler_OP_JLT,
+        [OP_JGT] = &&handler_OP_JGT,
+        [OP_JLE] = &&handler_OP_JLE,
+        [OP_JGE] = &&handler_OP_JGE,
+        [OP_JEQ] = &&handler_OP_JEQ,
+        [OP_JNE] = &&handler_OP_JNE,
+        [OP_JLTI] = &&handler_OP_JLTI,
+        [OP_JGTI] = &&handler_OP_JGTI,
+        [OP_JLEI] = &&handler_OP_JLEI,
+        [OP_JGEI] = &&handler_OP_JGEI,
+        [OP_JEQI] = &&handler_OP_JEQI,
+        [OP_JNEI] = &&handler_OP_JNEI,
+        [OP_RET] = &&handler_OP_RET,
+    };
+    DISPATCH();
+#else
+    for (;;) {
+        switch (ip->op) {
+#endif
+
+    HANDLER(OP_LOADI) r[ip->a] = ip->b; NEXT();
+    HANDLER(OP_MOV) r[ip->a] = r[ip->b]; NEXT();
+    HANDLER(OP_ADD) r[ip->a] = WRAP((uint64_t)r[ip->b] + (uint64_t)r[ip->c]); NEXT();
+    HANDLER(OP_SUB) r[ip->a] = WRAP((uint64_t)r[ip->b] - (uint64_t)r[ip->c]); NEXT();
+    HANDLER(OP_MUL) r[ip->a] = WRAP((uint64_t)r[ip->b] * (uint64_t)r[ip->c]); NEXT();
+    HANDLER(OP_DIV)
+        if (r[ip->c] == 0 || (r[ip->b] == INT64_MIN && r[ip->c] == -1)) {
+            fprintf(err_stream(), "Runtime error: division overflow in %s\n", function->name);
+            status = INTERP_ERROR;
+            goto done;
+        }
+        r[ip->a] = r[ip->b] / r[ip->c];
+        NEXT();
+    HANDLER(OP_LT) r[ip->a] = r[ip->b] < r[ip->c]; NEXT();
+    HANDLER(OP_GT) r[ip->a] = r[ip->b] > r[ip->c]; NEXT();
+    HANDLER(OP_LE) r[ip->a] = r[ip->b] <= r[ip->c]; NEXT();
+    HANDLER(OP_GE) r[ip->a] = r[ip->b] >= r[ip->c]; NEXT();
+    HANDLER(OP_EQ) r[ip->a] = r[ip->b] == r[ip->c]; NEXT();
+    HANDLER(OP_NE) r[ip->a] = r[ip->b] != r[ip->c]; NEXT();
+    HANDLER(OP_ADDI) r[ip->a] = WRAP((uint64_t)r[ip->b] + (uint64_t)(int64_t)ip->c); NEXT();
+    HANDLER(OP_SUBI) r[ip->a] = WRAP((uint64_t)r[ip->b] - (uint64_t)(int64_t)ip->c); NEXT();
+    HANDLER(OP_MULI) r[ip->a] = WRAP((uint64_t)r[ip->b] * (uint64_t)(int64_t)ip->c); NEXT();
+    HANDLER(OP_JMP) JUMP(ip->a);
+    HANDLER(OP_LOOP)
+        // Hot loops are handed to the native path by the caller
+        if (++function->backedges == hot_threshold) {
+            status = INTERP_HOT;
+            goto done;
+        }
+        JUMP(ip->a);
+    HANDLER(OP_JZ) if (r[ip->a] == 0) JUMP(ip->b); NEXT();
+    HANDLER(OP_JLT) if (r[ip->a] < r[ip->b]) JUMP(ip->c); NEXT();
+    HANDLER(OP_JGT) if (r[ip->a] > r[ip->b]) JUMP(ip->c); NEXT();
+    HANDLER(OP_JLE) if (r[ip->a] <= r[ip->b]) JUMP(ip->c); NEXT();
+    HANDLER(OP_JGE) if (r[ip->a] >= r[ip->b]) JUMP(ip->c); NEXT();
+    HANDLER(OP_JEQ) if (r[ip->a] == r[ip->b]) JUMP(ip->c); NEXT();
+    HANDLER(OP_JNE) if (r[ip->a] != r[ip->b]) JUMP(ip->c); NEXT();
+    HANDLER(OP_JLTI) if (r[ip->a] < ip->b) JUMP(ip->c); NEXT();
+    HANDLER(OP_JGTI) if (r[ip->a] > ip->b) JUMP(ip->c); NEXT();
+    HANDLER(OP_JLEI) if (r[ip->a] <= ip->b) JUMP(ip->c); NEXT();
+    HANDLER(OP_JGEI) if (r[ip->a] >= ip->b) JUMP(ip->c); NEXT();
+    HANDLER(OP_JEQI) if (r[ip->a] == ip->b) JUMP(ip->c); NEXT();
+    HANDLER(OP_JNEI) if (r[ip->a] != ip->b) JUMP(ip->c); NEXT();
+    HANDLER(OP_RET)
+        *result = (int)r[ip->a];
+        goto done;
+
+#ifndef THREADED_DISPATCH
+        default:
+            fprintf(err_stream(), "Runtime error: bad opcode %d\n", ip->op);
+            status = INTERP_ERROR;
+            goto done;
+        }
+    }
+#endif
+
+done:
+    free(r);
+    return status;
+}
@@ -0,0 +1,669 @@
+#include "crappola.h"
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/* In-memory execution: a small assembler for the AT&T subset that the
+ * code generator emits, encoding straight into executable memory. */
+
+#define MAX_OPERANDS 2
+
+typedef enum {
+    OPERAND_REG,
+    OPERAND_IMM,
+    OPERAND_MEM,
+    OPERAND_LABEL,
+} OperandKind;
+
+typedef struct {
+    OperandKind kind;
+    int reg;      /* register number, or base register for memory */
+    int size;     /* register width in bytes */
+    long imm;     /* immediate value or displacement */
+    char *label;
+} Operand;
+
+typedef struct {
+    const char *name;   /* in the assembler's copy of the text */
+    uint32_t hash;
+    size_t offset;
+    bool function;
+} Symbol;
+
+typedef struct {
+    int symbol;
+    size_t offset;   /* position of the rel32 field */
+} Fixup;
+
+typedef struct {
+    uint8_t *code;
+    size_t size;
+    size_t capacity;
+    char *text;         /* the assembly, split into lines in place */
+    Symbol *symbols;
+    int symbol_count;
+    int symbol_capacity;
+    int *buckets;       /* symbol index plus one by hash (0 = empty) */
+    int bucket_capacity;
+    Fixup *fixups;
+    int fixup_count;
+    int fixup_capacity;
+    int line;
+    const char *source; /* the line being assembled, as written */
+    size_t source_length;
+    bool failed;
+} Assembler;
+
+static const struct {
+    const char *name;
+    int reg;
+    int size;
+} registers[] = {
+    {"rax", 0, 8}, {"rcx", 1, 8}, {"rdx", 2, 8}, {"rbx", 3, 8},
+    {"rsp", 4, 8}, {"rbp", 5, 8}, {"rsi", 6, 8}, {"rdi", 7, 8},
+    {"r8", 8, 8}, {"r9", 9, 8}, {"r10", 10, 8}, {"r11", 11, 8},
+    {"r12", 12, 8}, {"r13", 13, 8}, {"r14", 14, 8}, {"r15", 15, 8},
+    {"eax", 0, 4}, {"ecx", 1, 4}, {"edx", 2, 4}, {"ebx", 3, 4},
+    {"esp", 4, 4}, {"ebp", 5, 4}, {"esi", 6, 4}, {"edi", 7, 4},
+    {"al", 0, 1}, {"cl", 1, 1}, {"dl", 2, 1}, {"bl", 3, 1},
+};
+
+static const struct {
+    const char *suffix;
+    int code;
+} conditions[] = {
+    {"o", 0}, {"no", 1}, {"b", 2}, {"ae", 3}, {"e", 4}, {"z", 4},
+    {"ne", 5}, {"nz", 5}, {"be", 6}, {"a", 7}, {"s", 8}, {"ns", 9},
+    {"l", 12}, {"ge", 13}, {"le", 14}, {"g", 15},
+};
+
+/* Two-operand ALU instructions: opcode for "op reg, r/m" and the
+ * /digit used by the 0x81/0x83 immediate forms. */
+static const struct {
+    const char *name;
+    uint8_t opcode;
+    int digit;
+} alu_ops[] = {
+    {"add", 0x01, 0}, {"or", 0x09, 1}, {"and", 0x21, 4},
+    {"sub", 0x29, 5}, {"xor", 0x31, 6}, {"cmp", 0x39, 7},
+};
+
+static void asm_error(Assembler *as, const char *msg) {
+    fprintf(err_stream(), "JIT error at line %d: %s: %.*s\n", as->line, msg,
+            (int)as->source_length, as->source);
+    as->failed = true;
+}
+
+static void put_byte(Assembler *as, uint8_t byte) {
+    if (as->size >= as->capacity) {
+        size_t capacity = as->capacity ? as->capacity * 2 : 4096;
+        uint8_t *code = realloc(as->code, capacity);
+        if (!code) {
+            fprintf(err_stream(), "Error: Memory allocation failed in JIT\n");
+            as->failed = true;
+            return;
+        }
+        as->code = code;
+        as->capacity = capacity;
+    }
+    as->code[as->size++] = byte;
+}
+
+static void put_u32(Assembler *as, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        put_byte(as, (uint8_t)(value >> (8 * i)));
+    }
+}
+
+static void put_u64(Assembler *as, uint64_t value) {
+    for (int i = 0; i < 8; i++) {
+        put_byte(as, (uint8_t)(value >> (8 * i)));
+    }
+}
+
+static uint32_t hash_name(const char *name) {
+    uint32_t hash = 2166136261u;
+    for (; *name; name++) {
+        hash ^= (unsigned char)*name;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* The bucket holding name, or the empty one where it would go. Labels
+ * are hashed, so a unit with many branches assembles in linear time. */
+static int *find_bucket(Assembler *as, const char *name, uint32_t hash) {
+    uint32_t mask = (uint32_t)as->bucket_capacity - 1;
+    for (uint32_t i = hash & mask;; i = (i + 1) & mask) {
+        int *bucket = &as->buckets[i];
+        if (*bucket == 0) {
+            return bucket;
+        }
+        Symbol *symbol = &as->symbols[*bucket - 1];
+        if (symbol->hash == hash && strcmp(symbol->name, name) == 0) {
+            return bucket;
+        }
+    }
+}
+
+static Symbol *find_symbol(Assembler *as, const char *name) {
+    if (!as->buckets) {
+        return NULL;
+    }
+    int *bucket = find_bucket(as, name, hash_name(name));
+    return *bucket ? &as->symbols[*bucket - 1] : NULL;
+}
+
+/* Double the buckets and rehash, keeping them at most half full */
+static bool grow_buckets(Assembler *as) {
+    int capacity = as->bucket_capacity ? as->bucket_capacity * 2 : 256;
+    int *buckets = calloc((size_t)capacity, sizeof(int));
+    if (!buckets) {
+        return false;
+    }
+    free(as->buckets);
+    as->buckets = buckets;
+    as->bucket_capacity = capacity;
+    for (int i = 0; i < as->symbol_count; i++) {
+        *find_bucket(as, as->symbols[i].name, as->symbols[i].hash) = i + 1;
+    }
+    return true;
+}
+
+/* The index of the symbol called name, added undefined if it is new, or
+ * -1 on failure. name must live as long as the assembler. */
+static int add_symbol(Assembler *as, const char *name) {
+    if ((as->symbol_count + 1) * 2 > as->bucket_capacity && !grow_buckets(as)) {
+        as->failed = true;
+        return -1;
+    }
+    uint32_t hash = hash_name(name);
+    int *bucket = find_bucket(as, name, hash);
+    if (*bucket) {
+        return *bucket - 1;
+    }
+    if (as->symbol_count >= as->symbol_capacity) {
+        int capacity = as->symbol_capacity ? as->symbol_capacity * 2 : 64;
+        Symbol *symbols = realloc(as->symbols, sizeof(Symbol) * capacity);
+        if (!symbols) {
+            as->failed = true;
+            return -1;
+        }
+        as->symbols = symbols;
+        as->symbol_capacity = capacity;
+    }
+    Symbol *symbol = &as->symbols[as->symbol_count++];
+    symbol->name = name;
+    symbol->hash = hash;
+    symbol->offset = (size_t)-1;
+    symbol->function = false;
+    *bucket = as->symbol_count;
+    return as->symbol_count - 1;
+}
+
+static void add_fixup(Assembler *as, const char *label) {
+    int symbol = add_symbol(as, label);
+    if (symbol < 0) {
+        return;
+    }
+    if (as->fixup_count >= as->fixup_capacity) {
+        int capacity = as->fixup_capacity ? as->fixup_capacity * 2 : 64;
+        Fixup *fixups = realloc(as->fixups, sizeof(Fixup) * capacity);
+        if (!fixups) {
+            as->failed = true;
+            return;
+        }
+        as->fixups = fixups;
+        as->fixup_capacity = capacity;
+    }
+    as->fixups[as->fixup_count].symbol = symbol;
+    as->fixups[as->fixup_count].offset = as->size;
+    as->fixup_count++;
+    put_u32(as, 0);
+}
+
+static bool parse_register(const char *text, Operand *op) {
+    for (size_t i = 0; i < sizeof(registers) / sizeof(registers[0]); i++) {
+        if (strcmp(text, registers[i].name) == 0) {
+            op->reg = registers[i].reg;
+            op->size = registers[i].size;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool parse_operand(char *text, Operand *op) {
+    memset(op, 0, sizeof(*op));
+
+    if (text[0] == '%') {
+        op->kind = OPERAND_REG;
+        return parse_register(text + 1, op);
+    }
+
+    if (text[0] == '$') {
+        char *end;
+        op->kind = OPERAND_IMM;
+        op->imm = strtol(text + 1, &end, 0);
+        return *end == '\0';
+    }
+
+    char *paren = strchr(text, '(');
+    if (paren) {
+        op->kind = OPERAND_MEM;
+        op->imm = (paren == text) ? 0 : strtol(text, NULL, 0);
+        char *close = strchr(paren, ')');
+        if (!close || paren[1] != '%') {
+            return false;
+        }
+        *close = '\0';
+        Operand base;
+        if (!parse_register(paren + 2, &base) || base.size != 8) {
+            return false;
+        }
+        op->reg = base.reg;
+        op->size = 8;
+        return true;
+    }
+
+    op->kind = OPERAND_LABEL;
+    op->label = text;
+    return true;
+}
+
+static void put_rex(Assembler *as, bool wide, int reg, int rm) {
+    uint8_t rex = 0x40 | (wide ? 0x08 : 0) | ((reg & 8) ? 0x04 : 0) | ((rm & 8) ? 0x01 : 0);
+    if (rex != 0x40) {
+        put_byte(as, rex);
+    }
+}
+
+/* ModRM (+SIB/displacement) for a register or [base + disp] operand. */
+static void put_modrm(Assembler *as, int reg, const Operand *rm) {
+    if (rm->kind == OPERAND_REG) {
+        put_byte(as, 0xC0 | ((reg & 7) << 3) | (rm->reg & 7));
+        return;
+    }
+
+    bool disp8 = rm->imm >= -128 && rm->imm <= 127;
+    bool no_disp = rm->imm == 0 && (rm->reg & 7) != 5;
+    int mod = no_disp ? 0 : (disp8 ? 1 : 2);
+    put_byte(as, (mod << 6) | ((reg & 7) << 3) | (rm->reg & 7));
+    if ((rm->reg & 7) == 4) {
+        put_byte(as, 0x24);
+    }
+    if (mod == 1) {
+        put_byte(as, (uint8_t)rm->imm);
+    } else if (mod == 2) {
+        put_u32(as, (uint32_t)rm->imm);
+    }
+}
+
+static int condition_code(const char *suffix) {
+    for (size_t i = 0; i < sizeof(conditions) / sizeof(conditions[0]); i++) {
+        if (strcmp(suffix, conditions[i].suffix) == 0) {
+            return conditions[i].code;
+        }
+    }
+    return -1;
+}
+
+/* Strip an AT&T size suffix when the remaining mnemonic is known. */
+static bool has_stem(const char *mnemonic, const char *stem, char *suffix) {
+    size_t len = strlen(stem);
+    if (strncmp(mnemonic, stem, len) != 0) {
+        return false;
+    }
+    if (mnemonic[len] == '\0') {
+        *suffix = '\0';
+        return true;
+    }
+    if ((mnemonic[len] == 'q' || mnemonic[len] == 'l') && mnemonic[len + 1] == '\0') {
+        *suffix = mnemonic[len];
+        return true;
+    }
+    return false;
+}
+
+static void encode(Assembler *as, const char *mnemonic, Operand *ops, int count) {
+    char suffix;
+    bool wide;
+
+    if (strcmp(mnemonic, "ret") == 0 || strcmp(mnemonic, "retq") == 0) {
+        put_byte(as, 0xC3);
+        return;
+    }
+    if (strcmp(mnemonic, "cqto") == 0 || strcmp(mnemonic, "cqo") == 0) {
+        put_byte(as, 0x48);
+        put_byte(as, 0x99);
+        return;
+    }
+    if (strcmp(mnemonic, "syscall") == 0) {
+        put_byte(as, 0x0F);
+        put_byte(as, 0x05);
+        return;
+    }
+
+    if ((strcmp(mnemonic, "jmp") == 0 || strcmp(mnemonic, "call") == 0 ||
+         strcmp(mnemonic, "callq") == 0) && count == 1 && ops[0].kind == OPERAND_LABEL) {
+        put_byte(as, mnemonic[0] == 'j' ? 0xE9 : 0xE8);
+        add_fixup(as, ops[0].label);
+        return;
+    }
+    if (mnemonic[0] == 'j' && count == 1 && ops[0].kind == OPERAND_LABEL) {
+        int cc = condition_code(mnemonic + 1);
+        if (cc >= 0) {
+            put_byte(as, 0x0F);
+            put_byte(as, 0x80 + cc);
+            add_fixup(as, ops[0].label);
+            return;
+        }
+    }
+    if (strncmp(mnemonic, "set", 3) == 0 && count == 1 &&
+        ops[0].kind == OPERAND_REG && ops[0].size == 1) {
+        int cc = condition_code(mnemonic + 3);
+        if (cc >= 0) {
+            put_byte(as, 0x0F);
+            put_byte(as, 0x90 + cc);
+            put_modrm(as, 0, &ops[0]);
+            return;
+        }
+    }
+
+    if ((has_stem(mnemonic, "push", &suffix) || has_stem(mnemonic, "pop", &suffix)) &&
+        count == 1 && ops[0].kind == OPERAND_REG && ops[0].size == 8) {
+        put_rex(as, false, 0, ops[0].reg);
+        put_byte(as, (mnemonic[1] == 'u' ? 0x50 : 0x58) + (ops[0].reg & 7));
+        return;
+    }
+
+    if (strcmp(mnemonic, "movzbq") == 0 && count == 2 &&
+        ops[0].kind == OPERAND_REG && ops[0].size == 1 && ops[1].kind == OPERAND_REG) {
+        put_rex(as, true, ops[1].reg, ops[0].reg);
+        put_byte(as, 0x0F);
+        put_byte(as, 0xB6);
+        put_modrm(as, ops[1].reg, &ops[0]);
+        return;
+    }
+
+    if (has_stem(mnemonic, "idiv", &suffix) && count == 1 && ops[0].kind == OPERAND_REG) {
+        put_rex(as, suffix == 'q', 0, ops[0].reg);
+        put_byte(as, 0xF7);
+        put_modrm(as, 7, &ops[0]);
+        return;
+    }
+
+    if (has_stem(mnemonic, "imul", &suffix) && count == 2 &&
+        ops[0].kind != OPERAND_IMM && ops[0].kind != OPERAND_LABEL && ops[1].kind == OPERAND_REG) {
+        put_rex(as, suffix == 'q', ops[1].reg, ops[0].reg);
+        put_byte(as, 0x0F);
+        put_byte(as, 0xAF);
+        put_modrm(as, ops[1].reg, &ops[0]);
+        return;
+    }
+
+    if (has_stem(mnemonic, "mov", &suffix) && count == 2) {
+        wide = suffix == 'q' || (ops[1].kind == OPERAND_REG && ops[1].size == 8);
+        if (ops[0].kind == OPERAND_REG && ops[1].kind != OPERAND_IMM && ops[1].kind != OPERAND_LABEL) {
+            put_rex(as, wide, ops[0].reg, ops[1].reg);
+            put_byte(as, 0x89);
+            put_modrm(as, ops[0].reg, &ops[1]);
+            return;
+        }
+        if (ops[0].kind == OPERAND_MEM && ops[1].kind == OPERAND_REG) {
+            put_rex(as, wide, ops[1].reg, ops[0].reg);
+            put_byte(as, 0x8B);
+            put_modrm(as, ops[1].reg, &ops[0]);
+            return;
+        }
+        if (ops[0].kind == OPERAND_IMM && ops[1].kind == OPERAND_REG) {
+            if (wide && (ops[0].imm < INT32_MIN || ops[0].imm > INT32_MAX)) {
+                put_rex(as, true, 0, ops[1].reg);
+                put_byte(as, 0xB8 + (ops[1].reg & 7));
+                put_u64(as, (uint64_t)ops[0].imm);
+            } else if (wide) {
+                put_rex(as, true, 0, ops[1].reg);
+                put_byte(as, 0xC7);
+                put_modrm(as, 0, &ops[1]);
+                put_u32(as, (uint32_t)ops[0].imm);
+            } else {
+                put_rex(as, false, 0, ops[1].reg);
+                put_byte(as, 0xB8 + (ops[1].reg & 7));
+                put_u32(as, (uint32_t)ops[0].imm);
+            }
+            return;
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(alu_ops) / sizeof(alu_ops[0]); i++) {
+        if (!has_stem(mnemonic, alu_ops[i].name, &suffix) || count != 2) {
+            continue;
+        }
+        wide = suffix == 'q' || (ops[1].kind == OPERAND_REG && ops[1].size == 8);
+        if (ops[0].kind == OPERAND_REG && ops[1].kind != OPERAND_IMM && ops[1].kind != OPERAND_LABEL) {
+            put_rex(as, wide, ops[0].reg, ops[1].reg);
+            put_byte(as, alu_ops[i].opcode);
+            put_modrm(as, ops[0].reg, &ops[1]);
+            return;
+        }
+        if (ops[0].kind == OPERAND_MEM && ops[1].kind == OPERAND_REG) {
+            put_rex(as, wide, ops[1].reg, ops[0].reg);
+            put_byte(as, alu_ops[i].opcode + 2);
+            put_modrm(as, ops[1].reg, &ops[0]);
+            return;
+        }
+        if (ops[0].kind == OPERAND_IMM && ops[1].kind != OPERAND_IMM && ops[1].kind != OPERAND_LABEL) {
+            bool imm8 = ops[0].imm >= -128 && ops[0].imm <= 127;
+            put_rex(as, wide, 0, ops[1].reg);
+            put_byte(as, imm8 ? 0x83 : 0x81);
+            put_modrm(as, alu_ops[i].digit, &ops[1]);
+            if (imm8) {
+                put_byte(as, (uint8_t)ops[0].imm);
+            } else {
+                put_u32(as, (uint32_t)ops[0].imm);
+            }
+            return;
+        }
+    }
+
+    asm_error(as, "unsupported instruction");
+}
+
+/* Assemble one line, parsing it in place. Names recorded from it point
+ * into it, so it must outlive the assembler. */
+static void assemble_line(Assembler *as, char *line) {
+    // Trim whitespace and comments
+    char *comment = strchr(line, '#');
+    if (comment) *comment = '\0';
+    while (isspace((unsigned char)*line)) line++;
+    size_t len = strlen(line);
+    while (len > 0 && isspace((unsigned char)line[len - 1])) line[--len] = '\0';
+    if (len == 0) return;
+
+    // Labels
+    if (line[len - 1] == ':') {
+        line[len - 1] = '\0';
+        int symbol = add_symbol(as, line);
+        if (symbol < 0) return;
+        if (as->symbols[symbol].offset != (size_t)-1) {
+            asm_error(as, "duplicate label");
+            return;
+        }
+        as->symbols[symbol].offset = as->size;
+        return;
+    }
+
+    // Directives: only function markers matter here
+    if (line[0] == '.') {
+        if (strncmp(line, ".globl", 6) == 0 && isspace((unsigned char)line[6])) {
+            char *name = line + 7;
+            while (isspace((unsigned char)*name)) name++;
+            int symbol = add_symbol(as, name);
+            if (symbol >= 0) as->symbols[symbol].function = true;
+        }
+        return;
+    }
+
+    // Instruction: mnemonic followed by comma separated operands
+    char *mnemonic = line;
+    char *rest = line;
+    while (*rest && !isspace((unsigned char)*rest)) rest++;
+    if (*rest) *rest++ = '\0';
+
+    Operand ops[MAX_OPERANDS];
+    int count = 0;
+    while (*rest) {
+        while (isspace((unsigned char)*rest)) rest++;
+        if (!*rest) break;
+        char *start = rest;
+        int depth = 0;
+        while (*rest && (depth > 0 || *rest != ',')) {
+            if (*rest == '(') depth++;
+            if (*rest == ')') depth--;
+            rest++;
+        }
+        if (*rest) *rest++ = '\0';
+        size_t op_len = strlen(start);
+        while (op_len > 0 && isspace((unsigned char)start[op_len - 1])) start[--op_len] = '\0';
+
+        if (count >= MAX_OPERANDS || !parse_operand(start, &ops[count])) {
+            asm_error(as, "bad operand");
+            return;
+        }
+        count++;
+    }
+
+    encode(as, mnemonic, ops, count);
+}
+
+static void free_assembler(Assembler *as) {
+    free(as->text);
+    free(as->symbols);
+    free(as->buckets);
+    free(as->fixups);
+    free(as->code);
+}
+
+static int resolve_fixups(Assembler *as) {
+    for (int i = 0; i < as->fixup_count; i++) {
+        Symbol *symbol = &as->symbols[as->fixups[i].symbol];
+        if (symbol->offset == (size_t)-1) {
+            fprintf(err_stream(), "JIT error: undefined symbol %s\n", symbol->name);
+            return -1;
+        }
+        size_t at = as->fixups[i].offset;
+        int32_t rel = (int32_t)((long)symbol->offset - (long)(at + 4));
+        for (int b = 0; b < 4; b++) {
+            as->code[at + b] = (uint8_t)((uint32_t)rel >> (8 * b));
+        }
+    }
+    return 0;
+}
+
+static int compare_offsets(const void *a, const void *b) {
+    size_t left = (*(Symbol *const *)a)->offset;
+    size_t right = (*(Symbol *const *)b)->offset;
+    return (left > right) - (left < right);
+}
+
+/* Describe every function to perf so samples in JIT'd code are attributed. */
+static void write_perf_map(Assembler *as, const uint8_t *base) {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", getpid());
+    FILE *map = fopen(path, "w");
+    if (!map) {
+        return;
+    }
+
+    // Each function runs to the next one, so list them in address order
+    Symbol **functions = malloc(sizeof(Symbol *) * (size_t)(as->symbol_count + 1));
+    if (!functions) {
+        fclose(map);
+        return;
+    }
+    int count = 0;
+    for (int i = 0; i < as->symbol_count; i++) {
+        if (as->symbols[i].function && as->symbols[i].offset != (size_t)-1) {
+            functions[count++] = &as->symbols[i];
+        }
+    }
+    qsort(functions, (size_t)count, sizeof(Symbol *), compare_offsets);
+
+    for (int i = 0; i < count; i++) {
+        size_t start = functions[i]->offset;
+        size_t end = i + 1 < count ? functions[i + 1]->offset : as->size;
+        fprintf(map, "%lx %lx %s\n", (unsigned long)(uintptr_t)(base + start),
+                (unsigned long)(end - start), functions[i]->name);
+    }
+    free(functions);
+    fclose(map);
+}
+
+int jit_run(const char *assembly, int *result) {
+    Assembler as;
+    memset(&as, 0, sizeof(as));
+
+    // Assemble line by line from one copy of the text, which the symbol
+    // names then point into; errors quote the original line
+    size_t length = strlen(assembly);
+    as.text = malloc(length + 1);
+    if (!as.text) {
+        fprintf(err_stream(), "Error: Memory allocation failed in JIT\n");
+        return -1;
+    }
+    memcpy(as.text, assembly, length + 1);
+    size_t start = 0;
+    while (start < length && !as.failed) {
+        const char *end = memchr(assembly + start, '\n', length - start);
+        size_t len = end ? (size_t)(end - (assembly + start)) : length - start;
+        as.text[start + len] = '\0';
+        as.source = assembly + start;
+        as.source_length = len;
+        as.line++;
+        assemble_line(&as, as.text + start);
+        start += len + 1;
+    }
+
+    if (as.failed || resolve_fixups(&as) != 0) {
+        free_assembler(&as);
+        return -1;
+    }
+
+#ifdef __APPLE__
+    Symbol *entry = find_symbol(&as, "_main");
+#else
+    Symbol *entry = find_symbol(&as, "main");
+#endif
+    if (!entry || entry->offset == (size_t)-1) {
+        fprintf(err_stream(), "JIT error: no main function\n");
+        free_assembler(&as);
+        return -1;
+    }
+
+    // Map writable, copy, then flip to executable (never both at once)
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t map_size = (as.size + page - 1) / page * page;
+    uint8_t *memory = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        fprintf(err_stream(), "Error: Could not map JIT memory\n");
+        free_assembler(&as);
+        return -1;
+    }
+    memcpy(memory, as.code, as.size);
+    if (mprotect(memory, map_size, PROT_READ | PROT_EXEC) != 0) {
+        fprintf(err_stream(), "Error: Could not make JIT memory executable\n");
+        munmap(memory, map_size);
+        free_assembler(&as);
+        return -1;
+    }
+
+    write_perf_map(&as, memory);
+
+    int (*entry_point)(void) = (int (*)(void))(void *)(memory + entry->offset);
+    *result = entry_point();
+
+    munmap(memory, map_size);
+    free_assembler(&as);
+    return 0;
+}
@@ -1,214 +1,209 @@
 #include "crappola.h"
 
-static bool is_keyword(const char *str, TokenType *type) {
-    if (strcmp(str, "int") == 0) {
-        *type = TOKEN_INT;
-        return true;
-    } else if (strcmp(str, "return") == 0) {
-        *type = TOKEN_RETURN;
-        return true;
-    } else if (strcmp(str, "if") == 0) {
-        *type = TOKEN_IF;
-        return true;
-    } else if (strcmp(str, "else") == 0) {
-        *type = TOKEN_ELSE;
-        return true;
-    } else if (strcmp(str, "while") == 0) {
-        *type = TOKEN_WHILE;
-        return true;
+/* Token type for each pre-interned keyword symbol */
+static const TokenType keyword_tokens[SYM_KEYWORD_COUNT] = {
+    [SYM_INT] = TOKEN_INT,
+    [SYM_RETURN] = TOKEN_RETURN,
+    [SYM_IF] = TOKEN_IF,
+    [SYM_ELSE] = TOKEN_ELSE,
+    [SYM_WHILE] = TOKEN_WHILE,
+};
+
+/* Most runs in real code are a few bytes long, too short to repay a
+ * vector load, so the first bytes are checked inline and only longer
+ * runs go to the SIMD scanner. */
+#define SHORT_RUN 8
+
+static inline const char *skip_whitespace(const char *p, const char *end, int *line) {
+    const char *limit = end - p > SHORT_RUN ? p + SHORT_RUN : end;
+    while (p < limit && (char_class[(unsigned char)*p] & CHAR_WHITESPACE)) {
+        if (*p == '\n') {
+            (*line)++;
+        }
+        p++;
     }
-    return false;
+    if (p == limit && p < end) {
+        p = scan_whitespace(p, end, line);
+    }
+    return p;
 }
 
-Token *tokenize(const char *source, int *token_count) {
-    int capacity = 100;
-    Token *tokens = malloc(sizeof(Token) * capacity);
-    if (!tokens) {
-        return NULL;
+static inline const char *skip_class(const char *p, const char *end, uint8_t mask) {
+    const char *limit = end - p > SHORT_RUN ? p + SHORT_RUN : end;
+    while (p < limit && (char_class[(unsigned char)*p] & mask)) {
+        p++;
     }
+    if (p == limit && p < end) {
+        p = scan_class(p, end, mask);
+    }
+    return p;
+}
 
-    int count = 0;
-    int line = 1;
-    const char *ptr = source;
-
-    while (*ptr) {
-        // Skip whitespace
-        while (*ptr && isspace(*ptr)) {
-            if (*ptr == '\n') {
-                line++;
-            }
-            ptr++;
-        }
+/* Lines straight from the preprocessor. Line numbers come from it, as it
+ * knows where included files start. */
+static bool preprocessor_lines(void *source, const char **text, size_t *length, int *line) {
+    Preprocessor *pp = source;
+    *text = pp_next_line(pp, length);
+    *line = pp->line;
+    return *text || !pp->failed;
+}
 
-        if (!*ptr) break;
+void lexer_init(Lexer *lexer, Preprocessor *pp) {
+    lexer_init_source(lexer, &pp->context->symbols, preprocessor_lines, pp);
+}
 
-        // Ensure capacity
-        if (count >= capacity) {
-            capacity *= 2;
-            Token *new_tokens = realloc(tokens, sizeof(Token) * capacity);
-            if (!new_tokens) {
-                free_tokens(tokens, count);
-                return NULL;
-            }
-            tokens = new_tokens;
-        }
+void lexer_init_source(Lexer *lexer, SymbolTable *symbols, LineSource read_line, void *source) {
+    memset(lexer, 0, sizeof(*lexer));
+    lexer->read_line = read_line;
+    lexer->source = source;
+    lexer->symbols = symbols;
+}
 
-        tokens[count].line = line;
+/* Pull the next line; false at the end of input, or with failed set when
+ * the source failed. Every line ends in a newline, so tokens never
+ * straddle two lines. */
+static bool next_line(Lexer *lexer) {
+    const char *text;
+    size_t length;
+    int line;
+    if (!lexer->read_line(lexer->source, &text, &length, &line)) {
+        lexer->failed = true;
+        return false;
+    }
+    if (!text) {
+        return false;
+    }
+    lexer->base += (size_t)(lexer->end - lexer->start);
+    lexer->line = line - 1;
+    lexer->start = text;
+    lexer->ptr = text;
+    lexer->end = text + length;
+    return true;
+}
 
-        // Numbers
-        if (isdigit(*ptr)) {
-            const char *start = ptr;
-            while (isdigit(*ptr)) {
-                ptr++;
+bool lexer_next(Lexer *lexer, Token *token) {
+    // Skip whitespace, moving on to further lines as needed
+    for (;;) {
+        if (lexer->ptr < lexer->end) {
+            lexer->ptr = skip_whitespace(lexer->ptr, lexer->end, &lexer->line);
+            if (lexer->ptr < lexer->end) {
+                break;
             }
-            int len = ptr - start;
-            tokens[count].value = malloc(len + 1);
-            strncpy(tokens[count].value, start, len);
-            tokens[count].value[len] = '\0';
-            tokens[count].type = TOKEN_NUMBER;
-            count++;
-            continue;
         }
-
-        // Identifiers and keywords
-        if (isalpha(*ptr) || *ptr == '_') {
-            const char *start = ptr;
-            while (isalnum(*ptr) || *ptr == '_') {
-                ptr++;
-            }
-            int len = ptr - start;
-            char *word = malloc(len + 1);
-            strncpy(word, start, len);
-            word[len] = '\0';
-
-            TokenType keyword_type;
-            if (is_keyword(word, &keyword_type)) {
-                tokens[count].type = keyword_type;
-                tokens[count].value = word;
-            } else {
-                tokens[count].type = TOKEN_IDENTIFIER;
-                tokens[count].value = word;
+        if (!next_line(lexer)) {
+            if (lexer->failed) {
+                return false;
             }
-            count++;
-            continue;
+            token->type = TOKEN_EOF;
+            token->line = lexer->line + 1;
+            token->offset = (uint32_t)(lexer->base + (size_t)(lexer->end - lexer->start));
+            token->length = 0;
+            token->value = 0;
+            return true;
         }
+    }
 
-        // Two-character operators
-        if (ptr[0] == '=' && ptr[1] == '=') {
-            tokens[count].type = TOKEN_EQ;
-            tokens[count].value = strdup("==");
-            ptr += 2;
-            count++;
-            continue;
-        }
-        if (ptr[0] == '!' && ptr[1] == '=') {
-            tokens[count].type = TOKEN_NE;
-            tokens[count].value = strdup("!=");
-            ptr += 2;
-            count++;
-            continue;
-        }
-        if (ptr[0] == '<' && ptr[1] == '=') {
-            tokens[count].type = TOKEN_LE;
-            tokens[count].value = strdup("<=");
-            ptr += 2;
-            count++;
-            continue;
-        }
-        if (ptr[0] == '>' && ptr[1] == '=') {
-            tokens[count].type = TOKEN_GE;
-            tokens[count].value = strdup(">=");
-            ptr += 2;
-            count++;
-            continue;
+    const char *ptr = lexer->ptr;
+    const char *end = lexer->end;
+
+    token->line = lexer->line + 1;
+    token->offset = (uint32_t)(lexer->base + (size_t)(ptr - lexer->start));
+    token->length = 1;
+    token->value = 0;
+
+    // Numbers
+    if (char_class[(unsigned char)*ptr] & CHAR_DIGIT) {
+        const char *start = ptr;
+        ptr = skip_class(ptr, end, CHAR_DIGIT);
+        unsigned int value = 0;
+        for (const char *digit = start; digit < ptr; digit++) {
+            value = value * 10 + (unsigned int)(*digit - '0');
         }
+        token->length = (uint32_t)(ptr - start);
+        token->value = (int)value;
+        token->type = TOKEN_NUMBER;
+        lexer->ptr = ptr;
+        return true;
+    }
 
-        // Single-character tokens
-        switch (*ptr) {
-            case '(':
-                tokens[count].type = TOKEN_LPAREN;
-                tokens[count].value = strdup("(");
-                break;
-            case ')':
-                tokens[count].type = TOKEN_RPAREN;
-                tokens[count].value = strdup(")");
-                break;
-            case '{':
-                tokens[count].type = TOKEN_LBRACE;
-                tokens[count].value = strdup("{");
-                break;
-            case '}':
-                tokens[count].type = TOKEN_RBRACE;
-                tokens[count].value = strdup("}");
-                break;
-            case ';':
-                tokens[count].type = TOKEN_SEMICOLON;
-                tokens[count].value = strdup(";");
-                break;
-            case '+':
-                tokens[count].type = TOKEN_PLUS;
-                tokens[count].value = strdup("+");
-                break;
-            case '-':
-                tokens[count].type = TOKEN_MINUS;
-                tokens[count].value = strdup("-");
-                break;
-            case '*':
-                tokens[count].type = TOKEN_STAR;
-                tokens[count].value = strdup("*");
-                break;
-            case '/':
-                tokens[count].type = TOKEN_SLASH;
-                tokens[count].value = strdup("/");
-                break;
-            case '=':
-                tokens[count].type = TOKEN_ASSIGN;
-                tokens[count].value = strdup("=");
-                break;
-            case '<':
-                tokens[count].type = TOKEN_LT;
-                tokens[count].value = strdup("<");
-                break;
-            case '>':
-                tokens[count].type = TOKEN_GT;
-                tokens[count].value = strdup(">");
-                break;
-            case ',':
-                tokens[count].type = TOKEN_COMMA;
-                tokens[count].value = strdup(",");
-                break;
-            default:
-                fprintf(stderr, "Unexpected character: %c at line %d\n", *ptr, line);
-                free_tokens(tokens, count);
-                return NULL;
+    // Identifiers and keywords
+    if (char_class[(unsigned char)*ptr] & CHAR_IDENT_START) {
+        const char *start = ptr;
+        ptr = skip_class(ptr, end, CHAR_IDENT);
+        size_t len = ptr - start;
+        int symbol = intern(lexer->symbols, start, len);
+        if (symbol < 0) {
+            return false;
         }
-        ptr++;
-        count++;
+        token->length = (uint32_t)len;
+        token->value = symbol;
+        token->type = symbol < SYM_KEYWORD_COUNT ? keyword_tokens[symbol] : TOKEN_IDENTIFIER;
+        lexer->ptr = ptr;
+        return true;
     }
 
-    // Add EOF token
-    if (count >= capacity) {
-        capacity++;
-        Token *new_tokens = realloc(tokens, sizeof(Token) * capacity);
-        if (!new_tokens) {
-            free_tokens(tokens, count);
-            return NULL;
+    // Two-character operators
+    if (ptr[1] == '=') {
+        TokenType type = TOKEN_EOF;
+        switch (ptr[0]) {
+            case '=': type = TOKEN_EQ; break;
+            case '!': type = TOKEN_NE; break;
+            case '<': type = TOKEN_LE; break;
+            case '>': type = TOKEN_GE; break;
+        }
+        if (type != TOKEN_EOF) {
+            token->type = type;
+            token->length = 2;
+            lexer->ptr = ptr + 2;
+            return true;
         }
-        tokens = new_tokens;
     }
 
-    tokens[count].type = TOKEN_EOF;
-    tokens[count].value = NULL;
-    tokens[count].line = line;
-    count++;
-
-    *token_count = count;
-    return tokens;
-}
-
-void free_tokens(Token *tokens, int count) {
-    for (int i = 0; i < count; i++) {
-        free(tokens[i].value);
+    // Single-character tokens
+    switch (*ptr) {
+        case '(':
+            token->type = TOKEN_LPAREN;
+            break;
+        case ')':
+            token->type = TOKEN_RPAREN;
+            break;
+        case '{':
+            token->type = TOKEN_LBRACE;
+            break;
+        case '}':
+            token->type = TOKEN_RBRACE;
+            break;
+        case ';':
+            token->type = TOKEN_SEMICOLON;
+            break;
+        case '+':
+            token->type = TOKEN_PLUS;
+            break;
+        case '-':
+            token->type = TOKEN_MINUS;
+            break;
+        case '*':
+            token->type = TOKEN_STAR;
+            break;
+        case '/':
+            token->type = TOKEN_SLASH;
+            break;
+        case '=':
+            token->type = TOKEN_ASSIGN;
+            break;
+        case '<':
+            token->type = TOKEN_LT;
+            break;
+        case '>':
+            token->type = TOKEN_GT;
+            break;
+        case ',':
+            token->type = TOKEN_COMMA;
+            break;
+        default:
+            fprintf(err_stream(), "Unexpected character: %c at line %d\n", *ptr, token->line);
+            return false;
     }
-    free(tokens);
+    lexer->ptr = ptr + 1;
+    return true;
 }
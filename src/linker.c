@@ -1,75 +1,265 @@
+#define _GNU_SOURCE     /* pipe2 */
 #include "crappola.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
 #include <unistd.h>
 #include <sys/wait.h>
 
-int link_program(const char *asm_file, const char *output_file) {
-    // First, assemble the .s file to .o file
-    char obj_file[256];
-    snprintf(obj_file, sizeof(obj_file), "/tmp/crappola_%d.o", getpid());
+extern char **environ;
 
-    pid_t as_pid = fork();
-    if (as_pid == 0) {
-        // Child process: run assembler
+/* Start a tool with posix_spawn, optionally reading its stdin from fd.
+ * Its stdout and stderr are this thread's streams, so diagnostics reach
+ * the user unchanged. */
+static pid_t spawn_tool(char *const argv[], int stdin_fd, int close_fd) {
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    FILE *out = out_stream();
+    FILE *diagnostics = err_stream();
+    fflush(out);
+    fflush(diagnostics);
+    if (fileno(out) > STDERR_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, fileno(out), STDOUT_FILENO);
+    }
+    if (fileno(diagnostics) > STDERR_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, fileno(diagnostics), STDERR_FILENO);
+    }
+    if (stdin_fd >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, stdin_fd, STDIN_FILENO);
+        posix_spawn_file_actions_addclose(&actions, stdin_fd);
+    }
+    if (close_fd >= 0) {
+        posix_spawn_file_actions_addclose(&actions, close_fd);
+    }
+
+    // Tools start with no signals blocked or ignored, whatever this
+    // thread has set up for itself
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t signals;
+    sigemptyset(&signals);
+    posix_spawnattr_setsigmask(&attr, &signals);
+    sigaddset(&signals, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &signals);
 #ifdef __APPLE__
-        execlp("as", "as", "-arch", "x86_64", "-o", obj_file, asm_file, NULL);
+    // Without pipe2, a pipe is briefly inheritable; close everything the
+    // file actions do not hand over
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF |
+                                    POSIX_SPAWN_CLOEXEC_DEFAULT);
 #else
-        execlp("as", "as", "-o", obj_file, asm_file, NULL);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
 #endif
-        fprintf(stderr, "Error: Failed to execute assembler\n");
-        exit(1);
-    } else if (as_pid < 0) {
-        fprintf(stderr, "Error: Failed to fork for assembler\n");
+
+    pid_t pid;
+    int err = posix_spawnp(&pid, argv[0], &actions, &attr, argv, environ);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    if (err != 0) {
+        fprintf(err_stream(), "Error: Failed to execute %s: %s\n", argv[0], strerror(err));
         return -1;
     }
+    return pid;
+}
 
-    // Wait for assembler
-    int as_status;
-    waitpid(as_pid, &as_status, 0);
-    if (WIFEXITED(as_status) && WEXITSTATUS(as_status) != 0) {
-        fprintf(stderr, "Error: Assembler failed\n");
-        return -1;
+/* Wait for a tool and translate its status into an exit code:
+ * 0 on success, the tool's own exit status, or 128 + signal number. */
+static int wait_tool(pid_t pid, const char *name) {
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            fprintf(err_stream(), "Error: Failed to wait for %s\n", name);
+            return 1;
+        }
     }
 
-    // Link the object file
-    pid_t ld_pid = fork();
-    if (ld_pid == 0) {
-        // Child process: run linker
+    if (WIFEXITED(status)) {
+        if (WEXITSTATUS(status) != 0) {
+            fprintf(err_stream(), "Error: %s failed with exit status %d\n", name, WEXITSTATUS(status));
+        }
+        return WEXITSTATUS(status);
+    }
+    if (WIFSIGNALED(status)) {
+        fprintf(err_stream(), "Error: %s terminated by signal %d\n", name, WTERMSIG(status));
+        return 128 + WTERMSIG(status);
+    }
+    return 1;
+}
+
+/* Run `as -o obj -` and have generate write the assembly into its stdin
+ * through a pipe, so the text is assembled as it is produced. If
+ * generation fails the assembler is stopped without a word of its own. */
+static int assemble(AsmGenerator generate, void *source, const char *obj_file) {
+    // Close-on-exec from the start, so a tool started by another thread
+    // at the same time never holds the write end open
+    int fds[2];
 #ifdef __APPLE__
-        execlp("ld", "ld", 
-               "-arch", "x86_64",
-               "-macosx_version_min", "10.13",
-               "-lSystem",
-               "-o", output_file,
-               obj_file,
-               NULL);
+    bool piped = pipe(fds) == 0;
+    if (piped) {
+        fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+        fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    }
+#else
+    bool piped = pipe2(fds, O_CLOEXEC) == 0;
+#endif
+    if (!piped) {
+        fprintf(err_stream(), "Error: Failed to create assembler pipe\n");
+        return 1;
+    }
+
+#ifdef __APPLE__
+    char *as_argv[] = { "as", "-arch", "x86_64", "-o", (char *)obj_file, "-", NULL };
 #else
-        execlp("ld", "ld", 
-               "-dynamic-linker", "/lib64/ld-linux-x86-64.so.2",
-               "-o", output_file,
-               "/usr/lib/x86_64-linux-gnu/crt1.o",
-               "/usr/lib/x86_64-linux-gnu/crti.o",
-               obj_file,
-               "-lc",
-               "/usr/lib/x86_64-linux-gnu/crtn.o",
-               NULL);
+    char *as_argv[] = { "as", "-o", (char *)obj_file, "-", NULL };
 #endif
-        fprintf(stderr, "Error: Failed to execute linker\n");
-        exit(1);
-    } else if (ld_pid < 0) {
-        fprintf(stderr, "Error: Failed to fork for linker\n");
+    pid_t pid = spawn_tool(as_argv, fds[0], fds[1]);
+    close(fds[0]);
+    if (pid < 0) {
+        close(fds[1]);
+        return 1;
+    }
+
+    // If the assembler dies early we want EPIPE, not to be killed by
+    // SIGPIPE. The signal is blocked in this thread only and a pending
+    // one is consumed, so other threads keep their own disposition.
+    sigset_t pipe_set, saved;
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_set, &saved);
+    AsmWriter out;
+    writer_init_fd(&out, fds[1]);
+    bool generated = generate(source, &out);
+    bool write_failed = !writer_flush(&out);
+    writer_release(&out);
+    close(fds[1]);
+    sigset_t pending;
+    int signal_number;
+    if (sigpending(&pending) == 0 && sigismember(&pending, SIGPIPE) &&
+        !sigismember(&saved, SIGPIPE)) {
+        sigwait(&pipe_set, &signal_number);
+    }
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+    if (!generated && !write_failed) {
+        // The error is already reported; the assembler only has half a unit
+        kill(pid, SIGKILL);
+        while (waitpid(pid, NULL, 0) < 0 && errno == EINTR) {
+        }
+        return 1;
+    }
+    int status = wait_tool(pid, "Assembler");
+    if (status == 0 && write_failed) {
+        fprintf(err_stream(), "Error: Failed to write to assembler\n");
+        return 1;
+    }
+    return status == 0 && !generated ? 1 : status;
+}
+
+/* Assemble one unit, written by generate, into an object file that is
+ * kept for a later link */
+int assemble_generated(AsmGenerator generate, void *source, const char *obj_file) {
+    int status = assemble(generate, source, obj_file);
+    if (status != 0) {
         remove(obj_file);
-        return -1;
     }
+    return status;
+}
 
-    // Wait for linker
-    int ld_status;
-    waitpid(ld_pid, &ld_status, 0);
-    remove(obj_file);
+static bool write_text(void *source, AsmWriter *out) {
+    const char *assembly = source;
+    writer_write(out, assembly, strlen(assembly));
+    return !out->failed;
+}
 
-    if (WIFEXITED(ld_status) && WEXITSTATUS(ld_status) != 0) {
-        fprintf(stderr, "Error: Linker failed\n");
-        return -1;
+/* Assemble text already in memory into an object file */
+int assemble_object(const char *assembly, const char *obj_file) {
+    return assemble_generated(write_text, (void *)assembly, obj_file);
+}
+
+/* Link object files into an executable with a single ld invocation */
+int link_objects(const char *const *objects, int count, const char *output_file,
+                 bool freestanding) {
+    char **ld_argv = malloc(sizeof(char *) * (size_t)(count + 16));
+    if (!ld_argv) {
+        fprintf(err_stream(), "Error: Memory allocation failed\n");
+        return 1;
     }
+    int n = 0;
+    ld_argv[n++] = "ld";
+    if (freestanding) {
+        // Static executable with our own _start: no crt objects,
+        // no libc and no dynamic loader.
+#ifdef __APPLE__
+        ld_argv[n++] = "-arch";
+        ld_argv[n++] = "x86_64";
+        ld_argv[n++] = "-static";
+        ld_argv[n++] = "-e";
+        ld_argv[n++] = "start";
+#else
+        ld_argv[n++] = "-static";
+        ld_argv[n++] = "-nostdlib";
+#endif
+        ld_argv[n++] = "-o";
+        ld_argv[n++] = (char *)output_file;
+        for (int i = 0; i < count; i++) {
+            ld_argv[n++] = (char *)objects[i];
+        }
+    } else {
+#ifdef __APPLE__
+        ld_argv[n++] = "-arch";
+        ld_argv[n++] = "x86_64";
+        ld_argv[n++] = "-macosx_version_min";
+        ld_argv[n++] = "10.13";
+        ld_argv[n++] = "-lSystem";
+        ld_argv[n++] = "-o";
+        ld_argv[n++] = (char *)output_file;
+        for (int i = 0; i < count; i++) {
+            ld_argv[n++] = (char *)objects[i];
+        }
+#else
+        ld_argv[n++] = "-dynamic-linker";
+        ld_argv[n++] = "/lib64/ld-linux-x86-64.so.2";
+        ld_argv[n++] = "-o";
+        ld_argv[n++] = (char *)output_file;
+        ld_argv[n++] = "/usr/lib/x86_64-linux-gnu/crt1.o";
+        ld_argv[n++] = "/usr/lib/x86_64-linux-gnu/crti.o";
+        for (int i = 0; i < count; i++) {
+            ld_argv[n++] = (char *)objects[i];
+        }
+        ld_argv[n++] = "-lc";
+        ld_argv[n++] = "/usr/lib/x86_64-linux-gnu/crtn.o";
+#endif
+    }
+    ld_argv[n] = NULL;
+
+    pid_t ld_pid = spawn_tool(ld_argv, -1, -1);
+    free(ld_argv);
+    if (ld_pid < 0) {
+        return 1;
+    }
+    return wait_tool(ld_pid, "Linker");
+}
 
-    return 0;
+int link_program(const char *assembly, const char *output_file, bool freestanding) {
+    // First, assemble the generated code into an object file. The name
+    // is unique, as several threads of one process may be linking.
+    char obj_file[] = "/tmp/crappola_XXXXXX.o";
+    int fd = mkstemps(obj_file, 2);
+    if (fd < 0) {
+        fprintf(err_stream(), "Error: Could not create a temporary object file\n");
+        return 1;
+    }
+    close(fd);
+
+    int status = assemble_object(assembly, obj_file);
+    if (status != 0) {
+        return status;
+    }
+
+    // Link the object file
+    const char *objects[] = { obj_file };
+    status = link_objects(objects, 1, output_file, freestanding);
+    remove(obj_file);
+    return status;
 }
@@ -0,0 +1,1357 @@
+#include "crappola.h"
+#include <stdarg.h>
+
+/* Macro table and macro expansion. Macros live in an open-addressing hash
+ * table keyed by name, and replacement lists are split into preprocessing
+ * tokens when they are defined. Expansion follows Prosser's algorithm:
+ * every token carries the set of macros it came out of (its hide set), and
+ * a name is never expanded inside its own hide set. This gives standard
+ * rescanning, and a name that is skipped once stays "painted blue". */
+
+#define INITIAL_MACRO_TABLE_SIZE 256
+#define EXPANSION_CACHE_LIMIT 65536
+
+typedef enum {
+    PP_IDENT,
+    PP_NUMBER,
+    PP_STRING,
+    PP_PUNCT,
+    PP_PARAM,       /* parameter reference in a replacement list */
+} PPTokenKind;
+
+typedef struct HideSet {
+    const struct Macro *macro;
+    const struct HideSet *next;
+} HideSet;
+
+typedef struct {
+    const char *text;
+    uint32_t length;
+    uint8_t kind;
+    bool space;             /* preceded by whitespace */
+    int param;              /* PP_PARAM: parameter index */
+    const HideSet *hide;
+} PPToken;
+
+/* Replacement list of a macro whose value is not plain text */
+typedef struct {
+    int count;
+    int param_count;        /* -1 for object-like macros */
+    bool variadic;
+    PPToken tokens[];
+} MacroBody;
+
+/* name is NULL in empty slots. The value and then the parameter list as
+ * written follow the name's terminator in the same allocation. body is
+ * NULL for plain macros: object-like, with no identifiers or ## in the
+ * value, so it is copied as text. */
+struct Macro {
+    uint32_t hash;
+    uint32_t name_length;
+    char *name;
+    uint32_t value_length;
+    uint32_t params_length;
+    MacroBody *body;
+};
+
+typedef struct {
+    PPToken *items;
+    int count;
+    int capacity;
+} TokenList;
+
+/* Pending input, with the next token last. pull allows reading further
+ * source lines, so a macro's arguments may span several lines. */
+typedef struct {
+    TokenList tokens;
+    bool pull;
+} Input;
+
+typedef struct {
+    Preprocessor *pp;
+    MacroTable *table;
+    Arena *scratch;
+    const char *prev_end;   /* end of the last token written, for spacing */
+} Expander;
+
+/* A fully expanded top-level invocation */
+struct CacheEntry {
+    const Macro *macro;
+    uint64_t epoch;
+    uint32_t hash;
+    char *key;
+    size_t key_length;
+    char *text;
+    size_t text_length;
+    struct CacheEntry *next;
+};
+
+/* Longest first, so "<<=" is not read as "<<" */
+static const struct {
+    const char *text;
+    size_t length;
+} punctuators[] = {
+    { "...", 3 }, { "<<=", 3 }, { ">>=", 3 },
+    { "##", 2 }, { "->", 2 }, { "++", 2 }, { "--", 2 }, { "<<", 2 }, { ">>", 2 },
+    { "<=", 2 }, { ">=", 2 }, { "==", 2 }, { "!=", 2 }, { "&&", 2 }, { "||", 2 },
+    { "+=", 2 }, { "-=", 2 }, { "*=", 2 }, { "/=", 2 }, { "%=", 2 }, { "&=", 2 },
+    { "|=", 2 }, { "^=", 2 },
+};
+
+static uint32_t hash_bytes(const char *data, size_t len, uint32_t hash) {
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t hash_name(const char *name, size_t len) {
+    return hash_bytes(name, len, 2166136261u);
+}
+
+/* Slot holding the macro, or the empty slot where it would go */
+static Macro *find_slot(MacroTable *t, const char *name, size_t len, uint32_t hash) {
+    size_t mask = t->table_size - 1;
+    size_t index = hash & mask;
+    while (t->macros[index].name) {
+        Macro *macro = &t->macros[index];
+        if (macro->hash == hash && macro->name_length == len &&
+            memcmp(macro->name, name, len) == 0) {
+            return macro;
+        }
+        index = (index + 1) & mask;
+    }
+    return &t->macros[index];
+}
+
+static bool resize_macros(MacroTable *t, size_t new_size) {
+    Macro *old = t->macros;
+    size_t old_size = t->table_size;
+
+    t->macros = calloc(new_size, sizeof(Macro));
+    if (!t->macros) {
+        t->macros = old;
+        return false;
+    }
+    t->table_size = new_size;
+
+    for (size_t i = 0; i < old_size; i++) {
+        if (old[i].name) {
+            *find_slot(t, old[i].name, old[i].name_length, old[i].hash) = old[i];
+        }
+    }
+    free(old);
+    return true;
+}
+
+static const Macro *lookup_macro(MacroTable *t, const char *name, size_t len) {
+    if (t->count == 0) {
+        return NULL;
+    }
+    Macro *macro = find_slot(t, name, len, hash_name(name, len));
+    return macro->name ? macro : NULL;
+}
+
+bool macro_defined(MacroTable *t, const char *name, size_t len) {
+    return lookup_macro(t, name, len) != NULL;
+}
+
+static void free_macro(Macro *macro) {
+    free(macro->name);
+    free(macro->body);
+    macro->name = NULL;
+    macro->body = NULL;
+}
+
+/* Remove a macro. Later entries of its probe run are shifted back into
+ * the hole, so lookups never need tombstones. */
+void macro_undefine(MacroTable *t, const char *name, size_t len) {
+    if (t->count == 0) {
+        return;
+    }
+    Macro *macro = find_slot(t, name, len, hash_name(name, len));
+    if (!macro->name) {
+        return;
+    }
+    free_macro(macro);
+    t->count--;
+    t->epoch++;
+
+    Macro *macros = t->macros;
+    size_t mask = t->table_size - 1;
+    size_t hole = (size_t)(macro - macros);
+    size_t index = hole;
+    for (;;) {
+        index = (index + 1) & mask;
+        if (!macros[index].name) {
+            break;
+        }
+        // Move the entry back unless its home slot lies after the hole
+        size_t home = macros[index].hash & mask;
+        if (((index - home) & mask) >= ((index - hole) & mask)) {
+            macros[hole] = macros[index];
+            hole = index;
+        }
+    }
+    macros[hole].name = NULL;
+    macros[hole].body = NULL;
+}
+
+/* Call visit for every macro with its name, parameter list as written
+ * (empty for object-like macros) and value, for saving the table */
+bool macro_visit(const MacroTable *t, MacroVisitor visit, void *context) {
+    for (size_t i = 0; i < t->table_size; i++) {
+        const Macro *macro = &t->macros[i];
+        if (!macro->name) {
+            continue;
+        }
+        const char *value = macro->name + macro->name_length + 1;
+        const char *params = value + macro->value_length + 1;
+        if (!visit(context, macro->name, macro->name_length, params, macro->params_length,
+                   value, macro->value_length)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void clear_cache(MacroTable *t) {
+    for (int i = 0; i < EXPANSION_CACHE_BUCKETS; i++) {
+        while (t->cache[i]) {
+            CacheEntry *entry = t->cache[i];
+            t->cache[i] = entry->next;
+            free(entry->key);
+            free(entry->text);
+            free(entry);
+        }
+    }
+    t->cache_count = 0;
+}
+
+/* Remove every macro. The slots and the first scratch chunk are kept,
+ * so a context compiling unit after unit does not allocate them again. */
+void macro_clear(MacroTable *t) {
+    for (size_t i = 0; i < t->table_size; i++) {
+        if (t->macros[i].name) {
+            free_macro(&t->macros[i]);
+        }
+    }
+    t->count = 0;
+    t->epoch++;
+    clear_cache(t);
+    arena_clear(&t->scratch);
+}
+
+void macro_release(MacroTable *t) {
+    macro_clear(t);
+    free(t->macros);
+    t->macros = NULL;
+    t->table_size = 0;
+    arena_release(&t->scratch);
+}
+
+static const char *skip_blanks(const char *p, const char *end) {
+    while (p < end && (char_class[(unsigned char)*p] & CHAR_WHITESPACE)) {
+        p++;
+    }
+    return p;
+}
+
+static const char *skip_identifier(const char *p, const char *end) {
+    while (p < end && (char_class[(unsigned char)*p] & CHAR_IDENT)) {
+        p++;
+    }
+    return p;
+}
+
+/* Read one preprocessing token at p, which is not whitespace */
+static const char *lex_pp_token(const char *p, const char *end, PPToken *token) {
+    const char *start = p;
+    unsigned char c = (unsigned char)*p;
+    memset(token, 0, sizeof(*token));
+    token->text = start;
+
+    if (char_class[c] & CHAR_IDENT_START) {
+        token->kind = PP_IDENT;
+        p = skip_identifier(p, end);
+    } else if ((char_class[c] & CHAR_DIGIT) ||
+               (c == '.' && p + 1 < end && (char_class[(unsigned char)p[1]] & CHAR_DIGIT))) {
+        // pp-number: digits, letters, '.', and signs after an exponent
+        token->kind = PP_NUMBER;
+        p++;
+        while (p < end) {
+            if ((*p == '+' || *p == '-') && strchr("eEpP", p[-1])) {
+                p++;
+            } else if ((char_class[(unsigned char)*p] & CHAR_IDENT) || *p == '.') {
+                p++;
+            } else {
+                break;
+            }
+        }
+    } else if (c == '"' || c == '\'') {
+        token->kind = PP_STRING;
+        p++;
+        while (p < end && *p != (char)c && *p != '\n') {
+            if (*p == '\\' && p + 1 < end) {
+                p++;
+            }
+            p++;
+        }
+        if (p < end && *p == (char)c) {
+            p++;
+        }
+    } else {
+        token->kind = PP_PUNCT;
+        p++;
+        // Most punctuators are single characters; only pairs that can
+        // begin a longer one are looked up
+        bool longer = end - start >= 2 && strchr("#-+<>=!&|*/%^.", c) && strchr("#>+-<=&|.", start[1]);
+        for (size_t i = 0; longer && i < sizeof(punctuators) / sizeof(punctuators[0]); i++) {
+            size_t len = punctuators[i].length;
+            if ((size_t)(end - start) >= len && memcmp(start, punctuators[i].text, len) == 0) {
+                p = start + len;
+                break;
+            }
+        }
+    }
+    token->length = (uint32_t)(p - start);
+    return p;
+}
+
+static bool is_punct(const PPToken *token, const char *text) {
+    return token->kind == PP_PUNCT && token->length == strlen(text) &&
+           memcmp(token->text, text, token->length) == 0;
+}
+
+/* Token lists live in the scratch arena; growing copies the items */
+static bool list_push(Arena *scratch, TokenList *list, PPToken token) {
+    if (list->count >= list->capacity) {
+        int capacity = list->capacity ? list->capacity * 2 : 16;
+        PPToken *items = arena_alloc(scratch, sizeof(PPToken) * capacity);
+        if (!items) {
+            return false;
+        }
+        if (list->count > 0) {
+            memcpy(items, list->items, sizeof(PPToken) * list->count);
+        }
+        list->items = items;
+        list->capacity = capacity;
+    }
+    list->items[list->count++] = token;
+    return true;
+}
+
+static bool list_append(Arena *scratch, TokenList *list, const TokenList *tokens) {
+    for (int i = 0; i < tokens->count; i++) {
+        if (!list_push(scratch, list, tokens->items[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool tokenize(Arena *scratch, const char *p, const char *end, TokenList *list) {
+    bool space = false;
+    for (;;) {
+        const char *next = skip_blanks(p, end);
+        space = space || next > p;
+        p = next;
+        if (p >= end) {
+            return true;
+        }
+
+        // Comments count as whitespace. One left open at the end of the
+        // line is passed through as text for the lexer to finish.
+        if (*p == '/' && p + 1 < end && p[1] == '/') {
+            return true;
+        }
+        PPToken token;
+        if (*p == '/' && p + 1 < end && p[1] == '*') {
+            const char *close = p + 2;
+            while (close + 1 < end && !(close[0] == '*' && close[1] == '/')) {
+                close++;
+            }
+            if (close + 1 < end) {
+                p = close + 2;
+                space = true;
+                continue;
+            }
+            memset(&token, 0, sizeof(token));
+            token.text = p;
+            token.length = (uint32_t)(end - p);
+            token.kind = PP_STRING;
+            p = end;
+        } else {
+            p = lex_pp_token(p, end, &token);
+        }
+        token.space = space;
+        if (!list_push(scratch, list, token)) {
+            return false;
+        }
+        space = false;
+    }
+}
+
+/* Print an error at the current source position; always returns false */
+static bool report(Expander *x, const char *format, ...) {
+    const char *path = "<command line>";
+    int line = 0;
+    if (x->pp && x->pp->depth > 0) {
+        path = x->pp->frames[x->pp->depth - 1].file->path;
+        line = x->pp->frames[x->pp->depth - 1].line;
+    }
+    va_list args;
+    va_start(args, format);
+    fprintf(err_stream(), "Error: ");
+    vfprintf(err_stream(), format, args);
+    fprintf(err_stream(), " at %s:%d\n", path, line);
+    va_end(args);
+    return false;
+}
+
+/* Whether a value can be copied as text: no identifiers and no ## */
+static bool plain_value(const char *p, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if ((char_class[(unsigned char)p[i]] & CHAR_IDENT_START) || p[i] == '#') {
+            // Letters may still be part of numbers such as 0x1f or 10UL
+            PPToken token;
+            const char *q = p;
+            const char *end = p + len;
+            while (q < end) {
+                q = skip_blanks(q, end);
+                if (q == end) {
+                    break;
+                }
+                q = lex_pp_token(q, end, &token);
+                if (token.kind == PP_IDENT || is_punct(&token, "##")) {
+                    return false;
+                }
+            }
+            return true;
+        }
+    }
+    return true;
+}
+
+/* Split a replacement list into tokens, with parameters turned into
+ * PP_PARAM. Returns an error message, or NULL with *result set. */
+static const char *parse_body(const char *value, size_t len, const char *const *params,
+                              const size_t *param_lengths, int param_count, bool variadic,
+                              MacroBody **result) {
+    int count = 0;
+    const char *p = value;
+    const char *end = value + len;
+    PPToken token;
+    while ((p = skip_blanks(p, end)) < end) {
+        p = lex_pp_token(p, end, &token);
+        count++;
+    }
+
+    MacroBody *body = malloc(sizeof(MacroBody) + sizeof(PPToken) * count);
+    if (!body) {
+        return "memory allocation failed";
+    }
+    body->count = count;
+    body->param_count = param_count;
+    body->variadic = variadic;
+
+    p = value;
+    for (int i = 0; i < count; i++) {
+        const char *start = skip_blanks(p, end);
+        PPToken *t = &body->tokens[i];
+        p = lex_pp_token(start, end, t);
+        t->space = i > 0 && start > value && (char_class[(unsigned char)start[-1]] & CHAR_WHITESPACE);
+        if (t->kind != PP_IDENT) {
+            continue;
+        }
+        for (int j = 0; j < param_count; j++) {
+            if (param_lengths[j] == t->length && memcmp(params[j], t->text, t->length) == 0) {
+                t->kind = PP_PARAM;
+                t->param = j;
+            }
+        }
+    }
+
+    // '#' must name a parameter; '##' needs an operand on both sides
+    for (int i = 0; i < count; i++) {
+        const char *error = NULL;
+        if (param_count >= 0 && is_punct(&body->tokens[i], "#") &&
+            (i + 1 == count || body->tokens[i + 1].kind != PP_PARAM)) {
+            error = "'#' is not followed by a macro parameter";
+        }
+        if (is_punct(&body->tokens[i], "##") && (i == 0 || i + 1 == count)) {
+            error = "'##' cannot appear at either end of a macro expansion";
+        }
+        if (error) {
+            free(body);
+            return error;
+        }
+    }
+    *result = body;
+    return NULL;
+}
+
+/* Parse the rest of a #define line: name, optional parameter list and
+ * replacement list. Parameters become PP_PARAM tokens in the body. */
+bool macro_define(MacroTable *t, const char *p, const char *end, const char *file, int line) {
+    const char *name = skip_blanks(p, end);
+    p = skip_identifier(name, end);
+    size_t name_len = (size_t)(p - name);
+    if (name_len == 0 || (char_class[(unsigned char)*name] & CHAR_DIGIT)) {
+        fprintf(err_stream(), "Error: Expected macro name in #define at %s:%d\n", file, line);
+        return false;
+    }
+
+    // A '(' right after the name starts a parameter list
+    const char *params[256];
+    size_t param_lengths[256];
+    int param_count = -1;
+    bool variadic = false;
+    const char *param_text = p;
+    if (p < end && *p == '(') {
+        param_count = 0;
+        p = skip_blanks(p + 1, end);
+        bool ok = true;
+        if (p < end && *p == ')') {
+            p++;
+        } else {
+            for (;;) {
+                p = skip_blanks(p, end);
+                const char *param = p;
+                if (end - p >= 3 && memcmp(p, "...", 3) == 0) {
+                    variadic = true;
+                    param = "__VA_ARGS__";
+                    p += 3;
+                    params[param_count] = param;
+                    param_lengths[param_count++] = 11;
+                } else {
+                    p = skip_identifier(p, end);
+                    if (p == param || param_count == 255) {
+                        ok = false;
+                        break;
+                    }
+                    params[param_count] = param;
+                    param_lengths[param_count++] = (size_t)(p - param);
+                }
+                p = skip_blanks(p, end);
+                if (p < end && *p == ')') {
+                    p++;
+                    break;
+                }
+                if (variadic || p >= end || *p != ',') {
+                    ok = false;
+                    break;
+                }
+                p++;
+            }
+        }
+        if (!ok) {
+            fprintf(err_stream(), "Error: Invalid parameter list for macro %.*s at %s:%d\n",
+                    (int)name_len, name, file, line);
+            return false;
+        }
+    }
+    size_t params_len = (size_t)(p - param_text);
+
+    const char *value = skip_blanks(p, end);
+    const char *value_end = end;
+    while (value_end > value && (char_class[(unsigned char)value_end[-1]] & CHAR_WHITESPACE)) {
+        value_end--;
+    }
+    size_t value_len = (size_t)(value_end - value);
+
+    char *storage = malloc(name_len + value_len + params_len + 3);
+    if (!storage) {
+        fprintf(err_stream(), "Error: Memory allocation failed in preprocessor\n");
+        return false;
+    }
+    memcpy(storage, name, name_len);
+    storage[name_len] = '\0';
+    memcpy(storage + name_len + 1, value, value_len);
+    storage[name_len + 1 + value_len] = '\0';
+    memcpy(storage + name_len + value_len + 2, param_text, params_len);
+    storage[name_len + value_len + 2 + params_len] = '\0';
+    const char *stored_value = storage + name_len + 1;
+
+    MacroBody *body = NULL;
+    if (param_count >= 0 || !plain_value(stored_value, value_len)) {
+        const char *error = parse_body(stored_value, value_len, params, param_lengths,
+                                       param_count, variadic, &body);
+        if (error) {
+            fprintf(err_stream(), "Error: %s in macro %.*s at %s:%d\n", error, (int)name_len, name, file, line);
+            free(storage);
+            return false;
+        }
+    }
+
+    // Keep the load factor at or below one half
+    if ((t->count + 1) * 2 > t->table_size &&
+        !resize_macros(t, t->table_size ? t->table_size * 2 : INITIAL_MACRO_TABLE_SIZE)) {
+        fprintf(err_stream(), "Error: Memory allocation failed in preprocessor\n");
+        free(storage);
+        free(body);
+        return false;
+    }
+
+    uint32_t hash = hash_name(name, name_len);
+    Macro *macro = find_slot(t, name, name_len, hash);
+    if (macro->name) {
+        free_macro(macro);
+    } else {
+        t->count++;
+    }
+    macro->hash = hash;
+    macro->name_length = (uint32_t)name_len;
+    macro->name = storage;
+    macro->value_length = (uint32_t)value_len;
+    macro->params_length = (uint32_t)params_len;
+    macro->body = body;
+    t->epoch++;
+    return true;
+}
+
+static bool hide_contains(const HideSet *hide, const Macro *macro) {
+    for (; hide; hide = hide->next) {
+        if (hide->macro == macro) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static const HideSet *hide_add(Arena *scratch, const HideSet *hide, const Macro *macro) {
+    HideSet *node = arena_alloc(scratch, sizeof(HideSet));
+    if (node) {
+        node->macro = macro;
+        node->next = hide;
+    }
+    return node;
+}
+
+static const HideSet *hide_union(Arena *scratch, const HideSet *a, const HideSet *b) {
+    for (; a; a = a->next) {
+        if (!hide_contains(b, a->macro)) {
+            b = hide_add(scratch, b, a->macro);
+        }
+    }
+    return b;
+}
+
+static const HideSet *hide_intersect(Arena *scratch, const HideSet *a, const HideSet *b) {
+    const HideSet *result = NULL;
+    for (; a; a = a->next) {
+        if (hide_contains(b, a->macro)) {
+            result = hide_add(scratch, result, a->macro);
+        }
+    }
+    return result;
+}
+
+/* Whether two characters would lex as one token if written together */
+static bool would_merge(char a, char b) {
+    bool a_ident = char_class[(unsigned char)a] & CHAR_IDENT;
+    bool b_ident = char_class[(unsigned char)b] & CHAR_IDENT;
+    if (a_ident || b_ident) {
+        return a_ident && b_ident;
+    }
+    return a && b && strchr("+-*/%<>=!&|^.#:", a) && strchr("+-*/%<>=!&|^.#:", b);
+}
+
+/* Put a space in the output before text starting with next if the source
+ * had one, or if the two would otherwise run together */
+static bool write_separator(Preprocessor *pp, char next, bool space) {
+    if (pp->output_size > 0 && (space || would_merge(pp->output[pp->output_size - 1], next))) {
+        return pp_append(pp, " ", 1);
+    }
+    return true;
+}
+
+static bool write_text(Expander *x, const char *text, size_t len, bool space, bool adjacent) {
+    if (len > 0 && !adjacent && !write_separator(x->pp, text[0], space)) {
+        return false;
+    }
+    return pp_append(x->pp, text, len);
+}
+
+static bool write_token(Expander *x, const PPToken *token) {
+    bool adjacent = token->text == x->prev_end && !token->space;
+    x->prev_end = token->text + token->length;
+    return write_text(x, token->text, token->length, token->space, adjacent);
+}
+
+/* Tokens go to out, or straight to the output when out is NULL */
+static bool emit(Expander *x, TokenList *out, PPToken token) {
+    return out ? list_push(x->scratch, out, token) : write_token(x, &token);
+}
+
+static bool push_input(Arena *scratch, Input *in, const TokenList *tokens) {
+    for (int i = tokens->count - 1; i >= 0; i--) {
+        if (!list_push(scratch, &in->tokens, tokens->items[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Continue an invocation on the next source line. Directive lines end
+ * the search, as does the end of the current file. */
+static bool pull_line(Expander *x, Input *in) {
+    if (!in->pull || !x->pp || x->pp->depth == 0) {
+        return false;
+    }
+    IncludeFrame *frame = &x->pp->frames[x->pp->depth - 1];
+    while (frame->ptr < frame->end) {
+        const char *line = frame->ptr;
+        const char *eol = memchr(line, '\n', (size_t)(frame->end - line));
+        if (!eol) {
+            eol = frame->end;
+        }
+        const char *first = skip_blanks(line, eol);
+        if (first < eol && *first == '#') {
+            return false;
+        }
+        frame->ptr = eol < frame->end ? eol + 1 : eol;
+        frame->line++;
+        if (first == eol) {
+            continue;
+        }
+
+        TokenList tokens = {0};
+        if (!tokenize(x->scratch, first, eol, &tokens)) {
+            return false;
+        }
+        tokens.items[0].space = true;
+        return push_input(x->scratch, in, &tokens);
+    }
+    return false;
+}
+
+static PPToken *peek_token(Expander *x, Input *in) {
+    if (in->tokens.count == 0 && !pull_line(x, in)) {
+        return NULL;
+    }
+    return &in->tokens.items[in->tokens.count - 1];
+}
+
+static bool next_token(Expander *x, Input *in, PPToken *token) {
+    PPToken *next = peek_token(x, in);
+    if (!next) {
+        return false;
+    }
+    *token = *next;
+    in->tokens.count--;
+    return true;
+}
+
+static bool expand(Expander *x, Input *in, TokenList *out, TokenList *rest);
+
+/* Fully expand an argument on its own, as the standard requires before
+ * substitution. An invocation left open at its end stays unexpanded. */
+static bool expand_argument(Expander *x, const TokenList *arg, TokenList *result) {
+    Input in = { {0}, false };
+    TokenList rest = {0};
+    return push_input(x->scratch, &in, arg) && expand(x, &in, result, &rest) &&
+           list_append(x->scratch, result, &rest);
+}
+
+static bool stringize(Arena *scratch, const TokenList *arg, bool space, PPToken *result) {
+    size_t len = 2;
+    for (int i = 0; i < arg->count; i++) {
+        len += arg->items[i].length * 2 + 1;
+    }
+    char *text = arena_alloc(scratch, len);
+    if (!text) {
+        return false;
+    }
+
+    size_t n = 0;
+    text[n++] = '"';
+    for (int i = 0; i < arg->count; i++) {
+        const PPToken *token = &arg->items[i];
+        if (i > 0 && token->space) {
+            text[n++] = ' ';
+        }
+        for (uint32_t j = 0; j < token->length; j++) {
+            char c = token->text[j];
+            if (token->kind == PP_STRING && (c == '"' || c == '\\')) {
+                text[n++] = '\\';
+            }
+            text[n++] = c;
+        }
+    }
+    text[n++] = '"';
+
+    memset(result, 0, sizeof(*result));
+    result->text = text;
+    result->length = (uint32_t)n;
+    result->kind = PP_STRING;
+    result->space = space;
+    return true;
+}
+
+/* Join two tokens with ##; the result must lex as a single token */
+static bool paste(Expander *x, PPToken *left, const PPToken *right) {
+    size_t len = left->length + right->length;
+    char *text = arena_alloc(x->scratch, len + 1);
+    if (!text) {
+        return false;
+    }
+    memcpy(text, left->text, left->length);
+    memcpy(text + left->length, right->text, right->length);
+    text[len] = '\0';
+
+    PPToken token;
+    const char *end = lex_pp_token(text, text + len, &token);
+    if (end != text + len) {
+        return report(x, "Pasting \"%.*s\" and \"%.*s\" does not give a valid token",
+                      (int)left->length, left->text, (int)right->length, right->text);
+    }
+    token.space = left->space;
+    token.hide = left->hide;
+    *left = token;
+    return true;
+}
+
+/* Build the replacement list of an invocation: parameters are replaced
+ * by expanded arguments, or by the raw ones next to # and ##, and every
+ * resulting token gets the hide set of the invocation. */
+static bool substitute(Expander *x, const Macro *macro, TokenList *args, const PPToken *name,
+                       const HideSet *hide, TokenList *out) {
+    TokenList *expanded = NULL;
+    const MacroBody *body = macro->body;
+    if (body->param_count > 0) {
+        expanded = arena_calloc(x->scratch, sizeof(TokenList) * body->param_count);
+        if (!expanded) {
+            return false;
+        }
+    }
+    bool *done = NULL;
+    if (body->param_count > 0) {
+        done = arena_calloc(x->scratch, sizeof(bool) * body->param_count);
+        if (!done) {
+            return false;
+        }
+    }
+
+    bool placemarker = false;
+    const PPToken *tokens = body->tokens;
+    for (int i = 0; i < body->count; i++) {
+        const PPToken *token = &tokens[i];
+        bool next_is_paste = i + 1 < body->count && is_punct(&tokens[i + 1], "##");
+
+        if (body->param_count >= 0 && is_punct(token, "#")) {
+            PPToken string;
+            if (!stringize(x->scratch, &args[tokens[i + 1].param], token->space, &string) ||
+                !list_push(x->scratch, out, string)) {
+                return false;
+            }
+            i++;
+            placemarker = false;
+            continue;
+        }
+
+        if (is_punct(token, "##")) {
+            const PPToken *operand = &tokens[++i];
+            TokenList single = {0};
+            const TokenList *right = &single;
+            if (operand->kind == PP_PARAM) {
+                right = &args[operand->param];
+            } else if (!list_push(x->scratch, &single, *operand)) {
+                return false;
+            }
+            // GNU extension: ", ## __VA_ARGS__" drops the comma when
+            // there are no variable arguments instead of pasting
+            if (body->variadic && operand->kind == PP_PARAM && operand->param == body->param_count - 1 &&
+                !placemarker && out->count > 0 && is_punct(&out->items[out->count - 1], ",")) {
+                if (right->count == 0) {
+                    out->count--;
+                } else if (!list_append(x->scratch, out, right)) {
+                    return false;
+                }
+                continue;
+            }
+            if (right->count == 0) {
+                continue;
+            }
+            if (placemarker || out->count == 0) {
+                placemarker = false;
+                if (!list_append(x->scratch, out, right)) {
+                    return false;
+                }
+                continue;
+            }
+            if (!paste(x, &out->items[out->count - 1], &right->items[0])) {
+                return false;
+            }
+            for (int j = 1; j < right->count; j++) {
+                if (!list_push(x->scratch, out, right->items[j])) {
+                    return false;
+                }
+            }
+            continue;
+        }
+
+        if (token->kind == PP_PARAM) {
+            int param = token->param;
+            bool raw = next_is_paste || (i > 0 && is_punct(&tokens[i - 1], "##"));
+            const TokenList *arg = &args[param];
+            if (!raw) {
+                if (!done[param]) {
+                    if (!expand_argument(x, &args[param], &expanded[param])) {
+                        return false;
+                    }
+                    done[param] = true;
+                }
+                arg = &expanded[param];
+            }
+            placemarker = next_is_paste && arg->count == 0;
+            int start = out->count;
+            if (!list_append(x->scratch, out, arg)) {
+                return false;
+            }
+            if (out->count > start) {
+                out->items[start].space = token->space;
+            }
+            continue;
+        }
+
+        placemarker = false;
+        if (!list_push(x->scratch, out, *token)) {
+            return false;
+        }
+    }
+
+    for (int i = 0; i < out->count; i++) {
+        out->items[i].hide = hide_union(x->scratch, out->items[i].hide, hide);
+    }
+    if (out->count > 0) {
+        out->items[0].space = name->space;
+    }
+    return true;
+}
+
+typedef enum {
+    ARGS_OK,
+    ARGS_INCOMPLETE,    /* input ran out before the closing parenthesis */
+    ARGS_ERROR,
+} ArgsStatus;
+
+/* Read the arguments after the '(' of an invocation. consumed records
+ * every token taken, so an incomplete invocation can be put back. */
+static ArgsStatus collect_arguments(Expander *x, Input *in, const Macro *macro, TokenList **args,
+                                    int *arg_count, PPToken *rparen, TokenList *consumed) {
+    const MacroBody *body = macro->body;
+    int capacity = body->param_count > 0 ? body->param_count : 1;
+    TokenList *list = arena_calloc(x->scratch, sizeof(TokenList) * capacity);
+    if (!list) {
+        return ARGS_ERROR;
+    }
+    int count = 1;
+    int depth = 0;
+    PPToken token;
+    for (;;) {
+        if (!next_token(x, in, &token)) {
+            return ARGS_INCOMPLETE;
+        }
+        if (!list_push(x->scratch, consumed, token)) {
+            return ARGS_ERROR;
+        }
+        if (depth == 0 && is_punct(&token, ")")) {
+            break;
+        }
+        if (depth == 0 && is_punct(&token, ",") &&
+            !(body->variadic && count == body->param_count)) {
+            if (count == capacity) {
+                TokenList *grown = arena_calloc(x->scratch, sizeof(TokenList) * capacity * 2);
+                if (!grown) {
+                    return ARGS_ERROR;
+                }
+                memcpy(grown, list, sizeof(TokenList) * capacity);
+                list = grown;
+                capacity *= 2;
+            }
+            count++;
+            continue;
+        }
+        if (is_punct(&token, "(")) depth++;
+        if (is_punct(&token, ")")) depth--;
+        if (!list_push(x->scratch, &list[count - 1], token)) {
+            return ARGS_ERROR;
+        }
+    }
+
+    // f() passes one empty argument, which is none for f with no parameters
+    if (body->param_count == 0 && count == 1 && list[0].count == 0) {
+        count = 0;
+    }
+    if (body->variadic && count == body->param_count - 1) {
+        count++;    // the variadic part may be left out entirely
+    }
+    if (count != body->param_count) {
+        report(x, "Macro %s expects %d arguments, got %d", macro->name, body->param_count, count);
+        return ARGS_ERROR;
+    }
+    *args = list;
+    *arg_count = count;
+    *rparen = token;
+    return ARGS_OK;
+}
+
+static bool cache_key(Expander *x, const Macro *macro, const TokenList *args, int arg_count,
+                      char **key, size_t *key_length, uint32_t *hash) {
+    size_t len = 0;
+    for (int i = 0; i < arg_count; i++) {
+        for (int j = 0; j < args[i].count; j++) {
+            len += args[i].items[j].length + 1;
+        }
+        len++;
+    }
+    char *text = arena_alloc(x->scratch, len + 1);
+    if (!text) {
+        return false;
+    }
+    size_t n = 0;
+    for (int i = 0; i < arg_count; i++) {
+        for (int j = 0; j < args[i].count; j++) {
+            const PPToken *token = &args[i].items[j];
+            if (j > 0 && token->space) {
+                text[n++] = ' ';
+            }
+            memcpy(text + n, token->text, token->length);
+            n += token->length;
+        }
+        text[n++] = '\x1f';     // argument separator, never in a token
+    }
+    text[n] = '\0';
+    *key = text;
+    *key_length = n;
+    *hash = hash_bytes(text, n, hash_name(macro->name, macro->name_length));
+    return true;
+}
+
+static CacheEntry *cache_find(const MacroTable *t, const Macro *macro, const char *key,
+                              size_t key_length, uint32_t hash) {
+    for (CacheEntry *entry = t->cache[hash % EXPANSION_CACHE_BUCKETS]; entry; entry = entry->next) {
+        if (entry->hash == hash && entry->macro == macro && entry->epoch == t->epoch &&
+            entry->key_length == key_length && memcmp(entry->key, key, key_length) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static void cache_store(MacroTable *t, const Macro *macro, const char *key, size_t key_length,
+                        uint32_t hash, const char *text, size_t text_length) {
+    if (t->cache_count >= EXPANSION_CACHE_LIMIT) {
+        clear_cache(t);
+    }
+    CacheEntry *entry = malloc(sizeof(CacheEntry));
+    char *key_copy = malloc(key_length + 1);
+    char *text_copy = malloc(text_length + 1);
+    if (!entry || !key_copy || !text_copy) {
+        // The cache is only an optimization, so failing to fill it is fine
+        free(entry);
+        free(key_copy);
+        free(text_copy);
+        return;
+    }
+    memcpy(key_copy, key, key_length);
+    memcpy(text_copy, text, text_length);
+    entry->macro = macro;
+    entry->epoch = t->epoch;
+    entry->hash = hash;
+    entry->key = key_copy;
+    entry->key_length = key_length;
+    entry->text = text_copy;
+    entry->text_length = text_length;
+    entry->next = t->cache[hash % EXPANSION_CACHE_BUCKETS];
+    t->cache[hash % EXPANSION_CACHE_BUCKETS] = entry;
+    t->cache_count++;
+}
+
+static bool unhidden(const TokenList *tokens) {
+    for (int i = 0; i < tokens->count; i++) {
+        if (tokens->items[i].hide) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Expand an invocation read straight from the source, through the
+ * cache. Source tokens have no hide sets, so the expansion depends only
+ * on the macro definitions and the argument text. */
+static bool expand_cached(Expander *x, Input *in, const Macro *macro, TokenList *args,
+                          int arg_count, const PPToken *name, const HideSet *hide) {
+    Preprocessor *pp = x->pp;
+    char *key;
+    size_t key_length;
+    uint32_t hash;
+    if (!cache_key(x, macro, args, arg_count, &key, &key_length, &hash)) {
+        return false;
+    }
+
+    pp->expansion_lookups++;
+    CacheEntry *entry = cache_find(x->table, macro, key, key_length, hash);
+    if (entry) {
+        pp->expansion_hits++;
+        x->prev_end = NULL;
+        return write_text(x, entry->text, entry->text_length, name->space, false);
+    }
+
+    TokenList replacement = {0};
+    Input isolated = { {0}, false };
+    TokenList result = {0};
+    TokenList rest = {0};
+    if (!substitute(x, macro, args, name, hide, &replacement) ||
+        !push_input(x->scratch, &isolated, &replacement) || !expand(x, &isolated, &result, &rest)) {
+        return false;
+    }
+
+    if (rest.count > 0) {
+        // The expansion ends in an invocation that reads on into the
+        // following source, so it depends on context and is not cached
+        for (int i = 0; i < result.count; i++) {
+            if (!write_token(x, &result.items[i])) {
+                return false;
+            }
+        }
+        return push_input(x->scratch, in, &rest);
+    }
+
+    // The cached text starts at the first token, without a separator
+    if (result.count > 0) {
+        if (!write_separator(pp, result.items[0].text[0], result.items[0].space)) {
+            return false;
+        }
+        result.items[0].space = false;
+        x->prev_end = result.items[0].text;
+    }
+    size_t start = pp->output_size;
+    for (int i = 0; i < result.count; i++) {
+        if (!write_token(x, &result.items[i])) {
+            return false;
+        }
+    }
+    cache_store(x->table, macro, key, key_length, hash, pp->output + start,
+                pp->output_size - start);
+    x->prev_end = NULL;
+    return true;
+}
+
+/* Expand tokens from in into out (or the output when out is NULL). With
+ * rest, expansion stops at an invocation whose arguments run past the
+ * end of the input and leaves its tokens in rest; without, such an
+ * invocation is an error. */
+static bool expand(Expander *x, Input *in, TokenList *out, TokenList *rest) {
+    // Only an open invocation reads further source lines
+    while (in->tokens.count > 0) {
+        PPToken token = in->tokens.items[--in->tokens.count];
+        const Macro *macro = NULL;
+        if (token.kind == PP_IDENT) {
+            macro = lookup_macro(x->table, token.text, token.length);
+        }
+        if (!macro || hide_contains(token.hide, macro)) {
+            if (!emit(x, out, token)) {
+                return false;
+            }
+            continue;
+        }
+
+        if (!macro->body) {
+            // Plain text has nothing to rescan
+            TokenList value = {0};
+            const char *text = macro->name + macro->name_length + 1;
+            if (!tokenize(x->scratch, text, text + macro->value_length, &value)) {
+                return false;
+            }
+            for (int i = 0; i < value.count; i++) {
+                value.items[i].space = i == 0 ? token.space : value.items[i].space;
+                if (!emit(x, out, value.items[i])) {
+                    return false;
+                }
+            }
+            continue;
+        }
+
+        if (macro->body->param_count < 0) {
+            const HideSet *hide = hide_add(x->scratch, token.hide, macro);
+            if (!out && !token.hide) {
+                if (!expand_cached(x, in, macro, NULL, 0, &token, hide)) {
+                    return false;
+                }
+                continue;
+            }
+            TokenList replacement = {0};
+            if (!substitute(x, macro, NULL, &token, hide, &replacement) ||
+                !push_input(x->scratch, in, &replacement)) {
+                return false;
+            }
+            continue;
+        }
+
+        // A function-like macro name is only an invocation before '('
+        PPToken *next = peek_token(x, in);
+        if (!next && rest) {
+            return list_push(x->scratch, rest, token);
+        }
+        if (!next || !is_punct(next, "(")) {
+            if (!emit(x, out, token)) {
+                return false;
+            }
+            continue;
+        }
+
+        PPToken lparen;
+        if (!next_token(x, in, &lparen)) {
+            if (!emit(x, out, token)) {
+                return false;
+            }
+            continue;
+        }
+        TokenList consumed = {0};
+        TokenList *args = NULL;
+        int arg_count = 0;
+        PPToken rparen;
+        if (!list_push(x->scratch, &consumed, lparen)) {
+            return false;
+        }
+        ArgsStatus status = collect_arguments(x, in, macro, &args, &arg_count, &rparen, &consumed);
+        if (status == ARGS_ERROR) {
+            return false;
+        }
+        if (status == ARGS_INCOMPLETE) {
+            if (rest) {
+                return list_push(x->scratch, rest, token) &&
+                       list_append(x->scratch, rest, &consumed);
+            }
+            return report(x, "Unterminated argument list invoking macro %.*s",
+                          (int)token.length, token.text);
+        }
+
+        const HideSet *hide = hide_add(x->scratch, hide_intersect(x->scratch, token.hide, rparen.hide),
+                                       macro);
+        if (!out && !token.hide && unhidden(&consumed)) {
+            if (!expand_cached(x, in, macro, args, arg_count, &token, hide)) {
+                return false;
+            }
+            continue;
+        }
+        TokenList replacement = {0};
+        if (!substitute(x, macro, args, &token, hide, &replacement) ||
+            !push_input(x->scratch, in, &replacement)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* pp_reserve with the common case inline */
+static inline bool reserve(Preprocessor *pp, size_t extra) {
+    return pp->output_size + extra <= pp->output_capacity || pp_reserve(pp, extra);
+}
+
+/* Append a source line with macros expanded, plus its newline. Text up
+ * to the first macro name is copied as whole spans, and object-like
+ * macros that expand to plain text are copied straight in; anything
+ * else hands the rest of the line to the token expander. */
+bool macro_expand_line(Preprocessor *pp, const char *p, const char *end) {
+    MacroTable *table = &pp->context->macros;
+    if (!reserve(pp, (size_t)(end - p) + 1)) {
+        return false;
+    }
+    char *out = pp->output + pp->output_size;
+
+    while (p < end) {
+        // Copy up to the next identifier or number
+        const char *run = p;
+        while (p < end && !(char_class[(unsigned char)*p] & CHAR_IDENT)) {
+            p++;
+        }
+        const char *start = p;
+        p = skip_identifier(p, end);
+
+        // Numbers such as 1e5 or 0x1f contain letters but are never
+        // macro names, so they are copied whole
+        const Macro *macro = NULL;
+        if (p > start && !(char_class[(unsigned char)*start] & CHAR_DIGIT)) {
+            macro = lookup_macro(table, start, (size_t)(p - start));
+        }
+        if (!macro) {
+            memcpy(out, run, (size_t)(p - run));
+            out += p - run;
+            continue;
+        }
+
+        memcpy(out, run, (size_t)(start - run));
+        out += start - run;
+        pp->output_size = (size_t)(out - pp->output);
+        if (macro->body) {
+            Expander x = { pp, table, &table->scratch, start };
+            arena_clear(x.scratch);
+            Input in = { {0}, true };
+            TokenList tokens = {0};
+            return tokenize(x.scratch, start, end, &tokens) && push_input(x.scratch, &in, &tokens) &&
+                   expand(&x, &in, NULL, NULL) && pp_append(pp, "\n", 1);
+        }
+
+        // Room for the value, two separating spaces and the rest of the line
+        const char *value = macro->name + macro->name_length + 1;
+        size_t len = macro->value_length;
+        if (!reserve(pp, len + (size_t)(end - p) + 3)) {
+            return false;
+        }
+        out = pp->output + pp->output_size;
+        if (len > 0) {
+            if (out > pp->output && would_merge(out[-1], value[0])) {
+                *out++ = ' ';
+            }
+            memcpy(out, value, len);
+            out += len;
+            if (p < end && would_merge(value[len - 1], *p)) {
+                *out++ = ' ';
+            }
+        }
+    }
+    *out++ = '\n';
+    pp->output_size = (size_t)(out - pp->output);
+    return true;
+}
+
+/* Append the expression of an #if with defined() replaced by 0 or 1 and
+ * macros expanded */
+bool macro_expand_condition(Preprocessor *pp, const char *p, const char *end) {
+    MacroTable *table = &pp->context->macros;
+    Expander x = { pp, table, &table->scratch, NULL };
+    arena_clear(x.scratch);
+    TokenList raw = {0};
+    TokenList tokens = {0};
+    if (!tokenize(x.scratch, p, end, &raw)) {
+        return false;
+    }
+
+    static const char *const truth[] = { "0", "1" };
+    for (int i = 0; i < raw.count; i++) {
+        PPToken token = raw.items[i];
+        if (token.kind == PP_IDENT && token.length == 7 && memcmp(token.text, "defined", 7) == 0) {
+            bool paren = i + 1 < raw.count && is_punct(&raw.items[i + 1], "(");
+            int name = i + (paren ? 2 : 1);
+            if (name >= raw.count || raw.items[name].kind != PP_IDENT ||
+                (paren && (name + 1 >= raw.count || !is_punct(&raw.items[name + 1], ")")))) {
+                return report(&x, "Expected macro name after defined");
+            }
+            bool defined = macro_defined(table, raw.items[name].text, raw.items[name].length);
+            token.kind = PP_NUMBER;
+            token.text = truth[defined];
+            token.length = 1;
+            i = name + (paren ? 1 : 0);
+        }
+        if (!list_push(x.scratch, &tokens, token)) {
+            return false;
+        }
+    }
+
+    Input in = { {0}, false };
+    return push_input(x.scratch, &in, &tokens) && expand(&x, &in, NULL, NULL);
+}
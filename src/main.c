@@ -1,119 +1,902 @@
 #include "crappola.h"
+#include <errno.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
 
-static char *read_file(const char *filename) {
-    FILE *file = fopen(filename, "r");
-    if (!file) {
-        fprintf(stderr, "Error: Could not open file %s\n", filename);
-        return NULL;
+/* Loop backedges the tiered interpreter runs before going native */
+#define HOT_LOOP_THRESHOLD 10000
+
+/* What every translation unit is compiled with; -I, -D and -U are held
+ * by the context */
+typedef struct {
+    CompilerContext *context;
+    const char *include_pch;
+    const char *directory;  /* where -c objects go, or NULL for the cwd */
+    const ResultCache *cache;   /* for objects, or NULL */
+    bool freestanding;      /* emit _start in the unit that defines main */
+    bool stats;
+    bool in_process;        /* compile units here rather than in workers */
+    bool pipeline;          /* run the phases of a unit on their own threads */
+} UnitOptions;
+
+/* One input of a multi-file build, compiled in its own worker process */
+typedef struct {
+    const char *input;
+    char *object;
+    char *dep_file;         /* for -MD, or NULL */
+    char *dep_target;       /* the rule's target in dep_file */
+    FILE *log;              /* the worker's stdout and stderr */
+    pid_t pid;
+    int status;
+    bool done;
+} Unit;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Dependency file for -MD: the output name with its extension replaced */
+static char *dep_file_name(const char *output_file) {
+    size_t len = strlen(output_file);
+    const char *dot = strrchr(output_file, '.');
+    const char *slash = strrchr(output_file, '/');
+    if (dot && (!slash || dot > slash)) {
+        len = (size_t)(dot - output_file);
+    }
+    char *name = malloc(len + 3);
+    if (name) {
+        memcpy(name, output_file, len);
+        memcpy(name + len, ".d", 3);
     }
+    return name;
+}
 
-    fseek(file, 0, SEEK_END);
-    long size = ftell(file);
-    fseek(file, 0, SEEK_SET);
+static void print_arena(const char *name, const Arena *arena) {
+    fprintf(out_stream(), "  Arena (%s): peak %zu bytes allocated, %zu bytes reserved in %d chunks\n",
+           name, arena->peak, arena->peak_reserved, arena->chunk_count);
+}
 
-    char *content = malloc(size + 1);
-    if (!content) {
-        fclose(file);
-        return NULL;
+static void print_stats(bool stats, const Ast *ast, const Preprocessor *pp,
+                        uint64_t assembly_bytes, double elapsed) {
+    if (!stats) {
+        return;
     }
+    double megabytes = pp->bytes_read / (1024.0 * 1024.0);
+    fprintf(out_stream(), "  Front end: %.1f MB in %.3f s, %.1f MB/s (%s scanner)\n", megabytes, elapsed,
+           elapsed > 0 ? megabytes / elapsed : 0.0, scan_backend_name());
+    fprintf(out_stream(), "  Includes: %d, %d skipped by include guard or #pragma once\n",
+           pp->includes, pp->includes_skipped);
+    fprintf(out_stream(), "  Macro expansion cache: %ld lookups, %ld hits (%.1f%%)\n", pp->expansion_lookups,
+           pp->expansion_hits,
+           pp->expansion_lookups ? 100.0 * pp->expansion_hits / pp->expansion_lookups : 0.0);
+    fprintf(out_stream(), "  AST: peak %u nodes, %zu bytes\n", ast->peak ? ast->peak - 1 : 0,
+           ast_peak_bytes(ast));
+    print_arena("identifiers", &pp->context->symbols.strings);
+    print_arena("macro expansion", &pp->context->macros.scratch);
+    if (assembly_bytes) {
+        fprintf(out_stream(), "  Assembly: %.1f MB written\n", assembly_bytes / (1024.0 * 1024.0));
+    }
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        fprintf(out_stream(), "  Peak RSS: %ld KB\n", usage.ru_maxrss);
+    }
+}
 
-    fread(content, 1, size, file);
-    content[size] = '\0';
-    fclose(file);
+static bool open_unit(Preprocessor *pp, const char *input_file, const UnitOptions *options) {
+    if (!pp_init(pp, options->context, input_file)) {
+        pp_finish(pp);
+        return false;
+    }
+    return true;
+}
 
-    return content;
+/* Lex, parse and generate code for the unit pp reads to out */
+static bool generate_unit(Preprocessor *pp, Ast *ast, const UnitOptions *options,
+                          AsmWriter *out) {
+    if (!options->pipeline) {
+        return compile_stream(pp, ast, options->freestanding, out);
+    }
+    PipelineStats pipeline;
+    bool ok = compile_pipelined(pp, ast, options->freestanding, &pipeline, out);
+    if (options->stats) {
+        pipeline_print_stats(&pipeline, out_stream());
+    }
+    return ok;
 }
 
-static int write_file(const char *filename, const char *content) {
-    FILE *file = fopen(filename, "w");
-    if (!file) {
-        fprintf(stderr, "Error: Could not write to file %s\n", filename);
-        return -1;
+/* A unit to compile from its file, for assemble_generated */
+typedef struct {
+    const char *input_file;
+    const UnitOptions *options;
+    const char *dep_file;
+    const char *dep_target;
+} UnitSource;
+
+/* Compile one unit to out, writing its dependencies to dep_file if one
+ * is given. Returns false after reporting an error. */
+static bool compile_unit(void *arg, AsmWriter *out) {
+    const UnitSource *unit = arg;
+    const UnitOptions *options = unit->options;
+    Preprocessor pp;
+    if (!open_unit(&pp, unit->input_file, options)) {
+        return false;
+    }
+    Ast ast;
+    ast_init(&ast);
+    double front_start = now_seconds();
+    if (options->include_pch && !pch_load(&pp, options->include_pch)) {
+        pp_finish(&pp);
+        ast_release(&ast);
+        return false;
+    }
+
+    fprintf(out_stream(), "  [1/5] Preprocessing...\n");
+    fprintf(out_stream(), "  [2/5] Lexical analysis...\n");
+    fprintf(out_stream(), "  [3/5] Parsing...\n");
+    fprintf(out_stream(), "  [4/5] Code generation...\n");
+    bool ok = generate_unit(&pp, &ast, options, out);
+    print_stats(options->stats, &ast, &pp, out->total, now_seconds() - front_start);
+    if (ok && unit->dep_file &&
+        !include_write_deps(&options->context->files, unit->dep_file, unit->dep_target)) {
+        ok = false;
     }
+    pp_finish(&pp);
+    ast_release(&ast);
+    return ok;
+}
+
+/* A unit already preprocessed into pp, for assemble_generated */
+typedef struct {
+    Preprocessor *pp;
+    Ast *ast;
+    const UnitOptions *options;
+    uint64_t written;       /* bytes of assembly */
+} PreprocessedUnit;
 
-    fprintf(file, "%s", content);
-    fclose(file);
-    return 0;
+static bool generate_preprocessed(void *arg, AsmWriter *out) {
+    PreprocessedUnit *unit = arg;
+    bool ok = generate_unit(unit->pp, unit->ast, unit->options, out);
+    unit->written = out->total;
+    return ok;
 }
 
-int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s <source.c> [-o output]\n", argv[0]);
+/* Compile one unit into an object file. With a result cache the unit is
+ * preprocessed up front, and an object cached for the same output is
+ * reused without lexing, parsing, generating or assembling anything.
+ * A unit that fails leaves no dependency file behind. */
+static int build_object(const char *input_file, const UnitOptions *options,
+                        const char *dep_file, const char *dep_target, const char *object) {
+    if (!options->cache) {
+        // The assembly goes to the assembler as it is generated
+        UnitSource unit = { input_file, options, dep_file, dep_target };
+        int status = assemble_generated(compile_unit, &unit, object);
+        if (status != 0 && dep_file) {
+            remove(dep_file);
+        }
+        return status;
+    }
+
+    Preprocessor pp;
+    if (!open_unit(&pp, input_file, options)) {
+        return 1;
+    }
+    Ast ast;
+    ast_init(&ast);
+    double front_start = now_seconds();
+    char *lines = NULL;
+    size_t size = 0;
+    fprintf(out_stream(), "  [1/5] Preprocessing...\n");
+    if ((options->include_pch && !pch_load(&pp, options->include_pch)) ||
+        !(lines = pp_buffer_lines(&pp, &size))) {
+        pp_finish(&pp);
+        ast_release(&ast);
         return 1;
     }
 
-    const char *input_file = argv[1];
-    const char *output_file = "a.out";
+    ResultKey key;
+    result_cache_key(&key, lines, size, options->freestanding);
+    bool hit = result_cache_fetch(options->cache, &key, object);
+    // Preprocessing is complete, so the dependencies are all known
+    int status = !dep_file || include_write_deps(&options->context->files, dep_file, dep_target)
+                 ? 0 : 1;
+    PreprocessedUnit unit = { &pp, &ast, options, 0 };
+    if (hit) {
+        fprintf(out_stream(), "  Result cache hit: %s\n", key.hex);
+    } else if (status == 0) {
+        fprintf(out_stream(), "  [2/5] Lexical analysis...\n");
+        fprintf(out_stream(), "  [3/5] Parsing...\n");
+        fprintf(out_stream(), "  [4/5] Code generation...\n");
+        status = assemble_generated(generate_preprocessed, &unit, object);
+        if (status == 0) {
+            result_cache_store(options->cache, &key, object);
+        }
+    }
+    print_stats(options->stats, &ast, &pp, unit.written, now_seconds() - front_start);
+    pp_finish(&pp);
+    ast_release(&ast);
+    free(lines);
+    if (status != 0 && dep_file) {
+        remove(dep_file);
+    }
+    return status;
+}
+
+/* Object file for an input: <name>.o in the current directory, like
+ * cc -c, or in directory if one is given */
+static char *object_name(const char *directory, const char *input_file) {
+    const char *slash = strrchr(input_file, '/');
+    const char *base = slash ? slash + 1 : input_file;
+    size_t len = strlen(base);
+    const char *dot = strrchr(base, '.');
+    if (dot && dot != base) {
+        len = (size_t)(dot - base);
+    }
+    size_t dir_len = directory ? strlen(directory) + 1 : 0;
+    char *name = malloc(dir_len + len + 3);
+    if (name) {
+        if (directory) {
+            memcpy(name, directory, dir_len - 1);
+            name[dir_len - 1] = '/';
+        }
+        memcpy(name + dir_len, base, len);
+        memcpy(name + dir_len + len, ".o", 3);
+    }
+    return name;
+}
+
+/* A uniquely named object file for a unit that is linked right away */
+static char *temp_object_name(void) {
+    char *name = strdup("/tmp/crappola_XXXXXX.o");
+    if (!name) {
+        return NULL;
+    }
+    int fd = mkstemps(name, 2);
+    if (fd < 0) {
+        fprintf(err_stream(), "Error: Could not create a temporary object file\n");
+        free(name);
+        return NULL;
+    }
+    close(fd);
+    return name;
+}
+
+/* Worker process: compile one unit into its object file. Everything it
+ * prints goes to the unit's log so the parent can replay it in order. */
+static void run_unit(const Unit *unit, const UnitOptions *options) {
+    int fd = fileno(unit->log);
+    if (dup2(fd, STDOUT_FILENO) < 0 || dup2(fd, STDERR_FILENO) < 0) {
+        _exit(1);
+    }
+    setvbuf(stdout, NULL, _IONBF, 0);
+
+    fprintf(out_stream(), "Compiling: %s\n", unit->input);
+    _exit(build_object(unit->input, options, unit->dep_file, unit->dep_target, unit->object));
+}
+
+static bool start_unit(Unit *unit, const UnitOptions *options) {
+    unit->log = tmpfile();
+    if (!unit->log) {
+        fprintf(err_stream(), "Error: Could not create a log for %s\n", unit->input);
+        return false;
+    }
+    // Anything still buffered would otherwise be printed by the child too
+    fflush(NULL);
+    unit->pid = fork();
+    if (unit->pid < 0) {
+        fprintf(err_stream(), "Error: Could not start a worker for %s\n", unit->input);
+        return false;
+    }
+    if (unit->pid == 0) {
+        run_unit(unit, options);
+    }
+    return true;
+}
+
+static void print_log(Unit *unit) {
+    char buffer[4096];
+    size_t n;
+    fflush(out_stream());
+    rewind(unit->log);
+    while ((n = fread(buffer, 1, sizeof(buffer), unit->log)) > 0) {
+        fwrite(buffer, 1, n, stdout);
+    }
+    fclose(unit->log);
+    unit->log = NULL;
+}
+
+/* Compile the units in worker processes, at most `jobs` at a time.
+ * Units are independent, so each idle slot simply takes the next unit
+ * from the list; output is replayed in command-line order whatever order
+ * the units finish in. Returns false if any unit failed. */
+static bool run_workers(Unit *units, int count, int jobs, const UnitOptions *options) {
+    int next = 0;
+    int running = 0;
+    int printed = 0;
+    bool failed = false;
+    while (!failed && printed < count) {
+        while (running < jobs && next < count) {
+            if (!start_unit(&units[next], options)) {
+                failed = true;
+                break;
+            }
+            next++;
+            running++;
+        }
+        if (running == 0) {
+            break;
+        }
+
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(err_stream(), "Error: Failed to wait for workers\n");
+            failed = true;
+            break;
+        }
+        for (int i = 0; i < next; i++) {
+            if (units[i].pid == pid && !units[i].done) {
+                units[i].done = true;
+                units[i].status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+                running--;
+                break;
+            }
+        }
+        while (printed < next && units[printed].done) {
+            print_log(&units[printed]);
+            if (units[printed].status != 0) {
+                failed = true;
+            }
+            printed++;
+        }
+    }
 
-    // Parse output file option
-    for (int i = 2; i < argc - 1; i++) {
-        if (strcmp(argv[i], "-o") == 0) {
-            output_file = argv[i + 1];
+    // After a failure, let the workers still running finish and show
+    // their output too, so the report does not depend on timing
+    while (running > 0) {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0 && errno != EINTR) {
             break;
         }
+        for (int i = 0; i < next; i++) {
+            if (units[i].pid == pid && !units[i].done) {
+                units[i].done = true;
+                running--;
+            }
+        }
+    }
+    for (; printed < next; printed++) {
+        print_log(&units[printed]);
+    }
+    return !failed;
+}
+
+/* Compile the units one after another in this process, stopping at the
+ * first that fails */
+static bool run_in_process(Unit *units, int count, const UnitOptions *options) {
+    for (int i = 0; i < count; i++) {
+        fprintf(out_stream(), "Compiling: %s\n", units[i].input);
+        if (build_object(units[i].input, options, units[i].dep_file, units[i].dep_target,
+                         units[i].object) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Compile every input into its own object file, then link them all into
+ * output_file at once unless compile_only, where output_file names the
+ * object of a single input instead. */
+static int compile_units(const char *const *inputs, int count, int jobs,
+                         const UnitOptions *options, bool write_deps, const char *dep_file,
+                         bool compile_only, const char *output_file) {
+    Unit *units = calloc((size_t)count, sizeof(Unit));
+    if (!units) {
+        return 1;
+    }
+    double start = now_seconds();
+    bool failed = false;
+    for (int i = 0; i < count && !failed; i++) {
+        units[i].input = inputs[i];
+        if (compile_only && output_file) {
+            units[i].object = strdup(output_file);
+        } else if (compile_only) {
+            units[i].object = object_name(options->directory, inputs[i]);
+        } else {
+            units[i].object = temp_object_name();
+        }
+        failed = !units[i].object;
+        if (!failed && write_deps) {
+            // A linked unit's object is temporary, so, as with cc, its
+            // rule is named after the source: <name>.o in <name>.d
+            units[i].dep_target = compile_only ? strdup(units[i].object)
+                                               : object_name(options->directory, inputs[i]);
+            failed = !units[i].dep_target;
+        }
+        if (!failed && write_deps) {
+            units[i].dep_file = dep_file ? strdup(dep_file) : dep_file_name(units[i].dep_target);
+            failed = !units[i].dep_file;
+        }
+    }
+
+    // A single job gains nothing from a worker process
+    if (!failed) {
+        bool in_process = options->in_process || jobs == 1;
+        failed = !(in_process ? run_in_process(units, count, options)
+                              : run_workers(units, count, jobs, options));
+    }
+
+    int result = failed ? 1 : 0;
+    if (!failed && options->stats) {
+        fprintf(out_stream(), "  Units: %d compiled with %d jobs in %.3f s\n", count,
+                options->in_process ? 1 : jobs, now_seconds() - start);
+    }
+    if (!failed && !compile_only) {
+        fprintf(out_stream(), "Linking: %d objects\n", count);
+        fflush(out_stream());
+        const char **objects = malloc(sizeof(char *) * (size_t)count);
+        result = 1;
+        if (objects) {
+            for (int i = 0; i < count; i++) {
+                objects[i] = units[i].object;
+            }
+            result = link_objects(objects, count, output_file, options->freestanding);
+            free(objects);
+        }
+        if (result == 0) {
+            fprintf(out_stream(), "Success! Output: %s\n", output_file);
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (!compile_only && units[i].object) {
+            remove(units[i].object);
+        }
+        free(units[i].object);
+        free(units[i].dep_file);
+        free(units[i].dep_target);
+    }
+    free(units);
+    return result;
+}
+
+/* A path from the command line, taken relative to directory if one is
+ * given. Returns NULL if it cannot be allocated. */
+static const char *resolve_path(Arena *arena, const char *directory, const char *path) {
+    if (!directory || path[0] == '/') {
+        return path;
+    }
+    size_t dir_len = strlen(directory);
+    size_t len = strlen(path);
+    char *resolved = arena_alloc(arena, dir_len + len + 2);
+    if (resolved) {
+        memcpy(resolved, directory, dir_len);
+        resolved[dir_len] = '/';
+        memcpy(resolved + dir_len + 1, path, len + 1);
     }
+    return resolved;
+}
 
-    printf("Crappola C Compiler v0.1\n");
-    printf("Compiling: %s\n", input_file);
+static int run_driver(CompilerContext *context, int argc, char *argv[], const char *directory,
+                      Arena *paths) {
+    const char *output_file = "a.out";
+    bool static_link = false;
+    bool freestanding = false;
+    bool run = false;
+    bool interp = false;
+    bool tiered = false;
+    bool stats = false;
+    bool pipeline = false;
+    long codegen_threads = 1;
+    long max_nesting = DEFAULT_MAX_NESTING;
+    const char *dep_file = NULL;
+    bool write_deps = false;
+    bool output_given = false;
+    bool emit_pch = false;
+    bool compile_only = false;
+    const char *include_pch = NULL;
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *cache_dir = getenv("CRAPPOLA_CACHE_DIR");
+    bool use_cache = cache_dir != NULL;
+    bool cache_stats = false;
+    long cache_size = 256;      /* MB */
 
-    // Step 1: Read source file
-    char *source = read_file(input_file);
-    if (!source) {
+    // -I, -D and -U go into the context; macros apply in command-line order
+    const char **inputs = arena_alloc(paths, sizeof(char *) * (size_t)argc);
+    int input_count = 0;
+    if (!inputs) {
         return 1;
     }
 
-    // Step 2: Preprocess
-    printf("  [1/5] Preprocessing...\n");
-    char *preprocessed = preprocess(source);
-    free(source);
-    if (!preprocessed) {
+    // Parse command line options
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output_file = argv[++i];
+            output_given = true;
+        } else if (strcmp(argv[i], "-c") == 0) {
+            compile_only = true;
+        } else if (strncmp(argv[i], "-j", 2) == 0 && (argv[i][2] || i + 1 < argc)) {
+            const char *count = argv[i][2] ? argv[i] + 2 : argv[++i];
+            char *end;
+            jobs = strtol(count, &end, 10);
+            if (*end || jobs < 1) {
+                fprintf(err_stream(), "Error: Invalid job count: %s\n", count);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-static") == 0) {
+            static_link = true;
+        } else if (strcmp(argv[i], "-nostdlib") == 0) {
+            freestanding = true;
+        } else if (strcmp(argv[i], "--run") == 0) {
+            run = true;
+        } else if (strcmp(argv[i], "--interp") == 0) {
+            interp = true;
+        } else if (strcmp(argv[i], "--tiered") == 0) {
+            tiered = true;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            stats = true;
+        } else if (strcmp(argv[i], "--pipeline") == 0) {
+            pipeline = true;
+        } else if (strcmp(argv[i], "--codegen-threads") == 0 && i + 1 < argc) {
+            char *end;
+            codegen_threads = strtol(argv[++i], &end, 10);
+            if (*end || codegen_threads < 1 || codegen_threads > 1024) {
+                fprintf(err_stream(), "Error: Invalid thread count: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--max-nesting") == 0 && i + 1 < argc) {
+            char *end;
+            max_nesting = strtol(argv[++i], &end, 10);
+            if (*end || max_nesting < 1 || max_nesting > 100000000) {
+                fprintf(err_stream(), "Error: Invalid nesting limit: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--emit-pch") == 0) {
+            emit_pch = true;
+        } else if (strcmp(argv[i], "--include-pch") == 0 && i + 1 < argc) {
+            include_pch = argv[++i];
+        } else if (strcmp(argv[i], "--cache") == 0) {
+            use_cache = true;
+        } else if (strcmp(argv[i], "--cache-dir") == 0 && i + 1 < argc) {
+            use_cache = true;
+            cache_dir = argv[++i];
+        } else if (strcmp(argv[i], "--cache-size") == 0 && i + 1 < argc) {
+            char *end;
+            cache_size = strtol(argv[++i], &end, 10);
+            if (*end || cache_size < 1) {
+                fprintf(err_stream(), "Error: Invalid cache size: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--cache-stats") == 0) {
+            cache_stats = true;
+        } else if (strcmp(argv[i], "-MD") == 0) {
+            write_deps = true;
+        } else if (strcmp(argv[i], "-MF") == 0 && i + 1 < argc) {
+            write_deps = true;
+            dep_file = argv[++i];
+        } else if (strncmp(argv[i], "-I", 2) == 0 && (argv[i][2] || i + 1 < argc)) {
+            const char *dir = resolve_path(paths, directory, argv[i][2] ? argv[i] + 2 : argv[++i]);
+            if (!dir || !crappola_add_include_path(context, dir)) {
+                return 1;
+            }
+        } else if ((strncmp(argv[i], "-D", 2) == 0 || strncmp(argv[i], "-U", 2) == 0) &&
+                   (argv[i][2] || i + 1 < argc)) {
+            bool undefine = argv[i][1] == 'U';
+            const char *text = argv[i][2] ? argv[i] + 2 : argv[++i];
+            if (!(undefine ? crappola_undefine(context, text) : crappola_define(context, text))) {
+                return 1;
+            }
+        } else {
+            inputs[input_count++] = argv[i];
+        }
+    }
+
+    // Without a directory the cache lives in the user's cache directory
+    ResultCache cache = { cache_dir, (uint64_t)cache_size * 1024 * 1024 };
+    if ((use_cache || cache_stats) && !cache_dir) {
+        const char *base = getenv("XDG_CACHE_HOME");
+        const char *home = getenv("HOME");
+        char *dir = NULL;
+        if (base || home) {
+            size_t len = strlen(base ? base : home) + 20;
+            if ((dir = arena_alloc(paths, len))) {
+                snprintf(dir, len, "%s%s/crappola", base ? base : home, base ? "" : "/.cache");
+            }
+        }
+        if (!dir) {
+            fprintf(err_stream(), "Error: No cache directory; use --cache-dir\n");
+            return 1;
+        }
+        cache.directory = dir;
+    } else if (cache_dir && !(cache.directory = resolve_path(paths, directory, cache_dir))) {
         return 1;
     }
+    if (cache_stats) {
+        return result_cache_print_stats(&cache, out_stream()) ? 0 : 1;
+    }
 
-    // Step 3: Tokenize (Lexer)
-    printf("  [2/5] Lexical analysis...\n");
-    int token_count = 0;
-    Token *tokens = tokenize(preprocessed, &token_count);
-    free(preprocessed);
-    if (!tokens) {
+    if (input_count == 0) {
+        fprintf(err_stream(), "Usage: %s <source.c>... [-o output] [-c] [-jN] [-I dir] [-D name[=value]] [-U name] [-MD [-MF file]] [--emit-pch | --include-pch file] [-static -nostdlib] [--run | --interp | --tiered] [--cache | --cache-dir dir] [--cache-size MB] [--pipeline] [--codegen-threads N] [--max-nesting N] [--stats]\n", argv[0]);
+        fprintf(err_stream(), "       %s --cache-stats [--cache-dir dir]\n", argv[0]);
+        fprintf(err_stream(), "       %s --server [--socket path] [-jN]\n", argv[0]);
+        fprintf(err_stream(), "       %s --client [--socket path] <arguments>...\n", argv[0]);
+        fprintf(err_stream(), "       %s --server-stats [--socket path]\n", argv[0]);
         return 1;
     }
 
-    // Step 4: Parse (Parser)
-    printf("  [3/5] Parsing...\n");
-    ASTNode *ast = parse(tokens, token_count);
-    free_tokens(tokens, token_count);
-    if (!ast) {
+    // Without libc there is nothing left to link dynamically, so -nostdlib
+    // always produces a static executable. Static libc is not supported.
+    if (static_link && !freestanding) {
+        fprintf(err_stream(), "Error: -static requires -nostdlib\n");
         return 1;
     }
 
-    // Step 5: Generate assembly code
-    printf("  [4/5] Code generation...\n");
-    char *assembly = generate_code(ast);
-    free_ast(ast);
-    if (!assembly) {
+    // A server must not run the programs it compiles
+    if (directory && (run || interp || tiered)) {
+        fprintf(err_stream(), "Error: --run, --interp and --tiered are not available from the server\n");
         return 1;
     }
 
-    // Write assembly to temporary file
-    char asm_file[256];
-    snprintf(asm_file, sizeof(asm_file), "/tmp/crappola_%d.s", getpid());
-    if (write_file(asm_file, assembly) != 0) {
-        free(assembly);
+    // Paths the server was given are made absolute, as its threads share
+    // one working directory
+    if (directory) {
+        bool resolved = (output_file = resolve_path(paths, directory, output_file)) &&
+                        (!dep_file || (dep_file = resolve_path(paths, directory, dep_file))) &&
+                        (!include_pch ||
+                         (include_pch = resolve_path(paths, directory, include_pch)));
+        for (int i = 0; i < input_count && resolved; i++) {
+            resolved = (inputs[i] = resolve_path(paths, directory, inputs[i])) != NULL;
+        }
+        if (!resolved) {
+            return 1;
+        }
+    }
+
+    // A server's context is reused, so this is set for every request
+    context->codegen_threads = (int)codegen_threads;
+    context->max_nesting = (int)max_nesting;
+
+    UnitOptions options = {
+        context, include_pch, directory, use_cache ? &cache : NULL, freestanding && !run, stats,
+        directory != NULL, pipeline
+    };
+
+    fprintf(out_stream(), "Crappola C Compiler v%s\n", CRAPPOLA_VERSION);
+
+    // Several inputs, or -c: every unit gets its own object file and
+    // they are compiled in parallel worker processes
+    if (input_count > 1 || compile_only) {
+        if (run || interp || tiered || emit_pch) {
+            fprintf(err_stream(), "Error: --run, --interp, --tiered and --emit-pch take a single input\n");
+            return 1;
+        } else if (compile_only && output_given && input_count > 1) {
+            fprintf(err_stream(), "Error: -o cannot name the object file of more than one input\n");
+            return 1;
+        } else if (dep_file && input_count > 1) {
+            fprintf(err_stream(), "Error: -MF cannot name the dependency file of more than one input\n");
+            return 1;
+        }
+        return compile_units(inputs, input_count, jobs < 1 ? 1 : (int)jobs, &options, write_deps,
+                             dep_file, compile_only,
+                             !compile_only || output_given ? output_file : NULL);
+    }
+
+    const char *input_file = inputs[0];
+    fprintf(out_stream(), "Compiling: %s\n", input_file);
+
+    if (write_deps && !dep_file) {
+        char *name = dep_file_name(output_file);
+        dep_file = name ? arena_strndup(paths, name, strlen(name)) : NULL;
+        free(name);
+        if (!dep_file) {
+            return 1;
+        }
+    }
+
+    // The header given as input is preprocessed and saved, not compiled;
+    // without -o the PCH goes next to it as <header>.pch
+    if (emit_pch) {
+        Preprocessor pp;
+        if (!open_unit(&pp, input_file, &options)) {
+            return 1;
+        }
+        char *pch_file = NULL;
+        if (!output_given && (pch_file = malloc(strlen(input_file) + 5))) {
+            strcpy(pch_file, input_file);
+            strcat(pch_file, ".pch");
+        }
+        const char *pch_output = output_given ? output_file : pch_file;
+        bool ok = pch_output && pch_write(&pp, pch_output);
+        if (ok) {
+            fprintf(out_stream(), "Precompiled header: %s\n", pch_output);
+        }
+        pp_finish(&pp);
+        free(pch_file);
+        return ok ? 0 : 1;
+    }
+
+    char *assembly = NULL;
+
+    // Interpreted modes: compile to bytecode and execute it directly.
+    // The bytecode compiler needs the whole function, so the AST is built.
+    if (interp || tiered) {
+        Preprocessor pp;
+        if (!open_unit(&pp, input_file, &options)) {
+            return 1;
+        }
+        Lexer lexer;
+        lexer_init(&lexer, &pp);
+
+        Ast ast;
+        ast_init(&ast);
+        double front_start = now_seconds();
+        if (include_pch && !pch_load(&pp, include_pch)) {
+            pp_finish(&pp);
+            ast_release(&ast);
+            return 1;
+        }
+
+        fprintf(out_stream(), "  [1/5] Preprocessing...\n");
+        fprintf(out_stream(), "  [2/5] Lexical analysis...\n");
+        fprintf(out_stream(), "  [3/5] Parsing...\n");
+        NodeIndex function = parse(&lexer, &ast, context->max_nesting);
+        print_stats(stats, &ast, &pp, 0, now_seconds() - front_start);
+        if (function && dep_file && !include_write_deps(&context->files, dep_file, output_file)) {
+            function = 0;
+        }
+        pp_finish(&pp);
+        if (!function) {
+            ast_release(&ast);
+            return 1;
+        }
+
+        fprintf(out_stream(), "  [4/5] Bytecode compilation...\n");
+        BytecodeFunction *bytecode = compile_bytecode(&context->symbols, &ast, function);
+        if (!bytecode) {
+            ast_release(&ast);
+            return 1;
+        }
+
+        fprintf(out_stream(), "  [5/5] Interpreting...\n");
+        fflush(out_stream());
+        int result = 0;
+        InterpStatus status = interpret(bytecode, tiered ? HOT_LOOP_THRESHOLD : 0, &result);
+        free_bytecode(bytecode);
+        if (status != INTERP_HOT) {
+            ast_release(&ast);
+            return status == INTERP_DONE ? result : 1;
+        }
+
+        // The function is hot: restart it natively. Functions take no
+        // arguments and have no side effects, so re-running from the top
+        // gives the same result as continuing in the interpreter.
+        fprintf(out_stream(), "  Hot loop in %s, switching to native code...\n",
+                symbol_name(&context->symbols, ast.values[function]));
+        run = true;
+        fprintf(out_stream(), "  [4/5] Code generation...\n");
+        AsmWriter out;
+        writer_init_memory(&out);
+        bool ok = generate_code(&context->symbols, &ast, function, 0, false, &out);
+        assembly = writer_take(&out);
+        if (!ok) {
+            free(assembly);
+            assembly = NULL;
+        }
+        ast_release(&ast);
+    } else if (run) {
+        // The JIT reads the whole unit, so it is kept in memory
+        UnitSource unit = { input_file, &options, dep_file, output_file };
+        AsmWriter out;
+        writer_init_memory(&out);
+        bool ok = compile_unit(&unit, &out);
+        assembly = writer_take(&out);
+        if (!ok) {
+            free(assembly);
+            assembly = NULL;
+        }
+    } else {
+        // Assembled to a temporary object, through the result cache if
+        // there is one, and linked
+        char *object = temp_object_name();
+        if (!object) {
+            return 1;
+        }
+        int status = build_object(input_file, &options, dep_file, output_file, object);
+        if (status == 0) {
+            fprintf(out_stream(), "  [5/5] Linking...\n");
+            const char *objects[] = { object };
+            status = link_objects(objects, 1, output_file, freestanding);
+        }
+        remove(object);
+        free(object);
+        if (status == 0) {
+            fprintf(out_stream(), "Success! Output: %s\n", output_file);
+        }
+        return status;
+    }
+
+    if (!assembly) {
         return 1;
     }
-    free(assembly);
 
-    // Step 6: Link
-    printf("  [5/5] Linking...\n");
-    if (link_program(asm_file, output_file) != 0) {
-        remove(asm_file);
+    // Step 6: Run in memory
+    fprintf(out_stream(), "  [5/5] Running...\n");
+    fflush(out_stream());
+    int result = 0;
+    int status = jit_run(assembly, &result);
+    free(assembly);
+    if (status != 0) {
         return 1;
     }
+    return result;
+}
+
+/* Run one compiler command line. Everything it allocates is released
+ * before returning, apart from what stays cached in the context. */
+int driver_run(CompilerContext *context, int argc, char *argv[], const char *directory) {
+    Arena paths;
+    arena_init(&paths);
+    int status = run_driver(context, argc, argv, directory, &paths);
+    arena_release(&paths);
+    return status;
+}
+
+/* The socket given by --socket, removing the option from argv */
+static const char *take_socket(int *argc, char *argv[]) {
+    const char *path = NULL;
+    int kept = 1;
+    for (int i = 1; i < *argc; i++) {
+        if (strcmp(argv[i], "--socket") == 0 && i + 1 < *argc) {
+            path = argv[++i];
+        } else {
+            argv[kept++] = argv[i];
+        }
+    }
+    *argc = kept;
+    argv[kept] = NULL;
+    if (path) {
+        return path;
+    }
+    return getenv("CRAPPOLA_SOCKET");
+}
 
-    remove(asm_file);
-    printf("Success! Output: %s\n", output_file);
+int main(int argc, char *argv[]) {
+    // Server and client modes; the client hands everything else to the
+    // server, which compiles as if it had been given this command line
+    if (argc > 1 && (strcmp(argv[1], "--server") == 0 || strcmp(argv[1], "--client") == 0 ||
+                     strcmp(argv[1], "--server-stats") == 0)) {
+        const char *mode = argv[1];
+        const char *socket_path = take_socket(&argc, argv);
+        if (strcmp(mode, "--client") == 0) {
+            return client_run(socket_path, argc - 2, argv + 2);
+        }
+        if (strcmp(mode, "--server-stats") == 0) {
+            return client_run(socket_path, argc - 1, argv + 1);
+        }
+        long threads = sysconf(_SC_NPROCESSORS_ONLN);
+        for (int i = 2; i < argc; i++) {
+            char *end;
+            if (strncmp(argv[i], "-j", 2) != 0 || (threads = strtol(argv[i] + 2, &end, 10)) < 1 ||
+                *end) {
+                fprintf(stderr, "Error: Invalid server option: %s\n", argv[i]);
+                return 1;
+            }
+        }
+        return server_run(socket_path, threads < 1 ? 1 : (int)threads);
+    }
 
-    return 0;
+    CompilerContext *context = crappola_create();
+    if (!context) {
+        return 1;
+    }
+    int status = driver_run(context, argc, argv, NULL);
+    crappola_destroy(context);
+    return status;
 }
@@ -0,0 +1,271 @@
+#include "crappola.h"
+#include <pthread.h>
+
+/* Parallel code generation. The calling thread parses one function at a
+ * time, each into an AST of its own, and queues it; a pool of threads
+ * generates the queued functions into separate memory writers. Labels are
+ * numbered per function, so a function's code does not depend on what
+ * was generated before it, and joining the buffers in source order gives
+ * exactly the output of compile_functions on one thread.
+ *
+ * Generated functions are appended to the result as soon as every
+ * function before them is. At most WINDOW_SIZE functions are held between
+ * the parser and the result, whether queued, being generated or finished
+ * and waiting for an earlier one; when the window is full the parser
+ * waits for its oldest function, so neither ASTs nor generated text pile
+ * up behind one slow function.
+ *
+ * Diagnostics are held with the function they concern, from its parsing
+ * and its generation, and printed as it is appended. Like one thread,
+ * the pool reports the first function that fails and nothing after it,
+ * whichever thread gets there first. */
+
+#define WINDOW_SIZE 64
+
+typedef struct {
+    int index;                      /* in the unit */
+    Ast ast;
+    NodeIndex function;
+    AsmWriter output;
+    char *diagnostics;              /* printed when the function is appended */
+    size_t diagnostics_size;
+    bool parsed;                    /* false: output and written are unset */
+    bool last;                      /* the unit ends after this function */
+    bool written;                   /* generated without error */
+    bool freestanding;              /* main with -nostdlib */
+    bool done;                      /* generated; set under the pool's lock */
+} FunctionJob;
+
+typedef struct {
+    const SymbolTable *symbols;
+    FILE *out;                      /* the caller's streams, for the pool */
+    FILE *err;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;           /* a function was queued, or closing */
+    pthread_cond_t finished;        /* a function was generated */
+    FunctionJob *queue[WINDOW_SIZE];
+    int queue_head;
+    int queue_count;
+    bool closing;                   /* nothing more will be queued */
+    bool failed;                    /* the caller's: an appended function failed */
+} CodegenPool;
+
+typedef struct {
+    FILE *stream;
+    char *text;
+    size_t size;
+} Capture;
+
+/* Send this thread's diagnostics to memory until end_capture; if no
+ * memory stream can be opened, they go to err at once */
+static void begin_capture(Capture *capture, FILE *out, FILE *err) {
+    capture->text = NULL;
+    capture->size = 0;
+    capture->stream = open_memstream(&capture->text, &capture->size);
+    crappola_set_streams(out, capture->stream ? capture->stream : err);
+}
+
+/* Restore the thread's streams and add what was captured to job's
+ * diagnostics */
+static void end_capture(Capture *capture, FunctionJob *job, FILE *out, FILE *err) {
+    crappola_set_streams(out, err);
+    if (!capture->stream) {
+        return;
+    }
+    fclose(capture->stream);
+    char *joined = NULL;
+    if (capture->size > 0 &&
+        (joined = realloc(job->diagnostics, job->diagnostics_size + capture->size))) {
+        memcpy(joined + job->diagnostics_size, capture->text, capture->size);
+        job->diagnostics = joined;
+        job->diagnostics_size += capture->size;
+    } else if (capture->size > 0) {
+        fwrite(capture->text, 1, capture->size, err);
+    }
+    free(capture->text);
+}
+
+static void *codegen_worker(void *arg) {
+    CodegenPool *pool = arg;
+    crappola_set_streams(pool->out, pool->err);
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->queue_count == 0 && !pool->closing) {
+            pthread_cond_wait(&pool->ready, &pool->lock);
+        }
+        if (pool->queue_count == 0) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        FunctionJob *job = pool->queue[pool->queue_head];
+        pool->queue_head = (pool->queue_head + 1) % WINDOW_SIZE;
+        pool->queue_count--;
+        pthread_mutex_unlock(&pool->lock);
+
+        Capture capture;
+        begin_capture(&capture, pool->out, pool->err);
+        bool written = generate_code(pool->symbols, &job->ast, job->function, job->index,
+                                     job->freestanding, &job->output);
+        end_capture(&capture, job, pool->out, pool->err);
+        ast_release(&job->ast);
+
+        pthread_mutex_lock(&pool->lock);
+        job->written = written;
+        job->done = true;
+        pthread_cond_signal(&pool->finished);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+/* The window bounds the queue, so there is always room */
+static void submit(CodegenPool *pool, FunctionJob *job) {
+    pthread_mutex_lock(&pool->lock);
+    pool->queue[(pool->queue_head + pool->queue_count) % WINDOW_SIZE] = job;
+    pool->queue_count++;
+    pthread_cond_signal(&pool->ready);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Parse the next function whole, into an AST of its own. A function
+ * that fails to parse still gets a job, done and not parsed, to carry
+ * its diagnostics into place; NULL only if there is no memory for one. */
+static FunctionJob *parse_job(Parser *parser, int index, bool freestanding) {
+    FunctionJob *job = calloc(1, sizeof(FunctionJob));
+    if (!job) {
+        fprintf(err_stream(), "Error: Memory allocation failed in code generator\n");
+        return NULL;
+    }
+    job->index = index;
+    ast_init(&job->ast);
+    FILE *out = out_stream();
+    FILE *err = err_stream();
+    Capture capture;
+    begin_capture(&capture, out, err);
+    Ast *unit_ast = parser->ast;
+    parser->ast = &job->ast;
+    job->function = parse_function(parser);
+    parser->ast = unit_ast;
+    job->parsed = job->function && !parser->lex_failed;
+    job->last = !job->parsed || parse_at_end(parser);
+    end_capture(&capture, job, out, err);
+    if (!job->parsed) {
+        ast_release(&job->ast);
+        job->done = true;
+        return job;
+    }
+    writer_init_memory(&job->output);
+    const char *name = symbol_name(parser->symbols, job->ast.values[job->function]);
+    job->freestanding = freestanding && strcmp(name, "main") == 0;
+    return job;
+}
+
+static void wait_finished(CodegenPool *pool, const FunctionJob *job) {
+    pthread_mutex_lock(&pool->lock);
+    while (!job->done) {
+        pthread_cond_wait(&pool->finished, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Append the generated functions from *next on, up to the first one
+ * still waiting for the pool, with their diagnostics. jobs is a ring of
+ * WINDOW_SIZE, indexed by the function's position in the unit. False
+ * once any function has failed. */
+static bool collect(CodegenPool *pool, FunctionJob **jobs, int count, int *next,
+                    AsmWriter *out) {
+    while (*next < count) {
+        FunctionJob *job = jobs[*next % WINDOW_SIZE];
+        pthread_mutex_lock(&pool->lock);
+        bool done = job->done;
+        pthread_mutex_unlock(&pool->lock);
+        if (!done) {
+            break;
+        }
+        (*next)++;
+        if (!pool->failed && job->diagnostics_size > 0) {
+            fwrite(job->diagnostics, 1, job->diagnostics_size, err_stream());
+        }
+        if (job->written) {
+            writer_write(out, job->output.data, job->output.size);
+        }
+        pool->failed = pool->failed || !job->written || out->failed;
+        if (job->parsed) {
+            writer_release(&job->output);
+        }
+        free(job->diagnostics);
+        free(job);
+    }
+    return !pool->failed;
+}
+
+/* Generate every function of the unit parser reads on threads threads,
+ * writing them to out in source order */
+bool generate_parallel(Parser *parser, bool freestanding, int threads, AsmWriter *out) {
+    CodegenPool pool;
+    memset(&pool, 0, sizeof(pool));
+    pool.symbols = parser->symbols;
+    pool.out = out_stream();
+    pool.err = err_stream();
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.ready, NULL);
+    pthread_cond_init(&pool.finished, NULL);
+
+    pthread_t *workers = calloc((size_t)threads, sizeof(pthread_t));
+    int started = 0;
+    while (workers && started < threads &&
+           pthread_create(&workers[started], NULL, codegen_worker, &pool) == 0) {
+        started++;
+    }
+
+    FunctionJob *jobs[WINDOW_SIZE];
+    int count = 0;              /* functions parsed */
+    int next = 0;               /* first function not yet in the output */
+    bool ok = started > 0;
+    if (!ok) {
+        fprintf(err_stream(), "Error: Could not start code generation threads\n");
+    }
+    while (ok) {
+        if (count - next == WINDOW_SIZE) {
+            wait_finished(&pool, jobs[next % WINDOW_SIZE]);
+            if (!collect(&pool, jobs, count, &next, out)) {
+                ok = false;
+                break;
+            }
+        }
+        FunctionJob *job = parse_job(parser, count, freestanding);
+        if (!job) {
+            ok = false;
+            break;
+        }
+        jobs[count % WINDOW_SIZE] = job;
+        count++;
+        // collect may free the job
+        bool last = job->last;
+        if (job->parsed) {
+            submit(&pool, job);
+        }
+        if (!collect(&pool, jobs, count, &next, out)) {
+            ok = false;
+            break;
+        }
+        if (last) {
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.closing = true;
+    pthread_cond_broadcast(&pool.ready);
+    pthread_mutex_unlock(&pool.lock);
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    if (!collect(&pool, jobs, count, &next, out)) {
+        ok = false;
+    }
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.ready);
+    pthread_cond_destroy(&pool.finished);
+    return ok;
+}
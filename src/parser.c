@@ -1,428 +1,548 @@
 #include "crappola.h"
 
-static Token *tokens;
-static int current;
-static int token_count;
-
-static Token *peek(void) {
-    if (current < token_count) {
-        return &tokens[current];
-    }
-    return &tokens[token_count - 1];
+/* Tokens are pulled from the lexer on demand with one token of
+ * lookahead. advance() returns the consumed token, which is only valid
+ * until the next advance, so callers copy what they keep. */
+static Token *peek(Parser *parser) {
+    return &parser->lookahead;
 }
 
-static Token *advance(void) {
-    if (current < token_count - 1) {
-        return &tokens[current++];
+static Token *advance(Parser *parser) {
+    parser->previous = parser->lookahead;
+    if (parser->lookahead.type != TOKEN_EOF &&
+        !parser->next_token(parser->source, &parser->lookahead)) {
+        // Lexer errors end the token stream; parse() reports failure
+        parser->lex_failed = true;
+        parser->lookahead.type = TOKEN_EOF;
     }
-    return &tokens[token_count - 1];
+    return &parser->previous;
 }
 
-static bool match(TokenType type) {
-    if (peek()->type == type) {
-        advance();
+static bool match(Parser *parser, TokenType type) {
+    if (peek(parser)->type == type) {
+        advance(parser);
         return true;
     }
     return false;
 }
 
-static ASTNode *create_node(NodeType type) {
-    ASTNode *node = calloc(1, sizeof(ASTNode));
-    node->type = type;
-    return node;
+static NodeIndex add_node(Parser *parser, NodeType kind, int32_t value, NodeIndex lhs,
+                          NodeIndex rhs) {
+    return ast_add(parser->ast, kind, value, lhs, rhs);
 }
 
-static ASTNode *parse_expression(void);
-static ASTNode *parse_statement(void);
-
-static ASTNode *parse_primary(void) {
-    Token *token = peek();
-
-    if (token->type == TOKEN_NUMBER) {
-        advance();
-        ASTNode *node = create_node(NODE_NUMBER);
-        node->data.number.value = atoi(token->value);
-        return node;
+/* Make room for one more element in one of the parser's stacks */
+static bool reserve(void **array, uint32_t count, uint32_t *capacity, size_t size) {
+    if (count < *capacity) {
+        return true;
     }
-
-    if (token->type == TOKEN_IDENTIFIER) {
-        advance();
-        ASTNode *node = create_node(NODE_VARIABLE);
-        node->data.variable.name = strdup(token->value);
-        return node;
+    uint32_t grown_capacity = *capacity ? *capacity * 2 : 64;
+    void *grown = realloc(*array, size * grown_capacity);
+    if (!grown) {
+        fprintf(err_stream(), "Error: Memory allocation failed in parser\n");
+        return false;
     }
+    *array = grown;
+    *capacity = grown_capacity;
+    return true;
+}
 
-    if (match(TOKEN_LPAREN)) {
-        ASTNode *expr = parse_expression();
-        if (!match(TOKEN_RPAREN)) {
-            fprintf(stderr, "Expected ')'\n");
-            free_ast(expr);
-            return NULL;
-        }
-        return expr;
+/* Add a statement to the innermost open block */
+static bool append_statement(Parser *parser, NodeIndex stmt) {
+    if (!reserve((void **)&parser->statements, parser->statement_count,
+                 &parser->statement_capacity, sizeof(NodeIndex))) {
+        return false;
     }
-
-    fprintf(stderr, "Unexpected token in expression at line %d\n", token->line);
-    return NULL;
+    parser->statements[parser->statement_count++] = stmt;
+    return true;
 }
 
-static ASTNode *parse_multiplicative(void) {
-    ASTNode *left = parse_primary();
-    if (!left) return NULL;
-
-    while (peek()->type == TOKEN_STAR || peek()->type == TOKEN_SLASH) {
-        Token *op = advance();
-        ASTNode *right = parse_primary();
-        if (!right) {
-            free_ast(left);
-            return NULL;
-        }
-
-        ASTNode *node = create_node(NODE_BINARY_OP);
-        node->data.binary_op.op = op->value[0];
-        node->data.binary_op.left = left;
-        node->data.binary_op.right = right;
-        left = node;
+/* Give block the statements collected since first, as one range */
+static bool close_block(Parser *parser, NodeIndex block, uint32_t first) {
+    uint32_t count = parser->statement_count - first;
+    uint32_t start = ast_add_extra(parser->ast, parser->statements + first, count);
+    if (start == UINT32_MAX) {
+        return false;
     }
-
-    return left;
+    parser->ast->lhs[block] = start;
+    parser->ast->rhs[block] = count;
+    parser->statement_count = first;
+    return true;
 }
 
-static ASTNode *parse_additive(void) {
-    ASTNode *left = parse_multiplicative();
-    if (!left) return NULL;
+static int nesting_limit(const Parser *parser) {
+    return parser->max_nesting > 0 ? parser->max_nesting : DEFAULT_MAX_NESTING;
+}
 
-    while (peek()->type == TOKEN_PLUS || peek()->type == TOKEN_MINUS) {
-        Token *op = advance();
-        ASTNode *right = parse_multiplicative();
-        if (!right) {
-            free_ast(left);
-            return NULL;
-        }
+static void nesting_error(Parser *parser) {
+    fprintf(err_stream(), "Nesting deeper than %d levels at line %d\n", nesting_limit(parser),
+            peek(parser)->line);
+}
 
-        ASTNode *node = create_node(NODE_BINARY_OP);
-        node->data.binary_op.op = op->value[0];
-        node->data.binary_op.left = left;
-        node->data.binary_op.right = right;
-        left = node;
+/* Binding power of a binary operator, or 0 for any other token.
+ * Comparisons bind loosest and do not chain. */
+static int binary_precedence(TokenType type) {
+    switch (type) {
+        case TOKEN_STAR: case TOKEN_SLASH: return 3;
+        case TOKEN_PLUS: case TOKEN_MINUS: return 2;
+        case TOKEN_LT: case TOKEN_GT: case TOKEN_LE: case TOKEN_GE:
+        case TOKEN_EQ: case TOKEN_NE: return 1;
+        default: return 0;
     }
-
-    return left;
 }
 
-static ASTNode *parse_comparison(void) {
-    ASTNode *left = parse_additive();
-    if (!left) return NULL;
-
-    TokenType type = peek()->type;
-    if (type == TOKEN_LT || type == TOKEN_GT || type == TOKEN_LE || 
-        type == TOKEN_GE || type == TOKEN_EQ || type == TOKEN_NE) {
-        Token *op = advance();
-        ASTNode *right = parse_additive();
-        if (!right) {
-            free_ast(left);
-            return NULL;
-        }
-
-        ASTNode *node = create_node(NODE_BINARY_OP);
-        if (type == TOKEN_EQ) node->data.binary_op.op = 'e';
-        else if (type == TOKEN_NE) node->data.binary_op.op = 'n';
-        else if (type == TOKEN_LT) node->data.binary_op.op = '<';
-        else if (type == TOKEN_GT) node->data.binary_op.op = '>';
-        else if (type == TOKEN_LE) node->data.binary_op.op = 'l';
-        else if (type == TOKEN_GE) node->data.binary_op.op = 'g';
-        
-        node->data.binary_op.left = left;
-        node->data.binary_op.right = right;
-        left = node;
+static char binary_op(TokenType type) {
+    switch (type) {
+        case TOKEN_PLUS: return '+';
+        case TOKEN_MINUS: return '-';
+        case TOKEN_STAR: return '*';
+        case TOKEN_SLASH: return '/';
+        case TOKEN_LT: return '<';
+        case TOKEN_GT: return '>';
+        case TOKEN_LE: return 'l';
+        case TOKEN_GE: return 'g';
+        case TOKEN_EQ: return 'e';
+        case TOKEN_NE: return 'n';
+        default: return '?';
     }
-
-    return left;
 }
 
-static ASTNode *parse_expression(void) {
-    return parse_comparison();
+/* Combine the top operator with the top two operands */
+static bool reduce(Parser *parser, uint32_t *operand_count, uint32_t *op_count) {
+    NodeIndex right = parser->operands[--*operand_count];
+    NodeIndex left = parser->operands[*operand_count - 1];
+    NodeIndex node = add_node(parser, NODE_BINARY_OP, parser->ops[--*op_count].op, left, right);
+    parser->operands[*operand_count - 1] = node;
+    return node != 0;
 }
 
-static ASTNode *parse_statement(void) {
-    // Return statement
-    if (match(TOKEN_RETURN)) {
-        ASTNode *node = create_node(NODE_RETURN);
-        node->data.return_stmt.expr = parse_expression();
-        if (!node->data.return_stmt.expr) {
-            free(node);
-            return NULL;
-        }
-        if (!match(TOKEN_SEMICOLON)) {
-            fprintf(stderr, "Expected ';' after return\n");
-            free_ast(node);
-            return NULL;
-        }
-        return node;
-    }
-
-    // If statement
-    if (match(TOKEN_IF)) {
-        if (!match(TOKEN_LPAREN)) {
-            fprintf(stderr, "Expected '(' after if\n");
-            return NULL;
-        }
-        ASTNode *node = create_node(NODE_IF);
-        node->data.if_stmt.condition = parse_expression();
-        if (!node->data.if_stmt.condition) {
-            free(node);
-            return NULL;
-        }
-        if (!match(TOKEN_RPAREN)) {
-            fprintf(stderr, "Expected ')' after if condition\n");
-            free_ast(node);
-            return NULL;
-        }
-        node->data.if_stmt.then_branch = parse_statement();
-        if (!node->data.if_stmt.then_branch) {
-            free_ast(node);
-            return NULL;
-        }
-        if (match(TOKEN_ELSE)) {
-            node->data.if_stmt.else_branch = parse_statement();
-        }
-        return node;
+static bool push_op(Parser *parser, uint32_t *op_count, PendingOp op) {
+    if (!reserve((void **)&parser->ops, *op_count, &parser->op_capacity, sizeof(PendingOp))) {
+        return false;
     }
+    parser->ops[(*op_count)++] = op;
+    return true;
+}
 
-    // While statement
-    if (match(TOKEN_WHILE)) {
-        if (!match(TOKEN_LPAREN)) {
-            fprintf(stderr, "Expected '(' after while\n");
-            return NULL;
-        }
-        ASTNode *node = create_node(NODE_WHILE);
-        node->data.while_stmt.condition = parse_expression();
-        if (!node->data.while_stmt.condition) {
-            free(node);
-            return NULL;
+/* Operator precedence parsing with explicit stacks, so neither long
+ * operator chains nor deep parentheses use the C stack. Operands
+ * alternate with operators; an operator first reduces the pending ones
+ * that bind at least as tightly, which makes every level left
+ * associative. */
+static NodeIndex parse_expression(Parser *parser) {
+    uint32_t operand_count = 0;
+    uint32_t op_count = 0;
+    int depth = 0;              /* open parentheses */
+    bool compared = false;      /* a comparison was seen at this level */
+    for (;;) {
+        // Operand: a number or a name, after any open parentheses
+        while (match(parser, TOKEN_LPAREN)) {
+            if (++depth > nesting_limit(parser)) {
+                nesting_error(parser);
+                return 0;
+            }
+            if (!push_op(parser, &op_count, (PendingOp){ '(', 0, compared })) {
+                return 0;
+            }
+            compared = false;
         }
-        if (!match(TOKEN_RPAREN)) {
-            fprintf(stderr, "Expected ')' after while condition\n");
-            free_ast(node);
-            return NULL;
+        Token token = *peek(parser);
+        NodeIndex operand;
+        if (token.type == TOKEN_NUMBER) {
+            operand = add_node(parser, NODE_NUMBER, token.value, 0, 0);
+        } else if (token.type == TOKEN_IDENTIFIER) {
+            operand = add_node(parser, NODE_VARIABLE, token.value, 0, 0);
+        } else {
+            fprintf(err_stream(), "Unexpected token in expression at line %d\n", token.line);
+            return 0;
         }
-        node->data.while_stmt.body = parse_statement();
-        if (!node->data.while_stmt.body) {
-            free_ast(node);
-            return NULL;
+        advance(parser);
+        if (!operand || !reserve((void **)&parser->operands, operand_count,
+                                 &parser->operand_capacity, sizeof(NodeIndex))) {
+            return 0;
         }
-        return node;
-    }
-
-    // Block statement
-    if (match(TOKEN_LBRACE)) {
-        ASTNode *node = create_node(NODE_BLOCK);
-        int capacity = 10;
-        node->data.block.statements = malloc(sizeof(ASTNode*) * capacity);
-        node->data.block.count = 0;
-
-        while (!match(TOKEN_RBRACE)) {
-            if (peek()->type == TOKEN_EOF) {
-                fprintf(stderr, "Expected '}'\n");
-                free_ast(node);
-                return NULL;
+        parser->operands[operand_count++] = operand;
+
+        // Then closing parentheses, until an operator or the end
+        for (;;) {
+            TokenType type = peek(parser)->type;
+            int precedence = binary_precedence(type);
+            if (precedence == 1 && compared) {
+                // A second comparison ends the expression
+                precedence = 0;
+            }
+            if (precedence > 0) {
+                while (op_count > 0 && parser->ops[op_count - 1].op != '(' &&
+                       parser->ops[op_count - 1].precedence >= precedence) {
+                    if (!reduce(parser, &operand_count, &op_count)) {
+                        return 0;
+                    }
+                }
+                advance(parser);
+                if (!push_op(parser, &op_count, (PendingOp){ binary_op(type), precedence, false })) {
+                    return 0;
+                }
+                compared = compared || precedence == 1;
+                break;
             }
 
-            ASTNode *stmt = parse_statement();
-            if (!stmt) {
-                free_ast(node);
-                return NULL;
+            if (type == TOKEN_RPAREN && depth > 0) {
+                while (parser->ops[op_count - 1].op != '(') {
+                    if (!reduce(parser, &operand_count, &op_count)) {
+                        return 0;
+                    }
+                }
+                compared = parser->ops[--op_count].compared;
+                depth--;
+                advance(parser);
+                continue;
             }
 
-            if (node->data.block.count >= capacity) {
-                capacity *= 2;
-                ASTNode **new_statements = realloc(node->data.block.statements, 
-                                                    sizeof(ASTNode*) * capacity);
-                if (!new_statements) {
-                    free_ast(node);
-                    return NULL;
+            if (depth > 0) {
+                fprintf(err_stream(), "Expected ')'\n");
+                return 0;
+            }
+            while (op_count > 0) {
+                if (!reduce(parser, &operand_count, &op_count)) {
+                    return 0;
                 }
-                node->data.block.statements = new_statements;
             }
-            node->data.block.statements[node->data.block.count++] = stmt;
+            return parser->operands[0];
         }
-        return node;
+    }
+}
+
+/* "return", "int" and assignments, up to their ';' */
+static NodeIndex parse_simple_statement(Parser *parser) {
+    // Return statement
+    if (match(parser, TOKEN_RETURN)) {
+        NodeIndex expr = parse_expression(parser);
+        if (!expr) {
+            return 0;
+        }
+        if (!match(parser, TOKEN_SEMICOLON)) {
+            fprintf(err_stream(), "Expected ';' after return\n");
+            return 0;
+        }
+        return add_node(parser, NODE_RETURN, 0, expr, 0);
     }
 
     // Variable declaration
-    if (match(TOKEN_INT)) {
-        Token *name = peek();
-        if (name->type != TOKEN_IDENTIFIER) {
-            fprintf(stderr, "Expected identifier after 'int'\n");
-            return NULL;
+    if (match(parser, TOKEN_INT)) {
+        if (peek(parser)->type != TOKEN_IDENTIFIER) {
+            fprintf(err_stream(), "Expected identifier after 'int'\n");
+            return 0;
         }
-        advance();
+        Token name = *advance(parser);
 
-        if (match(TOKEN_SEMICOLON)) {
+        if (match(parser, TOKEN_SEMICOLON)) {
             // Just declaration, no initialization
-            return create_node(NODE_BLOCK); // Empty statement
+            return add_node(parser, NODE_DECLARATION, name.value, 0, 0);
         }
 
-        if (!match(TOKEN_ASSIGN)) {
-            fprintf(stderr, "Expected '=' or ';'\n");
-            return NULL;
+        if (!match(parser, TOKEN_ASSIGN)) {
+            fprintf(err_stream(), "Expected '=' or ';'\n");
+            return 0;
         }
 
-        ASTNode *node = create_node(NODE_ASSIGNMENT);
-        node->data.assignment.name = strdup(name->value);
-        node->data.assignment.value = parse_expression();
-        if (!node->data.assignment.value) {
-            free_ast(node);
-            return NULL;
+        NodeIndex value = parse_expression(parser);
+        if (!value) {
+            return 0;
         }
 
-        if (!match(TOKEN_SEMICOLON)) {
-            fprintf(stderr, "Expected ';'\n");
-            free_ast(node);
-            return NULL;
+        if (!match(parser, TOKEN_SEMICOLON)) {
+            fprintf(err_stream(), "Expected ';'\n");
+            return 0;
         }
-        return node;
+        return add_node(parser, NODE_DECLARATION, name.value, value, 0);
     }
 
     // Assignment or expression statement
-    if (peek()->type == TOKEN_IDENTIFIER) {
-        Token *name = advance();
-        if (match(TOKEN_ASSIGN)) {
-            ASTNode *node = create_node(NODE_ASSIGNMENT);
-            node->data.assignment.name = strdup(name->value);
-            node->data.assignment.value = parse_expression();
-            if (!node->data.assignment.value) {
-                free_ast(node);
-                return NULL;
+    if (peek(parser)->type == TOKEN_IDENTIFIER) {
+        Token name = *advance(parser);
+        if (match(parser, TOKEN_ASSIGN)) {
+            NodeIndex value = parse_expression(parser);
+            if (!value) {
+                return 0;
             }
-            if (!match(TOKEN_SEMICOLON)) {
-                fprintf(stderr, "Expected ';'\n");
-                free_ast(node);
-                return NULL;
+            if (!match(parser, TOKEN_SEMICOLON)) {
+                fprintf(err_stream(), "Expected ';'\n");
+                return 0;
             }
-            return node;
+            return add_node(parser, NODE_ASSIGNMENT, name.value, value, 0);
         } else {
-            fprintf(stderr, "Expected '=' after identifier\n");
-            return NULL;
+            fprintf(err_stream(), "Expected '=' after identifier\n");
+            return 0;
         }
     }
 
-    fprintf(stderr, "Unexpected token in statement at line %d\n", peek()->line);
-    return NULL;
+    fprintf(err_stream(), "Unexpected token in statement at line %d\n", peek(parser)->line);
+    return 0;
 }
 
-ASTNode *parse(Token *token_list, int count) {
-    tokens = token_list;
-    token_count = count;
-    current = 0;
+/* Open an if, while or block: parse up to where its first inner
+ * statement starts. Returns false after reporting an error. */
+static bool open_statement(Parser *parser, PendingStatement *pending) {
+    pending->first = 0;
 
-    // Parse function: int main() { ... }
-    if (!match(TOKEN_INT)) {
-        fprintf(stderr, "Expected 'int' for function return type\n");
-        return NULL;
+    // If statement
+    if (match(parser, TOKEN_IF)) {
+        if (!match(parser, TOKEN_LPAREN)) {
+            fprintf(err_stream(), "Expected '(' after if\n");
+            return false;
+        }
+        NodeIndex condition = parse_expression(parser);
+        if (!condition) {
+            return false;
+        }
+        if (!match(parser, TOKEN_RPAREN)) {
+            fprintf(err_stream(), "Expected ')' after if condition\n");
+            return false;
+        }
+        // The branches are filled in as they are parsed
+        const NodeIndex branches[2] = { 0, 0 };
+        uint32_t extra = ast_add_extra(parser->ast, branches, 2);
+        pending->kind = AWAIT_THEN;
+        pending->node = extra == UINT32_MAX ? 0 : add_node(parser, NODE_IF, 0, condition, extra);
+        return pending->node != 0;
     }
 
-    Token *name = peek();
-    if (name->type != TOKEN_IDENTIFIER) {
-        fprintf(stderr, "Expected function name\n");
-        return NULL;
+    // While statement
+    if (match(parser, TOKEN_WHILE)) {
+        if (!match(parser, TOKEN_LPAREN)) {
+            fprintf(err_stream(), "Expected '(' after while\n");
+            return false;
+        }
+        NodeIndex condition = parse_expression(parser);
+        if (!condition) {
+            return false;
+        }
+        if (!match(parser, TOKEN_RPAREN)) {
+            fprintf(err_stream(), "Expected ')' after while condition\n");
+            return false;
+        }
+        pending->kind = AWAIT_BODY;
+        pending->node = add_node(parser, NODE_WHILE, 0, condition, 0);
+        return pending->node != 0;
     }
-    advance();
 
-    if (!match(TOKEN_LPAREN)) {
-        fprintf(stderr, "Expected '(' after function name\n");
-        return NULL;
+    // Block statement
+    match(parser, TOKEN_LBRACE);
+    pending->kind = AWAIT_STATEMENTS;
+    pending->node = add_node(parser, NODE_BLOCK, 0, 0, 0);
+    pending->first = parser->statement_count;
+    return pending->node != 0;
+}
+
+static bool opens_statement(TokenType type) {
+    return type == TOKEN_IF || type == TOKEN_WHILE || type == TOKEN_LBRACE;
+}
+
+/* Parse one statement. The compound statements still open around the
+ * current one are kept on an explicit stack rather than the C stack: a
+ * finished statement is handed to the innermost, which may then be
+ * finished in turn. */
+static NodeIndex parse_statement(Parser *parser) {
+    Ast *ast = parser->ast;
+    uint32_t depth = 0;
+    for (;;) {
+        NodeIndex stmt = 0;
+        if (opens_statement(peek(parser)->type)) {
+            if (depth == (uint32_t)nesting_limit(parser)) {
+                nesting_error(parser);
+                return 0;
+            }
+            if (!reserve((void **)&parser->pending, depth, &parser->pending_capacity,
+                         sizeof(PendingStatement)) ||
+                !open_statement(parser, &parser->pending[depth])) {
+                return 0;
+            }
+            depth++;
+        } else if (!(stmt = parse_simple_statement(parser))) {
+            return 0;
+        }
+
+        // Hand stmt to the statements around it, closing those it completes
+        while (depth > 0) {
+            PendingStatement *top = &parser->pending[depth - 1];
+            if (top->kind == AWAIT_STATEMENTS) {
+                if (stmt && !append_statement(parser, stmt)) {
+                    return 0;
+                }
+                stmt = 0;
+                if (!match(parser, TOKEN_RBRACE)) {
+                    if (peek(parser)->type == TOKEN_EOF) {
+                        fprintf(err_stream(), "Expected '}'\n");
+                        return 0;
+                    }
+                    break;
+                }
+                if (!close_block(parser, top->node, top->first)) {
+                    return 0;
+                }
+            } else if (!stmt) {
+                break;
+            } else if (top->kind == AWAIT_THEN) {
+                ast->extra[ast->rhs[top->node]] = stmt;
+                if (match(parser, TOKEN_ELSE)) {
+                    top->kind = AWAIT_ELSE;
+                    break;
+                }
+            } else if (top->kind == AWAIT_ELSE) {
+                ast->extra[ast->rhs[top->node] + 1] = stmt;
+            } else {
+                ast->rhs[top->node] = stmt;
+            }
+            stmt = top->node;
+            depth--;
+        }
+        if (depth == 0) {
+            return stmt;
+        }
     }
+}
+
+static bool lexer_tokens(void *source, Token *token) {
+    return lexer_next(source, token);
+}
+
+bool parser_init(Parser *parser, Lexer *lexer, Ast *ast) {
+    return parser_init_source(parser, lexer->symbols, lexer_tokens, lexer, ast);
+}
 
-    if (!match(TOKEN_RPAREN)) {
-        fprintf(stderr, "Expected ')' - parameters not supported yet\n");
-        return NULL;
+bool parser_init_source(Parser *parser, const SymbolTable *symbols, TokenSource next_token,
+                        void *source, Ast *ast) {
+    memset(parser, 0, sizeof(*parser));
+    parser->next_token = next_token;
+    parser->source = source;
+    parser->symbols = symbols;
+    parser->ast = ast;
+    parser->lookahead.type = TOKEN_NUMBER;
+    advance(parser);
+    return !parser->lex_failed;
+}
+
+/* Free the parser's stacks; the AST it built is the caller's */
+void parser_finish(Parser *parser) {
+    free(parser->operands);
+    free(parser->ops);
+    free(parser->pending);
+    free(parser->statements);
+    parser->operands = NULL;
+    parser->ops = NULL;
+    parser->pending = NULL;
+    parser->statements = NULL;
+}
+
+/* Parse "int name() {" and return the name's symbol, or -1 */
+int parse_function_header(Parser *parser) {
+    // Parse function: int main() { ... }
+    if (!match(parser, TOKEN_INT)) {
+        fprintf(err_stream(), "Expected 'int' for function return type\n");
+        return -1;
     }
 
-    if (!match(TOKEN_LBRACE)) {
-        fprintf(stderr, "Expected '{' to start function body\n");
-        return NULL;
+    if (peek(parser)->type != TOKEN_IDENTIFIER) {
+        fprintf(err_stream(), "Expected function name\n");
+        return -1;
     }
+    Token name = *advance(parser);
 
-    // Parse function body
-    ASTNode *body = create_node(NODE_BLOCK);
-    int capacity = 10;
-    body->data.block.statements = malloc(sizeof(ASTNode*) * capacity);
-    body->data.block.count = 0;
-
-    while (!match(TOKEN_RBRACE)) {
-        if (peek()->type == TOKEN_EOF) {
-            fprintf(stderr, "Expected '}' at end of function\n");
-            free_ast(body);
-            return NULL;
-        }
+    if (!match(parser, TOKEN_LPAREN)) {
+        fprintf(err_stream(), "Expected '(' after function name\n");
+        return -1;
+    }
 
-        ASTNode *stmt = parse_statement();
-        if (!stmt) {
-            free_ast(body);
-            return NULL;
-        }
+    if (!match(parser, TOKEN_RPAREN)) {
+        fprintf(err_stream(), "Expected ')' - parameters not supported yet\n");
+        return -1;
+    }
 
-        if (body->data.block.count >= capacity) {
-            capacity *= 2;
-            ASTNode **new_statements = realloc(body->data.block.statements, 
-                                               sizeof(ASTNode*) * capacity);
-            if (!new_statements) {
-                free_ast(body);
-                return NULL;
-            }
-            body->data.block.statements = new_statements;
+    if (!match(parser, TOKEN_LBRACE)) {
+        fprintf(err_stream(), "Expected '{' to start function body\n");
+        return -1;
+    }
+
+    return name.value;
+}
+
+/* Parse the next statement of the function body. Returns 0 with *done
+ * set once the closing brace is consumed, or 0 on error. */
+NodeIndex parse_function_statement(Parser *parser, bool *done) {
+    *done = false;
+    if (match(parser, TOKEN_RBRACE)) {
+        *done = !parser->lex_failed;
+        return 0;
+    }
+    if (peek(parser)->type == TOKEN_EOF) {
+        if (!parser->lex_failed) {
+            fprintf(err_stream(), "Expected '}' at end of function\n");
         }
-        body->data.block.statements[body->data.block.count++] = stmt;
+        return 0;
     }
 
-    ASTNode *function = create_node(NODE_FUNCTION);
-    function->data.function.name = strdup(name->value);
-    function->data.function.body = body;
+    NodeIndex stmt = parse_statement(parser);
+    return parser->lex_failed ? 0 : stmt;
+}
 
-    return function;
+/* True once every function of the unit has been parsed */
+bool parse_at_end(Parser *parser) {
+    return peek(parser)->type == TOKEN_EOF;
 }
 
-void free_ast(ASTNode *node) {
-    if (!node) return;
+/* Parse a whole function into the parser's AST */
+NodeIndex parse_function(Parser *parser) {
+    int name = parse_function_header(parser);
+    if (name < 0) {
+        return 0;
+    }
 
-    switch (node->type) {
-        case NODE_FUNCTION:
-            free(node->data.function.name);
-            free_ast(node->data.function.body);
-            break;
-        case NODE_RETURN:
-            free_ast(node->data.return_stmt.expr);
-            break;
-        case NODE_BINARY_OP:
-            free_ast(node->data.binary_op.left);
-            free_ast(node->data.binary_op.right);
-            break;
-        case NODE_VARIABLE:
-            free(node->data.variable.name);
-            break;
-        case NODE_ASSIGNMENT:
-            free(node->data.assignment.name);
-            free_ast(node->data.assignment.value);
-            break;
-        case NODE_IF:
-            free_ast(node->data.if_stmt.condition);
-            free_ast(node->data.if_stmt.then_branch);
-            free_ast(node->data.if_stmt.else_branch);
-            break;
-        case NODE_WHILE:
-            free_ast(node->data.while_stmt.condition);
-            free_ast(node->data.while_stmt.body);
-            break;
-        case NODE_BLOCK:
-            for (int i = 0; i < node->data.block.count; i++) {
-                free_ast(node->data.block.statements[i]);
-            }
-            free(node->data.block.statements);
-            break;
-        default:
+    // Parse function body
+    NodeIndex first_node = parser->ast->count ? parser->ast->count : 1;
+    uint32_t first = parser->statement_count;
+    bool done = false;
+    while (!done) {
+        NodeIndex stmt = parse_function_statement(parser, &done);
+        if (done) {
             break;
+        }
+        if (!stmt || !append_statement(parser, stmt)) {
+            parser->statement_count = first;
+            return 0;
+        }
+    }
+
+    NodeIndex body = add_node(parser, NODE_BLOCK, 0, 0, 0);
+    if (!body || !close_block(parser, body, first)) {
+        parser->statement_count = first;
+        return 0;
     }
+    return add_node(parser, NODE_FUNCTION, name, body, first_node);
+}
 
-    free(node);
+/* Parse every function of the unit and return main, or the first one if
+ * there is no main: functions cannot call each other yet, so that is the
+ * only one that can run */
+NodeIndex parse(Lexer *token_source, Ast *ast, int max_nesting) {
+    Parser state;
+    Parser *parser = &state;
+    if (!parser_init(parser, token_source, ast)) {
+        return 0;
+    }
+    parser->max_nesting = max_nesting;
+
+    NodeIndex result = 0;
+    do {
+        NodeIndex function = parse_function(parser);
+        if (!function) {
+            parser_finish(parser);
+            return 0;
+        }
+        const char *name = symbol_name(parser->symbols, ast->values[function]);
+        if (!result || strcmp(name, "main") == 0) {
+            result = function;
+        }
+    } while (!parse_at_end(parser));
+    parser_finish(parser);
+    return parser->lex_failed ? 0 : result;
 }
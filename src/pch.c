@@ -0,0 +1,321 @@
+#include "crappola.h"
+#include <limits.h>
+#include <unistd.h>
+
+/* Precompiled headers. Running a header through the preprocessor leaves
+ * two things behind: the macro table and the lines it expanded to. A PCH
+ * file stores both, with the files that went into them and a hash of
+ * their contents. Loading maps the PCH, defines its macros and hands its
+ * lines to the lexer straight from the mapping, so the header is not
+ * preprocessed again while its files are unchanged.
+ *
+ * Layout, in native byte order:
+ *   PCHHeader
+ *   files:  u32 path length, u32 guard length, u8 once, path, guard
+ *   macros: u32 name length, u32 params length, u32 value length,
+ *           name, params, value
+ *   lines:  u32 line number, u32 length, text ending in a newline */
+
+#define PCH_MAGIC "CRAPPCH\n"
+#define PCH_FORMAT 1
+
+typedef struct {
+    char magic[8];
+    uint32_t format;
+    uint32_t file_count;
+    char compiler[16];          /* CRAPPOLA_VERSION of the writer */
+    uint64_t content_hash;      /* of every file the header read */
+    uint64_t macros_offset;
+    uint64_t lines_offset;
+    uint64_t size;
+} PCHHeader;
+
+typedef struct {
+    char *data;
+    size_t size;
+    size_t capacity;
+    bool failed;
+} Buffer;
+
+static void put(Buffer *buffer, const void *data, size_t len) {
+    if (buffer->failed || len == 0) {
+        return;
+    }
+    if (buffer->size + len > buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity : 65536;
+        while (capacity < buffer->size + len) {
+            capacity *= 2;
+        }
+        char *grown = realloc(buffer->data, capacity);
+        if (!grown) {
+            buffer->failed = true;
+            return;
+        }
+        buffer->data = grown;
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->data + buffer->size, data, len);
+    buffer->size += len;
+}
+
+static void put_u32(Buffer *buffer, size_t value) {
+    uint32_t v = (uint32_t)value;
+    put(buffer, &v, sizeof(v));
+}
+
+/* FNV-1a, 64-bit */
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 1099511628211u;
+    }
+    return hash;
+}
+
+static uint64_t hash_file(uint64_t hash, const SourceFile *file) {
+    uint64_t size = file->size;
+    hash = hash_bytes(hash, &size, sizeof(size));
+    return hash_bytes(hash, file->data, file->size);
+}
+
+static bool put_macro(void *context, const char *name, size_t name_length, const char *params,
+                      size_t params_length, const char *value, size_t value_length) {
+    Buffer *buffer = context;
+    put_u32(buffer, name_length);
+    put_u32(buffer, params_length);
+    put_u32(buffer, value_length);
+    put(buffer, name, name_length);
+    put(buffer, params, params_length);
+    put(buffer, value, value_length);
+    return !buffer->failed;
+}
+
+/* Write to a temporary name and rename, so a reader never sees half a file */
+static bool write_file(const char *output, const Buffer *buffer) {
+    size_t len = strlen(output);
+    char *temp = malloc(len + 5);
+    if (!temp) {
+        return false;
+    }
+    memcpy(temp, output, len);
+    memcpy(temp + len, ".tmp", 5);
+
+    FILE *out = fopen(temp, "wb");
+    bool ok = out && fwrite(buffer->data, 1, buffer->size, out) == buffer->size;
+    if (out && fclose(out) != 0) {
+        ok = false;
+    }
+    if (ok && rename(temp, output) != 0) {
+        ok = false;
+    }
+    if (!ok) {
+        fprintf(err_stream(), "Error: Could not write precompiled header %s\n", output);
+        remove(temp);
+    }
+    free(temp);
+    return ok;
+}
+
+/* Preprocess the whole input of pp and save the result as a PCH */
+bool pch_write(Preprocessor *pp, const char *output) {
+    Buffer lines = {0};
+    const char *line;
+    size_t length;
+    while ((line = pp_next_line(pp, &length))) {
+        // Directive lines come back empty and need not be kept
+        if (length > 1) {
+            put_u32(&lines, (size_t)pp->line);
+            put_u32(&lines, length);
+            put(&lines, line, length);
+        }
+    }
+    if (pp->failed) {
+        free(lines.data);
+        return false;
+    }
+
+    PCHHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PCH_MAGIC, sizeof(header.magic));
+    header.format = PCH_FORMAT;
+    strncpy(header.compiler, CRAPPOLA_VERSION, sizeof(header.compiler) - 1);
+    header.content_hash = 14695981039346656037u;
+
+    Buffer buffer = {0};
+    put(&buffer, &header, sizeof(header));
+
+    // Paths are stored absolute, so the PCH can be used from anywhere
+    const FileCache *cache = &pp->context->files;
+    for (const SourceFile *file = include_next_loaded(cache, NULL); file;
+         file = include_next_loaded(cache, file)) {
+        char resolved[PATH_MAX];
+        const char *path = realpath(file->path, resolved) ? resolved : file->path;
+        size_t guard_length = file->guard ? file->guard_length : 0;
+        put_u32(&buffer, strlen(path));
+        put_u32(&buffer, guard_length);
+        put(&buffer, &(uint8_t){ file->once }, 1);
+        put(&buffer, path, strlen(path));
+        put(&buffer, file->guard, guard_length);
+        header.content_hash = hash_file(header.content_hash, file);
+        header.file_count++;
+    }
+
+    header.macros_offset = buffer.size;
+    macro_visit(&pp->context->macros, put_macro, &buffer);
+    header.lines_offset = buffer.size;
+    put(&buffer, lines.data, lines.size);
+    free(lines.data);
+    header.size = buffer.size;
+
+    if (buffer.failed) {
+        fprintf(err_stream(), "Error: Memory allocation failed writing precompiled header\n");
+        free(buffer.data);
+        return false;
+    }
+    memcpy(buffer.data, &header, sizeof(header));
+    bool ok = write_file(output, &buffer);
+    free(buffer.data);
+    return ok;
+}
+
+typedef struct {
+    const char *p;
+    const char *end;
+    bool failed;
+} Reader;
+
+static uint32_t get_u32(Reader *r) {
+    uint32_t value = 0;
+    if ((size_t)(r->end - r->p) < sizeof(value)) {
+        r->failed = true;
+        return 0;
+    }
+    memcpy(&value, r->p, sizeof(value));
+    r->p += sizeof(value);
+    return value;
+}
+
+static const char *get_bytes(Reader *r, size_t len) {
+    if ((size_t)(r->end - r->p) < len) {
+        r->failed = true;
+        return NULL;
+    }
+    const char *data = r->p;
+    r->p += len;
+    return data;
+}
+
+/* Load a PCH written by pch_write, as if its header were included before
+ * the rest of the input. Fails if the PCH comes from another compiler
+ * version or any file it was built from has changed since. */
+bool pch_load(Preprocessor *pp, const char *path) {
+    // Mapped through the file cache, so it stays valid for the whole
+    // compilation and shows up in -MD output
+    SourceFile *pch = include_open(&pp->context->files, path);
+    PCHHeader header;
+    if (!pch || pch->size < sizeof(header)) {
+        fprintf(err_stream(), "Error: Could not read precompiled header %s\n", path);
+        return false;
+    }
+    memcpy(&header, pch->data, sizeof(header));
+    if (memcmp(header.magic, PCH_MAGIC, sizeof(header.magic)) != 0 || header.format != PCH_FORMAT ||
+        header.size != pch->size || header.macros_offset < sizeof(header) ||
+        header.macros_offset > header.lines_offset ||
+        header.lines_offset > header.size) {
+        fprintf(err_stream(), "Error: %s is not a valid precompiled header\n", path);
+        return false;
+    }
+    if (strncmp(header.compiler, CRAPPOLA_VERSION, sizeof(header.compiler)) != 0) {
+        fprintf(err_stream(), "Error: %s was built by crappola %.16s, not %s\n", path, header.compiler,
+                CRAPPOLA_VERSION);
+        return false;
+    }
+
+    // Every file the header read must still have the same contents
+    Reader r = { pch->data + sizeof(header), pch->data + header.macros_offset, false };
+    uint64_t hash = 14695981039346656037u;
+    for (uint32_t i = 0; i < header.file_count && !r.failed; i++) {
+        uint32_t path_length = get_u32(&r);
+        uint32_t guard_length = get_u32(&r);
+        const char *once = get_bytes(&r, 1);
+        const char *file_path = get_bytes(&r, path_length);
+        const char *guard = get_bytes(&r, guard_length);
+        if (r.failed) {
+            break;
+        }
+
+        char *name = strndup(file_path, path_length);
+        SourceFile *file = name ? include_open(&pp->context->files, name) : NULL;
+        if (!file) {
+            fprintf(err_stream(), "Error: %s is out of date: %s is missing\n", path, name ? name : "file");
+            free(name);
+            return false;
+        }
+        free(name);
+        hash = hash_file(hash, file);
+
+        // Later #includes of these files are skipped as if already read
+        file->entered = true;
+        file->once = file->once || *once;
+        if (guard_length > 0 && !file->guard) {
+            file->guard = guard;
+            file->guard_length = guard_length;
+        }
+    }
+    if (r.failed) {
+        fprintf(err_stream(), "Error: %s is not a valid precompiled header\n", path);
+        return false;
+    }
+    if (hash != header.content_hash) {
+        fprintf(err_stream(), "Error: %s is out of date; rebuild it with --emit-pch\n", path);
+        return false;
+    }
+
+    // Macros are defined from their source text: "name(params) value"
+    r = (Reader){ pch->data + header.macros_offset, pch->data + header.lines_offset, false };
+    Buffer line = {0};
+    while (r.p < r.end && !r.failed) {
+        uint32_t name_length = get_u32(&r);
+        uint32_t params_length = get_u32(&r);
+        uint32_t value_length = get_u32(&r);
+        const char *text = get_bytes(&r, (size_t)name_length + params_length + value_length);
+        if (r.failed) {
+            break;
+        }
+        line.size = 0;
+        put(&line, text, name_length + params_length);
+        put(&line, " ", 1);
+        put(&line, text + name_length + params_length, value_length);
+        if (line.failed ||
+            !macro_define(&pp->context->macros, line.data, line.data + line.size, path, 0)) {
+            free(line.data);
+            return false;
+        }
+    }
+    free(line.data);
+    if (r.failed) {
+        fprintf(err_stream(), "Error: %s is not a valid precompiled header\n", path);
+        return false;
+    }
+
+    // Check the line records once so pp_next_line can trust them
+    r = (Reader){ pch->data + header.lines_offset, pch->data + header.size, false };
+    while (r.p < r.end && !r.failed) {
+        get_u32(&r);
+        uint32_t length = get_u32(&r);
+        const char *text = get_bytes(&r, length);
+        if (text && (length == 0 || text[length - 1] != '\n')) {
+            r.failed = true;
+        }
+    }
+    if (r.failed) {
+        fprintf(err_stream(), "Error: %s is not a valid precompiled header\n", path);
+        return false;
+    }
+
+    pp->pch_ptr = pch->data + header.lines_offset;
+    pp->pch_end = pch->data + header.size;
+    pp->bytes_read += pch->size;
+    return true;
+}
@@ -0,0 +1,362 @@
+#include "crappola.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <time.h>
+
+/* Pipelined front end. The preprocessor and the lexer each get a thread,
+ * and parsing with code generation stays on the caller's:
+ *
+ *   preprocess --lines--> lex --tokens--> parse + generate
+ *
+ * Each stage hands batches to the next through a bounded single-producer,
+ * single-consumer ring. A full ring makes its producer wait, so no stage
+ * gets more than RING_SIZE batches ahead of the next, and code for the
+ * first statements is generated while later ones are still being
+ * preprocessed and lexed.
+ *
+ * Lines are copied into the batch, as the preprocessor reuses its
+ * buffers; tokens carry symbol IDs, whose names the interner keeps at
+ * fixed addresses while the lexer adds more. */
+
+#define RING_SIZE 8                 /* batches in flight; a power of two */
+#define LINE_BATCH_BYTES 16384
+#define TOKEN_BATCH 512
+#define SPIN_LIMIT 64
+
+typedef struct {
+    alignas(64) atomic_size_t head;     /* next slot to read, advanced by the consumer */
+    alignas(64) atomic_size_t tail;     /* next slot to write, advanced by the producer */
+    void *slots[RING_SIZE];
+} Ring;
+
+/* Line records as pch.c stores them: u32 line number, u32 length, text */
+typedef struct {
+    size_t size;
+    size_t capacity;
+    char data[];
+} LineBatch;
+
+typedef struct {
+    int count;
+    Token tokens[TOKEN_BATCH];
+} TokenBatch;
+
+/* Pushed after the last batch of a stage that has failed and reported
+ * why, or of input that has ended */
+static char stage_failed;
+static char end_of_input;
+#define STAGE_FAILED ((void *)&stage_failed)
+#define END_OF_INPUT ((void *)&end_of_input)
+
+typedef struct {
+    Preprocessor *pp;
+    SymbolTable *symbols;
+    Ring lines;
+    Ring tokens;
+    atomic_bool stop;               /* the consumer has given up */
+    FILE *out;                      /* the caller's streams, for the stage threads */
+    FILE *err;
+    LineBatch *line_batch;          /* being lexed */
+    size_t line_pos;
+    TokenBatch *token_batch;        /* being parsed */
+    int token_pos;
+    PipelineStage stages[STAGE_COUNT];
+} Pipeline;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Spin briefly, then give the core away: the stage being waited for may
+ * need it, which matters most when there are fewer cores than stages */
+static void backoff(int *spins) {
+    if (++*spins < SPIN_LIMIT) {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    } else if (*spins < 2 * SPIN_LIMIT) {
+        sched_yield();
+    } else {
+        nanosleep(&(struct timespec){ 0, 20000 }, NULL);
+    }
+}
+
+/* Returns false, keeping item, if the consumer stopped while the ring was full */
+static bool ring_push(Pipeline *p, Ring *ring, void *item, PipelineStage *stage) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(&ring->head, memory_order_acquire) == RING_SIZE) {
+        double start = now_seconds();
+        int spins = 0;
+        while (tail - atomic_load_explicit(&ring->head, memory_order_acquire) == RING_SIZE) {
+            if (atomic_load_explicit(&p->stop, memory_order_relaxed)) {
+                return false;
+            }
+            backoff(&spins);
+        }
+        stage->waiting += now_seconds() - start;
+    }
+    ring->slots[tail & (RING_SIZE - 1)] = item;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+/* Returns NULL if the consumer stopped while the ring was empty */
+static void *ring_pop(Pipeline *p, Ring *ring, PipelineStage *stage) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (atomic_load_explicit(&ring->tail, memory_order_acquire) == head) {
+        double start = now_seconds();
+        int spins = 0;
+        while (atomic_load_explicit(&ring->tail, memory_order_acquire) == head) {
+            if (atomic_load_explicit(&p->stop, memory_order_relaxed)) {
+                return NULL;
+            }
+            backoff(&spins);
+        }
+        stage->waiting += now_seconds() - start;
+    }
+    void *item = ring->slots[head & (RING_SIZE - 1)];
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return item;
+}
+
+/* Free what a stopped pipeline left in a ring */
+static void ring_drain(Ring *ring) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    for (size_t i = atomic_load_explicit(&ring->head, memory_order_relaxed); i != tail; i++) {
+        void *item = ring->slots[i & (RING_SIZE - 1)];
+        if (item != STAGE_FAILED && item != END_OF_INPUT) {
+            free(item);
+        }
+    }
+}
+
+static void *preprocess_stage(void *arg) {
+    Pipeline *p = arg;
+    PipelineStage *stage = &p->stages[STAGE_PREPROCESS];
+    crappola_set_streams(p->out, p->err);
+    double start = now_seconds();
+
+    LineBatch *batch = NULL;
+    void *last = END_OF_INPUT;
+    const char *line;
+    size_t length;
+    while ((line = pp_next_line(p->pp, &length))) {
+        // Directive lines come back empty and need not be kept
+        if (length <= 1) {
+            continue;
+        }
+        size_t needed = 2 * sizeof(uint32_t) + length;
+        if (batch && batch->size + needed > batch->capacity) {
+            if (!ring_push(p, &p->lines, batch, stage)) {
+                break;
+            }
+            stage->batches++;
+            batch = NULL;
+        }
+        if (!batch) {
+            size_t capacity = needed > LINE_BATCH_BYTES ? needed : LINE_BATCH_BYTES;
+            if (!(batch = malloc(sizeof(LineBatch) + capacity))) {
+                fprintf(err_stream(), "Error: Memory allocation failed in the preprocessor stage\n");
+                last = STAGE_FAILED;
+                break;
+            }
+            batch->size = 0;
+            batch->capacity = capacity;
+        }
+        uint32_t record[2] = { (uint32_t)p->pp->line, (uint32_t)length };
+        memcpy(batch->data + batch->size, record, sizeof(record));
+        memcpy(batch->data + batch->size + sizeof(record), line, length);
+        batch->size += needed;
+    }
+    if (p->pp->failed) {
+        last = STAGE_FAILED;
+    }
+
+    if (batch && ring_push(p, &p->lines, batch, stage)) {
+        stage->batches++;
+        batch = NULL;
+    }
+    free(batch);
+    ring_push(p, &p->lines, last, stage);
+    stage->busy = now_seconds() - start - stage->waiting;
+    return NULL;
+}
+
+/* The lexer stage's LineSource: records of the batches from the ring */
+static bool batch_lines(void *source, const char **text, size_t *length, int *line) {
+    Pipeline *p = source;
+    while (!p->line_batch || p->line_pos == p->line_batch->size) {
+        free(p->line_batch);
+        p->line_batch = NULL;
+        void *item = ring_pop(p, &p->lines, &p->stages[STAGE_LEX]);
+        if (item == END_OF_INPUT) {
+            *text = NULL;
+            return true;
+        }
+        if (!item || item == STAGE_FAILED) {
+            return false;
+        }
+        p->line_batch = item;
+        p->line_pos = 0;
+    }
+
+    uint32_t record[2];
+    memcpy(record, p->line_batch->data + p->line_pos, sizeof(record));
+    *line = (int)record[0];
+    *length = record[1];
+    *text = p->line_batch->data + p->line_pos + sizeof(record);
+    p->line_pos += sizeof(record) + record[1];
+    return true;
+}
+
+static void *lex_stage(void *arg) {
+    Pipeline *p = arg;
+    PipelineStage *stage = &p->stages[STAGE_LEX];
+    crappola_set_streams(p->out, p->err);
+    double start = now_seconds();
+
+    Lexer lexer;
+    lexer_init_source(&lexer, p->symbols, batch_lines, p);
+    TokenBatch *batch = NULL;
+    bool ok = true;
+    for (;;) {
+        if (!batch) {
+            if (!(batch = malloc(sizeof(TokenBatch)))) {
+                fprintf(err_stream(), "Error: Memory allocation failed in the lexer stage\n");
+                ok = false;
+                break;
+            }
+            batch->count = 0;
+        }
+        Token *token = &batch->tokens[batch->count];
+        if (!lexer_next(&lexer, token)) {
+            ok = false;
+            break;
+        }
+        batch->count++;
+        // The parser asks for nothing after the end of input
+        if (token->type == TOKEN_EOF || batch->count == TOKEN_BATCH) {
+            if (!ring_push(p, &p->tokens, batch, stage)) {
+                break;
+            }
+            stage->batches++;
+            batch = NULL;
+            if (token->type == TOKEN_EOF) {
+                break;
+            }
+        }
+    }
+
+    // Tokens before an error are still parsed, so diagnostics come out
+    // in the same order as without the pipeline
+    if (!ok && batch && batch->count > 0 && ring_push(p, &p->tokens, batch, stage)) {
+        stage->batches++;
+        batch = NULL;
+    }
+    free(batch);
+    if (!ok) {
+        ring_push(p, &p->tokens, STAGE_FAILED, stage);
+    }
+    free(p->line_batch);
+    p->line_batch = NULL;
+    stage->busy = now_seconds() - start - stage->waiting;
+    return NULL;
+}
+
+/* The parser's TokenSource: tokens of the batches from the ring */
+static bool batch_tokens(void *source, Token *token) {
+    Pipeline *p = source;
+    while (!p->token_batch || p->token_pos == p->token_batch->count) {
+        free(p->token_batch);
+        p->token_batch = NULL;
+        void *item = ring_pop(p, &p->tokens, &p->stages[STAGE_GENERATE]);
+        if (!item || item == STAGE_FAILED) {
+            return false;
+        }
+        p->token_batch = item;
+        p->token_pos = 0;
+    }
+    *token = p->token_batch->tokens[p->token_pos++];
+    return true;
+}
+
+/* Compile the unit pp reads to out with each phase on its own thread. The
+ * output is the same as compile_stream's. */
+bool compile_pipelined(Preprocessor *pp, Ast *ast, bool freestanding, PipelineStats *stats,
+                       AsmWriter *out) {
+    Pipeline p;
+    memset(&p, 0, sizeof(p));
+    atomic_init(&p.lines.head, 0);
+    atomic_init(&p.lines.tail, 0);
+    atomic_init(&p.tokens.head, 0);
+    atomic_init(&p.tokens.tail, 0);
+    atomic_init(&p.stop, false);
+    p.pp = pp;
+    p.symbols = &pp->context->symbols;
+    p.out = out_stream();
+    p.err = err_stream();
+
+    double start = now_seconds();
+    pthread_t preprocessor;
+    pthread_t lexer;
+    if (pthread_create(&preprocessor, NULL, preprocess_stage, &p) != 0) {
+        fprintf(err_stream(), "Error: Could not start the preprocessor stage\n");
+        return false;
+    }
+    if (pthread_create(&lexer, NULL, lex_stage, &p) != 0) {
+        fprintf(err_stream(), "Error: Could not start the lexer stage\n");
+        atomic_store(&p.stop, true);
+        pthread_join(preprocessor, NULL);
+        ring_drain(&p.lines);
+        return false;
+    }
+
+    Parser parser;
+    bool ok = false;
+    if (parser_init_source(&parser, p.symbols, batch_tokens, &p, ast)) {
+        parser.max_nesting = pp->context->max_nesting;
+        ok = compile_functions(&parser, freestanding, pp->context->codegen_threads, out);
+    }
+    parser_finish(&parser);
+    double generated = now_seconds();
+
+    // After an error the earlier stages may still be running or waiting
+    // for room; stopping lets them leave
+    atomic_store(&p.stop, true);
+    pthread_join(lexer, NULL);
+    pthread_join(preprocessor, NULL);
+    ring_drain(&p.lines);
+    ring_drain(&p.tokens);
+    free(p.token_batch);
+
+    PipelineStage *generate = &p.stages[STAGE_GENERATE];
+    generate->busy = generated - start - generate->waiting;
+    if (stats) {
+        memcpy(stats->stages, p.stages, sizeof(p.stages));
+        stats->elapsed = now_seconds() - start;
+    }
+    return ok;
+}
+
+/* How much of the pipeline's time each stage spent working */
+void pipeline_print_stats(const PipelineStats *stats, FILE *out) {
+    static const char *const names[STAGE_COUNT] = {
+        [STAGE_PREPROCESS] = "preprocess",
+        [STAGE_LEX] = "lex",
+        [STAGE_GENERATE] = "parse + generate",
+    };
+    fprintf(out, "  Pipeline: %.3f s\n", stats->elapsed);
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        const PipelineStage *stage = &stats->stages[i];
+        double share = stats->elapsed > 0 ? 100.0 * stage->busy / stats->elapsed : 0.0;
+        fprintf(out, "    %-16s %5.1f%% busy, %.3f s waiting", names[i], share, stage->waiting);
+        if (i != STAGE_GENERATE) {
+            fprintf(out, ", %ld batches", stage->batches);
+        }
+        fputc('\n', out);
+    }
+}
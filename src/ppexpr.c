@@ -0,0 +1,219 @@
+#include "crappola.h"
+#include <limits.h>
+
+/* Constant expressions for #if and #elif. The preprocessor has already
+ * replaced defined() and expanded macros, so only numbers, operators and
+ * leftover identifiers (which count as 0) remain. Precedence climbing
+ * over the usual C binary operators, with ?: on top. */
+
+typedef struct {
+    const char *p;
+    const char *end;
+    bool failed;
+    const char *error;
+} ExprParser;
+
+static long long parse_conditional(ExprParser *e, bool evaluate);
+
+static void skip_space(ExprParser *e) {
+    while (e->p < e->end && (char_class[(unsigned char)*e->p] & CHAR_WHITESPACE)) {
+        e->p++;
+    }
+}
+
+static void fail(ExprParser *e, const char *error) {
+    if (!e->failed) {
+        e->failed = true;
+        e->error = error;
+    }
+}
+
+/* Two-character operators, so "<" is not taken from "<<" or "<=" */
+static bool is_two_char_op(const char *p, const char *end) {
+    static const char *const ops[] = { "||", "&&", "<<", ">>", "<=", ">=", "==", "!=" };
+    if (end - p < 2) {
+        return false;
+    }
+    for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        if (p[0] == ops[i][0] && p[1] == ops[i][1]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool accept(ExprParser *e, const char *op) {
+    skip_space(e);
+    size_t len = strlen(op);
+    if ((size_t)(e->end - e->p) < len || memcmp(e->p, op, len) != 0) {
+        return false;
+    }
+    if (len == 1 && is_two_char_op(e->p, e->end)) {
+        return false;
+    }
+    e->p += len;
+    return true;
+}
+
+static long long parse_number(ExprParser *e) {
+    const char *start = e->p;
+    unsigned long long value = 0;
+    int base = 10;
+    if (*e->p == '0' && e->p + 1 < e->end && (e->p[1] == 'x' || e->p[1] == 'X')) {
+        base = 16;
+        e->p += 2;
+    } else if (*e->p == '0') {
+        base = 8;
+    }
+    while (e->p < e->end) {
+        char c = *e->p;
+        int digit;
+        if (c >= '0' && c <= '9') digit = c - '0';
+        else if (c >= 'a' && c <= 'f') digit = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') digit = c - 'A' + 10;
+        else break;
+        if (digit >= base) break;
+        value = value * base + (unsigned long long)digit;
+        e->p++;
+    }
+    // Integer suffixes do not change the value here
+    while (e->p < e->end && strchr("uUlL", *e->p)) {
+        e->p++;
+    }
+    if (e->p == start || (e->p < e->end && (char_class[(unsigned char)*e->p] & CHAR_IDENT))) {
+        fail(e, "invalid number");
+    }
+    return (long long)value;
+}
+
+static long long parse_unary(ExprParser *e, bool evaluate) {
+    skip_space(e);
+    if (e->p >= e->end) {
+        fail(e, "expression ends early");
+        return 0;
+    }
+    if (accept(e, "(")) {
+        long long value = parse_conditional(e, evaluate);
+        if (!accept(e, ")")) {
+            fail(e, "expected ')'");
+        }
+        return value;
+    }
+    if (accept(e, "!")) return !parse_unary(e, evaluate);
+    if (accept(e, "~")) return ~parse_unary(e, evaluate);
+    if (accept(e, "-")) return (long long)(0ULL - (unsigned long long)parse_unary(e, evaluate));
+    if (accept(e, "+")) return parse_unary(e, evaluate);
+
+    unsigned char c = (unsigned char)*e->p;
+    if (char_class[c] & CHAR_DIGIT) {
+        return parse_number(e);
+    }
+    if (char_class[c] & CHAR_IDENT_START) {
+        // Identifiers that are not macros evaluate to 0
+        while (e->p < e->end && (char_class[(unsigned char)*e->p] & CHAR_IDENT)) {
+            e->p++;
+        }
+        return 0;
+    }
+    fail(e, "unexpected character");
+    return 0;
+}
+
+/* Binary operators by precedence level, loosest first */
+static const char *const levels[][5] = {
+    { "||" },
+    { "&&" },
+    { "|" },
+    { "^" },
+    { "&" },
+    { "==", "!=" },
+    { "<=", ">=", "<", ">" },
+    { "<<", ">>" },
+    { "+", "-" },
+    { "*", "/", "%" },
+};
+
+#define LEVEL_COUNT ((int)(sizeof(levels) / sizeof(levels[0])))
+
+static long long apply(ExprParser *e, const char *op, long long a, long long b, bool evaluate) {
+    unsigned long long ua = (unsigned long long)a, ub = (unsigned long long)b;
+    switch (op[0]) {
+        case '|': return op[1] ? (a || b) : (a | b);
+        case '&': return op[1] ? (a && b) : (a & b);
+        case '^': return a ^ b;
+        case '=': return a == b;
+        case '!': return a != b;
+        case '<':
+            if (op[1] == '<') return (long long)(ua << (ub & 63));
+            return op[1] ? a <= b : a < b;
+        case '>':
+            if (op[1] == '>') return a >> (ub & 63);
+            return op[1] ? a >= b : a > b;
+        case '+': return (long long)(ua + ub);
+        case '-': return (long long)(ua - ub);
+        case '*': return (long long)(ua * ub);
+        case '/':
+        case '%':
+            if (b == 0 || (a == LLONG_MIN && b == -1)) {
+                if (evaluate) {
+                    fail(e, "division by zero");
+                }
+                return 0;
+            }
+            return op[0] == '/' ? a / b : a % b;
+    }
+    return 0;
+}
+
+static long long parse_binary(ExprParser *e, int level, bool evaluate) {
+    if (level == LEVEL_COUNT) {
+        return parse_unary(e, evaluate);
+    }
+    long long value = parse_binary(e, level + 1, evaluate);
+    for (;;) {
+        const char *op = NULL;
+        for (int i = 0; i < 5 && levels[level][i]; i++) {
+            if (accept(e, levels[level][i])) {
+                op = levels[level][i];
+                break;
+            }
+        }
+        if (!op || e->failed) {
+            return value;
+        }
+        // The right side of && and || is not evaluated once decided
+        bool rhs_evaluate = evaluate;
+        if (strcmp(op, "&&") == 0 && !value) rhs_evaluate = false;
+        if (strcmp(op, "||") == 0 && value) rhs_evaluate = false;
+        long long rhs = parse_binary(e, level + 1, rhs_evaluate);
+        value = apply(e, op, value, rhs, rhs_evaluate);
+    }
+}
+
+static long long parse_conditional(ExprParser *e, bool evaluate) {
+    long long cond = parse_binary(e, 0, evaluate);
+    if (!accept(e, "?")) {
+        return cond;
+    }
+    long long then_value = parse_conditional(e, evaluate && cond);
+    if (!accept(e, ":")) {
+        fail(e, "expected ':'");
+        return 0;
+    }
+    long long else_value = parse_conditional(e, evaluate && !cond);
+    return cond ? then_value : else_value;
+}
+
+bool pp_evaluate(const char *p, const char *end, long long *value, const char **error) {
+    ExprParser e = { p, end, false, NULL };
+    *value = parse_conditional(&e, true);
+    skip_space(&e);
+    if (!e.failed && e.p < e.end) {
+        fail(&e, "unexpected text after expression");
+    }
+    if (e.failed) {
+        *error = e.error;
+        return false;
+    }
+    return true;
+}
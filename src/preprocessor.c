@@ -2,160 +2,621 @@
 
 /* Simple preprocessor that handles basic directives */
 
-#define MAX_DEFINES 100
-#define MAX_LINE 1024
+#define MAX_INCLUDE_DEPTH 200
 
-typedef struct {
-    char *name;
-    char *value;
-} Define;
+/* Command-line -D and -U. name=value defines name as value and a bare
+ * name defines it as 1; name(params)=body defines a function-like macro. */
+bool pp_define(Preprocessor *pp, const char *definition) {
+    const char *equals = strchr(definition, '=');
+    size_t len = equals ? (size_t)(equals - definition) : strlen(definition);
+    const char *value = equals ? equals + 1 : "1";
+    size_t value_len = strlen(value);
 
-static Define defines[MAX_DEFINES];
-static int define_count = 0;
+    // Rewrite as the text of a #define line
+    char *line = malloc(len + value_len + 2);
+    if (!line) {
+        fprintf(err_stream(), "Error: Memory allocation failed in preprocessor\n");
+        return false;
+    }
+    memcpy(line, definition, len);
+    line[len] = ' ';
+    memcpy(line + len + 1, value, value_len);
+    bool ok = macro_define(&pp->context->macros, line, line + len + 1 + value_len,
+                           "<command line>", 0);
+    free(line);
+    return ok;
+}
 
-static void add_define(const char *name, const char *value) {
-    if (define_count >= MAX_DEFINES) {
-        return;
+void pp_undefine(Preprocessor *pp, const char *name) {
+    macro_undefine(&pp->context->macros, name, strlen(name));
+}
+
+static bool push_file(Preprocessor *pp, SourceFile *file) {
+    if (pp->depth >= MAX_INCLUDE_DEPTH) {
+        fprintf(err_stream(), "Error: #include nested too deeply in %s\n", file->path);
+        return false;
+    }
+    if (pp->depth >= pp->frame_capacity) {
+        int capacity = pp->frame_capacity ? pp->frame_capacity * 2 : 8;
+        IncludeFrame *frames = realloc(pp->frames, sizeof(IncludeFrame) * capacity);
+        if (!frames) {
+            fprintf(err_stream(), "Error: Memory allocation failed in preprocessor\n");
+            return false;
+        }
+        pp->frames = frames;
+        pp->frame_capacity = capacity;
     }
-    defines[define_count].name = strdup(name);
-    defines[define_count].value = strdup(value ? value : "");
-    define_count++;
+
+    IncludeFrame *frame = &pp->frames[pp->depth++];
+    memset(frame, 0, sizeof(*frame));
+    frame->file = file;
+    frame->ptr = file->data;
+    frame->end = file->data + file->size;
+    frame->cond_base = pp->cond_depth;
+    frame->guard_state = GUARD_START;
+    file->entered = true;
+    pp->bytes_read += file->size;
+    return true;
 }
 
-static const char *get_define(const char *name) {
-    for (int i = 0; i < define_count; i++) {
-        if (strcmp(defines[i].name, name) == 0) {
-            return defines[i].value;
+/* Leave the innermost file. If all of it sat inside one #ifndef, that
+ * macro guards the file and later includes can skip it unread. */
+static bool pop_file(Preprocessor *pp) {
+    IncludeFrame *frame = &pp->frames[--pp->depth];
+    if (pp->cond_depth > frame->cond_base) {
+        fprintf(err_stream(), "Error: Unterminated conditional directive at %s:%d\n",
+                frame->file->path, pp->conds[pp->cond_depth - 1].line);
+        return false;
+    }
+    if (frame->guard_state == GUARD_CLOSED && !frame->file->guard) {
+        frame->file->guard = frame->guard;
+        frame->file->guard_length = frame->guard_length;
+    }
+    return true;
+}
+
+/* Start on file with the context's -D and -U options applied in order */
+static bool start(Preprocessor *pp, SourceFile *file) {
+    CompilerContext *context = pp->context;
+    for (int i = 0; i < context->macro_option_count; i++) {
+        if (context->macro_options[i].undefine) {
+            pp_undefine(pp, context->macro_options[i].text);
+        } else if (!pp_define(pp, context->macro_options[i].text)) {
+            return false;
         }
     }
-    return NULL;
+    return push_file(pp, file);
 }
 
-static void clear_defines(void) {
-    for (int i = 0; i < define_count; i++) {
-        free(defines[i].name);
-        free(defines[i].value);
+bool pp_init(Preprocessor *pp, CompilerContext *context, const char *path) {
+    memset(pp, 0, sizeof(*pp));
+    pp->context = context;
+    SourceFile *file = include_open(&context->files, path);
+    if (!file) {
+        fprintf(err_stream(), "Error: Could not open file %s\n", path);
+        return false;
     }
-    define_count = 0;
+    return start(pp, file);
 }
 
-char *preprocess(const char *source) {
-    size_t buffer_size = strlen(source) * 2 + 1024;
-    char *output = malloc(buffer_size);
+/* Preprocess source held in memory, which must outlive pp_finish. name
+ * stands in for its path in diagnostics and quoted #includes. */
+bool pp_init_memory(Preprocessor *pp, CompilerContext *context, const char *name,
+                    const char *source, size_t length) {
+    memset(pp, 0, sizeof(*pp));
+    pp->context = context;
+    SourceFile *file = include_add_memory(&context->files, name, source, length);
+    if (!file) {
+        fprintf(err_stream(), "Error: Memory allocation failed in preprocessor\n");
+        return false;
+    }
+    return start(pp, file);
+}
+
+/* Make room for at least extra more bytes of output */
+bool pp_reserve(Preprocessor *pp, size_t extra) {
+    if (pp->output_size + extra <= pp->output_capacity) {
+        return true;
+    }
+    size_t capacity = pp->output_capacity ? pp->output_capacity : 4096;
+    while (capacity < pp->output_size + extra) {
+        capacity *= 2;
+    }
+    char *output = realloc(pp->output, capacity);
     if (!output) {
-        return NULL;
+        fprintf(err_stream(), "Error: Memory allocation failed in preprocessor\n");
+        return false;
     }
-    output[0] = '\0';
+    pp->output = output;
+    pp->output_capacity = capacity;
+    return true;
+}
 
-    char *line = malloc(MAX_LINE);
-    if (!line) {
-        free(output);
-        return NULL;
+bool pp_append(Preprocessor *pp, const char *text, size_t len) {
+    if (!pp_reserve(pp, len)) {
+        return false;
     }
+    memcpy(pp->output + pp->output_size, text, len);
+    pp->output_size += len;
+    return true;
+}
 
-    const char *ptr = source;
-    size_t output_len = 0;
+static const char *skip_blanks(const char *p, const char *end) {
+    while (p < end && (char_class[(unsigned char)*p] & CHAR_WHITESPACE)) {
+        p++;
+    }
+    return p;
+}
 
-    while (*ptr) {
-        // Read a line
-        size_t line_len = 0;
-        while (*ptr && *ptr != '\n' && line_len < MAX_LINE - 1) {
-            line[line_len++] = *ptr++;
+static const char *skip_identifier(const char *p, const char *end) {
+    while (p < end && (char_class[(unsigned char)*p] & CHAR_IDENT)) {
+        p++;
+    }
+    return p;
+}
+
+static bool is_directive(const char *name, size_t len, const char *expected) {
+    return strlen(expected) == len && memcmp(name, expected, len) == 0;
+}
+
+/* Follow the #ifndef ... #endif include-guard idiom through the file;
+ * called for every non-blank line, with name NULL if not a directive */
+static void track_guard(IncludeFrame *frame, const char *name, size_t len,
+                        const char *p, const char *end) {
+    switch (frame->guard_state) {
+        case GUARD_START:
+            if (name && is_directive(name, len, "ifndef")) {
+                frame->guard = skip_blanks(p, end);
+                frame->guard_length = (size_t)(skip_identifier(frame->guard, end) - frame->guard);
+                frame->guard_state = frame->guard_length ? GUARD_INSIDE : GUARD_NONE;
+                frame->guard_depth = 1;
+            } else {
+                frame->guard_state = GUARD_NONE;
+            }
+            break;
+        case GUARD_INSIDE:
+            if (!name) {
+                break;
+            }
+            if (is_directive(name, len, "if") || is_directive(name, len, "ifdef") ||
+                is_directive(name, len, "ifndef")) {
+                frame->guard_depth++;
+            } else if (is_directive(name, len, "endif")) {
+                if (--frame->guard_depth == 0) {
+                    frame->guard_state = GUARD_CLOSED;
+                }
+            } else if (frame->guard_depth == 1 &&
+                       (is_directive(name, len, "else") || is_directive(name, len, "elif"))) {
+                frame->guard_state = GUARD_NONE;
+            }
+            break;
+        case GUARD_CLOSED:
+            frame->guard_state = GUARD_NONE;
+            break;
+        case GUARD_NONE:
+            break;
+    }
+}
+
+/* Enter the file named by an #include, unless #pragma once or its
+ * include guard says it would expand to nothing */
+static bool include_file(Preprocessor *pp, const char *p, const char *end) {
+    IncludeFrame *frame = &pp->frames[pp->depth - 1];
+    p = skip_blanks(p, end);
+    char close = p < end && *p == '<' ? '>' : '"';
+    if (p == end || (*p != '"' && *p != '<')) {
+        fprintf(err_stream(), "Error: Expected \"file\" or <file> after #include at %s:%d\n",
+                frame->file->path, frame->line);
+        return false;
+    }
+    const char *name = ++p;
+    while (p < end && *p != close) {
+        p++;
+    }
+    if (p == end || p == name) {
+        fprintf(err_stream(), "Error: Malformed #include at %s:%d\n", frame->file->path, frame->line);
+        return false;
+    }
+
+    SourceFile *file = include_resolve(&pp->context->files, frame->file, name, (size_t)(p - name),
+                                       close == '>');
+    if (!file) {
+        fprintf(err_stream(), "Error: Could not find include file %.*s at %s:%d\n",
+                (int)(p - name), name, frame->file->path, frame->line);
+        return false;
+    }
+
+    pp->includes++;
+    if ((file->once && file->entered) ||
+        (file->guard && macro_defined(&pp->context->macros, file->guard, file->guard_length))) {
+        pp->includes_skipped++;
+        return true;
+    }
+    return push_file(pp, file);
+}
+
+/* True while the current branch of a conditional is not compiled */
+static bool skipping(const Preprocessor *pp) {
+    return pp->cond_depth > 0 && !pp->conds[pp->cond_depth - 1].active;
+}
+
+/* Move past an inactive region to the next line that starts with '#'.
+ * Only '#' bytes are searched for, so skipped text is never tokenized
+ * or expanded; frame->ptr must be at the start of a line. */
+static void skip_inactive(IncludeFrame *frame) {
+    const char *p = frame->ptr;
+    const char *end = frame->end;
+    while (p < end) {
+        const char *hash = memchr(p, '#', (size_t)(end - p));
+        if (!hash) {
+            frame->line += (int)scan_count_newlines(p, end);
+            p = end;
+            break;
         }
-        line[line_len] = '\0';
-        if (*ptr == '\n') ptr++;
 
-        // Skip leading whitespace
-        char *trimmed = line;
-        while (*trimmed && isspace(*trimmed)) {
-            trimmed++;
+        // Directive only if nothing but blanks precede it on its line
+        const char *start = hash;
+        while (start > p && start[-1] != '\n' &&
+               (char_class[(unsigned char)start[-1]] & CHAR_WHITESPACE)) {
+            start--;
+        }
+        if (start == p || start[-1] == '\n') {
+            frame->line += (int)scan_count_newlines(p, start);
+            p = start;
+            break;
         }
 
-        // Handle preprocessor directives
-        if (trimmed[0] == '#') {
-            char *directive = trimmed + 1;
-            while (*directive && isspace(*directive)) {
-                directive++;
-            }
+        const char *eol = memchr(hash, '\n', (size_t)(end - hash));
+        eol = eol ? eol + 1 : end;
+        frame->line += (int)scan_count_newlines(p, eol);
+        p = eol;
+    }
+    frame->ptr = p;
+}
 
-            // #define
-            if (strncmp(directive, "define", 6) == 0) {
-                char *def_ptr = directive + 6;
-                while (*def_ptr && isspace(*def_ptr)) {
-                    def_ptr++;
-                }
+/* Evaluate the expression of an #if or #elif, using the output buffer
+ * as scratch space */
+static bool evaluate_condition(Preprocessor *pp, const char *p, const char *end, bool *result) {
+    IncludeFrame *frame = &pp->frames[pp->depth - 1];
+    pp->output_size = 0;
+    if (!macro_expand_condition(pp, p, end)) {
+        return false;
+    }
 
-                char name[256] = {0};
-                int name_len = 0;
-                while (*def_ptr && (isalnum(*def_ptr) || *def_ptr == '_')) {
-                    name[name_len++] = *def_ptr++;
-                }
-                name[name_len] = '\0';
+    long long value;
+    const char *error;
+    bool ok = pp_evaluate(pp->output, pp->output + pp->output_size, &value, &error);
+    pp->output_size = 0;
+    if (!ok) {
+        fprintf(err_stream(), "Error: Invalid #if expression at %s:%d: %s\n",
+                frame->file->path, frame->line, error);
+        return false;
+    }
+    *result = value != 0;
+    return true;
+}
 
-                while (*def_ptr && isspace(*def_ptr)) {
-                    def_ptr++;
-                }
+static bool push_conditional(Preprocessor *pp, bool enclosing_active, bool value, int line) {
+    if (pp->cond_depth >= pp->cond_capacity) {
+        int capacity = pp->cond_capacity ? pp->cond_capacity * 2 : 16;
+        Conditional *conds = realloc(pp->conds, sizeof(Conditional) * capacity);
+        if (!conds) {
+            fprintf(err_stream(), "Error: Memory allocation failed in preprocessor\n");
+            return false;
+        }
+        pp->conds = conds;
+        pp->cond_capacity = capacity;
+    }
+    Conditional *cond = &pp->conds[pp->cond_depth++];
+    cond->enclosing_active = enclosing_active;
+    cond->active = enclosing_active && value;
+    cond->taken = cond->active;
+    cond->seen_else = false;
+    cond->line = line;
+    return true;
+}
+
+/* #if, #ifdef, #ifndef, #elif, #else and #endif. Returns false on error;
+ * *handled tells whether the directive was one of these. Conditions in
+ * inactive regions are never evaluated. */
+static bool handle_conditional(Preprocessor *pp, const char *directive, size_t len,
+                               const char *p, const char *end, bool *handled) {
+    IncludeFrame *frame = &pp->frames[pp->depth - 1];
+    bool is_if = is_directive(directive, len, "if");
+    bool is_ifdef = is_directive(directive, len, "ifdef");
+    bool is_ifndef = is_directive(directive, len, "ifndef");
+    *handled = true;
 
-                add_define(name, *def_ptr ? def_ptr : "");
-                continue;
+    if (is_if || is_ifdef || is_ifndef) {
+        bool enclosing_active = !skipping(pp);
+        bool value = false;
+        if (enclosing_active && is_if) {
+            if (!evaluate_condition(pp, p, end, &value)) {
+                return false;
             }
+        } else if (enclosing_active) {
+            const char *name = skip_blanks(p, end);
+            size_t name_len = (size_t)(skip_identifier(name, end) - name);
+            if (name_len == 0) {
+                fprintf(err_stream(), "Error: Expected macro name after #%.*s at %s:%d\n",
+                        (int)len, directive, frame->file->path, frame->line);
+                return false;
+            }
+            value = macro_defined(&pp->context->macros, name, name_len) == is_ifdef;
+        }
+        return push_conditional(pp, enclosing_active, value, frame->line);
+    }
 
-            // Skip other directives (#include, #ifdef, etc.) for simplicity
+    bool is_elif = is_directive(directive, len, "elif");
+    bool is_else = is_directive(directive, len, "else");
+    bool is_endif = is_directive(directive, len, "endif");
+    if (!is_elif && !is_else && !is_endif) {
+        *handled = false;
+        return true;
+    }
+
+    if (pp->cond_depth <= frame->cond_base) {
+        fprintf(err_stream(), "Error: #%.*s without #if at %s:%d\n",
+                (int)len, directive, frame->file->path, frame->line);
+        return false;
+    }
+    Conditional *cond = &pp->conds[pp->cond_depth - 1];
+    if (is_endif) {
+        pp->cond_depth--;
+        return true;
+    }
+    if (cond->seen_else) {
+        fprintf(err_stream(), "Error: #%.*s after #else at %s:%d\n",
+                (int)len, directive, frame->file->path, frame->line);
+        return false;
+    }
+
+    if (is_else) {
+        cond->seen_else = true;
+        cond->active = cond->enclosing_active && !cond->taken;
+    } else if (cond->enclosing_active && !cond->taken) {
+        if (!evaluate_condition(pp, p, end, &cond->active)) {
+            return false;
+        }
+    } else {
+        cond->active = false;
+    }
+    cond->taken = cond->taken || cond->active;
+    return true;
+}
+
+/* Handle a directive line; p points just past the directive name */
+static bool handle_directive(Preprocessor *pp, const char *directive, size_t directive_len,
+                             const char *p, const char *end) {
+    bool handled;
+    bool ok = handle_conditional(pp, directive, directive_len, p, end, &handled);
+    if (!ok || handled) {
+        return ok;
+    }
+    if (skipping(pp)) {
+        return true;
+    }
+
+    if (is_directive(directive, directive_len, "define")) {
+        IncludeFrame *frame = &pp->frames[pp->depth - 1];
+        return macro_define(&pp->context->macros, p, end, frame->file->path, frame->line);
+    }
+    if (is_directive(directive, directive_len, "undef")) {
+        const char *name = skip_blanks(p, end);
+        macro_undefine(&pp->context->macros, name, (size_t)(skip_identifier(name, end) - name));
+        return true;
+    }
+
+    if (is_directive(directive, directive_len, "include")) {
+        return include_file(pp, p, end);
+    }
+
+    if (is_directive(directive, directive_len, "pragma")) {
+        const char *pragma = skip_blanks(p, end);
+        p = skip_identifier(pragma, end);
+        if (is_directive(pragma, (size_t)(p - pragma), "once")) {
+            pp->frames[pp->depth - 1].file->once = true;
+        }
+        return true;
+    }
+
+    if (is_directive(directive, directive_len, "error")) {
+        IncludeFrame *frame = &pp->frames[pp->depth - 1];
+        const char *message = skip_blanks(p, end);
+        fprintf(err_stream(), "%s:%d: #error %.*s\n", frame->file->path, frame->line,
+                (int)(end - message), message);
+        return false;
+    }
+
+    // Other directives (#line, unknown pragmas, etc.) are ignored
+    return true;
+}
+
+/* End of the logical line starting at p: a backslash right before a
+ * newline joins the next physical line, and *splices counts the joins */
+static const char *line_end(const char *p, const char *end, int *splices) {
+    for (;;) {
+        const char *eol = memchr(p, '\n', (size_t)(end - p));
+        if (!eol) {
+            return end;
+        }
+        if (eol == p || eol[-1] != '\\') {
+            return eol;
+        }
+        (*splices)++;
+        p = eol + 1;
+    }
+}
+
+/* Copy a logical line with its backslash-newlines removed */
+static const char *splice_line(Preprocessor *pp, const char *p, const char *end) {
+    size_t len = (size_t)(end - p);
+    if (len > pp->splice_capacity) {
+        char *splice = realloc(pp->splice, len);
+        if (!splice) {
+            fprintf(err_stream(), "Error: Memory allocation failed in preprocessor\n");
+            return NULL;
+        }
+        pp->splice = splice;
+        pp->splice_capacity = len;
+    }
+    size_t n = 0;
+    while (p < end) {
+        if (*p == '\\' && p + 1 < end && p[1] == '\n') {
+            p += 2;
             continue;
         }
+        pp->splice[n++] = *p++;
+    }
+    pp->splice_size = n;
+    return pp->splice;
+}
 
-        // Replace defined macros in the line
-        char expanded[MAX_LINE * 2];
-        expanded[0] = '\0';
-        char *exp_ptr = expanded;
+/* Produce the next preprocessed line, including its newline, or NULL at
+ * the end of input or on error. Directive lines come back empty. Lines
+ * may be of any length; the result is valid until the next call, and
+ * pp->line holds its line number within the current file. */
+const char *pp_next_line(Preprocessor *pp, size_t *length) {
+    // Lines of a precompiled header come first, straight from its mapping
+    if (pp->pch_ptr < pp->pch_end) {
+        uint32_t record[2];
+        memcpy(record, pp->pch_ptr, sizeof(record));
+        const char *line = pp->pch_ptr + sizeof(record);
+        pp->pch_ptr = line + record[1];
+        pp->line = (int)record[0];
+        *length = record[1];
+        return line;
+    }
 
-        for (size_t i = 0; i < line_len; i++) {
-            if (isalpha(line[i]) || line[i] == '_') {
-                // Potential identifier
-                char ident[256];
-                int ident_len = 0;
-                size_t j = i;
-                while (j < line_len && (isalnum(line[j]) || line[j] == '_')) {
-                    ident[ident_len++] = line[j++];
-                }
-                ident[ident_len] = '\0';
-
-                const char *replacement = get_define(ident);
-                if (replacement) {
-                    strcpy(exp_ptr, replacement);
-                    exp_ptr += strlen(replacement);
-                } else {
-                    strcpy(exp_ptr, ident);
-                    exp_ptr += ident_len;
-                }
-                i = j - 1;
-            } else {
-                *exp_ptr++ = line[i];
+    IncludeFrame *frame;
+    for (;;) {
+        while (pp->depth > 0 && pp->frames[pp->depth - 1].ptr >= pp->frames[pp->depth - 1].end) {
+            if (!pop_file(pp)) {
+                pp->failed = true;
+                return NULL;
             }
         }
-        *exp_ptr = '\0';
-
-        // Add expanded line to output
-        size_t expanded_len = strlen(expanded);
-        if (output_len + expanded_len + 2 >= buffer_size) {
-            buffer_size *= 2;
-            char *new_output = realloc(output, buffer_size);
-            if (!new_output) {
-                free(output);
-                free(line);
-                clear_defines();
+        if (pp->depth == 0) {
+            return NULL;
+        }
+
+        frame = &pp->frames[pp->depth - 1];
+        if (!skipping(pp)) {
+            break;
+        }
+        skip_inactive(frame);
+        if (frame->ptr < frame->end) {
+            break;
+        }
+    }
+
+    const char *line = frame->ptr;
+    int splices = 0;
+    const char *eol = line_end(line, frame->end, &splices);
+    frame->ptr = eol < frame->end ? eol + 1 : eol;
+    pp->line = ++frame->line;
+    frame->line += splices;
+    if (splices > 0) {
+        line = splice_line(pp, line, eol);
+        if (!line) {
+            pp->failed = true;
+            return NULL;
+        }
+        eol = line + pp->splice_size;
+        // A guard name must point into the file, which this copy does not
+        if (frame->guard_state == GUARD_START) {
+            frame->guard_state = GUARD_NONE;
+        }
+    }
+
+    pp->output_size = 0;
+    const char *first = skip_blanks(line, eol);
+    bool ok;
+    if (first < eol && *first == '#') {
+        const char *directive = skip_blanks(first + 1, eol);
+        const char *rest = skip_identifier(directive, eol);
+        size_t directive_len = (size_t)(rest - directive);
+        track_guard(frame, directive, directive_len, rest, eol);
+        ok = handle_directive(pp, directive, directive_len, rest, eol) && pp_append(pp, "\n", 1);
+    } else {
+        if (first < eol) {
+            track_guard(frame, NULL, 0, first, eol);
+        }
+        ok = macro_expand_line(pp, line, eol);
+    }
+    if (!ok) {
+        pp->failed = true;
+        return NULL;
+    }
+
+    *length = pp->output_size;
+    return pp->output;
+}
+
+/* Preprocess the rest of the input now, in the line record format of
+ * precompiled headers, and have pp_next_line return the lines from that
+ * buffer. Blank lines are dropped. The malloc'd buffer must outlive the
+ * preprocessor's use; NULL on error. */
+char *pp_buffer_lines(Preprocessor *pp, size_t *size) {
+    char *buffer = NULL;
+    size_t used = 0;
+    size_t capacity = 0;
+    const char *line;
+    size_t length;
+    while ((line = pp_next_line(pp, &length))) {
+        if (length <= 1) {
+            continue;
+        }
+        uint32_t record[2] = { (uint32_t)pp->line, (uint32_t)length };
+        if (used + sizeof(record) + length > capacity) {
+            size_t grown_capacity = capacity ? capacity : 65536;
+            while (grown_capacity < used + sizeof(record) + length) {
+                grown_capacity *= 2;
+            }
+            char *grown = realloc(buffer, grown_capacity);
+            if (!grown) {
+                fprintf(err_stream(), "Error: Memory allocation failed buffering preprocessed output\n");
+                free(buffer);
                 return NULL;
             }
-            output = new_output;
+            buffer = grown;
+            capacity = grown_capacity;
         }
-
-        strcpy(output + output_len, expanded);
-        output_len += expanded_len;
-        output[output_len++] = '\n';
-        output[output_len] = '\0';
+        memcpy(buffer + used, record, sizeof(record));
+        memcpy(buffer + used + sizeof(record), line, length);
+        used += sizeof(record) + length;
+    }
+    if (pp->failed) {
+        free(buffer);
+        return NULL;
+    }
+    if (!buffer && !(buffer = malloc(1))) {
+        return NULL;
     }
+    pp->pch_ptr = buffer;
+    pp->pch_end = buffer + used;
+    *size = used;
+    return buffer;
+}
 
-    free(line);
-    clear_defines();
-    return output;
+void pp_finish(Preprocessor *pp) {
+    free(pp->frames);
+    free(pp->conds);
+    free(pp->output);
+    free(pp->splice);
+    pp->frames = NULL;
+    pp->depth = 0;
+    pp->conds = NULL;
+    pp->cond_depth = 0;
+    pp->output = NULL;
+    pp->output_size = 0;
+    pp->output_capacity = 0;
+    pp->splice = NULL;
+    pp->splice_capacity = 0;
+    pp->pch_ptr = NULL;
+    pp->pch_end = NULL;
+    if (pp->context) {
+        macro_clear(&pp->context->macros);
+        include_reset(&pp->context->files);
+    }
 }
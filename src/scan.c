@@ -0,0 +1,305 @@
+#include "crappola.h"
+
+/* Character-class scanning for the lexer. Runs of whitespace, identifier
+ * and digit characters are classified 16 or 32 bytes at a time with a
+ * pshufb nibble lookup, picked at run time from the CPU's features. The
+ * preprocessor also counts newlines here when it skips inactive code. */
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define SCAN_SIMD 1
+#include <immintrin.h>
+#endif
+
+/* Each class bit is a product set: a byte belongs to it when both its
+ * low-nibble row and its high-nibble column have the bit set. */
+const uint8_t char_class[256] = {
+    ['\t'] = CHAR_CONTROL_SPACE, ['\n'] = CHAR_CONTROL_SPACE,
+    ['\v'] = CHAR_CONTROL_SPACE, ['\f'] = CHAR_CONTROL_SPACE,
+    ['\r'] = CHAR_CONTROL_SPACE, [' '] = CHAR_SPACE,
+    ['0'] = CHAR_DIGIT, ['1'] = CHAR_DIGIT, ['2'] = CHAR_DIGIT, ['3'] = CHAR_DIGIT,
+    ['4'] = CHAR_DIGIT, ['5'] = CHAR_DIGIT, ['6'] = CHAR_DIGIT, ['7'] = CHAR_DIGIT,
+    ['8'] = CHAR_DIGIT, ['9'] = CHAR_DIGIT,
+    ['A'] = CHAR_ALPHA_LO, ['B'] = CHAR_ALPHA_LO, ['C'] = CHAR_ALPHA_LO, ['D'] = CHAR_ALPHA_LO,
+    ['E'] = CHAR_ALPHA_LO, ['F'] = CHAR_ALPHA_LO, ['G'] = CHAR_ALPHA_LO, ['H'] = CHAR_ALPHA_LO,
+    ['I'] = CHAR_ALPHA_LO, ['J'] = CHAR_ALPHA_LO, ['K'] = CHAR_ALPHA_LO, ['L'] = CHAR_ALPHA_LO,
+    ['M'] = CHAR_ALPHA_LO, ['N'] = CHAR_ALPHA_LO, ['O'] = CHAR_ALPHA_LO,
+    ['P'] = CHAR_ALPHA_HI, ['Q'] = CHAR_ALPHA_HI, ['R'] = CHAR_ALPHA_HI, ['S'] = CHAR_ALPHA_HI,
+    ['T'] = CHAR_ALPHA_HI, ['U'] = CHAR_ALPHA_HI, ['V'] = CHAR_ALPHA_HI, ['W'] = CHAR_ALPHA_HI,
+    ['X'] = CHAR_ALPHA_HI, ['Y'] = CHAR_ALPHA_HI, ['Z'] = CHAR_ALPHA_HI,
+    ['_'] = CHAR_UNDERSCORE,
+    ['a'] = CHAR_ALPHA_LO, ['b'] = CHAR_ALPHA_LO, ['c'] = CHAR_ALPHA_LO, ['d'] = CHAR_ALPHA_LO,
+    ['e'] = CHAR_ALPHA_LO, ['f'] = CHAR_ALPHA_LO, ['g'] = CHAR_ALPHA_LO, ['h'] = CHAR_ALPHA_LO,
+    ['i'] = CHAR_ALPHA_LO, ['j'] = CHAR_ALPHA_LO, ['k'] = CHAR_ALPHA_LO, ['l'] = CHAR_ALPHA_LO,
+    ['m'] = CHAR_ALPHA_LO, ['n'] = CHAR_ALPHA_LO, ['o'] = CHAR_ALPHA_LO,
+    ['p'] = CHAR_ALPHA_HI, ['q'] = CHAR_ALPHA_HI, ['r'] = CHAR_ALPHA_HI, ['s'] = CHAR_ALPHA_HI,
+    ['t'] = CHAR_ALPHA_HI, ['u'] = CHAR_ALPHA_HI, ['v'] = CHAR_ALPHA_HI, ['w'] = CHAR_ALPHA_HI,
+    ['x'] = CHAR_ALPHA_HI, ['y'] = CHAR_ALPHA_HI, ['z'] = CHAR_ALPHA_HI,
+};
+
+static const char *scan_class_scalar(const char *p, const char *end, uint8_t mask) {
+    while (p < end && (char_class[(unsigned char)*p] & mask)) {
+        p++;
+    }
+    return p;
+}
+
+static const char *scan_whitespace_scalar(const char *p, const char *end, int *newlines) {
+    while (p < end && (char_class[(unsigned char)*p] & CHAR_WHITESPACE)) {
+        if (*p == '\n') {
+            (*newlines)++;
+        }
+        p++;
+    }
+    return p;
+}
+
+static size_t count_newlines_scalar(const char *p, const char *end) {
+    size_t count = 0;
+    while ((p = memchr(p, '\n', (size_t)(end - p))) != NULL) {
+        count++;
+        p++;
+    }
+    return count;
+}
+
+#ifdef SCAN_SIMD
+
+/* Class bits indexed by low nibble and by high nibble */
+#define NIBBLE_TABLES                                                       \
+    const char lo[16] = {                                                   \
+        CHAR_DIGIT | CHAR_ALPHA_HI | CHAR_SPACE,            /* 0 */         \
+        CHAR_DIGIT | CHAR_ALPHA_LO | CHAR_ALPHA_HI,         /* 1 */         \
+        CHAR_DIGIT | CHAR_ALPHA_LO | CHAR_ALPHA_HI,         /* 2 */         \
+        CHAR_DIGIT | CHAR_ALPHA_LO | CHAR_ALPHA_HI,         /* 3 */         \
+        CHAR_DIGIT | CHAR_ALPHA_LO | CHAR_ALPHA_HI,         /* 4 */         \
+        CHAR_DIGIT | CHAR_ALPHA_LO | CHAR_ALPHA_HI,         /* 5 */         \
+        CHAR_DIGIT | CHAR_ALPHA_LO | CHAR_ALPHA_HI,         /* 6 */         \
+        CHAR_DIGIT | CHAR_ALPHA_LO | CHAR_ALPHA_HI,         /* 7 */         \
+        CHAR_DIGIT | CHAR_ALPHA_LO | CHAR_ALPHA_HI,         /* 8 */         \
+        CHAR_DIGIT | CHAR_ALPHA_LO | CHAR_ALPHA_HI | CHAR_CONTROL_SPACE, /* 9 */ \
+        CHAR_ALPHA_LO | CHAR_ALPHA_HI | CHAR_CONTROL_SPACE, /* a */         \
+        CHAR_ALPHA_LO | CHAR_CONTROL_SPACE,                 /* b */         \
+        CHAR_ALPHA_LO | CHAR_CONTROL_SPACE,                 /* c */         \
+        CHAR_ALPHA_LO | CHAR_CONTROL_SPACE,                 /* d */         \
+        CHAR_ALPHA_LO,                                      /* e */         \
+        CHAR_ALPHA_LO | CHAR_UNDERSCORE,                    /* f */         \
+    };                                                                      \
+    const char hi[16] = {                                                   \
+        CHAR_CONTROL_SPACE, 0, CHAR_SPACE, CHAR_DIGIT,                      \
+        CHAR_ALPHA_LO, CHAR_ALPHA_HI | CHAR_UNDERSCORE,                     \
+        CHAR_ALPHA_LO, CHAR_ALPHA_HI,                                       \
+        0, 0, 0, 0, 0, 0, 0, 0,                                             \
+    }
+
+__attribute__((target("ssse3")))
+static inline __m128i classify16(__m128i bytes, __m128i lo_table, __m128i hi_table) {
+    __m128i nibble = _mm_set1_epi8(0x0F);
+    __m128i lo_bits = _mm_shuffle_epi8(lo_table, _mm_and_si128(bytes, nibble));
+    __m128i hi_bits = _mm_shuffle_epi8(hi_table, _mm_and_si128(_mm_srli_epi16(bytes, 4), nibble));
+    return _mm_and_si128(lo_bits, hi_bits);
+}
+
+/* Bitmask of lanes whose class has none of the mask bits set */
+__attribute__((target("ssse3")))
+static inline unsigned outside16(__m128i classes, uint8_t mask) {
+    __m128i hits = _mm_and_si128(classes, _mm_set1_epi8((char)mask));
+    return (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(hits, _mm_setzero_si128()));
+}
+
+__attribute__((target("ssse3")))
+static const char *scan_class_ssse3(const char *p, const char *end, uint8_t mask) {
+    NIBBLE_TABLES;
+    __m128i lo_table = _mm_loadu_si128((const __m128i *)lo);
+    __m128i hi_table = _mm_loadu_si128((const __m128i *)hi);
+
+    while (end - p >= 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)p);
+        unsigned stop = outside16(classify16(bytes, lo_table, hi_table), mask);
+        if (stop) {
+            return p + __builtin_ctz(stop);
+        }
+        p += 16;
+    }
+    return scan_class_scalar(p, end, mask);
+}
+
+__attribute__((target("ssse3,popcnt")))
+static const char *scan_whitespace_ssse3(const char *p, const char *end, int *newlines) {
+    NIBBLE_TABLES;
+    __m128i lo_table = _mm_loadu_si128((const __m128i *)lo);
+    __m128i hi_table = _mm_loadu_si128((const __m128i *)hi);
+    __m128i newline = _mm_set1_epi8('\n');
+
+    while (end - p >= 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)p);
+        unsigned stop = outside16(classify16(bytes, lo_table, hi_table), CHAR_WHITESPACE);
+        unsigned lines = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, newline));
+        if (stop) {
+            unsigned n = __builtin_ctz(stop);
+            *newlines += __builtin_popcount(lines & ((1u << n) - 1));
+            return p + n;
+        }
+        *newlines += __builtin_popcount(lines);
+        p += 16;
+    }
+    return scan_whitespace_scalar(p, end, newlines);
+}
+
+__attribute__((target("sse2,popcnt")))
+static size_t count_newlines_sse2(const char *p, const char *end) {
+    __m128i newline = _mm_set1_epi8('\n');
+    size_t count = 0;
+    while (end - p >= 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)p);
+        count += __builtin_popcount((unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, newline)));
+        p += 16;
+    }
+    return count + count_newlines_scalar(p, end);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i classify32(__m256i bytes, __m256i lo_table, __m256i hi_table) {
+    __m256i nibble = _mm256_set1_epi8(0x0F);
+    __m256i lo_bits = _mm256_shuffle_epi8(lo_table, _mm256_and_si256(bytes, nibble));
+    __m256i hi_bits = _mm256_shuffle_epi8(hi_table, _mm256_and_si256(_mm256_srli_epi16(bytes, 4), nibble));
+    return _mm256_and_si256(lo_bits, hi_bits);
+}
+
+__attribute__((target("avx2")))
+static inline uint32_t outside32(__m256i classes, uint8_t mask) {
+    __m256i hits = _mm256_and_si256(classes, _mm256_set1_epi8((char)mask));
+    return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hits, _mm256_setzero_si256()));
+}
+
+__attribute__((target("avx2")))
+static const char *scan_class_avx2(const char *p, const char *end, uint8_t mask) {
+    NIBBLE_TABLES;
+    // pshufb works per 128-bit lane, so both lanes get the same table
+    __m256i lo_table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)lo));
+    __m256i hi_table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)hi));
+
+    while (end - p >= 32) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i *)p);
+        uint32_t stop = outside32(classify32(bytes, lo_table, hi_table), mask);
+        if (stop) {
+            return p + __builtin_ctz(stop);
+        }
+        p += 32;
+    }
+    return scan_class_scalar(p, end, mask);
+}
+
+__attribute__((target("avx2,popcnt")))
+static const char *scan_whitespace_avx2(const char *p, const char *end, int *newlines) {
+    NIBBLE_TABLES;
+    __m256i lo_table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)lo));
+    __m256i hi_table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)hi));
+    __m256i newline = _mm256_set1_epi8('\n');
+
+    while (end - p >= 32) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i *)p);
+        uint32_t stop = outside32(classify32(bytes, lo_table, hi_table), CHAR_WHITESPACE);
+        uint32_t lines = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, newline));
+        if (stop) {
+            unsigned n = __builtin_ctz(stop);
+            *newlines += __builtin_popcount(lines & ((1u << n) - 1));
+            return p + n;
+        }
+        *newlines += __builtin_popcount(lines);
+        p += 32;
+    }
+    return scan_whitespace_scalar(p, end, newlines);
+}
+
+/* Compare results are summed in 8-bit lanes and folded into the total
+ * with vpsadbw at least every 255 vectors, before a lane can overflow */
+__attribute__((target("avx2")))
+static size_t count_newlines_avx2(const char *p, const char *end) {
+    __m256i newline = _mm256_set1_epi8('\n');
+    size_t count = 0;
+    while (end - p >= 32) {
+        __m256i sums = _mm256_setzero_si256();
+        int steps = 0;
+        while (end - p >= 32 && steps < 255) {
+            __m256i bytes = _mm256_loadu_si256((const __m256i *)p);
+            // Matching lanes are all ones, i.e. -1, so subtracting counts
+            sums = _mm256_sub_epi8(sums, _mm256_cmpeq_epi8(bytes, newline));
+            p += 32;
+            steps++;
+        }
+        __m256i totals = _mm256_sad_epu8(sums, _mm256_setzero_si256());
+        count += (size_t)_mm256_extract_epi64(totals, 0) + (size_t)_mm256_extract_epi64(totals, 1) +
+                 (size_t)_mm256_extract_epi64(totals, 2) + (size_t)_mm256_extract_epi64(totals, 3);
+    }
+    return count + count_newlines_scalar(p, end);
+}
+
+#endif /* SCAN_SIMD */
+
+typedef struct {
+    const char *name;
+    const char *(*scan_class)(const char *p, const char *end, uint8_t mask);
+    const char *(*scan_whitespace)(const char *p, const char *end, int *newlines);
+    size_t (*count_newlines)(const char *p, const char *end);
+} ScanBackend;
+
+static const ScanBackend scalar_backend = {
+    "scalar", scan_class_scalar, scan_whitespace_scalar, count_newlines_scalar,
+};
+#ifdef SCAN_SIMD
+static const ScanBackend ssse3_backend = {
+    "ssse3", scan_class_ssse3, scan_whitespace_ssse3, count_newlines_sse2,
+};
+static const ScanBackend avx2_backend = {
+    "avx2", scan_class_avx2, scan_whitespace_avx2, count_newlines_avx2,
+};
+#endif
+
+static const ScanBackend *backend = NULL;
+
+/* Pick the widest backend the CPU supports. CRAPPOLA_SCAN=scalar|ssse3|avx2
+ * narrows the choice, which is handy for benchmarking. */
+static const ScanBackend *select_backend(void) {
+    const char *forced = getenv("CRAPPOLA_SCAN");
+    if (forced && strcmp(forced, "scalar") == 0) {
+        return &scalar_backend;
+    }
+#ifdef SCAN_SIMD
+    __builtin_cpu_init();
+    bool want_avx2 = !forced || strcmp(forced, "avx2") == 0;
+    if (want_avx2 && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+        return &avx2_backend;
+    }
+    if (__builtin_cpu_supports("ssse3") && __builtin_cpu_supports("popcnt")) {
+        return &ssse3_backend;
+    }
+#endif
+    return &scalar_backend;
+}
+
+/* Threads that race on the first scan all pick the same backend, so
+ * the choice only has to be published atomically */
+static inline const ScanBackend *get_backend(void) {
+    const ScanBackend *chosen = __atomic_load_n(&backend, __ATOMIC_ACQUIRE);
+    if (!chosen) {
+        chosen = select_backend();
+        __atomic_store_n(&backend, chosen, __ATOMIC_RELEASE);
+    }
+    return chosen;
+}
+
+const char *scan_class(const char *p, const char *end, uint8_t mask) {
+    return get_backend()->scan_class(p, end, mask);
+}
+
+const char *scan_whitespace(const char *p, const char *end, int *newlines) {
+    return get_backend()->scan_whitespace(p, end, newlines);
+}
+
+size_t scan_count_newlines(const char *p, const char *end) {
+    return get_backend()->count_newlines(p, end);
+}
+
+const char *scan_backend_name(void) {
+    return get_backend()->name;
+}
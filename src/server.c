@@ -0,0 +1,620 @@
+#define _GNU_SOURCE     /* struct ucred, for SO_PEERCRED */
+#include "crappola.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+/* Compile server. A long-running process listens on a Unix domain socket
+ * and compiles the command lines its clients send, on a pool of threads.
+ * Each thread keeps its own CompilerContext from request to request, and
+ * all of them map files through one FileStore, so headers and PCH files
+ * stay mapped while they are unchanged.
+ *
+ * A request is a RequestHeader followed by the client's working directory
+ * and its arguments, each NUL-terminated. The client's stdout and stderr
+ * travel with the header as SCM_RIGHTS, so everything a compilation
+ * prints goes straight to the client's terminal. The reply is the exit
+ * status, as a 32-bit int.
+ *
+ * A request runs with the server's identity and may write any file it
+ * names, so only the user running the server may connect. The default
+ * socket lives in a directory only that user can enter, the socket is
+ * bound mode 0600, and both ends check the other's uid. */
+
+#define SERVER_MAGIC 0x43524150u    /* "CRAP" */
+#define MAX_REQUEST_ARGS 4096
+#define MAX_REQUEST_SIZE (1 << 20)
+#define QUEUE_SIZE 256
+#define LATENCY_SAMPLES 4096
+
+typedef struct {
+    uint32_t magic;
+    uint32_t argc;
+    uint32_t length;        /* of the strings that follow */
+} RequestHeader;
+
+typedef struct {
+    FileStore *files;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;           /* a connection was queued */
+    pthread_cond_t space;           /* a connection was taken */
+    int queue[QUEUE_SIZE];          /* accepted connections */
+    int queue_head;
+    int queue_count;
+    bool stopping;
+    int threads;
+    double started;
+    long requests;
+    long failed;
+    double latencies[LATENCY_SAMPLES];  /* of the latest requests, in seconds */
+} Server;
+
+static volatile sig_atomic_t stop_requested;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void request_stop(int signal_number) {
+    (void)signal_number;
+    stop_requested = 1;
+}
+
+/* Whether dir is a directory of ours that nobody else can enter. The
+ * server creates it if need be; a client only checks it. */
+static bool private_directory(const char *dir, bool create) {
+    if (create && mkdir(dir, 0700) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Error: Could not create %s: %s\n", dir, strerror(errno));
+        return false;
+    }
+    struct stat st;
+    if (lstat(dir, &st) != 0) {
+        fprintf(stderr, "Error: Could not find %s: %s\n", dir, strerror(errno));
+        return false;
+    }
+    if (!S_ISDIR(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & 077) != 0) {
+        fprintf(stderr, "Error: %s is not a directory private to this user\n", dir);
+        return false;
+    }
+    return true;
+}
+
+/* The socket to use when none is given: one per user, in
+ * $XDG_RUNTIME_DIR when that is private, or else in a 0700 directory
+ * of our own under /tmp. NULL if that directory is not safe to use. */
+static const char *socket_name(const char *path, bool create, char *buffer, size_t size) {
+    if (path) {
+        return path;
+    }
+    const char *runtime = getenv("XDG_RUNTIME_DIR");
+    struct stat st;
+    if (runtime && runtime[0] == '/' && lstat(runtime, &st) == 0 && S_ISDIR(st.st_mode) &&
+        st.st_uid == geteuid() && (st.st_mode & 077) == 0) {
+        snprintf(buffer, size, "%s/crappola.sock", runtime);
+        return buffer;
+    }
+    char dir[64];
+    snprintf(dir, sizeof(dir), "/tmp/crappola-%d", (int)geteuid());
+    if (!private_directory(dir, create)) {
+        return NULL;
+    }
+    snprintf(buffer, size, "%s/server.sock", dir);
+    return buffer;
+}
+
+/* Whether the process at the other end of a connection runs as us */
+static bool peer_is_us(int fd) {
+    uid_t uid;
+#ifdef SO_PEERCRED
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0) {
+        return false;
+    }
+    uid = cred.uid;
+#else
+    gid_t gid;
+    if (getpeereid(fd, &uid, &gid) != 0) {
+        return false;
+    }
+#endif
+    return uid == geteuid();
+}
+
+static bool socket_address(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "Error: Socket path too long: %s\n", path);
+        return false;
+    }
+    strcpy(addr->sun_path, path);
+    return true;
+}
+
+static int connect_to(const struct sockaddr_un *addr) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (const struct sockaddr *)addr, sizeof(*addr)) != 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+static bool read_all(int fd, void *data, size_t len) {
+    char *p = data;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+static bool write_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+/* Read a request: the header with the client's two stream descriptors,
+ * then its strings. On success *payload is malloc'd and NUL-terminated. */
+static bool receive_request(int fd, RequestHeader *header, int streams[2], char **payload) {
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    struct iovec iov = { header, sizeof(*header) };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    int flags = 0;
+#ifdef MSG_CMSG_CLOEXEC
+    flags = MSG_CMSG_CLOEXEC;
+#endif
+    ssize_t n;
+    while ((n = recvmsg(fd, &msg, flags)) < 0 && errno == EINTR) {
+    }
+    if (n <= 0) {
+        return false;
+    }
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS &&
+            c->cmsg_len == CMSG_LEN(2 * sizeof(int))) {
+            memcpy(streams, CMSG_DATA(c), 2 * sizeof(int));
+            fcntl(streams[0], F_SETFD, FD_CLOEXEC);
+            fcntl(streams[1], F_SETFD, FD_CLOEXEC);
+        }
+    }
+    if ((size_t)n < sizeof(*header) &&
+        !read_all(fd, (char *)header + n, sizeof(*header) - (size_t)n)) {
+        return false;
+    }
+    if (streams[0] < 0 || header->magic != SERVER_MAGIC || header->argc > MAX_REQUEST_ARGS ||
+        header->length == 0 || header->length > MAX_REQUEST_SIZE) {
+        return false;
+    }
+
+    *payload = malloc(header->length);
+    if (!*payload || !read_all(fd, *payload, header->length) ||
+        (*payload)[header->length - 1] != '\0') {
+        free(*payload);
+        *payload = NULL;
+        return false;
+    }
+    return true;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void print_server_stats(Server *server, FILE *out) {
+    double latencies[LATENCY_SAMPLES];
+    pthread_mutex_lock(&server->lock);
+    long requests = server->requests;
+    long failed = server->failed;
+    int count = requests < LATENCY_SAMPLES ? (int)requests : LATENCY_SAMPLES;
+    memcpy(latencies, server->latencies, sizeof(double) * (size_t)count);
+    pthread_mutex_unlock(&server->lock);
+
+    double uptime = now_seconds() - server->started;
+    fprintf(out, "Compile server: up %.1f s, %d threads\n", uptime, server->threads);
+    fprintf(out, "  Requests: %ld, %ld failed, %.2f per second\n", requests, failed,
+            uptime > 0 ? requests / uptime : 0.0);
+    if (count > 0) {
+        // Nearest-rank percentiles of the latest requests
+        qsort(latencies, (size_t)count, sizeof(double), compare_doubles);
+        const double ranks[] = { 0.50, 0.90, 0.99 };
+        double values[3];
+        for (int i = 0; i < 3; i++) {
+            int index = (int)(ranks[i] * count + 0.999999) - 1;
+            values[i] = latencies[index < 0 ? 0 : index];
+        }
+        fprintf(out, "  Latency over the last %d: p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+                count, values[0] * 1e3, values[1] * 1e3, values[2] * 1e3,
+                latencies[count - 1] * 1e3);
+    }
+
+    long hits, misses;
+    int files;
+    size_t bytes;
+    file_store_stats(server->files, &hits, &misses, &files, &bytes);
+    fprintf(out, "  File store: %d files, %.1f KB mapped, %ld hits, %ld misses (%.1f%% hits)\n",
+            files, bytes / 1024.0, hits, misses,
+            hits + misses ? 100.0 * hits / (hits + misses) : 0.0);
+}
+
+static void record_request(Server *server, double latency, bool failed) {
+    pthread_mutex_lock(&server->lock);
+    server->latencies[server->requests % LATENCY_SAMPLES] = latency;
+    server->requests++;
+    if (failed) {
+        server->failed++;
+    }
+    pthread_mutex_unlock(&server->lock);
+}
+
+/* Run one request and send its exit status. The connection and the
+ * client's stream descriptors are closed. */
+static void handle_request(Server *server, CompilerContext *context, int fd) {
+    double start = now_seconds();
+    RequestHeader header;
+    int streams[2] = { -1, -1 };
+    char *payload = NULL;
+    char **argv = NULL;
+    FILE *out = NULL;
+    FILE *err = NULL;
+    int32_t status = 1;
+
+    bool ok = receive_request(fd, &header, streams, &payload) &&
+              (argv = calloc(header.argc + 2, sizeof(char *)));
+    // The payload is the working directory, then one string per argument
+    const char *directory = payload;
+    const char *p = payload;
+    const char *end = payload + (ok ? header.length : 0);
+    for (uint32_t i = 0; ok && i <= header.argc; i++) {
+        if (p >= end) {
+            ok = false;
+            break;
+        }
+        if (i > 0) {
+            argv[i] = (char *)p;
+        }
+        p += strlen(p) + 1;
+    }
+    if (ok && (out = fdopen(streams[0], "w"))) {
+        streams[0] = -1;
+    }
+    if (ok && (err = fdopen(streams[1], "w"))) {
+        streams[1] = -1;
+    }
+
+    if (!out || !err || directory[0] != '/') {
+        // Not a request we can answer
+    } else if (header.argc == 1 && strcmp(argv[1], "--server-stats") == 0) {
+        print_server_stats(server, out);
+        status = 0;
+    } else if (!context) {
+        fprintf(err, "Error: The compile server is out of memory\n");
+    } else {
+        argv[0] = "crappola";
+        crappola_set_streams(out, err);
+        status = driver_run(context, (int)header.argc + 1, argv, directory);
+        fflush(out);
+        fflush(err);
+        crappola_set_streams(NULL, NULL);
+        crappola_reset(context);
+        record_request(server, now_seconds() - start, status != 0);
+    }
+
+    // The streams are flushed before the status goes out, so the client
+    // exits only after all of the output has been written
+    if (out) {
+        fclose(out);
+    }
+    if (err) {
+        fclose(err);
+    }
+    for (int i = 0; i < 2; i++) {
+        if (streams[i] >= 0) {
+            close(streams[i]);
+        }
+    }
+    write_all(fd, &status, sizeof(status));
+    close(fd);
+    free(argv);
+    free(payload);
+}
+
+static void *worker(void *arg) {
+    Server *server = arg;
+    CompilerContext *context = crappola_create();
+    if (context) {
+        context->files.store = server->files;
+    }
+    for (;;) {
+        pthread_mutex_lock(&server->lock);
+        while (server->queue_count == 0 && !server->stopping) {
+            pthread_cond_wait(&server->ready, &server->lock);
+        }
+        if (server->queue_count == 0) {
+            pthread_mutex_unlock(&server->lock);
+            break;
+        }
+        int fd = server->queue[server->queue_head];
+        server->queue_head = (server->queue_head + 1) % QUEUE_SIZE;
+        server->queue_count--;
+        pthread_cond_signal(&server->space);
+        pthread_mutex_unlock(&server->lock);
+
+        handle_request(server, context, fd);
+    }
+    crappola_destroy(context);
+    return NULL;
+}
+
+static void enqueue(Server *server, int fd) {
+    pthread_mutex_lock(&server->lock);
+    while (server->queue_count == QUEUE_SIZE) {
+        pthread_cond_wait(&server->space, &server->lock);
+    }
+    server->queue[(server->queue_head + server->queue_count) % QUEUE_SIZE] = fd;
+    server->queue_count++;
+    pthread_cond_signal(&server->ready);
+    pthread_mutex_unlock(&server->lock);
+}
+
+/* Bind the socket, replacing a stale one left by a server that is gone
+ * but never another file or a live server */
+static int listen_on(const char *path) {
+    struct sockaddr_un addr;
+    if (!socket_address(path, &addr)) {
+        return -1;
+    }
+    struct stat st;
+    if (lstat(path, &st) == 0) {
+        int fd = connect_to(&addr);
+        if (fd >= 0) {
+            close(fd);
+            fprintf(stderr, "Error: A compile server is already listening on %s\n", path);
+            return -1;
+        }
+        if (!S_ISSOCK(st.st_mode) || unlink(path) != 0) {
+            fprintf(stderr, "Error: %s exists and is not a stale socket\n", path);
+            return -1;
+        }
+    }
+
+    // Nobody else may connect, whatever the umask we were started with.
+    // No other thread is running yet, so changing the umask is safe.
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    mode_t saved_mask = umask(077);
+    bool bound = fd >= 0 && bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    umask(saved_mask);
+    if (!bound || chmod(path, 0600) != 0 || listen(fd, QUEUE_SIZE) != 0) {
+        fprintf(stderr, "Error: Could not listen on %s: %s\n", path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+/* Serve until SIGINT or SIGTERM, then finish the requests already
+ * accepted and remove the socket */
+int server_run(const char *socket_path, int threads) {
+    char buffer[108];
+    const char *path = socket_name(socket_path, true, buffer, sizeof(buffer));
+    int listen_fd = path ? listen_on(path) : -1;
+    if (listen_fd < 0) {
+        return 1;
+    }
+
+    Server *server = calloc(1, sizeof(Server));
+    pthread_t *pool = calloc((size_t)threads, sizeof(pthread_t));
+    if (!server || !pool || !(server->files = file_store_create())) {
+        fprintf(stderr, "Error: Memory allocation failed starting the compile server\n");
+        close(listen_fd);
+        unlink(path);
+        free(server);
+        free(pool);
+        return 1;
+    }
+    pthread_mutex_init(&server->lock, NULL);
+    pthread_cond_init(&server->ready, NULL);
+    pthread_cond_init(&server->space, NULL);
+    server->started = now_seconds();
+
+    // A client that goes away must not take the server with it. The
+    // stop signals are delivered to this thread only, so that they
+    // interrupt accept; workers start with them blocked.
+    signal(SIGPIPE, SIG_IGN);
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = request_stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    sigset_t stop_set, saved;
+    sigemptyset(&stop_set);
+    sigaddset(&stop_set, SIGINT);
+    sigaddset(&stop_set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_set, &saved);
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&pool[i], NULL, worker, server) != 0) {
+            fprintf(stderr, "Error: Could not start server thread %d\n", i + 1);
+            break;
+        }
+        server->threads++;
+    }
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+    printf("Crappola compile server v%s listening on %s with %d threads\n", CRAPPOLA_VERSION, path,
+           server->threads);
+    fflush(stdout);
+
+    while (!stop_requested && server->threads > 0) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                fprintf(stderr, "Error: accept failed: %s\n", strerror(errno));
+                break;
+            }
+            continue;
+        }
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        if (!peer_is_us(fd)) {
+            // Someone else's request would run as us: refuse it unread
+            close(fd);
+            continue;
+        }
+        enqueue(server, fd);
+    }
+
+    close(listen_fd);
+    unlink(path);
+    pthread_mutex_lock(&server->lock);
+    server->stopping = true;
+    pthread_cond_broadcast(&server->ready);
+    pthread_mutex_unlock(&server->lock);
+    for (int i = 0; i < server->threads; i++) {
+        pthread_join(pool[i], NULL);
+    }
+    printf("Compile server stopped after %ld requests\n", server->requests);
+
+    file_store_destroy(server->files);
+    pthread_cond_destroy(&server->space);
+    pthread_cond_destroy(&server->ready);
+    pthread_mutex_destroy(&server->lock);
+    free(pool);
+    free(server);
+    return 0;
+}
+
+/* Forward a command line to the server and wait for its exit status. The
+ * server writes to our stdout and stderr directly. */
+int client_run(const char *socket_path, int argc, char *argv[]) {
+    char buffer[108];
+    const char *path = socket_name(socket_path, false, buffer, sizeof(buffer));
+    struct sockaddr_un addr;
+    if (!path || !socket_address(path, &addr)) {
+        return 1;
+    }
+    // Our sources and streams go only to a server run by us
+    struct stat st;
+    if (lstat(path, &st) == 0 && (!S_ISSOCK(st.st_mode) || st.st_uid != geteuid())) {
+        fprintf(stderr, "Error: %s is not a socket owned by this user\n", path);
+        return 1;
+    }
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd))) {
+        fprintf(stderr, "Error: Could not get the current directory\n");
+        return 1;
+    }
+
+    size_t length = strlen(cwd) + 1;
+    for (int i = 0; i < argc; i++) {
+        length += strlen(argv[i]) + 1;
+    }
+    if (argc > MAX_REQUEST_ARGS || length > MAX_REQUEST_SIZE) {
+        fprintf(stderr, "Error: Command line too long for the compile server\n");
+        return 1;
+    }
+    char *payload = malloc(length);
+    if (!payload) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return 1;
+    }
+    char *p = payload;
+    p = stpcpy(p, cwd) + 1;
+    for (int i = 0; i < argc; i++) {
+        p = stpcpy(p, argv[i]) + 1;
+    }
+
+    int fd = connect_to(&addr);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Could not connect to the compile server at %s: %s\n", path,
+                strerror(errno));
+        free(payload);
+        return 1;
+    }
+    if (!peer_is_us(fd)) {
+        fprintf(stderr, "Error: The compile server at %s is run by another user\n", path);
+        close(fd);
+        free(payload);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    // Anything we printed must come before what the server prints
+    fflush(stdout);
+    fflush(stderr);
+
+    RequestHeader header = { SERVER_MAGIC, (uint32_t)argc, (uint32_t)length };
+    int streams[2] = { STDOUT_FILENO, STDERR_FILENO };
+    char control[CMSG_SPACE(sizeof(streams))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = { &header, sizeof(header) };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(streams));
+    memcpy(CMSG_DATA(c), streams, sizeof(streams));
+
+    ssize_t n;
+    while ((n = sendmsg(fd, &msg, 0)) < 0 && errno == EINTR) {
+    }
+    int32_t status;
+    bool ok = n >= 0 &&
+              ((size_t)n == sizeof(header) ||
+               write_all(fd, (char *)&header + n, sizeof(header) - (size_t)n)) &&
+              write_all(fd, payload, length) && read_all(fd, &status, sizeof(status));
+    free(payload);
+    close(fd);
+    if (!ok) {
+        fprintf(stderr, "Error: The compile server at %s closed the connection\n", path);
+        return 1;
+    }
+    return status;
+}
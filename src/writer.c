@@ -0,0 +1,110 @@
+#include "crappola.h"
+#include <errno.h>
+#include <unistd.h>
+
+/* Assembly output. A writer either keeps its text in memory, growing by
+ * doubling, or holds one fixed chunk that is written to a file
+ * descriptor whenever it fills, so the text of a unit never exists whole.
+ * Errors are sticky: after the first, later output is dropped and the
+ * caller finds failed set when it finishes. */
+
+#define WRITER_CHUNK (64 * 1024)
+
+void writer_init_memory(AsmWriter *writer) {
+    memset(writer, 0, sizeof(*writer));
+    writer->fd = -1;
+}
+
+void writer_init_fd(AsmWriter *writer, int fd) {
+    memset(writer, 0, sizeof(*writer));
+    writer->fd = fd;
+}
+
+static bool write_all(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t n = write(fd, data, length);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += n;
+        length -= (size_t)n;
+    }
+    return true;
+}
+
+/* Write the buffered text to the descriptor. A failed write is not
+ * reported here: the reader has usually gone, and it has its own story. */
+bool writer_flush(AsmWriter *writer) {
+    if (writer->fd >= 0 && writer->size > 0 && !writer->failed) {
+        writer->failed = !write_all(writer->fd, writer->data, writer->size);
+    }
+    if (writer->fd >= 0) {
+        writer->size = 0;
+    }
+    return !writer->failed;
+}
+
+/* Make room for length more bytes, flushing a descriptor's chunk or
+ * growing a memory buffer. The common case is checked inline by callers. */
+bool writer_reserve(AsmWriter *writer, size_t length) {
+    if (writer->failed) {
+        return false;
+    }
+    if (writer->fd >= 0 && writer->size > 0 && !writer_flush(writer)) {
+        return false;
+    }
+    if (writer->capacity - writer->size >= length) {
+        return true;
+    }
+    size_t capacity = writer->capacity ? writer->capacity : WRITER_CHUNK;
+    while (capacity - writer->size < length) {
+        capacity *= 2;
+    }
+    char *data = realloc(writer->data, capacity);
+    if (!data) {
+        fprintf(err_stream(), "Error: Memory allocation failed in code generator\n");
+        writer->failed = true;
+        return false;
+    }
+    writer->data = data;
+    writer->capacity = capacity;
+    return true;
+}
+
+void writer_write(AsmWriter *writer, const char *text, size_t length) {
+    if (writer->fd >= 0 && length >= WRITER_CHUNK) {
+        // Large blocks go straight out rather than through the chunk
+        if (writer_flush(writer) && !write_all(writer->fd, text, length)) {
+            writer->failed = true;
+        }
+        writer->total += length;
+        return;
+    }
+    if (writer->capacity - writer->size < length && !writer_reserve(writer, length)) {
+        return;
+    }
+    memcpy(writer->data + writer->size, text, length);
+    writer->size += length;
+    writer->total += length;
+}
+
+/* The text of a memory writer, NUL-terminated, or NULL if writing
+ * failed. The writer is left empty. */
+char *writer_take(AsmWriter *writer) {
+    char *text = NULL;
+    if (writer_reserve(writer, 1)) {
+        writer->data[writer->size] = '\0';
+        text = writer->data;
+        writer->data = NULL;
+    }
+    writer_release(writer);
+    return text;
+}
+
+void writer_release(AsmWriter *writer) {
+    free(writer->data);
+    writer->data = NULL;
+    writer->size = 0;
+    writer->capacity = 0;
+}
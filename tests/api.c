@@ -0,0 +1,137 @@
+#include "crappola.h"
+#include <spawn.h>
+#include <sys/wait.h>
+
+/* The library API: compile sources held in strings to assembly and to
+ * object files, hosted and freestanding, link the objects and check
+ * what the programs return. Takes a directory for the files it writes. */
+
+extern char **environ;
+
+static int failures;
+
+static void fail(const char *what) {
+    fprintf(stderr, "FAIL %s\n", what);
+    failures++;
+}
+
+/* Exit status of program, or -1 if it could not be run */
+static int run(const char *program) {
+    char *args[] = { (char *)program, NULL };
+    pid_t pid;
+    int status;
+    if (posix_spawn(&pid, program, NULL, NULL, args, environ) != 0 ||
+        waitpid(pid, &status, 0) < 0 || !WIFEXITED(status)) {
+        return -1;
+    }
+    return WEXITSTATUS(status);
+}
+
+/* Compile source to an object, link it and run it; its exit status, or
+ * -1 on any failure */
+static int build_and_run(CompilerContext *context, const char *dir, const char *name,
+                         const char *source, bool freestanding) {
+    size_t size;
+    unsigned char *bytes = crappola_compile_object(context, name, source, strlen(source),
+                                                   freestanding, &size);
+    if (!bytes) {
+        return -1;
+    }
+    bool elf = size > 4 && memcmp(bytes, "\177ELF", 4) == 0;
+
+    char object[4096];
+    char program[4096];
+    snprintf(object, sizeof(object), "%s/%s.o", dir, name);
+    snprintf(program, sizeof(program), "%s/%s", dir, name);
+    FILE *out = fopen(object, "wb");
+    bool written = out && fwrite(bytes, 1, size, out) == size;
+    if (out && fclose(out) != 0) {
+        written = false;
+    }
+    free(bytes);
+    if (!elf || !written) {
+        return -1;
+    }
+    const char *objects[] = { object };
+    int status = link_objects(objects, 1, program, freestanding) == 0 ? run(program) : -1;
+    remove(object);
+    remove(program);
+    return status;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <work-dir>\n", argv[0]);
+        return 1;
+    }
+    const char *dir = argv[1];
+
+    CompilerContext *context = crappola_create();
+    if (!context) {
+        return 1;
+    }
+    const char *source = "int main() {\n    int x = 40;\n    return x + 2;\n}\n";
+
+    // Assembly: a hosted unit defines main only, a freestanding one _start too
+    char *assembly = crappola_compile(context, "hosted.c", source, strlen(source), false);
+    if (!assembly || !strstr(assembly, "main:") || strstr(assembly, "_start:")) {
+        fail("crappola_compile, hosted");
+    }
+    free(assembly);
+    assembly = crappola_compile(context, "freestanding.c", source, strlen(source), true);
+    if (!assembly || !strstr(assembly, "main:") || !strstr(assembly, "_start:")) {
+        fail("crappola_compile, freestanding");
+    }
+    free(assembly);
+
+    // Objects, linked and run, from the same context
+    if (build_and_run(context, dir, "api_hosted", source, false) != 42) {
+        fail("crappola_compile_object, hosted");
+    }
+    if (build_and_run(context, dir, "api_freestanding", source, true) != 42) {
+        fail("crappola_compile_object, freestanding _start");
+    }
+
+    // Definitions made on the context apply to every later unit
+    const char *defined = "int main() {\n    return ANSWER;\n}\n";
+    if (!crappola_define(context, "ANSWER=7") ||
+        build_and_run(context, dir, "api_defined", defined, false) != 7) {
+        fail("crappola_define");
+    }
+    if (!crappola_undefine(context, "ANSWER") ||
+        !crappola_define(context, "ANSWER=9") ||
+        build_and_run(context, dir, "api_redefined", defined, true) != 9) {
+        fail("crappola_undefine");
+    }
+
+    // A unit with an error yields NULL and a diagnostic on the error stream
+    FILE *errors = tmpfile();
+    if (!errors) {
+        return 1;
+    }
+    crappola_set_streams(stdout, errors);
+    const char *broken = "int main() {\n    return 1 +;\n}\n";
+    assembly = crappola_compile(context, "broken.c", broken, strlen(broken), false);
+    size_t size;
+    unsigned char *bytes = crappola_compile_object(context, "broken.c", broken, strlen(broken),
+                                                   false, &size);
+    crappola_set_streams(stdout, stderr);
+    if (assembly || bytes || ftell(errors) == 0) {
+        fail("compile errors");
+    }
+    free(assembly);
+    free(bytes);
+    fclose(errors);
+
+    // The context is still usable after a failed unit
+    if (build_and_run(context, dir, "api_after_error", source, false) != 42) {
+        fail("compiling after an error");
+    }
+
+    crappola_destroy(context);
+    if (failures > 0) {
+        fprintf(stderr, "%d API test(s) failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
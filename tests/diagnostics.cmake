@@ -0,0 +1,55 @@
+# Compiles units with errors in several functions on one code generation
+# thread and on four, and checks that every run reports the same thing:
+# the first failing function only, whichever thread reaches it first.
+#
+#   cmake -DCOMPILER=<crappola> -DWORK_DIR=<dir> -P diagnostics.cmake
+#
+# codegen  undefined variables in functions 37 and 50 of 200
+# parse    an undefined variable in function 37, a syntax error in 50
+#
+# Function 37 is long, so later functions are parsed and generated while
+# it is still being generated, even on a single CPU.
+
+set(RUNS 10)
+
+set(body "")
+foreach(i RANGE 199)
+    string(APPEND body "    a = a + 1;\n")
+endforeach()
+set(long_body "")
+foreach(i RANGE 199)
+    string(APPEND long_body "${body}")
+endforeach()
+
+foreach(input codegen parse)
+    set(source "")
+    foreach(i RANGE 199)
+        if(i EQUAL 37)
+            string(APPEND source "int f${i}() {\n    int a = 0;\n${long_body}    return missing${i};\n}\n")
+        elseif(i EQUAL 50 AND input STREQUAL "codegen")
+            string(APPEND source "int f${i}() {\n    return missing${i};\n}\n")
+        elseif(i EQUAL 50 AND input STREQUAL "parse")
+            string(APPEND source "int f${i}() {\n    return 1 +;\n}\n")
+        else()
+            string(APPEND source "int f${i}() {\n    int a = ${i};\n${body}    return a;\n}\n")
+        endif()
+    endforeach()
+    string(APPEND source "int main() {\n    return 0;\n}\n")
+    set(file "${WORK_DIR}/diagnostics_${input}.c")
+    file(WRITE "${file}" "${source}")
+
+    execute_process(COMMAND "${COMPILER}" "${file}" -c -o "${WORK_DIR}/diagnostics.o"
+                    RESULT_VARIABLE status OUTPUT_QUIET ERROR_VARIABLE expected)
+    if(status EQUAL 0 OR NOT expected MATCHES "missing37" OR expected MATCHES "missing50|line")
+        message(FATAL_ERROR "${input}: one thread reported\n${expected}")
+    endif()
+    foreach(run RANGE 1 ${RUNS})
+        execute_process(COMMAND "${COMPILER}" "${file}" -c -o "${WORK_DIR}/diagnostics.o"
+                                --codegen-threads 4
+                        RESULT_VARIABLE status OUTPUT_QUIET ERROR_VARIABLE errors)
+        if(status EQUAL 0 OR NOT errors STREQUAL expected)
+            message(FATAL_ERROR "${input}, run ${run} on 4 threads (exit status ${status}):\n"
+                                "${errors}\nexpected, as on one thread:\n${expected}")
+        endif()
+    endforeach()
+endforeach()
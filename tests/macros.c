@@ -0,0 +1,207 @@
+#include "crappola.h"
+
+/* Macro expansion against the examples of C11 6.10.3.5, and the
+ * expansion cache across definitions that change between uses. Each
+ * case is preprocessed in memory and its output compared with the
+ * expected text, every run of white space counting as one space. */
+
+typedef struct {
+    const char *name;
+    const char *source;
+    const char *expected;
+} Case;
+
+static const Case cases[] = {
+    { "6.10.3.5 example 2",
+      "#define hash_hash # ## #\n"
+      "#define mkstr(a) # a\n"
+      "#define in_between(a) mkstr(a)\n"
+      "#define join(c, d) in_between(c hash_hash d)\n"
+      "char p[] = join(x, y);\n",
+      "char p[] = \"x ## y\";" },
+    { "6.10.3.5 example 3",
+      "#define x 3\n"
+      "#define f(a) f(x * (a))\n"
+      "#undef x\n"
+      "#define x 2\n"
+      "#define g f\n"
+      "#define z z[0]\n"
+      "#define h g(~\n"
+      "#define m(a) a(w)\n"
+      "#define w 0,1\n"
+      "#define t(a) a\n"
+      "#define p() int\n"
+      "#define q(x) x\n"
+      "#define r(x,y) x ## y\n"
+      "#define str(x) # x\n"
+      "f(y+1) + f(f(z)) % t(t(g)(0) + t)(1);\n"
+      "g(x+(3,4)-w) | h 5) & m\n"
+      "(f)^m(m);\n"
+      "p() i[q()] = { q(1), r(2,3), r(4,), r(,5), r(,) };\n"
+      "char c[2][6] = { str(hello), str() };\n",
+      "f(2 * (y+1)) + f(2 * (f(2 * (z[0])))) % f(2 * (0)) + t(1);\n"
+      "f(2 * (2+(3,4)-0,1)) | f(2 * (~ 5)) & f(2 * (0,1))^m(0,1);\n"
+      "int i[] = { 1, 23, 4, 5, };\n"
+      "char c[2][6] = { \"hello\", \"\" };" },
+    // The #include line of the example is left out: the header does not exist
+    { "6.10.3.5 example 4",
+      "#define str(s) # s\n"
+      "#define xstr(s) str(s)\n"
+      "#define debug(s, t) printf(\"x\" # s \"= %d, x\" # t \"= %s\", \\\n"
+      " x ## s, x ## t)\n"
+      "#define INCFILE(n) vers ## n\n"
+      "#define glue(a, b) a ## b\n"
+      "#define xglue(a, b) glue(a, b)\n"
+      "#define HIGHLOW \"hello\"\n"
+      "#define LOW LOW \", world\"\n"
+      "debug(1, 2);\n"
+      "fputs(str(strncmp(\"abc\\0d\", \"abc\", '\\4') // this goes away\n"
+      " == 0) str(: @\\n), s);\n"
+      "xstr(INCFILE(2).h)\n"
+      "glue(HIGH, LOW);\n"
+      "xglue(HIGH, LOW)\n",
+      "printf(\"x\" \"1\" \"= %d, x\" \"2\" \"= %s\", x1, x2);\n"
+      "fputs(\"strncmp(\\\"abc\\\\0d\\\", \\\"abc\\\", '\\\\4') == 0\" \": @\\n\", s);\n"
+      "\"vers2.h\"\n"
+      "\"hello\";\n"
+      "\"hello\" \", world\"" },
+    { "6.10.3.5 example 5",
+      "#define t(x,y,z) x ## y ## z\n"
+      "int j[] = { t(1,2,3), t(,4,5), t(6,,7), t(8,9,),\n"
+      " t(10,,), t(,11,), t(,,12), t(,,) };\n",
+      "int j[] = { 123, 45, 67, 89, 10, 11, 12, };" },
+    { "6.10.3.5 example 7",
+      "#define debug(...) fprintf(stderr, __VA_ARGS__)\n"
+      "#define showlist(...) puts(#__VA_ARGS__)\n"
+      "#define report(test, ...) ((test)?puts(#test):\\\n"
+      " printf(__VA_ARGS__))\n"
+      "debug(\"Flag\");\n"
+      "debug(\"X = %d\\n\", x);\n"
+      "showlist(The first, second, and third items.);\n"
+      "report(x>y, \"x is %d but y is %d\", x, y);\n",
+      "fprintf(stderr, \"Flag\");\n"
+      "fprintf(stderr, \"X = %d\\n\", x);\n"
+      "puts(\"The first, second, and third items.\");\n"
+      "((x>y)?puts(\"x>y\"): printf(\"x is %d but y is %d\", x, y));" },
+    // A cached expansion must not outlive a change to any macro it used
+    { "cache across #undef and #define",
+      "#define A 1\n"
+      "#define F(x) x + A\n"
+      "#define G F(2)\n"
+      "F(1) G\n"
+      "F(1) G\n"
+      "#undef A\n"
+      "F(1) G\n"
+      "#define A 3\n"
+      "F(1) G\n"
+      "#undef F\n"
+      "#define F(x) x * A\n"
+      "F(1) G\n",
+      "1 + 1 2 + 1\n"
+      "1 + 1 2 + 1\n"
+      "1 + A 2 + A\n"
+      "1 + 3 2 + 3\n"
+      "1 * 3 2 * 3" },
+};
+
+/* Copy text with every run of white space made one space, and none at
+ * either end */
+static char *squeeze(const char *text, size_t length) {
+    char *result = malloc(length + 1);
+    if (!result) {
+        return NULL;
+    }
+    size_t size = 0;
+    bool space = false;
+    for (size_t i = 0; i < length; i++) {
+        if (isspace((unsigned char)text[i])) {
+            space = size > 0;
+            continue;
+        }
+        if (space) {
+            result[size++] = ' ';
+            space = false;
+        }
+        result[size++] = text[i];
+    }
+    result[size] = '\0';
+    return result;
+}
+
+/* Preprocess source in context; the squeezed output, or NULL */
+static char *preprocess(CompilerContext *context, const char *source, long *hits) {
+    Preprocessor pp;
+    if (!pp_init_memory(&pp, context, "test.c", source, strlen(source))) {
+        return NULL;
+    }
+    char *output = NULL;
+    size_t size = 0;
+    const char *line;
+    size_t length;
+    while ((line = pp_next_line(&pp, &length))) {
+        char *grown = realloc(output, size + length);
+        if (!grown) {
+            free(output);
+            pp_finish(&pp);
+            return NULL;
+        }
+        output = grown;
+        memcpy(output + size, line, length);
+        size += length;
+    }
+    char *result = pp.failed ? NULL : squeeze(output ? output : "", size);
+    *hits = pp.expansion_hits;
+    free(output);
+    pp_finish(&pp);
+    return result;
+}
+
+static bool check(CompilerContext *context, const char *name, const char *source,
+                  const char *expected, long *hits) {
+    char *want = squeeze(expected, strlen(expected));
+    char *got = preprocess(context, source, hits);
+    bool ok = want && got && strcmp(want, got) == 0;
+    if (!ok) {
+        fprintf(stderr, "FAIL %s\n  expected: %s\n  got:      %s\n", name, want ? want : "",
+                got ? got : "(preprocessing failed)");
+    }
+    free(want);
+    free(got);
+    return ok;
+}
+
+int main(void) {
+    CompilerContext *context = crappola_create();
+    if (!context) {
+        return 1;
+    }
+    int failures = 0;
+    long hits;
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        if (!check(context, cases[i].name, cases[i].source, cases[i].expected, &hits)) {
+            failures++;
+        }
+    }
+
+    // The repeated line above must have been served from the cache, or
+    // the invalidation case proves nothing
+    if (hits == 0) {
+        fprintf(stderr, "FAIL cache across #undef and #define: no cache hits\n");
+        failures++;
+    }
+
+    // Units share the context's cache, but not its definitions
+    if (!check(context, "cache across units", "#define K 1\n#define F(x) x + K\nF(1)\n",
+               "1 + 1", &hits) ||
+        !check(context, "cache across units", "#define K 2\n#define F(x) x + K\nF(1)\n",
+               "1 + 2", &hits)) {
+        failures++;
+    }
+
+    crappola_destroy(context);
+    if (failures > 0) {
+        fprintf(stderr, "%d macro test(s) failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,76 @@
+# Generates one of the stress inputs and compiles it in one mode, checking
+# the exit status of the program (or of the compiler, for DIAGNOSTIC).
+#
+#   cmake -DCOMPILER=<crappola> -DINPUT=<name> -DMODE=<native|run|interp>
+#         -DEXPECTED=<status> [-DNESTING=N] [-DDIAGNOSTIC=<regex>]
+#         -DWORK_DIR=<dir> -P stress.cmake
+#
+# The inputs are megabytes of repetition, so they are built here rather
+# than stored in the tree:
+#   sum      a single expression of 1,000,000 terms
+#   ifs      100,000 nested if statements
+#   parens   100,000 nested parentheses
+#   minus    100,000 right-nested subtractions, 1 - (1 - (...))
+
+# out = text repeated count times, by doubling
+function(repeat out text count)
+    set(result "")
+    set(piece "${text}")
+    while(count GREATER 0)
+        math(EXPR bit "${count} % 2")
+        if(bit)
+            string(APPEND result "${piece}")
+        endif()
+        string(APPEND piece "${piece}")
+        math(EXPR count "${count} / 2")
+    endwhile()
+    set(${out} "${result}" PARENT_SCOPE)
+endfunction()
+
+if(INPUT STREQUAL "sum")
+    # 1,000,000 is 64 modulo 256
+    repeat(terms "1 + " 999999)
+    set(source "int main() {\n    return ${terms}1;\n}\n")
+elseif(INPUT STREQUAL "ifs")
+    repeat(open "if (1) { " 100000)
+    repeat(close "} " 100000)
+    set(source "int main() {\n    int x = 0;\n    ${open}x = 42; ${close}\n    return x;\n}\n")
+elseif(INPUT STREQUAL "parens")
+    repeat(open "(" 100000)
+    repeat(close ")" 100000)
+    set(source "int main() {\n    return ${open}42${close};\n}\n")
+elseif(INPUT STREQUAL "minus")
+    # An even number of subtractions from 1 leaves the innermost value
+    repeat(open "1 - (" 100000)
+    repeat(close ")" 100000)
+    set(source "int main() {\n    return ${open}42${close};\n}\n")
+else()
+    message(FATAL_ERROR "Unknown stress input ${INPUT}")
+endif()
+
+set(file "${WORK_DIR}/${INPUT}.c")
+file(WRITE "${file}" "${source}")
+
+set(options "")
+if(NESTING)
+    list(APPEND options --max-nesting ${NESTING})
+endif()
+
+if(MODE STREQUAL "native")
+    set(program "${WORK_DIR}/${INPUT}-${MODE}")
+    execute_process(COMMAND "${COMPILER}" "${file}" -o "${program}" ${options}
+                    RESULT_VARIABLE status OUTPUT_VARIABLE output ERROR_VARIABLE errors)
+    if(NOT DIAGNOSTIC AND status EQUAL 0)
+        execute_process(COMMAND "${program}" RESULT_VARIABLE status)
+    endif()
+else()
+    execute_process(COMMAND "${COMPILER}" "${file}" --${MODE} ${options}
+                    RESULT_VARIABLE status OUTPUT_VARIABLE output ERROR_VARIABLE errors)
+endif()
+
+if(NOT "${status}" STREQUAL "${EXPECTED}")
+    message(FATAL_ERROR "${INPUT} (${MODE}): exit status ${status}, expected ${EXPECTED}\n${errors}")
+endif()
+if(DIAGNOSTIC AND NOT errors MATCHES "${DIAGNOSTIC}")
+    message(FATAL_ERROR "${INPUT} (${MODE}): no diagnostic matching '${DIAGNOSTIC}'\n${errors}")
+endif()